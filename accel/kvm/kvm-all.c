@@ -21,6 +21,7 @@
 #include "qemu/atomic.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
+#include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
 #include "hw/pci/msi.h"
@@ -72,6 +73,7 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -86,6 +88,9 @@ struct KVMState
     int coalesced_pio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
+    bool coalesced_io_thread_enabled;
+    QemuThread coalesced_io_thread;
+    QemuEvent coalesced_io_event;
     int vcpu_events;
     int robust_singlestep;
     int debugregs;
@@ -101,6 +106,10 @@ struct KVMState
     OnOffAuto kernel_irqchip_split;
     bool sync_mmu;
     bool manual_dirty_log_protect;
+    /* Entries of each vCPU's dirty GFN ring; 0 to use the dirty bitmap */
+    uint32_t kvm_dirty_ring_size;
+    uint32_t kvm_dirty_ring_bytes;
+    QemuThread dirty_ring_reaper;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -159,8 +168,15 @@ static const KVMCapabilityInfo kvm_required_capabilites[] = {
 static NotifierList kvm_irqchip_change_notifiers =
     NOTIFIER_LIST_INITIALIZER(kvm_irqchip_change_notifiers);
 
-#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
-#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+/*
+ * Protects the slots of all KVMMemoryListeners and everything inside them.
+ * There is a single lock because dirty ring entries can refer to slots of
+ * any address space.
+ */
+static QemuMutex kml_slots_lock;
+
+#define kvm_slots_lock()    qemu_mutex_lock(&kml_slots_lock)
+#define kvm_slots_unlock()  qemu_mutex_unlock(&kml_slots_lock)
 
 int kvm_get_max_memslots(void)
 {
@@ -189,12 +205,19 @@ int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
     return 1;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     KVMState *s = kvm_state;
     int i;
 
+    /* Prefer slots that KVM does not have either */
+    for (i = 0; i < s->nr_slots; i++) {
+        if (kml->slots[i].memory_size == 0 &&
+            kml->slots[i].old_memory_size == 0) {
+            return &kml->slots[i];
+        }
+    }
     for (i = 0; i < s->nr_slots; i++) {
         if (kml->slots[i].memory_size == 0) {
             return &kml->slots[i];
@@ -204,20 +227,44 @@ static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
     return NULL;
 }
 
+/*
+ * Find a slot that was removed in the current transaction and that KVM
+ * can reuse for the same memory at another address, or with other flags.
+ *
+ * Called with kml_slots_lock held
+ */
+static KVMSlot *kvm_get_removed_slot(KVMMemoryListener *kml, void *ram,
+                                     hwaddr size)
+{
+    KVMState *s = kvm_state;
+    int i;
+
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *mem = &kml->slots[i];
+
+        if (mem->memory_size == 0 && mem->old_memory_size == size &&
+            mem->old_ram == ram) {
+            return mem;
+        }
+    }
+
+    return NULL;
+}
+
 bool kvm_has_free_slot(MachineState *ms)
 {
     KVMState *s = KVM_STATE(ms->accelerator);
     bool result;
     KVMMemoryListener *kml = &s->memory_listener;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     result = !!kvm_get_free_slot(kml);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return result;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -278,7 +325,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     KVMMemoryListener *kml = &s->memory_listener;
     int i, ret = 0;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
@@ -288,36 +335,310 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
             break;
         }
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
 
-static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, bool new)
+/* Called with kml_slots_lock held */
+static int kvm_slot_ioctl(KVMMemoryListener *kml, KVMSlot *slot,
+                          hwaddr start_addr, ram_addr_t size, void *ram,
+                          int flags)
 {
-    KVMState *s = kvm_state;
     struct kvm_userspace_memory_region mem;
     int ret;
 
     mem.slot = slot->slot | (kml->as_id << 16);
-    mem.guest_phys_addr = slot->start_addr;
-    mem.userspace_addr = (unsigned long)slot->ram;
-    mem.flags = slot->flags;
-
-    if (slot->memory_size && !new && (mem.flags ^ slot->old_flags) & KVM_MEM_READONLY) {
-        /* Set the slot size to 0 before setting the slot to the desired
-         * value. This is needed based on KVM commit 75d61fbc. */
-        mem.memory_size = 0;
-        kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
-    }
-    mem.memory_size = slot->memory_size;
-    ret = kvm_vm_ioctl(s, KVM_SET_USER_MEMORY_REGION, &mem);
-    slot->old_flags = mem.flags;
+    mem.guest_phys_addr = start_addr;
+    mem.memory_size = size;
+    mem.userspace_addr = (unsigned long)ram;
+    mem.flags = flags;
+
+    ret = kvm_vm_ioctl(kvm_state, KVM_SET_USER_MEMORY_REGION, &mem);
+    kml->nr_slot_ioctls++;
     trace_kvm_set_user_memory(mem.slot, mem.flags, mem.guest_phys_addr,
                               mem.memory_size, mem.userspace_addr, ret);
+    if (!ret) {
+        slot->old_start_addr = start_addr;
+        slot->old_memory_size = size;
+        slot->old_ram = ram;
+        slot->old_flags = flags;
+    }
     return ret;
 }
 
+/* Called with kml_slots_lock held */
+static bool kvm_slot_changed(KVMSlot *slot)
+{
+    if (slot->memory_size != slot->old_memory_size) {
+        return true;
+    }
+    return slot->memory_size &&
+           (slot->start_addr != slot->old_start_addr ||
+            slot->ram != slot->old_ram ||
+            slot->flags != slot->old_flags);
+}
+
+/*
+ * Bring KVM's view of the slot in line with ours.
+ *
+ * Called with kml_slots_lock held
+ */
+static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot)
+{
+    int ret;
+
+    if (slot->old_memory_size &&
+        (slot->memory_size != slot->old_memory_size ||
+         slot->ram != slot->old_ram ||
+         (slot->flags ^ slot->old_flags) & KVM_MEM_READONLY)) {
+        /*
+         * Only the address and the flags of an existing slot can change,
+         * and not even KVM_MEM_READONLY (KVM commit 75d61fbc): delete the
+         * slot before setting it to the desired value.
+         */
+        ret = kvm_slot_ioctl(kml, slot, slot->old_start_addr, 0,
+                             slot->old_ram, 0);
+        if (ret) {
+            return ret;
+        }
+    }
+    if (!slot->memory_size) {
+        return 0;
+    }
+    return kvm_slot_ioctl(kml, slot, slot->start_addr, slot->memory_size,
+                          slot->ram, slot->flags);
+}
+
+/*
+ * Dirty ring
+ *
+ * With KVM_CAP_DIRTY_LOG_RING, each vCPU pushes the GFNs it dirties to
+ * a ring shared with the kernel, instead of KVM setting bits in a bitmap
+ * per slot that has to be fetched and scanned whole at every sync.
+ * Harvested entries go straight to the ram_list dirty bitmaps, and
+ * KVM_RESET_DIRTY_RINGS write-protects the pages again and recycles the
+ * entries.  The rings are reaped by a thread in the background, by a
+ * vCPU whose ring is full, and on every log sync.
+ */
+
+/* Interval between two rounds of the reaper thread */
+#define KVM_DIRTY_RING_REAP_INTERVAL_US (1 * G_USEC_PER_SEC)
+
+/* A run of consecutive dirty pages within a slot */
+typedef struct KVMDirtyRange {
+    KVMSlot *mem;
+    uint64_t start;
+    uint64_t npages;
+} KVMDirtyRange;
+
+static inline bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return atomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static inline void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+static void kvm_dirty_range_flush(KVMDirtyRange *r)
+{
+    uint8_t clients = tcg_enabled() ? DIRTY_CLIENTS_ALL : DIRTY_CLIENTS_NOCODE;
+
+    if (!r->npages) {
+        return;
+    }
+    if (!global_dirty_log) {
+        clients &= ~(1 << DIRTY_MEMORY_MIGRATION);
+    }
+    cpu_physical_memory_set_dirty_range(r->mem->ram_start_offset +
+                                        r->start * qemu_real_host_page_size,
+                                        r->npages * qemu_real_host_page_size,
+                                        clients);
+    r->npages = 0;
+}
+
+/* Called with kml_slots_lock held */
+static void kvm_dirty_ring_mark_page(KVMState *s, KVMDirtyRange *r,
+                                     uint32_t as_id, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    KVMMemoryListener *kml = NULL;
+    KVMSlot *mem;
+    int i;
+
+    for (i = 0; i < s->nr_as; i++) {
+        if (s->as[i].ml && s->as[i].ml->as_id == as_id) {
+            kml = s->as[i].ml;
+            break;
+        }
+    }
+    if (!kml || slot_id >= s->nr_slots) {
+        return;
+    }
+
+    mem = &kml->slots[slot_id];
+    if (offset >= mem->memory_size / qemu_real_host_page_size) {
+        /* The slot went away or was resized: nothing to track anymore */
+        return;
+    }
+
+    if (r->npages && r->mem == mem && r->start + r->npages == offset) {
+        r->npages++;
+        return;
+    }
+    kvm_dirty_range_flush(r);
+    r->mem = mem;
+    r->start = offset;
+    r->npages = 1;
+}
+
+/* Called with kml_slots_lock held */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu,
+                                        KVMDirtyRange *r)
+{
+    struct kvm_dirty_gfn *gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+
+    if (!gfns) {
+        return 0;
+    }
+
+    for (;;) {
+        cur = &gfns[fetch % s->kvm_dirty_ring_size];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, r, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+
+    return count;
+}
+
+/*
+ * Harvest the ring of @cpu, or the rings of all vCPUs if @cpu is NULL;
+ * the latter requires the BQL, which keeps the vCPU list stable.
+ * Called with kml_slots_lock held.
+ */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState *cpu)
+{
+    KVMDirtyRange r = {};
+    uint64_t total = 0;
+    int ret;
+
+    if (cpu) {
+        total = kvm_dirty_ring_reap_one(s, cpu, &r);
+    } else {
+        CPU_FOREACH(cpu) {
+            total += kvm_dirty_ring_reap_one(s, cpu, &r);
+        }
+    }
+    kvm_dirty_range_flush(&r);
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("%s: KVM_RESET_DIRTY_RINGS failed: %s",
+                         __func__, strerror(-ret));
+            abort();
+        }
+    }
+    trace_kvm_dirty_ring_reap(total);
+
+    return total;
+}
+
+static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
+{
+    uint64_t total;
+
+    kvm_slots_lock();
+    total = kvm_dirty_ring_reap_locked(s, cpu);
+    kvm_slots_unlock();
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Leaving KVM_RUN is enough to flush the hardware buffers */
+}
+
+/*
+ * Push everything the guest dirtied so far to the ram_list bitmaps.
+ * Dirty GFNs can still sit in hardware buffers (PML) until the vCPU
+ * exits, so kick all vCPUs out synchronously before reaping.
+ */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+    }
+    kvm_dirty_ring_reap(s, NULL);
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAP_INTERVAL_US);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s, NULL);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+    uint64_t ring_bytes = (uint64_t)s->kvm_dirty_ring_size *
+                          sizeof(struct kvm_dirty_gfn);
+    int ret;
+
+    /* The capability returns the maximum size of a ring in bytes */
+    ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (ret <= 0) {
+        warn_report("KVM dirty ring not available, using the dirty bitmap");
+        s->kvm_dirty_ring_size = 0;
+        return 0;
+    }
+    if (ring_bytes > ret) {
+        error_report("KVM dirty ring size %" PRIu32 " too big "
+                     "(maximum is %zu)", s->kvm_dirty_ring_size,
+                     ret / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret) {
+        error_report("Enabling the KVM dirty ring failed: %s",
+                     strerror(-ret));
+        return ret;
+    }
+    s->kvm_dirty_ring_bytes = ring_bytes;
+
+    qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                       kvm_dirty_ring_reaper_thread, s,
+                       QEMU_THREAD_DETACHED);
+    return 0;
+}
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -344,24 +665,39 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* Do not lose what is still in the ring */
+        kvm_dirty_ring_reap(s, cpu);
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
+    *fetch_index = 0;
     QLIST_FOREACH(cpu, &s->kvm_parked_vcpus, node) {
         if (cpu->vcpu_id == vcpu_id) {
             int kvm_fd;
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            /* The kernel's ring index survives in the parked vCPU */
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
@@ -378,7 +714,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -408,6 +744,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty gfns failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -431,50 +780,45 @@ static int kvm_mem_flags(MemoryRegion *mr)
     return flags;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
-static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
-                                 MemoryRegion *mr)
+/* Called with kml_slots_lock held */
+static void kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
+                                  MemoryRegion *mr)
 {
     mem->flags = kvm_mem_flags(mr);
 
     /* If nothing changed effectively, no need to issue ioctl */
-    if (mem->flags == mem->old_flags) {
-        return 0;
+    if (mem->flags != mem->old_flags) {
+        kml->update_pending = true;
     }
-
-    return kvm_set_user_memory_region(kml, mem, false);
 }
 
-static int kvm_section_update_flags(KVMMemoryListener *kml,
-                                    MemoryRegionSection *section)
+static void kvm_section_update_flags(KVMMemoryListener *kml,
+                                     MemoryRegionSection *section)
 {
     hwaddr start_addr, size, slot_size;
     KVMSlot *mem;
-    int ret = 0;
 
     size = kvm_align_section(section, &start_addr);
     if (!size) {
-        return 0;
+        return;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
-    while (size && !ret) {
+    while (size) {
         slot_size = MIN(kvm_max_slot_size, size);
         mem = kvm_lookup_matching_slot(kml, start_addr, slot_size);
         if (!mem) {
             /* We don't have a slot if we want to trap every access. */
-            goto out;
+            break;
         }
 
-        ret = kvm_slot_update_flags(kml, mem, section->mr);
+        kvm_slot_update_flags(kml, mem, section->mr);
         start_addr += slot_size;
         size -= slot_size;
     }
 
-out:
-    kvm_slots_unlock(kml);
-    return ret;
+    kvm_slots_unlock();
 }
 
 static void kvm_log_start(MemoryListener *listener,
@@ -482,16 +826,12 @@ static void kvm_log_start(MemoryListener *listener,
                           int old, int new)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
-    int r;
 
     if (old != 0) {
         return;
     }
 
-    r = kvm_section_update_flags(kml, section);
-    if (r < 0) {
-        abort();
-    }
+    kvm_section_update_flags(kml, section);
 }
 
 static void kvm_log_stop(MemoryListener *listener,
@@ -499,16 +839,12 @@ static void kvm_log_stop(MemoryListener *listener,
                           int old, int new)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
-    int r;
 
     if (new != 0) {
         return;
     }
 
-    r = kvm_section_update_flags(kml, section);
-    if (r < 0) {
-        abort();
-    }
+    kvm_section_update_flags(kml, section);
 }
 
 /* get kvm's dirty pages bitmap and update qemu's */
@@ -552,7 +888,7 @@ static void kvm_memslot_init_dirty_bitmap(KVMSlot *mem)
  * This function will first try to fetch dirty bitmap from the kernel,
  * and then updates qemu's dirty bitmap.
  *
- * NOTE: caller must be with kml->slots_lock held.
+ * NOTE: caller must be with kml_slots_lock held.
  *
  * @kml: the KVM memory listener object
  * @section: the memory section to sync the dirty bitmap with
@@ -744,7 +1080,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         return ret;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
@@ -770,7 +1106,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         }
     }
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -1017,10 +1353,10 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                              MemoryRegionSection *section, bool add)
 {
     KVMSlot *mem;
-    int err;
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size, slot_size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -1041,8 +1377,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* use aligned delta to align the ram address */
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     if (!add) {
         do {
@@ -1052,20 +1391,24 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                 goto out;
             }
             if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                kvm_physical_sync_dirty_bitmap(kml, section);
+                if (kvm_state->kvm_dirty_ring_size) {
+                    /*
+                     * Harvest the slot's entries while the slot id still
+                     * maps to it.  As with the bitmap, pages dirtied from
+                     * here to the removal itself are missed.
+                     */
+                    kvm_dirty_ring_reap_locked(kvm_state, NULL);
+                } else {
+                    kvm_physical_sync_dirty_bitmap(kml, section);
+                }
             }
 
-            /* unregister the slot */
+            /* unregister the slot when the transaction commits */
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
             mem->memory_size = 0;
             mem->flags = 0;
-            err = kvm_set_user_memory_region(kml, mem, false);
-            if (err) {
-                fprintf(stderr, "%s: error unregistering slot: %s\n",
-                        __func__, strerror(-err));
-                abort();
-            }
+            kml->update_pending = true;
             start_addr += slot_size;
             size -= slot_size;
         } while (size);
@@ -1075,32 +1418,33 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* register the new slot */
     do {
         slot_size = MIN(kvm_max_slot_size, size);
-        mem = kvm_alloc_slot(kml);
+        mem = kvm_get_removed_slot(kml, ram, slot_size);
+        if (!mem) {
+            mem = kvm_alloc_slot(kml);
+        }
         mem->memory_size = slot_size;
         mem->start_addr = start_addr;
         mem->ram = ram;
+        mem->ram_start_offset = ram_start_offset;
         mem->flags = kvm_mem_flags(mr);
 
-        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        if ((mem->flags & KVM_MEM_LOG_DIRTY_PAGES) &&
+            !kvm_state->kvm_dirty_ring_size) {
             /*
              * Reallocate the bmap; it means it doesn't disappear in
              * middle of a migrate.
              */
             kvm_memslot_init_dirty_bitmap(mem);
         }
-        err = kvm_set_user_memory_region(kml, mem, true);
-        if (err) {
-            fprintf(stderr, "%s: error registering slot: %s\n", __func__,
-                    strerror(-err));
-            abort();
-        }
+        kml->update_pending = true;
         start_addr += slot_size;
         ram += slot_size;
+        ram_start_offset += slot_size;
         size -= slot_size;
     } while (size);
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -1121,20 +1465,128 @@ static void kvm_region_del(MemoryListener *listener,
     memory_region_unref(section->mr);
 }
 
+/*
+ * Does the new place of the slot overlap another slot that KVM still has?
+ *
+ * Called with kml_slots_lock held
+ */
+static bool kvm_slot_overlaps_old(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    KVMState *s = kvm_state;
+    int i;
+
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *other = &kml->slots[i];
+
+        if (other != mem && other->old_memory_size &&
+            ranges_overlap(mem->start_addr, mem->memory_size,
+                           other->old_start_addr, other->old_memory_size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Apply all slot changes of a memory transaction at once.  KVM rebuilds
+ * its memslot array and kicks all vCPUs on every KVM_SET_USER_MEMORY_REGION,
+ * so go for as few calls as possible: a slot whose memory only moved or
+ * changed flags is updated in place rather than deleted and recreated,
+ * and a slot that was removed and added back as it was costs nothing.
+ * KVM does not allow overlapping slots, so removals go first and new
+ * slots last.
+ */
+static void kvm_region_commit(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    uint64_t nr_ioctls = kml->nr_slot_ioctls;
+    unsigned int changed = 0;
+    KVMSlot *mem;
+    int i, err;
+
+    kvm_slots_lock();
+    if (!kml->update_pending) {
+        goto out;
+    }
+    kml->update_pending = false;
+
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (!kvm_slot_changed(mem)) {
+            continue;
+        }
+        changed++;
+        if (mem->old_memory_size &&
+            (mem->memory_size != mem->old_memory_size ||
+             mem->ram != mem->old_ram)) {
+            err = kvm_slot_ioctl(kml, mem, mem->old_start_addr, 0,
+                                 mem->old_ram, 0);
+            if (err) {
+                goto fail;
+            }
+        }
+    }
+
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (!mem->old_memory_size || !kvm_slot_changed(mem)) {
+            continue;
+        }
+        if (mem->start_addr != mem->old_start_addr &&
+            kvm_slot_overlaps_old(kml, mem)) {
+            /* Another slot is in the way: recreate this one last */
+            err = kvm_slot_ioctl(kml, mem, mem->old_start_addr, 0,
+                                 mem->old_ram, 0);
+        } else {
+            err = kvm_set_user_memory_region(kml, mem);
+        }
+        if (err) {
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (mem->memory_size && !mem->old_memory_size) {
+            err = kvm_set_user_memory_region(kml, mem);
+            if (err) {
+                goto fail;
+            }
+        }
+    }
+
+    trace_kvm_memory_commit(kml->as_id, changed,
+                            kml->nr_slot_ioctls - nr_ioctls);
+out:
+    kvm_slots_unlock();
+    return;
+
+fail:
+    fprintf(stderr, "%s: error updating slot %d: %s\n", __func__,
+            mem->slot, strerror(-err));
+    abort();
+}
+
 static void kvm_log_sync(MemoryListener *listener,
                          MemoryRegionSection *section)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     r = kvm_physical_sync_dirty_bitmap(kml, section);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_flush(kvm_state);
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1229,7 +1681,6 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
-    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
@@ -1239,10 +1690,15 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->listener.region_add = kvm_region_add;
     kml->listener.region_del = kvm_region_del;
+    kml->listener.commit = kvm_region_commit;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
-    kml->listener.log_clear = kvm_log_clear;
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1852,6 +2308,108 @@ bool kvm_vcpu_id_is_valid(int vcpu_id)
     return vcpu_id >= 0 && vcpu_id < kvm_max_vcpu_id(s);
 }
 
+/* Called from RCU critical section */
+static MemoryRegion *kvm_coalesced_mmio_region(struct kvm_coalesced_mmio *ent)
+{
+    AddressSpace *as = ent->pio == 1 ? &address_space_io :
+                                       &address_space_memory;
+    hwaddr xlat, len = ent->len;
+
+    return address_space_translate(as, ent->phys_addr, &xlat, &len, true,
+                                   MEMTXATTRS_UNSPECIFIED);
+}
+
+/*
+ * Dispatch the writes queued in the coalesced MMIO ring, in order.  With
+ * @async_only, stop at the first one for a region that did not allow
+ * processing outside of the vCPU threads.
+ *
+ * Called with the BQL held
+ */
+static void kvm_coalesced_mmio_drain(KVMState *s, bool async_only)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+    while (ring->first != ring->last) {
+        struct kvm_coalesced_mmio *ent;
+        MemoryRegion *mr;
+
+        ent = &ring->coalesced_mmio[ring->first];
+
+        rcu_read_lock();
+        mr = kvm_coalesced_mmio_region(ent);
+        if (async_only && !mr->coalesced_async) {
+            rcu_read_unlock();
+            break;
+        }
+        mr->coalesced_ring_accesses++;
+        rcu_read_unlock();
+
+        if (ent->pio == 1) {
+            address_space_rw(&address_space_io, ent->phys_addr,
+                             MEMTXATTRS_UNSPECIFIED, ent->data,
+                             ent->len, true);
+        } else {
+            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+        }
+        /* Finish with the entry before KVM can reuse it */
+        smp_wmb();
+        ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+    }
+}
+
+/* Is there something at the head of the ring that the thread can process? */
+static bool kvm_coalesced_io_pending_async(KVMState *s)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+    uint32_t first = atomic_read(&ring->first);
+    bool ret;
+
+    if (first == atomic_read(&ring->last)) {
+        return false;
+    }
+    /* Read the entry after KVM published it, pairs with KVM's smp_wmb() */
+    smp_rmb();
+
+    rcu_read_lock();
+    ret = kvm_coalesced_mmio_region(&ring->coalesced_mmio[first])->
+          coalesced_async;
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Process coalesced writes as soon as a vCPU exits with some in the ring,
+ * rather than leaving them all to the next flush on a vCPU thread.  Only
+ * the regions that declared it safe are handled here; a write to any other
+ * region stops the thread until a vCPU flushes the ring.
+ */
+static void *kvm_coalesced_io_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        qemu_event_wait(&s->coalesced_io_event);
+        qemu_event_reset(&s->coalesced_io_event);
+
+        if (!kvm_coalesced_io_pending_async(s)) {
+            continue;
+        }
+
+        qemu_mutex_lock_iothread();
+        if (!s->coalesced_flush_in_progress) {
+            s->coalesced_flush_in_progress = true;
+            kvm_coalesced_mmio_drain(s, true);
+            s->coalesced_flush_in_progress = false;
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
 static int kvm_init(MachineState *ms)
 {
     MachineClass *mc = MACHINE_GET_CLASS(ms);
@@ -1889,6 +2447,7 @@ static int kvm_init(MachineState *ms)
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
 #endif
     QLIST_INIT(&s->kvm_parked_vcpus);
+    qemu_mutex_init(&kml_slots_lock);
     s->vmfd = -1;
     s->fd = qemu_open("/dev/kvm", O_RDWR);
     if (s->fd == -1) {
@@ -1997,7 +2556,26 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
-    s->manual_dirty_log_protect =
+    if (s->coalesced_io_thread_enabled && !s->coalesced_mmio) {
+        warn_report("KVM coalesced MMIO not available, "
+                    "ignoring coalesced-io-thread");
+        s->coalesced_io_thread_enabled = false;
+    }
+    if (s->coalesced_io_thread_enabled) {
+        qemu_event_init(&s->coalesced_io_event, false);
+        qemu_thread_create(&s->coalesced_io_thread, "kvm-coalesced",
+                           kvm_coalesced_io_thread, s, QEMU_THREAD_DETACHED);
+    }
+
+    if (s->kvm_dirty_ring_size) {
+        ret = kvm_dirty_ring_init(s);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    /* Only the dirty bitmap can be cleared manually */
+    s->manual_dirty_log_protect = !s->kvm_dirty_ring_size &&
         kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
     if (s->manual_dirty_log_protect) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
@@ -2171,22 +2749,7 @@ void kvm_flush_coalesced_mmio_buffer(void)
     s->coalesced_flush_in_progress = true;
 
     if (s->coalesced_mmio_ring) {
-        struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
-        while (ring->first != ring->last) {
-            struct kvm_coalesced_mmio *ent;
-
-            ent = &ring->coalesced_mmio[ring->first];
-
-            if (ent->pio == 1) {
-                address_space_rw(&address_space_io, ent->phys_addr,
-                                 MEMTXATTRS_UNSPECIFIED, ent->data,
-                                 ent->len, true);
-            } else {
-                cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
-            }
-            smp_wmb();
-            ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
-        }
+        kvm_coalesced_mmio_drain(s, false);
     }
 
     s->coalesced_flush_in_progress = false;
@@ -2337,6 +2900,12 @@ int kvm_cpu_exec(CPUState *cpu)
 
         attrs = kvm_arch_post_run(cpu, run);
 
+        if (kvm_state->coalesced_io_thread_enabled &&
+            atomic_read(&kvm_state->coalesced_mmio_ring->first) !=
+            atomic_read(&kvm_state->coalesced_mmio_ring->last)) {
+            qemu_event_set(&kvm_state->coalesced_io_event);
+        }
+
 #ifdef KVM_HAVE_MCE_INJECTION
         if (unlikely(have_sigbus_pending)) {
             qemu_mutex_lock_iothread();
@@ -2394,6 +2963,15 @@ int kvm_cpu_exec(CPUState *cpu)
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * KVM won't run the vCPU again until its ring has room, so
+             * harvest it now instead of waiting for the reaper.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            kvm_dirty_ring_reap(kvm_state, cpu);
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
@@ -2993,6 +3571,51 @@ static void kvm_set_kvm_shadow_mem(Object *obj, Visitor *v,
     s->kvm_shadow_mem = value;
 }
 
+static void kvm_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of two");
+        return;
+    }
+
+    s->kvm_dirty_ring_size = value;
+}
+
+static bool kvm_get_coalesced_io_thread(Object *obj, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+
+    return s->coalesced_io_thread_enabled;
+}
+
+static void kvm_set_coalesced_io_thread(Object *obj, bool value, Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+
+    s->coalesced_io_thread_enabled = value;
+}
+
 static void kvm_set_kernel_irqchip(Object *obj, Visitor *v,
                                    const char *name, void *opaque,
                                    Error **errp)
@@ -3074,6 +3697,20 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
         NULL, NULL, &error_abort);
     object_class_property_set_description(oc, "kvm-shadow-mem",
         "KVM shadow MMU size", &error_abort);
+
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+        kvm_get_dirty_ring_size, kvm_set_dirty_ring_size,
+        NULL, NULL, &error_abort);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Entries of the per-vCPU KVM dirty ring (0 = use the dirty bitmap)",
+        &error_abort);
+
+    object_class_property_add_bool(oc, "coalesced-io-thread",
+        kvm_get_coalesced_io_thread, kvm_set_coalesced_io_thread,
+        &error_abort);
+    object_class_property_set_description(oc, "coalesced-io-thread",
+        "Process coalesced MMIO and PIO from a separate thread",
+        &error_abort);
 }
 
 static const TypeInfo kvm_accel_type = {
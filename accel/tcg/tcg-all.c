@@ -40,6 +40,7 @@ typedef struct TCGState {
     AccelState parent_obj;
 
     bool mttcg_enabled;
+    bool ebb_enabled;
     unsigned long tb_size;
 } TCGState;
 
@@ -120,6 +121,7 @@ static void tcg_accel_instance_init(Object *obj)
     TCGState *s = TCG_STATE(obj);
 
     s->mttcg_enabled = default_mttcg_enabled();
+    s->ebb_enabled = true;
 }
 
 static int tcg_init(MachineState *ms)
@@ -129,6 +131,7 @@ static int tcg_init(MachineState *ms)
     tcg_exec_init(s->tb_size * 1024 * 1024);
     cpu_interrupt_handler = tcg_handle_interrupt;
     mttcg_enabled = s->mttcg_enabled;
+    tcg_ebb_enabled = s->ebb_enabled;
     return 0;
 }
 
@@ -167,6 +170,20 @@ static void tcg_set_thread(Object *obj, const char *value, Error **errp)
     }
 }
 
+static bool tcg_get_ebb(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return s->ebb_enabled;
+}
+
+static void tcg_set_ebb(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    s->ebb_enabled = value;
+}
+
 static void tcg_get_tb_size(Object *obj, Visitor *v,
                             const char *name, void *opaque,
                             Error **errp)
@@ -212,6 +229,12 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size", &error_abort);
 
+    object_class_property_add_bool(oc, "ebb",
+        tcg_get_ebb, tcg_set_ebb, &error_abort);
+    object_class_property_set_description(oc, "ebb",
+        "Keep globals in host registers across conditional branches",
+        &error_abort);
+
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -1425,6 +1425,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     PageDesc *p;
     uint32_t h;
     tb_page_addr_t phys_pc;
+    unsigned int i;
 
     assert_memory_lock();
 
@@ -1460,6 +1461,11 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
         if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
             atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
+        for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+            if (atomic_read(&cpu->tb_jmp_victim[i]) == tb) {
+                atomic_set(&cpu->tb_jmp_victim[i], NULL);
+            }
+        }
     }
 
     /* suppress this TB from the two jump lists */
@@ -2241,11 +2247,44 @@ static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
 
 void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 {
+    unsigned int i;
+
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
     tb_jmp_cache_clear_page(cpu, addr - TARGET_PAGE_SIZE);
     tb_jmp_cache_clear_page(cpu, addr);
+
+    /* The victim set is not indexed by page; it is small, drop it all.  */
+    for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+        atomic_set(&cpu->tb_jmp_victim[i], NULL);
+    }
+}
+
+#ifdef CONFIG_PROFILER
+static void print_jmp_cache_statistics(void)
+{
+    TBJmpCacheStats st = {};
+    size_t lookups;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        st.hits += atomic_read(&cpu->tb_jmp_cache_stats.hits);
+        st.victim_hits += atomic_read(&cpu->tb_jmp_cache_stats.victim_hits);
+        st.misses += atomic_read(&cpu->tb_jmp_cache_stats.misses);
+    }
+    lookups = st.hits + st.victim_hits + st.misses;
+    if (!lookups) {
+        return;
+    }
+    qemu_printf("TB jmp cache lookups %zu\n", lookups);
+    qemu_printf("TB jmp cache hits    %zu (%0.2f%%)\n", st.hits,
+                (double)st.hits * 100 / lookups);
+    qemu_printf("TB jmp victim hits   %zu (%0.2f%%)\n", st.victim_hits,
+                (double)st.victim_hits * 100 / lookups);
+    qemu_printf("TB jmp cache misses  %zu (%0.2f%%)\n", st.misses,
+                (double)st.misses * 100 / lookups);
 }
+#endif
 
 static void print_qht_statistics(struct qht_stats hst)
 {
@@ -2352,6 +2391,9 @@ void dump_exec_info(void)
     qht_statistics_init(&tb_ctx.htable, &hst);
     print_qht_statistics(hst);
     qht_statistics_destroy(&hst);
+#ifdef CONFIG_PROFILER
+    print_jmp_cache_statistics();
+#endif
 
     qemu_printf("\nStatistics:\n");
     qemu_printf("TB flush count      %u\n",
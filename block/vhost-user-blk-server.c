@@ -0,0 +1,883 @@
+/*
+ * Export a block node over vhost-user-blk
+ *
+ * The server listens on a UNIX socket for a vhost-user master, such as
+ * another QEMU process running a vhost-user-blk-pci device, and serves
+ * its virtqueues from a block node.  Everything runs in one AioContext,
+ * the main loop's or that of an IOThread: a coroutine that reads and
+ * processes vhost-user messages, virtqueue kicks, and one coroutine per
+ * request.  Guest buffers are mapped from the memory table sent by the
+ * master and handed to the block layer as they are, so request data is
+ * never copied.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/aio-wait.h"
+#include "block/block.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/sockets.h"
+#include "qom/object_interfaces.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+
+#define TYPE_VHOST_USER_BLK_SERVER "vhost-user-blk-server"
+#define VHOST_USER_BLK_SERVER(obj) \
+    OBJECT_CHECK(VuBlkServer, (obj), TYPE_VHOST_USER_BLK_SERVER)
+
+enum {
+    VU_BLK_MAX_QUEUES = 16,
+    VU_BLK_MAX_DISCARD_SECTORS = 32768,
+    VU_BLK_MAX_WRITE_ZEROES_SECTORS = 32768,
+};
+
+typedef struct VuBlkServer VuBlkServer;
+
+typedef struct VuBlkWatch {
+    VuBlkServer *server;
+    int fd;
+    vu_watch_cb cb;
+    void *data;
+    QTAILQ_ENTRY(VuBlkWatch) next;
+} VuBlkWatch;
+
+struct VuBlkServer {
+    Object parent_obj;
+
+    char *node_name;
+    char *unix_socket;
+    char *iothread;
+    bool writable;
+    uint16_t num_queues;
+
+    AioContext *ctx;
+    BlockBackend *blk;
+    struct virtio_blk_config blkcfg;
+    int listen_fd;
+
+    /* The connected vhost-user master; only one at a time */
+    VuDev vu_dev;
+    int client_fd;
+    QTAILQ_HEAD(, VuBlkWatch) watches;
+    unsigned int in_flight;
+
+    Coroutine *co;          /* reads and processes vhost-user messages */
+    bool co_sleeping;       /* co waits in vu_blk_co_sleep() */
+    bool draining;          /* co waits for in_flight to drop to zero */
+    bool quit;              /* co must disconnect the master */
+    bool stopping;          /* the server is going away */
+};
+
+typedef struct VuBlkReq {
+    VuVirtqElement elem;
+    VuBlkServer *server;
+    VuVirtq *vq;
+} VuBlkReq;
+
+static void vu_blk_wake(VuBlkServer *server);
+static void vu_blk_server_accept(void *opaque);
+
+static uint8_t coroutine_fn
+vu_blk_co_discard_write_zeroes(VuBlkServer *server, struct iovec *iov,
+                               unsigned int iov_cnt, uint32_t type)
+{
+    struct virtio_blk_discard_write_zeroes desc;
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+    int ret;
+
+    if (!server->writable) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+    if (iov_to_buf(iov, iov_cnt, 0, &desc, sizeof(desc)) != sizeof(desc)) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    sector = le64_to_cpu(desc.sector);
+    num_sectors = le32_to_cpu(desc.num_sectors);
+    flags = le32_to_cpu(desc.flags);
+    if (sector > INT64_MAX >> BDRV_SECTOR_BITS) {
+        return VIRTIO_BLK_S_IOERR;
+    }
+
+    if (type == VIRTIO_BLK_T_DISCARD) {
+        if (flags) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (num_sectors > VU_BLK_MAX_DISCARD_SECTORS) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        ret = blk_co_pdiscard(server->blk, sector << BDRV_SECTOR_BITS,
+                              num_sectors << BDRV_SECTOR_BITS);
+    } else {
+        if (flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
+            return VIRTIO_BLK_S_UNSUPP;
+        }
+        if (num_sectors > VU_BLK_MAX_WRITE_ZEROES_SECTORS) {
+            return VIRTIO_BLK_S_IOERR;
+        }
+        ret = blk_co_pwrite_zeroes(server->blk, sector << BDRV_SECTOR_BITS,
+                                   num_sectors << BDRV_SECTOR_BITS,
+                                   flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP ?
+                                   BDRV_REQ_MAY_UNMAP : 0);
+    }
+
+    return ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+}
+
+static void coroutine_fn vu_blk_co_process_req(void *opaque)
+{
+    VuBlkReq *req = opaque;
+    VuBlkServer *server = req->server;
+    VuVirtqElement *elem = &req->elem;
+    struct iovec *in_iov = elem->in_sg;
+    struct iovec *out_iov = elem->out_sg;
+    unsigned int in_num = elem->in_num;
+    unsigned int out_num = elem->out_num;
+    struct virtio_blk_outhdr out;
+    QEMUIOVector qiov;
+    uint8_t *status;
+    size_t in_len = 0;
+    uint64_t sector;
+    uint32_t type;
+    int ret;
+
+    /* Same layout checks as hw/block/virtio-blk.c */
+    if (out_num < 1 || in_num < 1) {
+        vu_panic(&server->vu_dev, "vhost-user-blk request missing headers");
+        goto err;
+    }
+    if (iov_to_buf(out_iov, out_num, 0, &out, sizeof(out)) != sizeof(out)) {
+        vu_panic(&server->vu_dev, "vhost-user-blk request outhdr too short");
+        goto err;
+    }
+    iov_discard_front(&out_iov, &out_num, sizeof(out));
+
+    if (in_iov[in_num - 1].iov_len < 1) {
+        vu_panic(&server->vu_dev, "vhost-user-blk request inhdr too short");
+        goto err;
+    }
+    status = in_iov[in_num - 1].iov_base + in_iov[in_num - 1].iov_len - 1;
+    iov_discard_back(in_iov, &in_num, 1);
+
+    type = le32_to_cpu(out.type);
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT: {
+        bool is_write = type & VIRTIO_BLK_T_OUT;
+
+        sector = le64_to_cpu(out.sector);
+        if (sector > INT64_MAX >> BDRV_SECTOR_BITS ||
+            (is_write && !server->writable)) {
+            *status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+
+        if (is_write) {
+            qemu_iovec_init_external(&qiov, out_iov, out_num);
+            ret = blk_co_pwritev(server->blk, sector << BDRV_SECTOR_BITS,
+                                 qiov.size, &qiov, 0);
+        } else {
+            qemu_iovec_init_external(&qiov, in_iov, in_num);
+            ret = blk_co_preadv(server->blk, sector << BDRV_SECTOR_BITS,
+                                qiov.size, &qiov, 0);
+            in_len = qiov.size;
+        }
+        *status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        break;
+    }
+    case VIRTIO_BLK_T_FLUSH:
+        ret = blk_co_flush(server->blk);
+        *status = ret < 0 ? VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK;
+        break;
+    case VIRTIO_BLK_T_GET_ID: {
+        char id[VIRTIO_BLK_ID_BYTES];
+
+        strpadcpy(id, sizeof(id), server->node_name, '\0');
+        in_len = iov_from_buf(in_iov, in_num, 0, id, sizeof(id));
+        *status = VIRTIO_BLK_S_OK;
+        break;
+    }
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        *status = vu_blk_co_discard_write_zeroes(server, out_iov, out_num,
+                                                 type & ~VIRTIO_BLK_T_BARRIER);
+        break;
+    default:
+        *status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+
+    /* IO size with 1 extra status byte */
+    vu_queue_push(&server->vu_dev, req->vq, elem, in_len + 1);
+    vu_queue_notify(&server->vu_dev, req->vq);
+
+err:
+    free(req);
+    server->in_flight--;
+    if (!server->in_flight && server->draining) {
+        vu_blk_wake(server);
+    }
+}
+
+static void vu_blk_process_vq(VuDev *vu_dev, int idx)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+    VuBlkReq *req;
+    Coroutine *co;
+
+    while ((req = vu_queue_pop(vu_dev, vq, sizeof(VuBlkReq)))) {
+        req->server = server;
+        req->vq = vq;
+        server->in_flight++;
+
+        co = qemu_coroutine_create(vu_blk_co_process_req, req);
+        qemu_coroutine_enter(co);
+    }
+}
+
+static void vu_blk_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VuVirtq *vq = vu_get_queue(vu_dev, idx);
+
+    vu_set_queue_handler(vu_dev, vq, started ? vu_blk_process_vq : NULL);
+}
+
+static uint64_t vu_blk_get_features(VuDev *vu_dev)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+    uint64_t features;
+
+    features = 1ull << VIRTIO_BLK_F_SIZE_MAX |
+               1ull << VIRTIO_BLK_F_SEG_MAX |
+               1ull << VIRTIO_BLK_F_TOPOLOGY |
+               1ull << VIRTIO_BLK_F_BLK_SIZE |
+               1ull << VIRTIO_BLK_F_FLUSH |
+               1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_BLK_F_MQ |
+               1ull << VIRTIO_F_VERSION_1 |
+               1ull << VHOST_USER_F_PROTOCOL_FEATURES;
+
+    if (server->writable) {
+        features |= 1ull << VIRTIO_BLK_F_DISCARD |
+                    1ull << VIRTIO_BLK_F_WRITE_ZEROES;
+    } else {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+static uint64_t vu_blk_get_protocol_features(VuDev *vu_dev)
+{
+    return 1ull << VHOST_USER_PROTOCOL_F_MQ |
+           1ull << VHOST_USER_PROTOCOL_F_CONFIG |
+           1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD;
+}
+
+static int vu_blk_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+
+    if (len > sizeof(server->blkcfg)) {
+        return -1;
+    }
+    memcpy(config, &server->blkcfg, len);
+    return 0;
+}
+
+static int vu_blk_set_config(VuDev *vu_dev, const uint8_t *data,
+                             uint32_t offset, uint32_t size, uint32_t flags)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+
+    /* Only the write cache policy can be changed by the driver */
+    if (flags != VHOST_SET_CONFIG_TYPE_MASTER ||
+        offset != offsetof(struct virtio_blk_config, wce) || size != 1) {
+        return -1;
+    }
+
+    server->blkcfg.wce = *data;
+    blk_set_enable_write_cache(server->blk, *data);
+    return 0;
+}
+
+static const VuDevIface vu_blk_iface = {
+    .get_features = vu_blk_get_features,
+    .queue_set_started = vu_blk_queue_set_started,
+    .get_protocol_features = vu_blk_get_protocol_features,
+    .get_config = vu_blk_get_config,
+    .set_config = vu_blk_set_config,
+};
+
+static void vu_blk_watch_read(void *opaque)
+{
+    VuBlkWatch *watch = opaque;
+    VuBlkServer *server = watch->server;
+
+    aio_context_acquire(server->ctx);
+    watch->cb(&server->vu_dev, VU_WATCH_IN, watch->data);
+    aio_context_release(server->ctx);
+}
+
+static void vu_blk_set_watch(VuDev *vu_dev, int fd, int condition,
+                             vu_watch_cb cb, void *data)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+    VuBlkWatch *watch;
+
+    QTAILQ_FOREACH(watch, &server->watches, next) {
+        if (watch->fd == fd) {
+            break;
+        }
+    }
+    if (!watch) {
+        watch = g_new0(VuBlkWatch, 1);
+        watch->server = server;
+        watch->fd = fd;
+        QTAILQ_INSERT_TAIL(&server->watches, watch, next);
+    }
+    watch->cb = cb;
+    watch->data = data;
+
+    /* Kicks are external events, so drained sections stop new requests */
+    aio_set_fd_handler(server->ctx, fd, true, vu_blk_watch_read, NULL, NULL,
+                       watch);
+}
+
+/* Stop or resume processing kicks without forgetting about them */
+static void vu_blk_set_kicks_enabled(VuBlkServer *server, bool enabled)
+{
+    VuBlkWatch *watch;
+
+    QTAILQ_FOREACH(watch, &server->watches, next) {
+        aio_set_fd_handler(server->ctx, watch->fd, true,
+                           enabled ? vu_blk_watch_read : NULL, NULL, NULL,
+                           watch);
+    }
+}
+
+static void vu_blk_remove_watch(VuDev *vu_dev, int fd)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+    VuBlkWatch *watch;
+
+    QTAILQ_FOREACH(watch, &server->watches, next) {
+        if (watch->fd == fd) {
+            aio_set_fd_handler(server->ctx, fd, true, NULL, NULL, NULL, NULL);
+            QTAILQ_REMOVE(&server->watches, watch, next);
+            g_free(watch);
+            return;
+        }
+    }
+}
+
+/* Wake the client coroutine up, if it waits in vu_blk_co_sleep() */
+static void vu_blk_wake(VuBlkServer *server)
+{
+    if (server->co_sleeping) {
+        server->co_sleeping = false;
+        aio_co_wake(server->co);
+    }
+}
+
+static void coroutine_fn vu_blk_co_sleep(VuBlkServer *server)
+{
+    server->co_sleeping = true;
+    qemu_coroutine_yield();
+}
+
+/* Make the client coroutine disconnect the master */
+static void vu_blk_quit(VuBlkServer *server)
+{
+    if (server->co) {
+        server->quit = true;
+        vu_blk_wake(server);
+    }
+}
+
+static void vu_blk_quit_bh(void *opaque)
+{
+    VuBlkServer *server = opaque;
+
+    aio_context_acquire(server->ctx);
+    vu_blk_quit(server);
+    aio_context_release(server->ctx);
+}
+
+static void vu_blk_panic(VuDev *vu_dev, const char *buf)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+
+    error_report("vhost-user-blk-server: %s", buf);
+
+    /* This may be called deep into libvhost-user, tear down later */
+    aio_bh_schedule_oneshot(server->ctx, vu_blk_quit_bh, server);
+}
+
+static void vu_blk_client_readable(void *opaque)
+{
+    vu_blk_wake(opaque);
+}
+
+/* Wait for data from the master, or for vu_blk_quit() */
+static void coroutine_fn vu_blk_co_wait_readable(VuBlkServer *server)
+{
+    aio_set_fd_handler(server->ctx, server->client_fd, true,
+                       vu_blk_client_readable, NULL, NULL, server);
+    vu_blk_co_sleep(server);
+    aio_set_fd_handler(server->ctx, server->client_fd, true, NULL, NULL, NULL,
+                       NULL);
+}
+
+/*
+ * Receive @len bytes, adding the file descriptors that come with them to
+ * @vmsg.  The master can send a message in as many pieces as it likes, so
+ * yield until each of them arrives rather than blocking the AioContext.
+ */
+static bool coroutine_fn vu_blk_co_recv(VuBlkServer *server, void *buf,
+                                        size_t len, VhostUserMsg *vmsg)
+{
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int i, n, fd;
+
+    while (len > 0) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(server->client_fd, &msg, MSG_DONTWAIT);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            vu_blk_co_wait_readable(server);
+            if (server->quit) {
+                return false;
+            }
+            continue;
+        } else if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            vu_panic(&server->vu_dev, "Error while recvmsg: %s",
+                     strerror(errno));
+            return false;
+        } else if (ret == 0) {
+            /* The master hung up */
+            return false;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET ||
+                cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < n; i++) {
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (vmsg->fd_num < VHOST_MEMORY_MAX_NREGIONS) {
+                    vmsg->fds[vmsg->fd_num++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/* Called by vu_dispatch() in the client coroutine */
+static bool coroutine_fn vu_blk_co_read_msg(VuDev *vu_dev, int sock,
+                                            VhostUserMsg *vmsg)
+{
+    VuBlkServer *server = container_of(vu_dev, VuBlkServer, vu_dev);
+    size_t hdr_size = offsetof(VhostUserMsg, payload);
+    int i;
+
+    assert(sock == server->client_fd);
+    vmsg->fd_num = 0;
+    if (!vu_blk_co_recv(server, vmsg, hdr_size, vmsg)) {
+        goto fail;
+    }
+    if (vmsg->size > sizeof(vmsg->payload)) {
+        vu_panic(vu_dev, "vhost-user message too big: %u bytes", vmsg->size);
+        goto fail;
+    }
+    if (!vu_blk_co_recv(server, (uint8_t *)vmsg + hdr_size, vmsg->size,
+                        vmsg)) {
+        goto fail;
+    }
+    return true;
+
+fail:
+    for (i = 0; i < vmsg->fd_num; i++) {
+        close(vmsg->fds[i]);
+    }
+    vmsg->fd_num = 0;
+    return false;
+}
+
+static void coroutine_fn vu_blk_co_disconnect(VuBlkServer *server)
+{
+    VuBlkWatch *watch, *next;
+
+    QTAILQ_FOREACH_SAFE(watch, &server->watches, next, next) {
+        vu_blk_remove_watch(&server->vu_dev, watch->fd);
+    }
+    server->draining = true;
+    while (server->in_flight > 0) {
+        vu_blk_co_sleep(server);
+    }
+    server->draining = false;
+
+    /* This closes client_fd too */
+    vu_deinit(&server->vu_dev);
+    server->client_fd = -1;
+    server->co = NULL;
+    server->quit = false;
+
+    if (!server->stopping) {
+        aio_set_fd_handler(server->ctx, server->listen_fd, true,
+                           vu_blk_server_accept, NULL, NULL, server);
+    }
+    aio_wait_kick();
+}
+
+/*
+ * Serve the master until it hangs up or misbehaves, or the server goes
+ * away.  Messages can remap guest memory or take queues away from us, so
+ * they are processed with no request in flight: once a message starts to
+ * arrive, kicks are left pending in their eventfds until it is done.
+ */
+static void coroutine_fn vu_blk_co_client(void *opaque)
+{
+    VuBlkServer *server = opaque;
+
+    while (!server->quit) {
+        vu_blk_co_wait_readable(server);
+        if (server->quit) {
+            break;
+        }
+
+        vu_blk_set_kicks_enabled(server, false);
+        server->draining = true;
+        while (server->in_flight > 0 && !server->quit) {
+            vu_blk_co_sleep(server);
+        }
+        server->draining = false;
+
+        if (server->quit || !vu_dispatch(&server->vu_dev) ||
+            server->vu_dev.broken) {
+            break;
+        }
+        vu_blk_set_kicks_enabled(server, true);
+    }
+
+    vu_blk_co_disconnect(server);
+}
+
+static void vu_blk_server_accept(void *opaque)
+{
+    VuBlkServer *server = opaque;
+    int fd;
+
+    fd = qemu_accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error_report("vhost-user-blk-server: accept: %s",
+                         strerror(errno));
+        }
+        return;
+    }
+
+    aio_context_acquire(server->ctx);
+    if (!vu_init(&server->vu_dev, server->num_queues, fd, vu_blk_panic,
+                 vu_blk_co_read_msg, vu_blk_set_watch, vu_blk_remove_watch,
+                 &vu_blk_iface)) {
+        error_report("vhost-user-blk-server: failed to initialize "
+                     "libvhost-user");
+        close(fd);
+        aio_context_release(server->ctx);
+        return;
+    }
+    server->client_fd = fd;
+
+    aio_set_fd_handler(server->ctx, server->listen_fd, true, NULL, NULL, NULL,
+                       NULL);
+    server->co = qemu_coroutine_create(vu_blk_co_client, server);
+    qemu_coroutine_enter(server->co);
+    aio_context_release(server->ctx);
+}
+
+static void vu_blk_server_init_config(VuBlkServer *server, int64_t length)
+{
+    struct virtio_blk_config *config = &server->blkcfg;
+
+    config->capacity = cpu_to_le64(length >> BDRV_SECTOR_BITS);
+    config->size_max = cpu_to_le32(65536);
+    config->seg_max = cpu_to_le32(128 - 2);
+    config->blk_size = cpu_to_le32(BDRV_SECTOR_SIZE);
+    config->min_io_size = cpu_to_le16(1);
+    config->opt_io_size = cpu_to_le32(1);
+    config->num_queues = cpu_to_le16(server->num_queues);
+    config->wce = blk_enable_write_cache(server->blk);
+    config->max_discard_sectors = cpu_to_le32(VU_BLK_MAX_DISCARD_SECTORS);
+    config->max_discard_seg = cpu_to_le32(1);
+    config->discard_sector_alignment = cpu_to_le32(1);
+    config->max_write_zeroes_sectors =
+        cpu_to_le32(VU_BLK_MAX_WRITE_ZEROES_SECTORS);
+    config->max_write_zeroes_seg = cpu_to_le32(1);
+}
+
+static void vu_blk_server_complete(UserCreatable *uc, Error **errp)
+{
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(uc);
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    AioContext *old_ctx;
+    AioContext *ctx;
+    uint64_t perm;
+    int64_t length;
+    int ret;
+
+    if (!server->node_name || !server->unix_socket) {
+        error_setg(errp, "'node-name' and 'unix-socket' are required");
+        return;
+    }
+    if (!server->num_queues || server->num_queues > VU_BLK_MAX_QUEUES) {
+        error_setg(errp, "'num-queues' must be between 1 and %d",
+                   VU_BLK_MAX_QUEUES);
+        return;
+    }
+
+    if (server->iothread) {
+        IOThread *iothread = iothread_by_id(server->iothread);
+
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", server->iothread);
+            return;
+        }
+        ctx = iothread_get_aio_context(iothread);
+    } else {
+        ctx = qemu_get_aio_context();
+    }
+
+    bs = bdrv_lookup_bs(NULL, server->node_name, errp);
+    if (!bs) {
+        return;
+    }
+    if (server->writable && bdrv_is_read_only(bs)) {
+        error_setg(errp, "Cannot export read-only node '%s' as writable",
+                   server->node_name);
+        return;
+    }
+
+    old_ctx = bdrv_get_aio_context(bs);
+    aio_context_acquire(old_ctx);
+    ret = bdrv_try_set_aio_context(bs, ctx, errp);
+    aio_context_release(old_ctx);
+    if (ret < 0) {
+        return;
+    }
+
+    aio_context_acquire(ctx);
+
+    /* Like NBD exports, don't allow resizing the node while it is served */
+    perm = BLK_PERM_CONSISTENT_READ;
+    if (server->writable) {
+        perm |= BLK_PERM_WRITE;
+    }
+    blk = blk_new(ctx, perm,
+                  BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED |
+                  BLK_PERM_WRITE | BLK_PERM_GRAPH_MOD);
+    ret = blk_insert_bs(blk, bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    blk_set_enable_write_cache(blk, true);
+
+    length = blk_getlength(blk);
+    if (length < 0) {
+        error_setg_errno(errp, -length, "Failed to determine the length of "
+                         "node '%s'", server->node_name);
+        goto fail;
+    }
+
+    server->listen_fd = unix_listen(server->unix_socket, errp);
+    if (server->listen_fd < 0) {
+        goto fail;
+    }
+    qemu_set_nonblock(server->listen_fd);
+
+    server->blk = blk;
+    server->ctx = ctx;
+    vu_blk_server_init_config(server, length);
+
+    aio_set_fd_handler(ctx, server->listen_fd, true, vu_blk_server_accept,
+                       NULL, NULL, server);
+    aio_context_release(ctx);
+    return;
+
+fail:
+    blk_unref(blk);
+    aio_context_release(ctx);
+}
+
+static void vu_blk_server_stop_bh(void *opaque)
+{
+    VuBlkServer *server = opaque;
+
+    aio_context_acquire(server->ctx);
+    server->stopping = true;
+    aio_set_fd_handler(server->ctx, server->listen_fd, true, NULL, NULL, NULL,
+                       NULL);
+    vu_blk_quit(server);
+    aio_context_release(server->ctx);
+}
+
+static void vu_blk_server_get_num_queues(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(obj);
+
+    visit_type_uint16(v, name, &server->num_queues, errp);
+}
+
+static void vu_blk_server_set_num_queues(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(obj);
+
+    visit_type_uint16(v, name, &server->num_queues, errp);
+}
+
+static bool vu_blk_server_get_writable(Object *obj, Error **errp)
+{
+    return VHOST_USER_BLK_SERVER(obj)->writable;
+}
+
+static void vu_blk_server_set_writable(Object *obj, bool value, Error **errp)
+{
+    VHOST_USER_BLK_SERVER(obj)->writable = value;
+}
+
+#define VU_BLK_SERVER_STR_PROP(field)                                   \
+static char *vu_blk_server_get_##field(Object *obj, Error **errp)       \
+{                                                                       \
+    return g_strdup(VHOST_USER_BLK_SERVER(obj)->field);                 \
+}                                                                       \
+                                                                        \
+static void vu_blk_server_set_##field(Object *obj, const char *value,   \
+                                      Error **errp)                     \
+{                                                                       \
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(obj);                   \
+                                                                        \
+    g_free(server->field);                                              \
+    server->field = g_strdup(value);                                    \
+}
+
+VU_BLK_SERVER_STR_PROP(node_name)
+VU_BLK_SERVER_STR_PROP(unix_socket)
+VU_BLK_SERVER_STR_PROP(iothread)
+
+static void vu_blk_server_init(Object *obj)
+{
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(obj);
+
+    server->num_queues = 1;
+    server->listen_fd = -1;
+    server->client_fd = -1;
+    QTAILQ_INIT(&server->watches);
+}
+
+static void vu_blk_server_finalize(Object *obj)
+{
+    VuBlkServer *server = VHOST_USER_BLK_SERVER(obj);
+
+    if (server->ctx) {
+        aio_context_acquire(server->ctx);
+        aio_wait_bh_oneshot(server->ctx, vu_blk_server_stop_bh, server);
+        AIO_WAIT_WHILE(server->ctx, server->co);
+        blk_unref(server->blk);
+        aio_context_release(server->ctx);
+
+        close(server->listen_fd);
+        unlink(server->unix_socket);
+    }
+
+    g_free(server->node_name);
+    g_free(server->unix_socket);
+    g_free(server->iothread);
+}
+
+static void vu_blk_server_class_init(ObjectClass *oc, void *data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = vu_blk_server_complete;
+
+    object_class_property_add_str(oc, "node-name",
+                                  vu_blk_server_get_node_name,
+                                  vu_blk_server_set_node_name,
+                                  &error_abort);
+    object_class_property_add_str(oc, "unix-socket",
+                                  vu_blk_server_get_unix_socket,
+                                  vu_blk_server_set_unix_socket,
+                                  &error_abort);
+    object_class_property_add_str(oc, "iothread",
+                                  vu_blk_server_get_iothread,
+                                  vu_blk_server_set_iothread,
+                                  &error_abort);
+    object_class_property_add_bool(oc, "writable",
+                                   vu_blk_server_get_writable,
+                                   vu_blk_server_set_writable,
+                                   &error_abort);
+    object_class_property_add(oc, "num-queues", "uint16",
+                              vu_blk_server_get_num_queues,
+                              vu_blk_server_set_num_queues,
+                              NULL, NULL, &error_abort);
+}
+
+static const TypeInfo vu_blk_server_info = {
+    .name = TYPE_VHOST_USER_BLK_SERVER,
+    .parent = TYPE_OBJECT,
+    .instance_size = sizeof(VuBlkServer),
+    .instance_init = vu_blk_server_init,
+    .instance_finalize = vu_blk_server_finalize,
+    .class_init = vu_blk_server_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void vu_blk_server_register_types(void)
+{
+    type_register_static(&vu_blk_server_info);
+}
+
+type_init(vu_blk_server_register_types);
@@ -43,6 +43,7 @@
 #include "qemu/atomic.h"
 #include "qemu/osdep.h"
 #include "qemu/memfd.h"
+#include "qemu/processor.h"
 
 #include "libvhost-user.h"
 
@@ -147,7 +148,7 @@ vu_request_to_string(unsigned int req)
     }
 }
 
-static void
+void
 vu_panic(VuDev *dev, const char *msg, ...)
 {
     char *buf = NULL;
@@ -617,7 +618,7 @@ vu_set_mem_table_exec_postcopy(VuDev *dev, VhostUserMsg *vmsg)
     /* Wait for QEMU to confirm that it's registered the handler for the
      * faults.
      */
-    if (!vu_message_read(dev, dev->sock, vmsg) ||
+    if (!dev->read_msg(dev, dev->sock, vmsg) ||
         vmsg->size != sizeof(vmsg->payload.u64) ||
         vmsg->payload.u64 != 0) {
         vu_panic(dev, "failed to receive valid ack for postcopy set-mem-table");
@@ -902,6 +903,7 @@ vu_get_vring_base_exec(VuDev *dev, VhostUserMsg *vmsg)
     if (dev->iface->queue_set_started) {
         dev->iface->queue_set_started(dev, index, false);
     }
+    vu_queue_stop_worker(dev, &dev->vq[index]);
 
     if (dev->vq[index].call_fd != -1) {
         close(dev->vq[index].call_fd);
@@ -1033,6 +1035,7 @@ vu_set_vring_kick_exec(VuDev *dev, VhostUserMsg *vmsg)
     }
 
     if (dev->vq[index].kick_fd != -1) {
+        vu_queue_stop_worker(dev, &dev->vq[index]);
         dev->remove_watch(dev, dev->vq[index].kick_fd);
         close(dev->vq[index].kick_fd);
         dev->vq[index].kick_fd = -1;
@@ -1077,6 +1080,241 @@ void vu_set_queue_handler(VuDev *dev, VuVirtq *vq,
     }
 }
 
+struct VuQueueWorker {
+    VuDev *dev;
+    int qidx;
+    vu_queue_worker_cb cb;
+    void *opaque;
+    int wakeup_fd;
+    int stop_fd;
+    bool stop;
+    bool busy;
+    int64_t poll_ns;
+    int64_t max_poll_ns;
+    pthread_t thread;
+};
+
+static int64_t
+vu_get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * A worker is busy while it may access the rings.  vu_dispatch() sets
+ * workers_paused and waits for all workers to be idle before processing a
+ * message; the two sides use full barriers so that either the worker sees
+ * the flag, or the dispatcher sees the worker busy.
+ *
+ * Returns false if the worker must exit.
+ */
+static bool
+vu_worker_enter(VuQueueWorker *w)
+{
+    VuDev *dev = w->dev;
+
+    atomic_mb_set(&w->busy, true);
+    if (likely(!atomic_read(&dev->workers_paused))) {
+        return !atomic_read(&w->stop);
+    }
+
+    pthread_mutex_lock(&dev->worker_lock);
+    atomic_set(&w->busy, false);
+    pthread_cond_broadcast(&dev->worker_cond);
+    while (dev->workers_paused && !w->stop) {
+        pthread_cond_wait(&dev->worker_cond, &dev->worker_lock);
+    }
+    atomic_set(&w->busy, true);
+    pthread_mutex_unlock(&dev->worker_lock);
+
+    return !w->stop;
+}
+
+static void
+vu_worker_exit(VuQueueWorker *w)
+{
+    VuDev *dev = w->dev;
+
+    atomic_mb_set(&w->busy, false);
+    if (unlikely(atomic_read(&dev->workers_paused))) {
+        pthread_mutex_lock(&dev->worker_lock);
+        pthread_cond_broadcast(&dev->worker_cond);
+        pthread_mutex_unlock(&dev->worker_lock);
+    }
+}
+
+static void
+vu_workers_pause(VuDev *dev)
+{
+    int i;
+
+    pthread_mutex_lock(&dev->worker_lock);
+    atomic_mb_set(&dev->workers_paused, true);
+    for (i = 0; i < dev->max_queues; i++) {
+        VuQueueWorker *w = dev->vq[i].worker;
+
+        while (w && atomic_read(&w->busy)) {
+            pthread_cond_wait(&dev->worker_cond, &dev->worker_lock);
+        }
+    }
+    pthread_mutex_unlock(&dev->worker_lock);
+}
+
+static void
+vu_workers_resume(VuDev *dev)
+{
+    pthread_mutex_lock(&dev->worker_lock);
+    atomic_set(&dev->workers_paused, false);
+    pthread_cond_broadcast(&dev->worker_cond);
+    pthread_mutex_unlock(&dev->worker_lock);
+}
+
+/* Same policy as the AioContext adaptive polling in util/aio-posix.c */
+static void
+vu_worker_adjust_poll(VuQueueWorker *w, int64_t block_ns)
+{
+    if (block_ns <= w->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > w->max_poll_ns) {
+        /* We'd have to poll for too long, poll less */
+        w->poll_ns /= 2;
+    } else if (w->poll_ns < w->max_poll_ns) {
+        /* There is room to grow, poll longer */
+        w->poll_ns = w->poll_ns ? w->poll_ns * 2 : 4000;
+        if (w->poll_ns > w->max_poll_ns) {
+            w->poll_ns = w->max_poll_ns;
+        }
+    }
+}
+
+static void *
+vu_queue_worker_thread(void *opaque)
+{
+    VuQueueWorker *w = opaque;
+    VuDev *dev = w->dev;
+    VuVirtq *vq = &dev->vq[w->qidx];
+    struct pollfd fds[3];
+    int64_t poll_end = 0;
+    int64_t t0, t;
+    eventfd_t val;
+    int nfds;
+
+    while (vu_worker_enter(w)) {
+        if (!vq->vring.avail) {
+            /* Not set up yet; wait for the next kick */
+            goto sleep;
+        }
+        if (vq->notification) {
+            vu_queue_set_notification(dev, vq, 0);
+        }
+        if (w->cb(dev, w->qidx, w->opaque)) {
+            poll_end = vu_get_time_ns() + w->poll_ns;
+            vu_worker_exit(w);
+            continue;
+        }
+        if (vu_get_time_ns() < poll_end) {
+            vu_worker_exit(w);
+            cpu_relax();
+            continue;
+        }
+
+        /* Idle: re-enable notifications, and sleep unless we raced */
+        vu_queue_set_notification(dev, vq, 1);
+        if (!vu_queue_empty(dev, vq)) {
+            vu_worker_exit(w);
+            continue;
+        }
+
+sleep:
+        nfds = 0;
+        fds[nfds++] = (struct pollfd) { .fd = w->stop_fd, .events = POLLIN };
+        fds[nfds++] = (struct pollfd) { .fd = vq->kick_fd, .events = POLLIN };
+        if (w->wakeup_fd >= 0) {
+            fds[nfds++] = (struct pollfd) { .fd = w->wakeup_fd,
+                                            .events = POLLIN };
+        }
+        vu_worker_exit(w);
+
+        t0 = vu_get_time_ns();
+        if (poll(fds, nfds, -1) < 0 && errno != EINTR) {
+            vu_panic(dev, "worker poll(): %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            eventfd_read(fds[1].fd, &val);
+        }
+        t = vu_get_time_ns();
+        if (w->max_poll_ns) {
+            vu_worker_adjust_poll(w, t - t0);
+        }
+        poll_end = t + w->poll_ns;
+    }
+
+    return NULL;
+}
+
+bool
+vu_queue_start_worker(VuDev *dev, VuVirtq *vq, vu_queue_worker_cb cb,
+                      void *opaque, int wakeup_fd, int64_t max_poll_ns)
+{
+    VuQueueWorker *w;
+
+    assert(cb);
+    assert(!vq->handler);
+
+    vu_queue_stop_worker(dev, vq);
+
+    w = calloc(1, sizeof(*w));
+    if (!w) {
+        return false;
+    }
+    w->dev = dev;
+    w->qidx = vq - dev->vq;
+    w->cb = cb;
+    w->opaque = opaque;
+    w->wakeup_fd = wakeup_fd;
+    w->max_poll_ns = max_poll_ns;
+    w->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (w->stop_fd < 0) {
+        free(w);
+        return false;
+    }
+
+    vq->worker = w;
+    if (pthread_create(&w->thread, NULL, vu_queue_worker_thread, w)) {
+        vq->worker = NULL;
+        close(w->stop_fd);
+        free(w);
+        return false;
+    }
+
+    return true;
+}
+
+void
+vu_queue_stop_worker(VuDev *dev, VuVirtq *vq)
+{
+    VuQueueWorker *w = vq->worker;
+
+    if (!w) {
+        return;
+    }
+
+    pthread_mutex_lock(&dev->worker_lock);
+    atomic_set(&w->stop, true);
+    pthread_cond_broadcast(&dev->worker_cond);
+    pthread_mutex_unlock(&dev->worker_lock);
+    eventfd_write(w->stop_fd, 1);
+
+    pthread_join(w->thread, NULL);
+    vq->worker = NULL;
+    close(w->stop_fd);
+    free(w);
+}
+
 bool vu_set_queue_host_notifier(VuDev *dev, VuVirtq *vq, int fd,
                                 int size, int offset)
 {
@@ -1552,11 +1790,13 @@ vu_dispatch(VuDev *dev)
     int reply_requested;
     bool success = false;
 
-    if (!vu_message_read(dev, dev->sock, &vmsg)) {
+    if (!dev->read_msg(dev, dev->sock, &vmsg)) {
         goto end;
     }
 
+    vu_workers_pause(dev);
     reply_requested = vu_process_message(dev, &vmsg);
+    vu_workers_resume(dev);
     if (!reply_requested) {
         success = true;
         goto end;
@@ -1578,6 +1818,10 @@ vu_deinit(VuDev *dev)
 {
     int i;
 
+    for (i = 0; i < dev->max_queues; i++) {
+        vu_queue_stop_worker(dev, &dev->vq[i]);
+    }
+
     for (i = 0; i < dev->nregions; i++) {
         VuDevRegion *r = &dev->regions[i];
         void *m = (void *) (uintptr_t) r->mmap_addr;
@@ -1635,6 +1879,9 @@ vu_deinit(VuDev *dev)
 
     free(dev->vq);
     dev->vq = NULL;
+
+    pthread_cond_destroy(&dev->worker_cond);
+    pthread_mutex_destroy(&dev->worker_lock);
 }
 
 bool
@@ -1642,6 +1889,7 @@ vu_init(VuDev *dev,
         uint16_t max_queues,
         int socket,
         vu_panic_cb panic,
+        vu_read_msg_cb read_msg,
         vu_set_watch_cb set_watch,
         vu_remove_watch_cb remove_watch,
         const VuDevIface *iface)
@@ -1659,12 +1907,15 @@ vu_init(VuDev *dev,
 
     dev->sock = socket;
     dev->panic = panic;
+    dev->read_msg = read_msg ? read_msg : vu_message_read;
     dev->set_watch = set_watch;
     dev->remove_watch = remove_watch;
     dev->iface = iface;
     dev->log_call_fd = -1;
     dev->slave_fd = -1;
     dev->max_queues = max_queues;
+    pthread_mutex_init(&dev->worker_lock, NULL);
+    pthread_cond_init(&dev->worker_cond, NULL);
 
     dev->vq = malloc(max_queues * sizeof(dev->vq[0]));
     if (!dev->vq) {
@@ -18,6 +18,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/poll.h>
+#include <pthread.h>
 #include <linux/vhost.h>
 #include "standard-headers/linux/virtio_ring.h"
 
@@ -235,6 +236,9 @@ typedef struct VuDevIface {
 } VuDevIface;
 
 typedef void (*vu_queue_handler_cb) (VuDev *dev, int qidx);
+typedef bool (*vu_queue_worker_cb) (VuDev *dev, int qidx, void *opaque);
+
+typedef struct VuQueueWorker VuQueueWorker;
 
 typedef struct VuRing {
     unsigned int num;
@@ -321,6 +325,9 @@ typedef struct VuVirtq {
 
     vu_queue_handler_cb handler;
 
+    /* Thread processing the queue, see vu_queue_start_worker() */
+    VuQueueWorker *worker;
+
     int call_fd;
     int kick_fd;
     int err_fd;
@@ -337,6 +344,7 @@ enum VuWatchCondtion {
 };
 
 typedef void (*vu_panic_cb) (VuDev *dev, const char *err);
+typedef bool (*vu_read_msg_cb) (VuDev *dev, int sock, VhostUserMsg *vmsg);
 typedef void (*vu_watch_cb) (VuDev *dev, int condition, void *data);
 typedef void (*vu_set_watch_cb) (VuDev *dev, int fd, int condition,
                                  vu_watch_cb cb, void *data);
@@ -375,9 +383,23 @@ struct VuDev {
     vu_panic_cb panic;
     const VuDevIface *iface;
 
+    /*
+     * @read_msg: read a message from the master; can be replaced, for
+     * example to wait for it without blocking
+     */
+    vu_read_msg_cb read_msg;
+
     /* Postcopy data */
     int postcopy_ufd;
     bool postcopy_listening;
+
+    /*
+     * Queue workers stay away from the rings while messages are
+     * processed; protected by worker_lock.
+     */
+    pthread_mutex_t worker_lock;
+    pthread_cond_t worker_cond;
+    bool workers_paused;
 };
 
 typedef struct VuVirtqElement {
@@ -394,6 +416,7 @@ typedef struct VuVirtqElement {
  * @max_queues: maximum number of virtqueues
  * @socket: the socket connected to vhost-user master
  * @panic: a panic callback
+ * @read_msg: a read_msg callback, or NULL to use blocking reads
  * @set_watch: a set_watch callback
  * @remove_watch: a remove_watch callback
  * @iface: a VuDevIface structure with vhost-user device callbacks
@@ -406,6 +429,7 @@ bool vu_init(VuDev *dev,
              uint16_t max_queues,
              int socket,
              vu_panic_cb panic,
+             vu_read_msg_cb read_msg,
              vu_set_watch_cb set_watch,
              vu_remove_watch_cb remove_watch,
              const VuDevIface *iface);
@@ -429,6 +453,17 @@ void vu_deinit(VuDev *dev);
  */
 bool vu_dispatch(VuDev *dev);
 
+/**
+ * vu_panic:
+ * @dev: a VuDev context
+ * @msg: a printf-like format string
+ *
+ * Marks the device as broken and calls the panic callback.  Devices use
+ * this when the driver misbehaves, for example when a request does not
+ * have the expected layout.
+ */
+void vu_panic(VuDev *dev, const char *msg, ...);
+
 /**
  * vu_gpa_to_va:
  * @dev: a VuDev context
@@ -461,6 +496,46 @@ VuVirtq *vu_get_queue(VuDev *dev, int qidx);
 void vu_set_queue_handler(VuDev *dev, VuVirtq *vq,
                           vu_queue_handler_cb handler);
 
+/**
+ * vu_queue_start_worker:
+ * @dev: a VuDev context
+ * @vq: a VuVirtq queue
+ * @cb: the queue worker callback
+ * @opaque: passed to @cb
+ * @wakeup_fd: an additional file descriptor to wait on, or -1
+ * @max_poll_ns: maximum time to busy poll the queue before sleeping, or 0
+ *
+ * Process @vq in a dedicated thread rather than in the thread calling
+ * vu_dispatch(), which lets a backend serve several queues in parallel.
+ * The queue must not have a handler set with vu_set_queue_handler().
+ *
+ * The worker calls @cb whenever there may be work to do: after a kick,
+ * when @wakeup_fd (e.g. an I/O completion eventfd, which @cb must drain)
+ * becomes readable, and while busy polling.  @cb returns true if it made
+ * progress.  Guest notifications are disabled while the worker is busy.
+ * When @cb makes no progress, the worker keeps calling it for up to a
+ * polling interval before re-enabling notifications and sleeping.  The
+ * interval adapts between 0 and @max_poll_ns depending on how soon the
+ * worker is woken up after going to sleep.
+ *
+ * @cb runs concurrently with vu_dispatch(), but never while it processes
+ * a message.  It may use the vu_queue_*() functions on @vq only.
+ *
+ * Returns: true on success, false on failure.
+ */
+bool vu_queue_start_worker(VuDev *dev, VuVirtq *vq, vu_queue_worker_cb cb,
+                           void *opaque, int wakeup_fd, int64_t max_poll_ns);
+
+/**
+ * vu_queue_stop_worker:
+ * @dev: a VuDev context
+ * @vq: a VuVirtq queue
+ *
+ * Stop the worker thread of @vq, if any, and wait for it to exit.  This
+ * is done automatically when the queue is stopped by the master.
+ */
+void vu_queue_stop_worker(VuDev *dev, VuVirtq *vq);
+
 /**
  * vu_set_queue_host_notifier:
  * @dev: a VuDev context
@@ -16,32 +16,94 @@
  */
 
 #include "qemu/osdep.h"
+#include <glib-unix.h>
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "contrib/libvhost-user/libvhost-user-glib.h"
 #include "contrib/libvhost-user/libvhost-user.h"
 
 #if defined(__linux__)
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <sys/ioctl.h>
 #endif
 
+#ifdef CONFIG_LINUX_AIO
+#include <sys/eventfd.h>
+#include <libaio.h>
+#endif
+
 enum {
     VHOST_USER_BLK_MAX_QUEUES = 8,
+    /* Requests submitted with a single io_submit() */
+    VUB_AIO_BATCH = 32,
+    /* Latency buckets: <1us, then [2^(n-1), 2^n) us up to ~1s */
+    VUB_LAT_BUCKETS = 21,
+};
+
+enum {
+    VUB_OP_READ,
+    VUB_OP_WRITE,
+    VUB_OP_FLUSH,
+    VUB_OP_DISCARD,
+    VUB_OP_WRITE_ZEROES,
+    VUB_OP_OTHER,
+    VUB_OP__MAX,
 };
 
+static const char *const vub_op_names[VUB_OP__MAX] = {
+    [VUB_OP_READ] = "read",
+    [VUB_OP_WRITE] = "write",
+    [VUB_OP_FLUSH] = "flush",
+    [VUB_OP_DISCARD] = "discard",
+    [VUB_OP_WRITE_ZEROES] = "write-zeroes",
+    [VUB_OP_OTHER] = "other",
+};
+
+typedef struct VubLatency {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[VUB_LAT_BUCKETS];
+} VubLatency;
+
 struct virtio_blk_inhdr {
     unsigned char status;
 };
 
+typedef struct VubDev VubDev;
+
+/*
+ * Each started queue is processed by its own libvhost-user worker thread,
+ * which is the only user of this state while the queue runs.
+ */
+typedef struct VubQueue {
+    VubDev *vdev_blk;
+    bool need_notify;
+    VubLatency lat[VUB_OP__MAX];
+#ifdef CONFIG_LINUX_AIO
+    io_context_t ctx;
+    int efd;
+    unsigned int inflight;
+    struct iocb *pending[VUB_AIO_BATCH];
+    int nr_pending;
+#endif
+} VubQueue;
+
 /* vhost user block device */
-typedef struct VubDev {
+struct VubDev {
     VugDev parent;
     int blk_fd;
+    bool is_blk;
     struct virtio_blk_config blkcfg;
     bool enable_ro;
     char *blk_name;
     GMainLoop *loop;
-} VubDev;
+    uint16_t num_queues;
+    int64_t poll_max_ns;
+    VubQueue queues[VHOST_USER_BLK_MAX_QUEUES];
+};
 
 typedef struct VubReq {
     VuVirtqElement *elem;
@@ -50,7 +112,16 @@ typedef struct VubReq {
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     VubDev *vdev_blk;
+    VubQueue *q;
     struct VuVirtq *vq;
+    int op;
+    int64_t start_ns;
+    struct iovec *iov;
+    uint32_t iovcnt;
+    bool is_write;
+#ifdef CONFIG_LINUX_AIO
+    struct iocb iocb;
+#endif
 } VubReq;
 
 /* refer util/iov.c */
@@ -97,15 +168,88 @@ static void vub_panic_cb(VuDev *vu_dev, const char *buf)
     g_main_loop_quit(vdev_blk->loop);
 }
 
+static int64_t vub_get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void vub_latency_account(VubLatency *lat, int64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - clz64(us) : 0;
+
+    bucket = MIN(bucket, VUB_LAT_BUCKETS - 1);
+
+    /* single writer, see vub_print_stats() */
+    atomic_set_u64(&lat->count, lat->count + 1);
+    atomic_set_u64(&lat->total_ns, lat->total_ns + ns);
+    atomic_set_u64(&lat->max_ns, MAX(lat->max_ns, ns));
+    atomic_set_u64(&lat->hist[bucket], lat->hist[bucket] + 1);
+}
+
+/*
+ * Statistics are updated by the queue workers without any locking, so
+ * the numbers printed here may be slightly off while I/O is running.
+ */
+static void vub_print_stats(VubDev *vdev_blk)
+{
+    int i, op, b;
+
+    for (i = 0; i < vdev_blk->num_queues; i++) {
+        for (op = 0; op < VUB_OP__MAX; op++) {
+            VubLatency *lat = &vdev_blk->queues[i].lat[op];
+            uint64_t count = atomic_read_u64(&lat->count);
+
+            if (!count) {
+                continue;
+            }
+            printf("queue %d %s: %" PRIu64 " requests, "
+                   "avg %.1f us, max %.1f us\n", i, vub_op_names[op], count,
+                   atomic_read_u64(&lat->total_ns) / 1000.0 / count,
+                   atomic_read_u64(&lat->max_ns) / 1000.0);
+            for (b = 0; b < VUB_LAT_BUCKETS; b++) {
+                uint64_t n = atomic_read_u64(&lat->hist[b]);
+
+                if (!n) {
+                    continue;
+                }
+                if (b == 0) {
+                    printf("  %10s < 1 us: %" PRIu64 "\n", "", n);
+                } else if (b == VUB_LAT_BUCKETS - 1) {
+                    printf("  %10" PRIu64 "+ us    : %" PRIu64 "\n",
+                           (uint64_t)1 << (b - 1), n);
+                } else {
+                    printf("  %10" PRIu64 "-%-10" PRIu64 " us: %" PRIu64 "\n",
+                           (uint64_t)1 << (b - 1), (uint64_t)1 << b, n);
+                }
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+static gboolean vub_stats_signal(gpointer opaque)
+{
+    vub_print_stats(opaque);
+    return G_SOURCE_CONTINUE;
+}
+
+/* The guest is notified once per batch, see vub_process_vq() */
 static void vub_req_complete(VubReq *req)
 {
     VugDev *gdev = &req->vdev_blk->parent;
     VuDev *vu_dev = &gdev->parent;
 
+    vub_latency_account(&req->q->lat[req->op],
+                        vub_get_time_ns() - req->start_ns);
+
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, req->elem,
                   req->size + 1);
-    vu_queue_notify(vu_dev, req->vq);
+    req->q->need_notify = true;
 
     if (req->elem) {
         free(req->elem);
@@ -114,6 +258,27 @@ static void vub_req_complete(VubReq *req)
     g_free(req);
 }
 
+static int vub_rw_sync(VubReq *req)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    off_t offset = req->sector_num * 512;
+    ssize_t rc;
+
+    if (req->is_write) {
+        rc = pwritev(vdev_blk->blk_fd, req->iov, req->iovcnt, offset);
+    } else {
+        rc = preadv(vdev_blk->blk_fd, req->iov, req->iovcnt, offset);
+    }
+    if (rc < 0) {
+        fprintf(stderr, "%s, Sector %"PRIu64", Size %lu failed with %s\n",
+                vdev_blk->blk_name, req->sector_num, req->size,
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 static int vub_open(const char *file_name, bool wce)
 {
     int fd;
@@ -133,87 +298,187 @@ static int vub_open(const char *file_name, bool wce)
     return fd;
 }
 
-static ssize_t
-vub_readv(VubReq *req, struct iovec *iov, uint32_t iovcnt)
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Reap completed requests.  With @wait, block until none is left in
+ * flight.  Returns true if any request was completed.
+ */
+static bool vub_aio_complete(VubQueue *q, bool wait)
 {
-    VubDev *vdev_blk = req->vdev_blk;
-    ssize_t rc;
+    struct io_event events[64];
+    struct timespec ts = { 0 };
+    bool progress = false;
+    eventfd_t val;
+    int i, n;
+
+    /*
+     * Non-blocking, just resets the counter.  Always do it, even with
+     * nothing in flight, or the level-triggered eventfd keeps waking
+     * the worker up.
+     */
+    eventfd_read(q->efd, &val);
+
+    if (!q->inflight) {
+        return false;
+    }
 
-    if (!iovcnt) {
-        fprintf(stderr, "Invalid Read IOV count\n");
-        return -1;
+    while (q->inflight) {
+        n = io_getevents(q->ctx, wait ? 1 : 0, ARRAY_SIZE(events), events,
+                         wait ? NULL : &ts);
+        if (n == -EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            VubReq *req = events[i].data;
+
+            if (events[i].res == req->size) {
+                req->in->status = VIRTIO_BLK_S_OK;
+            } else {
+                fprintf(stderr, "%s, Sector %"PRIu64", Size %lu failed "
+                        "with %s\n", req->vdev_blk->blk_name, req->sector_num,
+                        req->size, strerror(-(long)events[i].res));
+                req->in->status = VIRTIO_BLK_S_IOERR;
+            }
+            q->inflight--;
+            vub_req_complete(req);
+        }
+        progress = true;
+
+        if (!wait && n < ARRAY_SIZE(events)) {
+            break;
+        }
     }
 
-    req->size = vub_iov_size(iov, iovcnt);
-    rc = preadv(vdev_blk->blk_fd, iov, iovcnt, req->sector_num * 512);
-    if (rc < 0) {
-        fprintf(stderr, "%s, Sector %"PRIu64", Size %lu failed with %s\n",
-                vdev_blk->blk_name, req->sector_num, req->size,
-                strerror(errno));
-        return -1;
+    return progress;
+}
+
+/* Submit the requests queued by vub_rw() */
+static void vub_aio_submit(VubQueue *q)
+{
+    int i = 0;
+    int ret;
+
+    while (i < q->nr_pending) {
+        ret = io_submit(q->ctx, q->nr_pending - i, &q->pending[i]);
+        if (ret <= 0) {
+            break;
+        }
+        q->inflight += ret;
+        i += ret;
     }
 
-    return rc;
+    /* The context is full, fall back to synchronous I/O */
+    for (; i < q->nr_pending; i++) {
+        VubReq *req = q->pending[i]->data;
+
+        req->in->status = vub_rw_sync(req) ? VIRTIO_BLK_S_IOERR
+                                           : VIRTIO_BLK_S_OK;
+        vub_req_complete(req);
+    }
+    q->nr_pending = 0;
 }
+#endif
 
-static ssize_t
-vub_writev(VubReq *req, struct iovec *iov, uint32_t iovcnt)
+/*
+ * Returns 1 if the request was queued for submission and will be completed
+ * by vub_aio_complete(), 0 if it was completed synchronously and -1 on
+ * error.
+ */
+static int
+vub_rw(VubReq *req, struct iovec *iov, uint32_t iovcnt, bool is_write)
 {
+#ifdef CONFIG_LINUX_AIO
     VubDev *vdev_blk = req->vdev_blk;
-    ssize_t rc;
+    off_t offset = req->sector_num * 512;
+    VubQueue *q = req->q;
+    struct iocb *iocb = &req->iocb;
+#endif
 
     if (!iovcnt) {
-        fprintf(stderr, "Invalid Write IOV count\n");
+        fprintf(stderr, "Invalid %s IOV count\n", is_write ? "Write" : "Read");
         return -1;
     }
 
     req->size = vub_iov_size(iov, iovcnt);
-    rc = pwritev(vdev_blk->blk_fd, iov, iovcnt, req->sector_num * 512);
-    if (rc < 0) {
-        fprintf(stderr, "%s, Sector %"PRIu64", Size %lu failed with %s\n",
-                vdev_blk->blk_name, req->sector_num, req->size,
-                strerror(errno));
-        return -1;
+    req->iov = iov;
+    req->iovcnt = iovcnt;
+    req->is_write = is_write;
+
+#ifdef CONFIG_LINUX_AIO
+    if (q->efd >= 0) {
+        if (is_write) {
+            io_prep_pwritev(iocb, vdev_blk->blk_fd, iov, iovcnt, offset);
+        } else {
+            io_prep_preadv(iocb, vdev_blk->blk_fd, iov, iovcnt, offset);
+        }
+        io_set_eventfd(iocb, q->efd);
+        iocb->data = req;
+
+        q->pending[q->nr_pending++] = iocb;
+        if (q->nr_pending == VUB_AIO_BATCH) {
+            vub_aio_submit(q);
+        }
+        return 1;
     }
+#endif
 
-    return rc;
+    return vub_rw_sync(req);
 }
 
+/*
+ * Block devices use the BLKDISCARD and BLKZEROOUT ioctls, regular files
+ * punch holes or zero ranges with fallocate().
+ */
 static int
 vub_discard_write_zeroes(VubReq *req, struct iovec *iov, uint32_t iovcnt,
                          uint32_t type)
 {
-    struct virtio_blk_discard_write_zeroes *desc;
+    struct virtio_blk_discard_write_zeroes desc;
     ssize_t size;
-    void *buf;
 
     size = vub_iov_size(iov, iovcnt);
-    if (size != sizeof(*desc)) {
-        fprintf(stderr, "Invalid size %ld, expect %ld\n", size, sizeof(*desc));
+    if (size != sizeof(desc)) {
+        fprintf(stderr, "Invalid size %ld, expect %ld\n", size, sizeof(desc));
         return -1;
     }
-    buf = g_new0(char, size);
-    vub_iov_to_buf(iov, iovcnt, buf);
+    vub_iov_to_buf(iov, iovcnt, &desc);
 
     #if defined(__linux__) && defined(BLKDISCARD) && defined(BLKZEROOUT)
     VubDev *vdev_blk = req->vdev_blk;
-    desc = (struct virtio_blk_discard_write_zeroes *)buf;
-    uint64_t range[2] = { le64toh(desc->sector) << 9,
-                          le32toh(desc->num_sectors) << 9 };
-    if (type == VIRTIO_BLK_T_DISCARD) {
-        if (ioctl(vdev_blk->blk_fd, BLKDISCARD, range) == 0) {
-            g_free(buf);
-            return 0;
-        }
-    } else if (type == VIRTIO_BLK_T_WRITE_ZEROES) {
-        if (ioctl(vdev_blk->blk_fd, BLKZEROOUT, range) == 0) {
-            g_free(buf);
-            return 0;
+    uint64_t sector = le64toh(desc.sector);
+    uint64_t num_sectors = le32toh(desc.num_sectors);
+    uint64_t range[2] = { sector << 9, num_sectors << 9 };
+    int mode;
+
+    if (sector > vdev_blk->blkcfg.capacity ||
+        num_sectors > vdev_blk->blkcfg.capacity - sector) {
+        return -1;
+    }
+
+    if (vdev_blk->is_blk) {
+        if (type == VIRTIO_BLK_T_DISCARD) {
+            return ioctl(vdev_blk->blk_fd, BLKDISCARD, range) ? -1 : 0;
+        } else {
+            return ioctl(vdev_blk->blk_fd, BLKZEROOUT, range) ? -1 : 0;
         }
     }
+
+    mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    if (type == VIRTIO_BLK_T_WRITE_ZEROES &&
+        fallocate(vdev_blk->blk_fd, FALLOC_FL_ZERO_RANGE, range[0],
+                  range[1]) == 0) {
+        return 0;
+    }
+    /* A punched hole reads back as zeroes too */
+    if (fallocate(vdev_blk->blk_fd, mode, range[0], range[1]) == 0) {
+        return 0;
+    }
     #endif
 
-    g_free(buf);
     return -1;
 }
 
@@ -225,9 +490,9 @@ vub_flush(VubReq *req)
     fdatasync(vdev_blk->blk_fd);
 }
 
-static int vub_virtio_process_req(VubDev *vdev_blk,
-                                     VuVirtq *vq)
+static int vub_virtio_process_req(VubQueue *q, VuVirtq *vq)
 {
+    VubDev *vdev_blk = q->vdev_blk;
     VugDev *gdev = &vdev_blk->parent;
     VuDev *vu_dev = &gdev->parent;
     VuVirtqElement *elem;
@@ -249,7 +514,10 @@ static int vub_virtio_process_req(VubDev *vdev_blk,
     }
 
     req = g_new0(VubReq, 1);
+    req->start_ns = vub_get_time_ns();
+    req->op = VUB_OP_OTHER;
     req->vdev_blk = vdev_blk;
+    req->q = q;
     req->vq = vq;
     req->elem = elem;
 
@@ -275,15 +543,22 @@ static int vub_virtio_process_req(VubDev *vdev_blk,
     switch (type & ~VIRTIO_BLK_T_BARRIER) {
     case VIRTIO_BLK_T_IN:
     case VIRTIO_BLK_T_OUT: {
-        ssize_t ret = 0;
+        int ret;
         bool is_write = type & VIRTIO_BLK_T_OUT;
+        req->op = is_write ? VUB_OP_WRITE : VUB_OP_READ;
         req->sector_num = le64toh(req->out->sector);
-        if (is_write) {
-            ret  = vub_writev(req, &elem->out_sg[1], out_num);
+        if (is_write && vdev_blk->enable_ro) {
+            ret = -1;
+        } else if (is_write) {
+            ret = vub_rw(req, &elem->out_sg[1], out_num, true);
         } else {
-            ret = vub_readv(req, &elem->in_sg[0], in_num);
+            ret = vub_rw(req, &elem->in_sg[0], in_num, false);
         }
-        if (ret >= 0) {
+        if (ret > 0) {
+            /* in flight */
+            break;
+        }
+        if (ret == 0) {
             req->in->status = VIRTIO_BLK_S_OK;
         } else {
             req->in->status = VIRTIO_BLK_S_IOERR;
@@ -292,6 +567,7 @@ static int vub_virtio_process_req(VubDev *vdev_blk,
         break;
     }
     case VIRTIO_BLK_T_FLUSH:
+        req->op = VUB_OP_FLUSH;
         vub_flush(req);
         req->in->status = VIRTIO_BLK_S_OK;
         vub_req_complete(req);
@@ -307,8 +583,16 @@ static int vub_virtio_process_req(VubDev *vdev_blk,
     }
     case VIRTIO_BLK_T_DISCARD:
     case VIRTIO_BLK_T_WRITE_ZEROES: {
-        int rc;
-        rc = vub_discard_write_zeroes(req, &elem->out_sg[1], out_num, type);
+        int rc = -1;
+        if (type == VIRTIO_BLK_T_DISCARD) {
+            req->op = VUB_OP_DISCARD;
+        } else {
+            req->op = VUB_OP_WRITE_ZEROES;
+        }
+        if (!vdev_blk->enable_ro) {
+            rc = vub_discard_write_zeroes(req, &elem->out_sg[1], out_num,
+                                          type);
+        }
         if (rc == 0) {
             req->in->status = VIRTIO_BLK_S_OK;
         } else {
@@ -331,36 +615,72 @@ err:
     return -1;
 }
 
-static void vub_process_vq(VuDev *vu_dev, int idx)
+static void vub_queue_notify(VuDev *vu_dev, VuVirtq *vq, VubQueue *q)
 {
-    VugDev *gdev;
-    VubDev *vdev_blk;
-    VuVirtq *vq;
-    int ret;
+    if (q->need_notify) {
+        q->need_notify = false;
+        vu_queue_notify(vu_dev, vq);
+    }
+}
 
-    gdev = container_of(vu_dev, VugDev, parent);
-    vdev_blk = container_of(gdev, VubDev, parent);
-    assert(vdev_blk);
+/* Worker callback, runs in the queue's own thread */
+static bool vub_process_vq(VuDev *vu_dev, int idx, void *opaque)
+{
+    VubQueue *q = opaque;
+    VuVirtq *vq;
+    bool progress = false;
 
     vq = vu_get_queue(vu_dev, idx);
     assert(vq);
 
-    while (1) {
-        ret = vub_virtio_process_req(vdev_blk, vq);
-        if (ret) {
-            break;
-        }
+#ifdef CONFIG_LINUX_AIO
+    progress = vub_aio_complete(q, false);
+#endif
+    while (vub_virtio_process_req(q, vq) == 0) {
+        progress = true;
+    }
+#ifdef CONFIG_LINUX_AIO
+    if (q->nr_pending) {
+        vub_aio_submit(q);
     }
+#endif
+    vub_queue_notify(vu_dev, vq, q);
+
+    return progress;
 }
 
 static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
 {
+    VugDev *gdev;
+    VubDev *vdev_blk;
+    VubQueue *q;
     VuVirtq *vq;
+    int wakeup_fd = -1;
 
     assert(vu_dev);
 
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    q = &vdev_blk->queues[idx];
     vq = vu_get_queue(vu_dev, idx);
-    vu_set_queue_handler(vu_dev, vq, started ? vub_process_vq : NULL);
+
+    if (started) {
+#ifdef CONFIG_LINUX_AIO
+        wakeup_fd = q->efd;
+#endif
+        if (!vu_queue_start_worker(vu_dev, vq, vub_process_vq, q, wakeup_fd,
+                                   vdev_blk->poll_max_ns)) {
+            vub_panic_cb(vu_dev, "Failed to start queue worker");
+        }
+        return;
+    }
+
+    vu_queue_stop_worker(vu_dev, vq);
+#ifdef CONFIG_LINUX_AIO
+    /* Give the ring back to the master with no request in flight */
+    vub_aio_complete(q, true);
+#endif
+    vub_queue_notify(vu_dev, vq, q);
 }
 
 static uint64_t
@@ -383,6 +703,7 @@ vub_get_features(VuDev *dev)
                1ull << VIRTIO_BLK_F_WRITE_ZEROES |
                #endif
                1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_BLK_F_MQ |
                1ull << VIRTIO_F_VERSION_1 |
                1ull << VHOST_USER_F_PROTOCOL_FEATURES;
 
@@ -396,7 +717,8 @@ vub_get_features(VuDev *dev)
 static uint64_t
 vub_get_protocol_features(VuDev *dev)
 {
-    return 1ull << VHOST_USER_PROTOCOL_F_CONFIG |
+    return 1ull << VHOST_USER_PROTOCOL_F_MQ |
+           1ull << VHOST_USER_PROTOCOL_F_CONFIG |
            1ull << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD;
 }
 
@@ -506,10 +828,25 @@ fail:
 
 static void vub_free(struct VubDev *vdev_blk)
 {
+#ifdef CONFIG_LINUX_AIO
+    int i;
+#endif
+
     if (!vdev_blk) {
         return;
     }
 
+#ifdef CONFIG_LINUX_AIO
+    for (i = 0; i < vdev_blk->num_queues; i++) {
+        VubQueue *q = &vdev_blk->queues[i];
+
+        if (q->efd >= 0) {
+            io_destroy(q->ctx);
+            close(q->efd);
+        }
+    }
+#endif
+
     g_main_loop_unref(vdev_blk->loop);
     if (vdev_blk->blk_fd >= 0) {
         close(vdev_blk->blk_fd);
@@ -532,7 +869,8 @@ vub_get_blocksize(int fd)
 }
 
 static void
-vub_initialize_config(int fd, struct virtio_blk_config *config)
+vub_initialize_config(int fd, struct virtio_blk_config *config,
+                      uint16_t num_queues)
 {
     off64_t capacity;
 
@@ -543,7 +881,7 @@ vub_initialize_config(int fd, struct virtio_blk_config *config)
     config->seg_max = 128 - 2;
     config->min_io_size = 1;
     config->opt_io_size = 1;
-    config->num_queues = 1;
+    config->num_queues = num_queues;
     #if defined(__linux__) && defined(BLKDISCARD) && defined(BLKZEROOUT)
     config->max_discard_sectors = 32768;
     config->max_discard_seg = 1;
@@ -553,25 +891,52 @@ vub_initialize_config(int fd, struct virtio_blk_config *config)
     #endif
 }
 
+static void
+vub_queue_init(VubDev *vdev_blk, VubQueue *q)
+{
+    q->vdev_blk = vdev_blk;
+
+#ifdef CONFIG_LINUX_AIO
+    q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->efd < 0) {
+        return;
+    }
+    if (io_setup(VIRTQUEUE_MAX_SIZE, &q->ctx) < 0) {
+        fprintf(stderr, "io_setup failed, using synchronous I/O\n");
+        close(q->efd);
+        q->efd = -1;
+    }
+#endif
+}
+
 static VubDev *
-vub_new(char *blk_file)
+vub_new(char *blk_file, uint16_t num_queues)
 {
     VubDev *vdev_blk;
+    struct stat st;
+    int i;
 
     vdev_blk = g_new0(VubDev, 1);
     vdev_blk->loop = g_main_loop_new(NULL, FALSE);
+    vdev_blk->num_queues = num_queues;
+    for (i = 0; i < num_queues; i++) {
+        vub_queue_init(vdev_blk, &vdev_blk->queues[i]);
+    }
     vdev_blk->blk_fd = vub_open(blk_file, 0);
     if (vdev_blk->blk_fd  < 0) {
         fprintf(stderr, "Error to open block device %s\n", blk_file);
         vub_free(vdev_blk);
         return NULL;
     }
+    if (fstat(vdev_blk->blk_fd, &st) == 0) {
+        vdev_blk->is_blk = S_ISBLK(st.st_mode);
+    }
     vdev_blk->enable_ro = false;
     vdev_blk->blkcfg.wce = 0;
     vdev_blk->blk_name = blk_file;
 
     /* fill virtio_blk_config with block parameters */
-    vub_initialize_config(vdev_blk->blk_fd, &vdev_blk->blkcfg);
+    vub_initialize_config(vdev_blk->blk_fd, &vdev_blk->blkcfg, num_queues);
 
     return vdev_blk;
 }
@@ -581,6 +946,8 @@ static char *opt_socket_path;
 static char *opt_blk_file;
 static gboolean opt_print_caps;
 static gboolean opt_read_only;
+static int opt_num_queues = 1;
+static gint64 opt_poll_max_ns;
 
 static GOptionEntry entries[] = {
     { "print-capabilities", 'c', 0, G_OPTION_ARG_NONE, &opt_print_caps,
@@ -592,7 +959,14 @@ static GOptionEntry entries[] = {
     {"blk-file", 'b', 0, G_OPTION_ARG_FILENAME, &opt_blk_file,
      "block device or file path", "PATH"},
     { "read-only", 'r', 0, G_OPTION_ARG_NONE, &opt_read_only,
-      "Enable read-only", NULL }
+      "Enable read-only", NULL },
+    { "num-queues", 'n', 0, G_OPTION_ARG_INT, &opt_num_queues,
+      "Number of queues, each processed by its own thread (default: 1)",
+      "NUM" },
+    { "poll-max-ns", 'p', 0, G_OPTION_ARG_INT64, &opt_poll_max_ns,
+      "Maximum time to busy poll a queue before sleeping (default: 0)",
+      "NS" },
+    { NULL }
 };
 
 int main(int argc, char **argv)
@@ -624,6 +998,12 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
+    if (opt_num_queues < 1 || opt_num_queues > VHOST_USER_BLK_MAX_QUEUES) {
+        g_printerr("num-queues must be between 1 and %d\n",
+                   VHOST_USER_BLK_MAX_QUEUES);
+        exit(EXIT_FAILURE);
+    }
+
     if (opt_socket_path) {
         lsock = unix_sock_new(opt_socket_path);
         if (lsock < 0) {
@@ -642,7 +1022,7 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
     }
 
-    vdev_blk = vub_new(opt_blk_file);
+    vdev_blk = vub_new(opt_blk_file, opt_num_queues);
     if (!vdev_blk) {
         exit(EXIT_FAILURE);
     }
@@ -650,12 +1030,17 @@ int main(int argc, char **argv)
         vdev_blk->enable_ro = true;
     }
 
-    if (!vug_init(&vdev_blk->parent, VHOST_USER_BLK_MAX_QUEUES, csock,
+    vdev_blk->poll_max_ns = MAX(opt_poll_max_ns, 0);
+
+    if (!vug_init(&vdev_blk->parent, opt_num_queues, csock,
                   vub_panic_cb, &vub_iface)) {
         g_printerr("Failed to initialize libvhost-user-glib\n");
         exit(EXIT_FAILURE);
     }
 
+    /* kill -USR1 prints the latency histograms */
+    g_unix_signal_add(SIGUSR1, vub_stats_signal, vdev_blk);
+
     g_main_loop_run(vdev_blk->loop);
     g_main_loop_unref(vdev_blk->loop);
     g_option_context_free(context);
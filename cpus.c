@@ -1834,9 +1834,11 @@ void qemu_mutex_lock_iothread_impl(const char *file, int line)
 
 void qemu_mutex_unlock_iothread(void)
 {
+    QemuMutexUnlockFunc bql_unlock = atomic_read(&qemu_bql_mutex_unlock_func);
+
     g_assert(qemu_mutex_iothread_locked());
     iothread_locked = false;
-    qemu_mutex_unlock(&qemu_global_mutex);
+    bql_unlock(&qemu_global_mutex, __FILE__, __LINE__);
 }
 
 static bool all_vcpus_paused(void)
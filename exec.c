@@ -70,6 +70,7 @@
 #include "migration/vmstate.h"
 
 #include "qemu/range.h"
+#include "qemu/qsp.h"
 #ifndef _WIN32
 #include "qemu/mmap-alloc.h"
 #endif
@@ -141,7 +142,8 @@ typedef struct PhysPageMap {
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
-    MemoryRegionSection *mru_section;
+    /* Unique among all dispatches ever created, never 0 */
+    uint64_t generation;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -149,6 +151,29 @@ struct AddressSpaceDispatch {
     PhysPageMap map;
 };
 
+/*
+ * Recent lookups of the current thread: the section for a page, and for
+ * subpages the last section resolved within it.  Each vCPU thread, and
+ * each thread doing DMA for devices, hits its own small set of MMIO
+ * pages over and over; keeping the results per thread avoids walking
+ * the map every time without bouncing a shared cache line around.
+ * Entries are tagged with the generation of the dispatch they come from,
+ * so a new FlatView invalidates them all.
+ */
+#define DISPATCH_CACHE_SIZE 16
+
+typedef struct DispatchCacheEntry {
+    uint64_t generation;
+    hwaddr index;
+    MemoryRegionSection *section;
+    MemoryRegionSection *sub_section;
+} DispatchCacheEntry;
+
+static __thread DispatchCacheEntry dispatch_cache[DISPATCH_CACHE_SIZE];
+
+/* Protected by the BQL */
+static uint64_t dispatch_generation;
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -354,17 +379,28 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = atomic_read(&d->mru_section);
+    hwaddr index = addr >> TARGET_PAGE_BITS;
+    DispatchCacheEntry *e = &dispatch_cache[index % DISPATCH_CACHE_SIZE];
+    MemoryRegionSection *section;
     subpage_t *subpage;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
-        section = phys_page_find(d, addr);
-        atomic_set(&d->mru_section, section);
+    if (e->generation != d->generation || e->index != index) {
+        e->generation = d->generation;
+        e->index = index;
+        e->section = phys_page_find(d, addr);
+        e->sub_section = NULL;
     }
+    section = e->section;
     if (resolve_subpage && section->mr->subpage) {
+        if (e->sub_section && section_covers_addr(e->sub_section, addr)) {
+            return e->sub_section;
+        }
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->map.sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
+        /* The unassigned section covers everything, don't cache it */
+        if (section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+            e->sub_section = section;
+        }
     }
     return section;
 }
@@ -2925,6 +2961,7 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
     assert(n == PHYS_SECTION_UNASSIGNED);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
+    d->generation = ++dispatch_generation;
 
     return d;
 }
@@ -3122,13 +3159,32 @@ static int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
     return l;
 }
 
+/*
+ * The region for which this thread took the BQL in prepare_mmio_access(),
+ * and when.  Used to account the time the BQL is held to the region; only
+ * set while the synchronization profiler is enabled, so that the clock is
+ * not read twice for every access otherwise.
+ */
+static __thread MemoryRegion *mmio_bql_mr;
+static __thread int64_t mmio_bql_acquired_at;
+
 static bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool unlocked = !qemu_mutex_iothread_locked();
     bool release_lock = false;
 
     if (unlocked && mr->global_locking) {
-        qemu_mutex_lock_iothread();
+        if (qsp_is_enabled()) {
+            int64_t start = get_clock();
+
+            qemu_mutex_lock_iothread();
+            mmio_bql_acquired_at = get_clock();
+            mmio_bql_mr = mr;
+            mr->bql_acquisitions++;
+            mr->bql_wait_ns += mmio_bql_acquired_at - start;
+        } else {
+            qemu_mutex_lock_iothread();
+        }
         unlocked = false;
         release_lock = true;
     }
@@ -3145,6 +3201,16 @@ static bool prepare_mmio_access(MemoryRegion *mr)
     return release_lock;
 }
 
+/* Drop the BQL if prepare_mmio_access() took it */
+static void finish_mmio_access(void)
+{
+    if (mmio_bql_mr) {
+        mmio_bql_mr->bql_hold_ns += get_clock() - mmio_bql_acquired_at;
+        mmio_bql_mr = NULL;
+    }
+    qemu_mutex_unlock_iothread();
+}
+
 /* Called within RCU critical section.  */
 static MemTxResult flatview_write_continue(FlatView *fv, hwaddr addr,
                                            MemTxAttrs attrs,
@@ -3174,7 +3240,7 @@ static MemTxResult flatview_write_continue(FlatView *fv, hwaddr addr,
         }
 
         if (release_lock) {
-            qemu_mutex_unlock_iothread();
+            finish_mmio_access();
             release_lock = false;
         }
 
@@ -3236,7 +3302,7 @@ MemTxResult flatview_read_continue(FlatView *fv, hwaddr addr,
         }
 
         if (release_lock) {
-            qemu_mutex_unlock_iothread();
+            finish_mmio_access();
             release_lock = false;
         }
 
@@ -4031,14 +4097,13 @@ void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
                                 " [ROM]", " [watch]" };
 
         qemu_printf("      #%d @" TARGET_FMT_plx ".." TARGET_FMT_plx
-                    " %s%s%s%s%s",
+                    " %s%s%s%s",
             i,
             s->offset_within_address_space,
             s->offset_within_address_space + MR_SIZE(s->mr->size),
             s->mr->name ? s->mr->name : "(noname)",
             i < ARRAY_SIZE(names) ? names[i] : "",
             s->mr == root ? " [ROOT]" : "",
-            s == d->mru_section ? " [MRU]" : "",
             s->mr->is_iommu ? " [iommu]" : "");
 
         if (s->mr->alias) {
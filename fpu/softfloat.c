@@ -414,6 +414,93 @@ float64_gen2(float64 xa, float64 xb, float_status *s,
     return soft(ua.s, ub.s, s);
 }
 
+/*
+ * Batch flavors of the above, for helpers that apply the same operation to
+ * every element of a vector.  can_use_fpu() is tested once per call: the
+ * softfloat fallback for one element only ever adds exception flags, so
+ * it cannot make the host FPU unusable for the following ones.  @d may
+ * alias @a or @b.
+ */
+static inline void
+float32_gen2_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                 float_status *s, hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                 f32_check_fn pre, f32_check_fn post,
+                 f32_check_fn fast_test, soft_f32_op2_fn fast_op)
+{
+    union_float32 ua, ub, ur;
+    size_t i;
+
+    if (unlikely(!can_use_fpu(s))) {
+        for (i = 0; i < n; i++) {
+            d[i] = soft(a[i], b[i], s);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        ua.s = a[i];
+        ub.s = b[i];
+        float32_input_flush2(&ua.s, &ub.s, s);
+        if (unlikely(!pre(ua, ub))) {
+            d[i] = soft(ua.s, ub.s, s);
+            continue;
+        }
+        if (fast_test && fast_test(ua, ub)) {
+            d[i] = fast_op(ua.s, ub.s, s);
+            continue;
+        }
+
+        ur.h = hard(ua.h, ub.h);
+        if (unlikely(f32_is_inf(ur))) {
+            s->float_exception_flags |= float_flag_overflow;
+        } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+                   (post == NULL || post(ua, ub))) {
+            ur.s = soft(ua.s, ub.s, s);
+        }
+        d[i] = ur.s;
+    }
+}
+
+static inline void
+float64_gen2_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                 float_status *s, hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                 f64_check_fn pre, f64_check_fn post,
+                 f64_check_fn fast_test, soft_f64_op2_fn fast_op)
+{
+    union_float64 ua, ub, ur;
+    size_t i;
+
+    if (unlikely(!can_use_fpu(s))) {
+        for (i = 0; i < n; i++) {
+            d[i] = soft(a[i], b[i], s);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        ua.s = a[i];
+        ub.s = b[i];
+        float64_input_flush2(&ua.s, &ub.s, s);
+        if (unlikely(!pre(ua, ub))) {
+            d[i] = soft(ua.s, ub.s, s);
+            continue;
+        }
+        if (fast_test && fast_test(ua, ub)) {
+            d[i] = fast_op(ua.s, ub.s, s);
+            continue;
+        }
+
+        ur.h = hard(ua.h, ub.h);
+        if (unlikely(f64_is_inf(ur))) {
+            s->float_exception_flags |= float_flag_overflow;
+        } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+                   (post == NULL || post(ua, ub))) {
+            ur.s = soft(ua.s, ub.s, s);
+        }
+        d[i] = ur.s;
+    }
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the single-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -1844,6 +1931,74 @@ float64_div(float64 a, float64 b, float_status *s)
                         f64_div_pre, f64_div_post, NULL, NULL);
 }
 
+/*
+ * Vector batch versions of add/sub/mul/div: d[i] = op(a[i], b[i]) for
+ * 0 <= i < n, with the same results and flags as the scalar functions.
+ */
+void QEMU_FLATTEN
+float32_add_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_add, soft_f32_add,
+                     f32_is_zon2, f32_addsub_post, NULL, NULL);
+}
+
+void QEMU_FLATTEN
+float32_sub_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_sub, soft_f32_sub,
+                     f32_is_zon2, f32_addsub_post, NULL, NULL);
+}
+
+void QEMU_FLATTEN
+float32_mul_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_mul, soft_f32_mul,
+                     f32_is_zon2, NULL, f32_mul_fast_test, f32_mul_fast_op);
+}
+
+void QEMU_FLATTEN
+float32_div_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_div, soft_f32_div,
+                     f32_div_pre, f32_div_post, NULL, NULL);
+}
+
+void QEMU_FLATTEN
+float64_add_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_add, soft_f64_add,
+                     f64_is_zon2, f64_addsub_post, NULL, NULL);
+}
+
+void QEMU_FLATTEN
+float64_sub_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_sub, soft_f64_sub,
+                     f64_is_zon2, f64_addsub_post, NULL, NULL);
+}
+
+void QEMU_FLATTEN
+float64_mul_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_mul, soft_f64_mul,
+                     f64_is_zon2, NULL, f64_mul_fast_test, f64_mul_fast_op);
+}
+
+void QEMU_FLATTEN
+float64_div_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_div, soft_f64_div,
+                     f64_div_pre, f64_div_post, NULL, NULL);
+}
+
 /*
  * Float to Float conversions
  *
@@ -1952,13 +2107,41 @@ float16 float64_to_float16(float64 a, bool ieee, float_status *s)
     return float16a_round_pack_canonical(pr, s, fmt16);
 }
 
-float32 float64_to_float32(float64 a, float_status *s)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_float64_to_float32(float64 a, float_status *s)
 {
     FloatParts p = float64_unpack_canonical(a, s);
     FloatParts pr = float_to_float(p, &float32_params, s);
     return float32_round_pack_canonical(pr, s);
 }
 
+float32 float64_to_float32(float64 a, float_status *s)
+{
+    union_float64 ua;
+    union_float32 ur;
+
+    ua.s = a;
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+
+    float64_input_flush1(&ua.s, s);
+    if (unlikely(!float64_is_zero_or_normal(ua.s))) {
+        goto soft;
+    }
+    ur.h = ua.h;
+    /* Let softfloat handle overflow and underflow of the narrowed value.  */
+    if (unlikely(f32_is_inf(ur))) {
+        goto soft;
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && !float64_is_zero(ua.s)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_float64_to_float32(ua.s, s);
+}
+
 /*
  * Rounds the floating-point value `a' to an integer, and returns the
  * result as a floating-point value. The operation is performed
@@ -2590,19 +2773,37 @@ float32 int16_to_float32_scalbn(int16_t a, int scale, float_status *status)
     return int64_to_float32_scalbn(a, scale, status);
 }
 
+/*
+ * Integer to float conversions are exact, and thus raise no flags, as long
+ * as the integer fits in the significand.  Wider integers only need to be
+ * rounded, which the host FPU does for us when can_use_fpu() holds.
+ */
+#define F32_EXACT_INT_MAX (1 << 24)
+#define F64_EXACT_INT_MAX (1ULL << 53)
+
 float32 int64_to_float32(int64_t a, float_status *status)
 {
+    union_float32 ur;
+
+    if (likely((a >= -F32_EXACT_INT_MAX && a <= F32_EXACT_INT_MAX) ||
+               can_use_fpu(status))) {
+        ur.h = a;
+        return ur.s;
+    }
     return int64_to_float32_scalbn(a, 0, status);
 }
 
 float32 int32_to_float32(int32_t a, float_status *status)
 {
-    return int64_to_float32_scalbn(a, 0, status);
+    return int64_to_float32(a, status);
 }
 
 float32 int16_to_float32(int16_t a, float_status *status)
 {
-    return int64_to_float32_scalbn(a, 0, status);
+    union_float32 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 float64 int64_to_float64_scalbn(int64_t a, int scale, float_status *status)
@@ -2623,17 +2824,31 @@ float64 int16_to_float64_scalbn(int16_t a, int scale, float_status *status)
 
 float64 int64_to_float64(int64_t a, float_status *status)
 {
+    union_float64 ur;
+
+    if (likely((a >= -(int64_t)F64_EXACT_INT_MAX &&
+                a <= (int64_t)F64_EXACT_INT_MAX) ||
+               can_use_fpu(status))) {
+        ur.h = a;
+        return ur.s;
+    }
     return int64_to_float64_scalbn(a, 0, status);
 }
 
 float64 int32_to_float64(int32_t a, float_status *status)
 {
-    return int64_to_float64_scalbn(a, 0, status);
+    union_float64 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 float64 int16_to_float64(int16_t a, float_status *status)
 {
-    return int64_to_float64_scalbn(a, 0, status);
+    union_float64 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 
@@ -2717,17 +2932,26 @@ float32 uint16_to_float32_scalbn(uint16_t a, int scale, float_status *status)
 
 float32 uint64_to_float32(uint64_t a, float_status *status)
 {
+    union_float32 ur;
+
+    if (likely(a <= F32_EXACT_INT_MAX || can_use_fpu(status))) {
+        ur.h = a;
+        return ur.s;
+    }
     return uint64_to_float32_scalbn(a, 0, status);
 }
 
 float32 uint32_to_float32(uint32_t a, float_status *status)
 {
-    return uint64_to_float32_scalbn(a, 0, status);
+    return uint64_to_float32(a, status);
 }
 
 float32 uint16_to_float32(uint16_t a, float_status *status)
 {
-    return uint64_to_float32_scalbn(a, 0, status);
+    union_float32 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 float64 uint64_to_float64_scalbn(uint64_t a, int scale, float_status *status)
@@ -2748,17 +2972,29 @@ float64 uint16_to_float64_scalbn(uint16_t a, int scale, float_status *status)
 
 float64 uint64_to_float64(uint64_t a, float_status *status)
 {
+    union_float64 ur;
+
+    if (likely(a <= F64_EXACT_INT_MAX || can_use_fpu(status))) {
+        ur.h = a;
+        return ur.s;
+    }
     return uint64_to_float64_scalbn(a, 0, status);
 }
 
 float64 uint32_to_float64(uint32_t a, float_status *status)
 {
-    return uint64_to_float64_scalbn(a, 0, status);
+    union_float64 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 float64 uint16_to_float64(uint16_t a, float_status *status)
 {
-    return uint64_to_float64_scalbn(a, 0, status);
+    union_float64 ur;
+
+    ur.h = a;
+    return ur.s;
 }
 
 /* Float Min/Max */
@@ -2848,9 +3084,10 @@ static FloatParts minmax_floats(FloatParts a, FloatParts b, bool ismin,
     }
 }
 
-#define MINMAX(sz, name, ismin, isiee, ismag)                           \
-float ## sz float ## sz ## _ ## name(float ## sz a, float ## sz b,      \
-                                     float_status *s)                   \
+#define MINMAX_SOFT(name, attr, sz)                                     \
+static float ## sz attr                                                 \
+name(float ## sz a, float ## sz b, bool ismin, bool isiee, bool ismag,  \
+     float_status *s)                                                   \
 {                                                                       \
     FloatParts pa = float ## sz ## _unpack_canonical(a, s);             \
     FloatParts pb = float ## sz ## _unpack_canonical(b, s);             \
@@ -2859,6 +3096,84 @@ float ## sz float ## sz ## _ ## name(float ## sz a, float ## sz b,      \
     return float ## sz ## _round_pack_canonical(pr, s);                 \
 }
 
+MINMAX_SOFT(f16_minmax, QEMU_FLATTEN, 16)
+MINMAX_SOFT(soft_f32_minmax, QEMU_SOFTFLOAT_ATTR, 32)
+MINMAX_SOFT(soft_f64_minmax, QEMU_SOFTFLOAT_ATTR, 64)
+
+#undef MINMAX_SOFT
+
+/*
+ * Zero or normal inputs cannot be NaNs and the result is one of the
+ * inputs, so no flags are raised and a host comparison is enough.
+ * Equal inputs (e.g. zeroes of different signs) are left to softfloat.
+ */
+static inline float32
+f32_minmax(float32 xa, float32 xb, bool ismin, bool isiee, bool ismag,
+           float_status *s)
+{
+    union_float32 ua, ub;
+    float ha, hb;
+
+    ua.s = xa;
+    ub.s = xb;
+
+    if (QEMU_NO_HARDFLOAT) {
+        goto soft;
+    }
+
+    float32_input_flush2(&ua.s, &ub.s, s);
+    if (unlikely(!f32_is_zon2(ua, ub))) {
+        goto soft;
+    }
+    ha = ismag ? fabsf(ua.h) : ua.h;
+    hb = ismag ? fabsf(ub.h) : ub.h;
+    if (isless(ha, hb)) {
+        return ismin ? ua.s : ub.s;
+    }
+    if (isgreater(ha, hb)) {
+        return ismin ? ub.s : ua.s;
+    }
+ soft:
+    return soft_f32_minmax(ua.s, ub.s, ismin, isiee, ismag, s);
+}
+
+static inline float64
+f64_minmax(float64 xa, float64 xb, bool ismin, bool isiee, bool ismag,
+           float_status *s)
+{
+    union_float64 ua, ub;
+    double ha, hb;
+
+    ua.s = xa;
+    ub.s = xb;
+
+    if (QEMU_NO_HARDFLOAT) {
+        goto soft;
+    }
+
+    float64_input_flush2(&ua.s, &ub.s, s);
+    if (unlikely(!f64_is_zon2(ua, ub))) {
+        goto soft;
+    }
+    ha = ismag ? fabs(ua.h) : ua.h;
+    hb = ismag ? fabs(ub.h) : ub.h;
+    if (isless(ha, hb)) {
+        return ismin ? ua.s : ub.s;
+    }
+    if (isgreater(ha, hb)) {
+        return ismin ? ub.s : ua.s;
+    }
+ soft:
+    return soft_f64_minmax(ua.s, ub.s, ismin, isiee, ismag, s);
+}
+
+#define MINMAX(sz, name, ismin, isiee, ismag)                           \
+float ## sz QEMU_FLATTEN                                                \
+float ## sz ## _ ## name(float ## sz a, float ## sz b, float_status *s) \
+{                                                                       \
+    return f ## sz ## _minmax(a, b, ismin, isiee, ismag, s);            \
+}
+
 MINMAX(16, min, true, false, false)
 MINMAX(16, minnum, true, true, false)
 MINMAX(16, minnummag, true, true, true)
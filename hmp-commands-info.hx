@@ -267,11 +267,13 @@ ETEXI
 
     {
         .name       = "mtree",
-        .args_type  = "flatview:-f,dispatch_tree:-d,owner:-o",
-        .params     = "[-f][-d][-o]",
+        .args_type  = "flatview:-f,dispatch_tree:-d,owner:-o,locking:-l",
+        .params     = "[-f][-d][-o][-l]",
         .help       = "show memory tree (-f: dump flat view for address spaces;"
                       "-d: dump dispatch tree, valid with -f only);"
-                      "-o: dump region owners/parents",
+                      "-o: dump region owners/parents;"
+                      "-l: dump locking and BQL usage of MMIO accesses,"
+                      " recorded while sync-profile is on",
         .cmd        = hmp_info_mtree,
     },
 
@@ -315,22 +317,25 @@ ETEXI
 
     {
         .name       = "sync-profile",
-        .args_type  = "mean:-m,no_coalesce:-n,max:i?",
-        .params     = "[-m] [-n] [max]",
+        .args_type  = "mean:-m,no_coalesce:-n,hold:-b,max:i?",
+        .params     = "[-m] [-n] [-b] [max]",
         .help       = "show synchronization profiling info, up to max entries "
                       "(default: 10), sorted by total wait time. (-m: sort by "
                       "mean wait time; -n: do not coalesce objects with the "
-                      "same call site)",
+                      "same call site; -b: show how long the BQL is held "
+                      "after being taken at each call site)",
         .cmd        = hmp_info_sync_profile,
     },
 
 STEXI
-@item info sync-profile [-m|-n] [@var{max}]
+@item info sync-profile [-m|-n|-b] [@var{max}]
 @findex info sync-profile
 Show synchronization profiling info, up to @var{max} entries (default: 10),
 sorted by total wait time.
         -m: sort by mean wait time
         -n: do not coalesce objects with the same call site
+        -b: show the BQL hold times instead, sorted by total (or with -m,
+            mean) hold time, with a histogram of the hold times
 When different objects that share the same call site are coalesced, the "Object"
 field shows---enclosed in brackets---the number of objects being coalesced.
 ETEXI
@@ -38,6 +38,7 @@
 #include "sysemu/block-backend.h"
 
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
 #include "trace.h"
@@ -51,6 +52,7 @@
     } while (0)
 
 static void nvme_process_sq(void *opaque);
+static void nvme_db_flush(NvmeCtrl *n);
 
 static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
 {
@@ -917,6 +919,10 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 
     blk_flush(n->conf.blk);
     n->bar.cc = 0;
+
+    qemu_mutex_lock(&n->db_lock);
+    bitmap_zero(n->db_pending, n->db_count);
+    qemu_mutex_unlock(&n->db_lock);
 }
 
 static int nvme_start_ctrl(NvmeCtrl *n)
@@ -1156,6 +1162,8 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     uint8_t *ptr = (uint8_t *)&n->bar;
     uint64_t val = 0;
 
+    nvme_db_flush(n);
+
     if (unlikely(addr & (sizeof(uint32_t) - 1))) {
         NVME_GUEST_ERR(nvme_ub_mmiord_misaligned32,
                        "MMIO read not 32-bit aligned,"
@@ -1259,14 +1267,41 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
     }
 }
 
+/*
+ * Doorbell writes are accepted without the BQL and processed later by
+ * db_bh.  A newer write to a doorbell replaces a pending one, which is
+ * fine because head and tail values are absolute.
+ */
+static void nvme_db_flush(NvmeCtrl *n)
+{
+    unsigned long i;
+    uint32_t val;
+
+    qemu_mutex_lock(&n->db_lock);
+    while ((i = find_first_bit(n->db_pending, n->db_count)) < n->db_count) {
+        clear_bit(i, n->db_pending);
+        val = n->db_val[i];
+        qemu_mutex_unlock(&n->db_lock);
+        nvme_process_db(n, 0x1000 + (i << 2), val);
+        qemu_mutex_lock(&n->db_lock);
+    }
+    qemu_mutex_unlock(&n->db_lock);
+}
+
+static void nvme_db_bh(void *opaque)
+{
+    nvme_db_flush(opaque);
+}
+
 static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    /* Keep doorbells ordered with respect to controller register writes */
+    nvme_db_flush(n);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
-    } else if (addr >= 0x1000) {
-        nvme_process_db(n, addr, data);
     }
 }
 
@@ -1280,6 +1315,42 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+/* Called with db_lock held instead of the BQL, see nvme_db_flush */
+static void nvme_db_write(void *opaque, hwaddr addr, uint64_t data,
+    unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+
+    if (unlikely(addr & ((1 << 2) - 1))) {
+        NVME_GUEST_ERR(nvme_ub_db_wr_misaligned,
+                       "doorbell write not 32-bit aligned,"
+                       " offset=0x%"PRIx64", ignoring", 0x1000 + addr);
+        return;
+    }
+
+    n->db_val[addr >> 2] = data;
+    set_bit(addr >> 2, n->db_pending);
+    qemu_bh_schedule(n->db_bh);
+}
+
+static uint64_t nvme_db_read(void *opaque, hwaddr addr, unsigned size)
+{
+    NVME_GUEST_ERR(nvme_ub_mmiord_invalid_ofs,
+                   "MMIO read beyond last register,"
+                   " offset=0x%"PRIx64", returning 0", 0x1000 + addr);
+    return 0;
+}
+
+static const MemoryRegionOps nvme_db_ops = {
+    .read = nvme_db_read,
+    .write = nvme_db_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 2,
+        .max_access_size = 8,
+    },
+};
+
 static void nvme_cmb_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
@@ -1354,6 +1425,16 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
+
+    n->db_count = (n->reg_size - 0x1000) >> 2;
+    n->db_pending = bitmap_new(n->db_count);
+    n->db_val = g_new0(uint32_t, n->db_count);
+    n->db_bh = qemu_bh_new(nvme_db_bh, n);
+    qemu_mutex_init(&n->db_lock);
+    memory_region_init_io(&n->db_mem, OBJECT(n), &nvme_db_ops, n,
+                          "nvme-doorbells", n->reg_size - 0x1000);
+    memory_region_set_lock(&n->db_mem, &n->db_lock);
+    memory_region_add_subregion(&n->iomem, 0x1000, &n->db_mem);
     pci_register_bar(pci_dev, 0,
         PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64,
         &n->iomem);
@@ -1438,6 +1519,10 @@ static void nvme_exit(PCIDevice *pci_dev)
     NvmeCtrl *n = NVME(pci_dev);
 
     nvme_clear_ctrl(n);
+    qemu_bh_delete(n->db_bh);
+    qemu_mutex_destroy(&n->db_lock);
+    g_free(n->db_pending);
+    g_free(n->db_val);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
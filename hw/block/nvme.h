@@ -1,6 +1,7 @@
 #ifndef HW_NVME_H
 #define HW_NVME_H
 #include "block/nvme.h"
+#include "qemu/thread.h"
 
 typedef struct NvmeAsyncEvent {
     QSIMPLEQ_ENTRY(NvmeAsyncEvent) entry;
@@ -60,6 +61,7 @@ typedef struct NvmeNamespace {
 typedef struct NvmeCtrl {
     PCIDevice    parent_obj;
     MemoryRegion iomem;
+    MemoryRegion db_mem;
     MemoryRegion ctrl_mem;
     NvmeBar      bar;
     BlockConf    conf;
@@ -89,6 +91,13 @@ typedef struct NvmeCtrl {
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
+
+    /* Doorbell writes waiting for db_bh, protected by db_lock */
+    QemuMutex       db_lock;
+    QEMUBH          *db_bh;
+    uint32_t        db_count;
+    unsigned long   *db_pending;
+    uint32_t        *db_val;
 } NvmeCtrl;
 
 #endif /* HW_NVME_H */
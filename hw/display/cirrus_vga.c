@@ -2927,6 +2927,7 @@ void cirrus_init_common(CirrusVGAState *s, Object *owner,
                                         &s->low_mem_container,
                                         1);
     memory_region_set_coalescing(&s->low_mem);
+    memory_region_set_coalescing_async(&s->low_mem);
 
     /* I/O handler for LFB */
     memory_region_init_io(&s->cirrus_linear_io, owner, &cirrus_linear_io_ops, s,
@@ -2291,6 +2291,7 @@ void vga_init(VGACommonState *s, Object *obj, MemoryRegion *address_space,
                                         vga_io_memory,
                                         1);
     memory_region_set_coalescing(vga_io_memory);
+    memory_region_set_coalescing_async(vga_io_memory);
     if (init_vga_ports) {
         portio_list_init(&s->vga_port_list, obj, vga_ports, s, "vga");
         portio_list_set_flush_coalesced(&s->vga_port_list);
@@ -37,6 +37,7 @@
 #include "qemu/units.h"
 #include "net/net.h"
 #include "net/tap.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/range.h"
 #include "sysemu/sysemu.h"
@@ -57,6 +58,18 @@
 #define TYPE_E1000E "e1000e"
 #define E1000E(obj) OBJECT_CHECK(E1000EState, (obj), TYPE_E1000E)
 
+typedef struct E1000ETail {
+    MemoryRegion mr;
+    struct E1000EState *s;
+    hwaddr addr;
+    bool pending;
+    /* Last value written by the guest, and the number of writes */
+    uint32_t val;
+    uint32_t gen;
+    /* Value of the core register, for reads while nothing is pending */
+    uint32_t cur;
+} E1000ETail;
+
 typedef struct E1000EState {
     PCIDevice parent_obj;
     NICState *nic;
@@ -79,6 +92,10 @@ typedef struct E1000EState {
 
     E1000ECore core;
 
+    /* Tail register state shared with the vCPUs, protected by tail_lock */
+    QemuMutex tail_lock;
+    QEMUBH *tail_bh;
+    E1000ETail tail[4];
 } E1000EState;
 
 #define E1000E_MMIO_IDX     0
@@ -94,10 +111,112 @@ typedef struct E1000EState {
 #define E1000E_MSIX_TABLE   (0x0000)
 #define E1000E_MSIX_PBA     (0x2000)
 
+/*
+ * The descriptor tail registers are what drivers write for every batch of
+ * packets.  They are accepted without the BQL and applied later by
+ * tail_bh; everything else goes through the core under the BQL, after
+ * pending tail writes are applied.
+ */
+static const hwaddr e1000e_tail_regs[] = {
+    E1000_RDT, E1000_RDT1, E1000_TDT, E1000_TDT1
+};
+
+/*
+ * Publish the core's tail registers to e1000e_tail_read() after a reset,
+ * a migration, or a write through an alias or the I/O BAR.  Called with
+ * the BQL, which also protects writes to tail->cur.
+ */
+static void
+e1000e_tail_sync(E1000EState *s)
+{
+    E1000ETail *tail;
+    uint32_t cur;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->tail); i++) {
+        tail = &s->tail[i];
+        cur = s->core.mac[tail->addr >> 2];
+        if (cur != tail->cur) {
+            qemu_mutex_lock(&s->tail_lock);
+            tail->cur = cur;
+            qemu_mutex_unlock(&s->tail_lock);
+        }
+    }
+}
+
+static void
+e1000e_tail_flush(E1000EState *s)
+{
+    E1000ETail *tail;
+    uint32_t val, gen, cur;
+    bool pending;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(s->tail); i++) {
+        tail = &s->tail[i];
+
+        qemu_mutex_lock(&s->tail_lock);
+        pending = tail->pending;
+        val = tail->val;
+        gen = tail->gen;
+        qemu_mutex_unlock(&s->tail_lock);
+
+        if (!pending) {
+            continue;
+        }
+
+        e1000e_core_write(&s->core, tail->addr, val, sizeof(val));
+        cur = s->core.mac[tail->addr >> 2];
+
+        /*
+         * The write stays pending, and visible to reads, until the core
+         * has it; a newer one is left for the next flush.
+         */
+        qemu_mutex_lock(&s->tail_lock);
+        tail->cur = cur;
+        if (tail->gen == gen) {
+            tail->pending = false;
+        }
+        qemu_mutex_unlock(&s->tail_lock);
+    }
+}
+
+static void
+e1000e_tail_bh(void *opaque)
+{
+    e1000e_tail_flush(opaque);
+}
+
+/*
+ * Called with tail_lock held instead of the BQL, so the core cannot be
+ * accessed here
+ */
+static uint64_t
+e1000e_tail_read(void *opaque, hwaddr addr, unsigned size)
+{
+    E1000ETail *tail = opaque;
+
+    return tail->pending ? tail->val : tail->cur;
+}
+
+/* Called with tail_lock held instead of the BQL */
+static void
+e1000e_tail_write(void *opaque, hwaddr addr,
+                  uint64_t val, unsigned size)
+{
+    E1000ETail *tail = opaque;
+
+    tail->val = val;
+    tail->gen++;
+    tail->pending = true;
+    qemu_bh_schedule(tail->s->tail_bh);
+}
+
 static uint64_t
 e1000e_mmio_read(void *opaque, hwaddr addr, unsigned size)
 {
     E1000EState *s = opaque;
+    e1000e_tail_flush(s);
     return e1000e_core_read(&s->core, addr, size);
 }
 
@@ -106,7 +225,9 @@ e1000e_mmio_write(void *opaque, hwaddr addr,
                    uint64_t val, unsigned size)
 {
     E1000EState *s = opaque;
+    e1000e_tail_flush(s);
     e1000e_core_write(&s->core, addr, val, size);
+    e1000e_tail_sync(s);
 }
 
 static bool
@@ -144,6 +265,7 @@ e1000e_io_read(void *opaque, hwaddr addr, unsigned size)
         return s->ioaddr;
     case E1000_IODATA:
         if (e1000e_io_get_reg_index(s, &idx)) {
+            e1000e_tail_flush(s);
             val = e1000e_core_read(&s->core, idx, sizeof(val));
             trace_e1000e_io_read_data(idx, val);
             return val;
@@ -170,7 +292,9 @@ e1000e_io_write(void *opaque, hwaddr addr,
     case E1000_IODATA:
         if (e1000e_io_get_reg_index(s, &idx)) {
             trace_e1000e_io_write_data(idx, val);
+            e1000e_tail_flush(s);
             e1000e_core_write(&s->core, idx, val, sizeof(val));
+            e1000e_tail_sync(s);
         }
         return;
     default:
@@ -189,6 +313,16 @@ static const MemoryRegionOps mmio_ops = {
     },
 };
 
+static const MemoryRegionOps tail_ops = {
+    .read = e1000e_tail_read,
+    .write = e1000e_tail_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .impl = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
+};
+
 static const MemoryRegionOps io_ops = {
     .read = e1000e_io_read,
     .write = e1000e_io_write,
@@ -423,7 +557,7 @@ static void e1000e_pci_realize(PCIDevice *pci_dev, Error **errp)
     static const uint16_t e1000e_dsn_offset =  0x140;
     E1000EState *s = E1000E(pci_dev);
     uint8_t *macaddr;
-    int ret;
+    int ret, i;
 
     trace_e1000e_cb_pci_realize();
 
@@ -444,6 +578,18 @@ static void e1000e_pci_realize(PCIDevice *pci_dev, Error **errp)
     pci_register_bar(pci_dev, E1000E_MMIO_IDX,
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio);
 
+    qemu_mutex_init(&s->tail_lock);
+    s->tail_bh = qemu_bh_new(e1000e_tail_bh, s);
+    for (i = 0; i < ARRAY_SIZE(s->tail); i++) {
+        s->tail[i].s = s;
+        s->tail[i].addr = e1000e_tail_regs[i];
+        memory_region_init_io(&s->tail[i].mr, OBJECT(s), &tail_ops,
+                              &s->tail[i], "e1000e-tail", 4);
+        memory_region_set_lock(&s->tail[i].mr, &s->tail_lock);
+        memory_region_add_subregion(&s->mmio, s->tail[i].addr,
+                                    &s->tail[i].mr);
+    }
+
     /*
      * We provide a dummy implementation for the flash BAR
      * for drivers that may theoretically probe for its presence.
@@ -517,15 +663,27 @@ static void e1000e_pci_uninit(PCIDevice *pci_dev)
 
     e1000e_cleanup_msix(s);
     msi_uninit(pci_dev);
+
+    qemu_bh_delete(s->tail_bh);
+    qemu_mutex_destroy(&s->tail_lock);
 }
 
 static void e1000e_qdev_reset(DeviceState *dev)
 {
     E1000EState *s = E1000E(dev);
 
+    int i;
+
     trace_e1000e_cb_qdev_reset();
 
+    qemu_mutex_lock(&s->tail_lock);
+    for (i = 0; i < ARRAY_SIZE(s->tail); i++) {
+        s->tail[i].pending = false;
+    }
+    qemu_mutex_unlock(&s->tail_lock);
+
     e1000e_core_reset(&s->core);
+    e1000e_tail_sync(s);
 }
 
 static int e1000e_pre_save(void *opaque)
@@ -534,6 +692,7 @@ static int e1000e_pre_save(void *opaque)
 
     trace_e1000e_cb_pre_save();
 
+    e1000e_tail_flush(s);
     e1000e_core_pre_save(&s->core);
 
     return 0;
@@ -542,6 +701,7 @@ static int e1000e_pre_save(void *opaque)
 static int e1000e_post_load(void *opaque, int version_id)
 {
     E1000EState *s = opaque;
+    int ret;
 
     trace_e1000e_cb_post_load();
 
@@ -553,7 +713,9 @@ static int e1000e_post_load(void *opaque, int version_id)
         return -1;
     }
 
-    return e1000e_core_post_load(&s->core);
+    ret = e1000e_core_post_load(&s->core);
+    e1000e_tail_sync(s);
+    return ret;
 }
 
 static const VMStateDescription e1000e_vmstate_tx = {
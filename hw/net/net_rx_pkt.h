@@ -133,7 +133,9 @@ typedef enum {
     NetPktRssIpV4Tcp,
     NetPktRssIpV6Tcp,
     NetPktRssIpV6,
-    NetPktRssIpV6Ex
+    NetPktRssIpV6Ex,
+    NetPktRssIpV4Udp,
+    NetPktRssIpV6Udp
 } NetRxPktRssType;
 
 /**
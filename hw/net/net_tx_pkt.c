@@ -30,6 +30,9 @@ enum {
     NET_TX_PKT_PL_START_FRAG
 };
 
+/* Number of TSO segments built before they are handed to the peer. */
+#define NET_TX_PKT_SEG_BATCH 64
+
 /* TX packet private context */
 struct NetTxPkt {
     PCIDevice *pci_dev;
@@ -56,6 +59,11 @@ struct NetTxPkt {
     uint8_t l4proto;
 
     bool is_loopback;
+
+    /* Software TSO, see net_tx_pkt_do_sw_tso() */
+    uint8_t *seg_hdrs;
+    size_t seg_hdrs_size;
+    struct iovec *seg_vec;
 };
 
 void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
@@ -69,6 +77,12 @@ void net_tx_pkt_init(struct NetTxPkt **pkt, PCIDevice *pci_dev,
 
     p->raw = g_new(struct iovec, max_frags);
 
+    /*
+     * A batch of segments takes one header vector each, plus the payload
+     * vectors, each of which can be split once at every segment boundary.
+     */
+    p->seg_vec = g_new(struct iovec, 2 * NET_TX_PKT_SEG_BATCH + max_frags);
+
     p->max_payload_frags = max_frags;
     p->max_raw_frags = max_frags;
     p->has_virt_hdr = has_virt_hdr;
@@ -86,6 +100,8 @@ void net_tx_pkt_uninit(struct NetTxPkt *pkt)
     if (pkt) {
         g_free(pkt->vec);
         g_free(pkt->raw);
+        g_free(pkt->seg_hdrs);
+        g_free(pkt->seg_vec);
         g_free(pkt);
     }
 }
@@ -547,6 +563,206 @@ static inline void net_tx_pkt_sendv(struct NetTxPkt *pkt,
     }
 }
 
+/*
+ * Let the client that receives the packets sent by net_tx_pkt_sendv()
+ * collect a burst of them, see qemu_net_io_plug().
+ */
+static NetClientState *net_tx_pkt_plug(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    NetClientState *receiver = pkt->is_loopback ? nc : nc->peer;
+
+    if (receiver) {
+        qemu_net_io_plug(receiver);
+    }
+    return receiver;
+}
+
+static void net_tx_pkt_unplug(NetClientState *receiver)
+{
+    if (receiver) {
+        qemu_net_io_unplug(receiver);
+    }
+}
+
+/*
+ * Point @dst at the next @len bytes of the payload, starting at fragment
+ * *@idx, offset *@off, and advance the position past them.  Returns the
+ * number of vectors used.
+ */
+static int net_tx_pkt_slice_payload(struct NetTxPkt *pkt, unsigned int *idx,
+    size_t *off, struct iovec *dst, size_t len)
+{
+    struct iovec *src = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    int cnt = 0;
+
+    while (len && *idx < pkt->payload_frags) {
+        size_t chunk = MIN(src[*idx].iov_len - *off, len);
+
+        if (chunk) {
+            dst[cnt].iov_base = src[*idx].iov_base + *off;
+            dst[cnt].iov_len = chunk;
+            cnt++;
+            len -= chunk;
+            *off += chunk;
+        }
+        if (*off == src[*idx].iov_len) {
+            *off = 0;
+            (*idx)++;
+        }
+    }
+    return cnt;
+}
+
+/*
+ * Segment a TCP packet the way a TSO capable NIC does, for peers that
+ * cannot take it in one piece.  Each segment gets a copy of the headers
+ * with its own sequence number, flags, lengths and checksums, and refers
+ * to its part of the guest payload without copying it.
+ *
+ * The sums over the header fields that are the same in all segments are
+ * computed once; for each segment only the fields that change and the
+ * payload are added.  Segments are built NET_TX_PKT_SEG_BATCH at a time
+ * and the whole packet is delivered while the receiver is plugged.
+ */
+static bool net_tx_pkt_do_sw_tso(struct NetTxPkt *pkt, NetClientState *nc)
+{
+    struct iovec *payload = &pkt->vec[NET_TX_PKT_PL_START_FRAG];
+    size_t l2_len = pkt->vec[NET_TX_PKT_L2HDR_FRAG].iov_len;
+    size_t l3_len = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_len;
+    void *l3_hdr = pkt->vec[NET_TX_PKT_L3HDR_FRAG].iov_base;
+    bool is_ip4 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                  VIRTIO_NET_HDR_GSO_TCPV4;
+    uint16_t mss = pkt->virt_hdr.gso_size;
+    unsigned int seg_iov[NET_TX_PKT_SEG_BATCH + 1];
+    size_t l4_len, hdr_len, data_len, seg_len, done, src_off;
+    uint32_t ip_sum = 0, tcp_sum, cso, seq, csum;
+    uint16_t ip_id = 0, tcp_flags, flags;
+    unsigned int src_idx, nsegs, i;
+    NetClientState *receiver;
+    uint8_t *tmpl, *hdr, *l3, *l4;
+    tcp_header tcp;
+
+    if (iov_to_buf(payload, pkt->payload_frags, 0, &tcp, sizeof(tcp)) <
+        sizeof(tcp)) {
+        return false;
+    }
+    l4_len = TCP_HEADER_DATA_OFFSET(&tcp);
+    if (!mss || l4_len < sizeof(tcp) || l4_len > pkt->payload_len) {
+        return false;
+    }
+    hdr_len = l2_len + l3_len + l4_len;
+    data_len = pkt->payload_len - l4_len;
+
+    /* Header buffers for a batch of segments, followed by the template. */
+    if (pkt->seg_hdrs_size < (NET_TX_PKT_SEG_BATCH + 1) * hdr_len) {
+        pkt->seg_hdrs_size = (NET_TX_PKT_SEG_BATCH + 1) * hdr_len;
+        pkt->seg_hdrs = g_realloc(pkt->seg_hdrs, pkt->seg_hdrs_size);
+    }
+    tmpl = pkt->seg_hdrs + NET_TX_PKT_SEG_BATCH * hdr_len;
+    memcpy(tmpl, pkt->vec[NET_TX_PKT_L2HDR_FRAG].iov_base, l2_len);
+    memcpy(tmpl + l2_len, l3_hdr, l3_len);
+    iov_to_buf(payload, pkt->payload_frags, 0, tmpl + l2_len + l3_len, l4_len);
+
+    /* Zero the fields that differ between segments and sum the rest. */
+    l3 = tmpl + l2_len;
+    l4 = l3 + l3_len;
+    seq = ldl_be_p(l4 + offsetof(tcp_header, th_seq));
+    tcp_flags = lduw_be_p(l4 + offsetof(tcp_header, th_offset_flags));
+    stl_be_p(l4 + offsetof(tcp_header, th_seq), 0);
+    stw_be_p(l4 + offsetof(tcp_header, th_offset_flags), 0);
+    stw_be_p(l4 + offsetof(tcp_header, th_sum), 0);
+    if (is_ip4) {
+        ip_id = lduw_be_p(l3 + offsetof(struct ip_header, ip_id));
+        stw_be_p(l3 + offsetof(struct ip_header, ip_len), 0);
+        stw_be_p(l3 + offsetof(struct ip_header, ip_id), 0);
+        stw_be_p(l3 + offsetof(struct ip_header, ip_sum), 0);
+        ip_sum = net_checksum_add(l3_len, l3);
+        tcp_sum = eth_calc_ip4_pseudo_hdr_csum(l3_hdr, 0, &cso);
+    } else {
+        tcp_sum = eth_calc_ip6_pseudo_hdr_csum(l3_hdr, 0, IP_PROTO_TCP, &cso);
+    }
+    tcp_sum += net_checksum_add(l4_len, l4);
+
+    /* Skip the TCP header in the payload. */
+    src_idx = 0;
+    src_off = l4_len;
+    while (src_idx < pkt->payload_frags &&
+           src_off >= payload[src_idx].iov_len) {
+        src_off -= payload[src_idx].iov_len;
+        src_idx++;
+    }
+
+    receiver = net_tx_pkt_plug(pkt, nc);
+    done = 0;
+    do {
+        seg_iov[0] = 0;
+        for (nsegs = 0; nsegs < NET_TX_PKT_SEG_BATCH; nsegs++) {
+            seg_len = MIN(mss, data_len - done);
+            hdr = pkt->seg_hdrs + nsegs * hdr_len;
+            memcpy(hdr, tmpl, hdr_len);
+            l3 = hdr + l2_len;
+            l4 = l3 + l3_len;
+
+            /* FIN and PSH go to the last segment, CWR to the first. */
+            flags = tcp_flags;
+            if (done + seg_len < data_len) {
+                flags &= ~(TH_FIN | TH_PUSH);
+            }
+            if (done) {
+                flags &= ~TH_CWR;
+            }
+            stl_be_p(l4 + offsetof(tcp_header, th_seq), seq + done);
+            stw_be_p(l4 + offsetof(tcp_header, th_offset_flags), flags);
+
+            if (is_ip4) {
+                uint16_t len = l3_len + l4_len + seg_len;
+
+                stw_be_p(l3 + offsetof(struct ip_header, ip_len), len);
+                stw_be_p(l3 + offsetof(struct ip_header, ip_id), ip_id);
+                csum = ip_sum + len + ip_id;
+                stw_be_p(l3 + offsetof(struct ip_header, ip_sum),
+                         net_checksum_finish(csum));
+                ip_id++;
+            } else {
+                stw_be_p(l3 + offsetof(struct ip6_header,
+                                       ip6_ctlun.ip6_un1.ip6_un1_plen),
+                         l3_len - sizeof(struct ip6_header) + l4_len +
+                         seg_len);
+            }
+
+            i = seg_iov[nsegs];
+            pkt->seg_vec[i].iov_base = hdr;
+            pkt->seg_vec[i].iov_len = hdr_len;
+            seg_iov[nsegs + 1] = i + 1 +
+                net_tx_pkt_slice_payload(pkt, &src_idx, &src_off,
+                                         &pkt->seg_vec[i + 1], seg_len);
+
+            csum = tcp_sum + l4_len + seg_len +
+                   ((seq + done) >> 16) + ((seq + done) & 0xffff) + flags +
+                   net_checksum_add_iov(&pkt->seg_vec[i + 1],
+                                        seg_iov[nsegs + 1] - i - 1,
+                                        0, seg_len, 0);
+            stw_be_p(l4 + offsetof(tcp_header, th_sum),
+                     net_checksum_finish(csum));
+
+            done += seg_len;
+            if (done == data_len) {
+                nsegs++;
+                break;
+            }
+        }
+
+        for (i = 0; i < nsegs; i++) {
+            net_tx_pkt_sendv(pkt, nc, &pkt->seg_vec[seg_iov[i]],
+                             seg_iov[i + 1] - seg_iov[i]);
+        }
+    } while (done < data_len);
+    net_tx_pkt_unplug(receiver);
+
+    return true;
+}
+
 static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     NetClientState *nc)
 {
@@ -560,6 +776,7 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     int src_idx =  NET_TX_PKT_PL_START_FRAG, dst_idx;
     size_t src_offset = 0;
     size_t fragment_offset = 0;
+    NetClientState *receiver;
 
     l2_iov_base = pkt->vec[NET_TX_PKT_L2HDR_FRAG].iov_base;
     l2_iov_len = pkt->vec[NET_TX_PKT_L2HDR_FRAG].iov_len;
@@ -574,6 +791,7 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
 
 
     /* Put as much data as possible and send */
+    receiver = net_tx_pkt_plug(pkt, nc);
     do {
         fragment_len = net_tx_pkt_fetch_fragment(pkt, &src_idx, &src_offset,
             fragment, &dst_idx);
@@ -590,18 +808,18 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
         fragment_offset += fragment_len;
 
     } while (fragment_len && more_frags);
+    net_tx_pkt_unplug(receiver);
 
     return true;
 }
 
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
+    uint8_t gso_type;
+
     assert(pkt);
 
-    if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-        net_tx_pkt_do_sw_csum(pkt);
-    }
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
 
     /*
      * Since underlying infrastructure does not support IP datagrams longer
@@ -615,6 +833,18 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         }
     }
 
+    /* Segments get their own checksums, don't sum the whole packet. */
+    if (!pkt->has_virt_hdr && pkt->l4proto == IP_PROTO_TCP &&
+        (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+         gso_type == VIRTIO_NET_HDR_GSO_TCPV6)) {
+        return net_tx_pkt_do_sw_tso(pkt, nc);
+    }
+
+    if (!pkt->has_virt_hdr &&
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        net_tx_pkt_do_sw_csum(pkt);
+    }
+
     if (pkt->has_virt_hdr ||
         pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
         net_tx_pkt_sendv(pkt, nc, pkt->vec,
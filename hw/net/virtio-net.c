@@ -16,6 +16,7 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "block/aio-wait.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
@@ -42,6 +43,7 @@
 #include "trace.h"
 #include "monitor/qdev.h"
 #include "hw/pci/pci.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -56,6 +58,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Maximum number of TX elements popped and pushed at once */
+#define VIRTIO_NET_TX_BATCH 64
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -77,6 +82,14 @@
    tso/gso/gro 'off'. */
 #define VIRTIO_NET_RSC_DEFAULT_INTERVAL 300000
 
+#define VIRTIO_NET_RSS_SUPPORTED_HASHES (VIRTIO_NET_RSS_HASH_TYPE_IPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv4 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_IP_EX | \
+                                         VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)
+
 /* temporary until standard header include it */
 #if !defined(VIRTIO_NET_HDR_F_RSC_INFO)
 
@@ -108,6 +121,8 @@ static VirtIOFeature feature_sizes[] = {
      .end = endof(struct virtio_net_config, mtu)},
     {.flags = 1ULL << VIRTIO_NET_F_SPEED_DUPLEX,
      .end = endof(struct virtio_net_config, duplex)},
+    {.flags = (1ULL << VIRTIO_NET_F_RSS) | (1ULL << VIRTIO_NET_F_HASH_REPORT),
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -138,6 +153,11 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     virtio_stl_p(vdev, &netcfg.speed, n->net_conf.speed);
     netcfg.duplex = n->net_conf.duplex;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -163,6 +183,46 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/*
+ * While dataplane is running, the datapath of each queue pair is serialized
+ * by its IOThread's AioContext rather than by the QEMU global mutex.  Main
+ * loop code that touches state used by the datapath must hold all of them.
+ * Returns whether the contexts were acquired.
+ */
+static bool virtio_net_datapath_lock(VirtIONet *n)
+{
+    int i;
+
+    if (!n->dataplane_started) {
+        return false;
+    }
+    for (i = 0; i < n->dataplane_queues; i++) {
+        aio_context_acquire(n->vqs[i].ctx);
+    }
+    return true;
+}
+
+static void virtio_net_datapath_unlock(VirtIONet *n, bool locked)
+{
+    int i;
+
+    if (!locked) {
+        return;
+    }
+    for (i = n->dataplane_queues - 1; i >= 0; i--) {
+        aio_context_release(n->vqs[i].ctx);
+    }
+}
+
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
 static void virtio_net_announce_notify(VirtIONet *net)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(net);
@@ -316,7 +376,7 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -324,12 +384,14 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q;
+    bool locked;
     int i;
     uint8_t queue_status;
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    locked = virtio_net_datapath_lock(n);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -375,6 +437,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_datapath_unlock(n, locked);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -382,11 +445,14 @@ static void virtio_net_set_link_status(NetClientState *nc)
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint16_t old_status = n->status;
+    bool locked;
 
+    locked = virtio_net_datapath_lock(n);
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
         n->status |= VIRTIO_NET_S_LINK_UP;
+    virtio_net_datapath_unlock(n, locked);
 
     if (n->status != old_status)
         virtio_notify_config(vdev);
@@ -496,6 +562,14 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    if (n->rss_data.enabled) {
+        trace_virtio_net_rss_disable();
+    }
+    n->rss_data.enabled = false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -523,6 +597,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     memcpy(&n->mac[0], &n->nic->conf->macaddr, sizeof(n->mac));
     qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+    virtio_net_disable_rss(n);
 
     /* Flush any async TX */
     for (i = 0;  i < n->max_queues; i++) {
@@ -561,28 +636,39 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
     int i;
     NetClientState *nc;
+    size_t hdr_len;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->rss_data.populate_hash = !!hash_report;
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
             sizeof(struct virtio_net_hdr);
+        n->rss_data.populate_hash = false;
     }
 
+    /*
+     * The hash fields are filled in by the device model, backends never
+     * see them.
+     */
+    hdr_len = MIN(n->guest_hdr_len, sizeof(struct virtio_net_hdr_mrg_rxbuf));
+
     for (i = 0; i < n->max_queues; i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
-            qemu_has_vnet_hdr_len(nc->peer, n->guest_hdr_len)) {
-            qemu_set_vnet_hdr_len(nc->peer, n->guest_hdr_len);
-            n->host_hdr_len = n->guest_hdr_len;
+            qemu_has_vnet_hdr_len(nc->peer, hdr_len)) {
+            qemu_set_vnet_hdr_len(nc->peer, hdr_len);
+            n->host_hdr_len = hdr_len;
         }
     }
 }
@@ -701,6 +787,9 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         return features;
     }
 
+    /* Steering and hash reporting are implemented by the device model */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -866,7 +955,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     n->rsc4_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
@@ -1136,29 +1227,163 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse a VIRTIO_NET_CTRL_MQ_RSS_CONFIG (@do_rss) or
+ * VIRTIO_NET_CTRL_MQ_HASH_CONFIG command.  Both share the layout of
+ * struct virtio_net_rss_config; for the latter the indirection table has
+ * a single entry and the queue count is ignored.
+ *
+ * Returns the number of queue pairs requested, or 0 on error.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, struct iovec *iov,
+                                      unsigned int iov_cnt, bool do_rss)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct virtio_net_rss_config cfg;
+    size_t s, offset = 0, size_get;
+    uint16_t queues, i;
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    const char *err_msg = "";
+    uint32_t err_value = 0;
+
+    if (do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_RSS)) {
+        err_msg = "RSS is not negotiated";
+        goto error;
+    }
+    if (!do_rss && !virtio_vdev_has_feature(vdev, VIRTIO_NET_F_HASH_REPORT)) {
+        err_msg = "Hash report is not negotiated";
+        goto error;
+    }
+
+    size_get = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, offset, &cfg, size_get);
+    if (s != size_get) {
+        err_msg = "Short command buffer";
+        err_value = s;
+        goto error;
+    }
+    rss->hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    rss->indirections_len = do_rss ?
+        virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1 : 1;
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
+        err_msg = "Invalid size of indirection table";
+        err_value = rss->indirections_len;
+        goto error;
+    }
+    rss->default_queue = do_rss ?
+        virtio_lduw_p(vdev, &cfg.unclassified_queue) : 0;
+
+    offset += size_get;
+    size_get = sizeof(uint16_t) * rss->indirections_len;
+    s = iov_to_buf(iov, iov_cnt, offset, rss->indirections_table, size_get);
+    if (s != size_get) {
+        err_msg = "Short indirection table buffer";
+        err_value = s;
+        goto error;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        rss->indirections_table[i] =
+            virtio_lduw_p(vdev, &rss->indirections_table[i]);
+    }
+
+    offset += size_get;
+    size_get = sizeof(tail);
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, size_get);
+    if (s != size_get) {
+        err_msg = "Can't get queues";
+        err_value = s;
+        goto error;
+    }
+    queues = do_rss ? virtio_lduw_p(vdev, &tail.max_tx_vq) : n->curr_queues;
+    if (queues == 0 || queues > n->max_queues) {
+        err_msg = "Invalid number of queues";
+        err_value = queues;
+        goto error;
+    }
+    if (rss->default_queue >= queues) {
+        err_msg = "Invalid default queue";
+        err_value = rss->default_queue;
+        goto error;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= queues) {
+            err_msg = "Invalid queue in indirection table";
+            err_value = rss->indirections_table[i];
+            goto error;
+        }
+    }
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        err_msg = "Invalid key size";
+        err_value = tail.hash_key_length;
+        goto error;
+    }
+    if (!tail.hash_key_length && rss->hash_types) {
+        err_msg = "No key provided";
+        goto error;
+    }
+    if (!tail.hash_key_length && !rss->hash_types) {
+        virtio_net_disable_rss(n);
+        return queues;
+    }
+
+    offset += size_get;
+    size_get = tail.hash_key_length;
+    memset(rss->key, 0, sizeof(rss->key));
+    s = iov_to_buf(iov, iov_cnt, offset, rss->key, size_get);
+    if (s != size_get) {
+        err_msg = "Short key buffer";
+        err_value = s;
+        goto error;
+    }
+
+    rss->enabled = true;
+    rss->redirect = do_rss;
+    trace_virtio_net_rss_enable(rss->hash_types, rss->indirections_len,
+                                tail.hash_key_length);
+    return queues;
+
+error:
+    trace_virtio_net_rss_error(err_msg, err_value);
+    virtio_net_disable_rss(n);
+    return 0;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    struct virtio_net_ctrl_mq mq;
-    size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
+    virtio_net_disable_rss(n);
+    if (cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, false);
+        return queues ? VIRTIO_NET_OK : VIRTIO_NET_ERR;
     }
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG) {
+        queues = virtio_net_handle_rss(n, iov, iov_cnt, true);
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        struct virtio_net_ctrl_mq mq;
+        size_t s;
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
-
     if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
         queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
         queues > n->max_queues ||
         !n->multiqueue) {
+        virtio_net_disable_rss(n);
         return VIRTIO_NET_ERR;
     }
 
@@ -1180,7 +1405,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    bool locked;
 
+    locked = virtio_net_datapath_lock(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1222,6 +1449,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_datapath_unlock(n, locked);
 }
 
 /* RX */
@@ -1231,6 +1459,19 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+    /*
+     * With RSS, packets queued on any subqueue may be steered to this
+     * one, so give all of them a chance to be delivered.
+     */
+    if (n->rss_data.enabled && n->rss_data.redirect) {
+        int i;
+
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
+
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -1387,8 +1628,97 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+static int virtio_net_get_hash_type(bool isip4, bool isip6,
+                                    bool isudp, bool istcp,
+                                    uint32_t types)
+{
+    if (isip4) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            return NetPktRssIpV4Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            return NetPktRssIpV4Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            return NetPktRssIpV4;
+        }
+    } else if (isip6) {
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            return NetPktRssIpV6Tcp;
+        }
+        if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            return NetPktRssIpV6Udp;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            return NetPktRssIpV6Ex;
+        }
+        if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            return NetPktRssIpV6;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Compute the Toeplitz hash of an incoming packet, store it in @hash if
+ * hash reporting is enabled and return the index of the queue the packet
+ * must be steered to, or -1 to keep it on @nc.
+ */
+static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
+                                  size_t size,
+                                  struct virtio_net_hdr_v1_hash *hash)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtioNetRssData *rss = &n->rss_data;
+    struct NetRxPkt *pkt = n->rx_pkt;
+    bool isip4, isip6, isudp, istcp;
+    int hash_type, index;
+    uint32_t value;
+    static const uint8_t reports[] = {
+        [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+    };
+
+    if (size < n->host_hdr_len) {
+        return -1;
+    }
+
+    net_rx_pkt_set_protocols(pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+    if ((isip4 && net_rx_pkt_get_ip4_info(pkt)->fragment) ||
+        (isip6 && net_rx_pkt_get_ip6_info(pkt)->fragment)) {
+        /* Only the first fragment has an L4 header */
+        isudp = istcp = false;
+    }
+
+    hash_type = virtio_net_get_hash_type(isip4, isip6, isudp, istcp,
+                                         rss->hash_types);
+    if (hash_type < 0) {
+        index = rss->redirect ? rss->default_queue : -1;
+    } else {
+        value = net_rx_pkt_calc_rss_hash(pkt, hash_type, rss->key);
+        if (rss->populate_hash) {
+            virtio_stl_p(vdev, &hash->hash_value, value);
+            virtio_stw_p(vdev, &hash->hash_report, reports[hash_type]);
+        }
+        index = rss->redirect ?
+            rss->indirections_table[value & (rss->indirections_len - 1)] : -1;
+    }
+
+    trace_virtio_net_rss_steer(nc->queue_index, hash_type, index);
+    return index == nc->queue_index ? -1 : index;
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size,
+                                      const struct virtio_net_hdr_v1_hash *hash)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1437,7 +1767,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(elem);
             return -1;
         }
 
@@ -1452,6 +1782,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->rss_data.populate_hash) {
+                size_t hash_offset = offsetof(typeof(*hash), hash_value);
+
+                iov_from_buf(sg, elem->in_num, hash_offset,
+                             &hash->hash_value, sizeof(*hash) - hash_offset);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1469,13 +1805,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_element_free(elem);
     }
 
     if (mhdr_cnt) {
@@ -1486,17 +1822,45 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (nc->io_plugged) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
 
+static void virtio_net_io_unplug(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+}
+
 static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    struct virtio_net_hdr_v1_hash hash = {
+        .hash_report = VIRTIO_NET_HASH_REPORT_NONE,
+    };
+    int index;
+
     RCU_READ_LOCK_GUARD();
 
-    return virtio_net_receive_rcu(nc, buf, size);
+    if (n->rss_data.enabled) {
+        index = virtio_net_process_rss(nc, buf, size, &hash);
+        if (index >= 0) {
+            nc = qemu_get_subqueue(n->nic, index);
+        }
+    }
+
+    return virtio_net_receive_rcu(nc, buf, size, &hash);
 }
 
 static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
@@ -2111,12 +2475,11 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2124,13 +2487,98 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+/*
+ * Send the packet of @elem to the peer.  Returns 1 if the element can be
+ * returned to the guest, 0 if the peer queued the packet and will complete
+ * it asynchronously, or -EINVAL if the element is malformed.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
-    int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_v1_hash mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* Drop the packet. */
+                return 1;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    return qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                   out_sg, out_num,
+                                   virtio_net_tx_complete) ? 1 : 0;
+}
+
+/* Return sent elements to the guest with a single used index update. */
+static void virtio_net_tx_push(VirtIONetQueue *q, VirtQueueElement **elems,
+                               unsigned int num)
+{
+    static const unsigned int lens[VIRTIO_NET_TX_BATCH];
+
+    virtqueue_push_batch(q->tx_vq, elems, lens, num);
+    while (num--) {
+        virtqueue_element_free(elems[num]);
+    }
+}
+
+/* Give back elements that were popped but not sent. */
+static void virtio_net_tx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                unsigned int num)
+{
+    virtqueue_unpop_batch(q->tx_vq, elems, num);
+    while (num--) {
+        virtqueue_element_free(elems[num]);
+    }
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    int32_t num_packets = 0;
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2140,83 +2588,68 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    while (num_packets < n->tx_burst) {
+        unsigned int i, popped;
+        int ret = 1;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        popped = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                     (void **)elems,
+                                     MIN(ARRAY_SIZE(elems),
+                                         n->tx_burst - num_packets));
+        if (!popped) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+        for (i = 0; i < popped; i++) {
+            ret = virtio_net_tx_one(q, elems[i]);
+            if (ret <= 0) {
+                break;
+            }
         }
+        virtio_net_tx_push(q, elems, i);
+        num_packets += i;
 
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-                }
-                out_num += 1;
-                out_sg = sg2;
-            }
+        if (ret < 0) {
+            virtqueue_detach_element(q->tx_vq, elems[i], 0);
+            virtqueue_element_free(elems[i]);
+            virtio_net_tx_unpop(q, elems + i + 1, popped - i - 1);
+            return -EINVAL;
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
-
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
+            virtio_net_tx_unpop(q, elems + i + 1, popped - i - 1);
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            q->async_tx.elem = elems[i];
+            if (num_packets) {
+                virtio_net_notify(n, q->tx_vq);
+            }
             return -EBUSY;
         }
+    }
+    if (num_packets) {
+        virtio_net_notify(n, q->tx_vq);
+    }
+    return num_packets;
+}
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+/*
+ * Plug the backend while flushing so that it can batch the packets of a
+ * burst, e.g. into a single sendmmsg() call.
+ */
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *peer = qemu_get_subqueue(n->nic, queue_index)->peer;
+    int32_t ret;
 
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+    if (!peer) {
+        return virtio_net_do_flush_tx(q);
     }
-    return num_packets;
+
+    qemu_net_io_plug(peer);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_net_io_unplug(peer);
+    return ret;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
@@ -2344,12 +2777,197 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+/* Dataplane */
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    AioContext *ctx = n->vqs[vq2q(virtio_get_queue_index(vq))].ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(ctx);
+    return true;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    AioContext *ctx = n->vqs[vq2q(virtio_get_queue_index(vq))].ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_handle_tx_bh(vdev, vq);
+    aio_context_release(ctx);
+    return true;
+}
+
+static void virtio_net_dataplane_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    AioContext *ctx = q->ctx;
+
+    aio_context_acquire(ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(ctx);
+}
+
+/* Run the TX bottom half of @q in @ctx, or in the main loop if NULL */
+static void virtio_net_set_tx_bh_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_dataplane_tx_bh, q);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+    }
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    if (n->dataplane_started || n->dataplane_disabled) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!qemu_net_client_can_set_aio_context(peer)) {
+            warn_report("virtio-net: netdev '%s' cannot run in an iothread; "
+                        "falling back on the main loop",
+                        peer ? peer->name : "");
+            n->dataplane_disabled = true;
+            return;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "falling back on the main loop", r);
+        n->dataplane_disabled = true;
+        return;
+    }
+
+    n->dataplane_queues = queues;
+    n->dataplane_started = true;
+
+    /*
+     * The host notifiers were set up by virtio_device_start_ioeventfd_impl()
+     * with main loop handlers; hand them and the backends over to the
+     * IOThread of each queue pair.  The control virtqueue stays in the main
+     * loop.
+     */
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+        virtio_net_set_tx_bh_context(q, q->ctx);
+        qemu_net_client_set_aio_context(qemu_get_subqueue(n->nic, i)->peer,
+                                        q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                virtio_net_dataplane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                virtio_net_dataplane_handle_tx);
+        aio_context_release(q->ctx);
+    }
+
+    /* Kick right away to begin processing buffers already in the vrings */
+    for (i = 0; i < queues; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(n->vqs[i].rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(n->vqs[i].tx_vq));
+    }
+}
+
+/* Context: BH in the IOThread of the queue pair */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    int i = q - n->vqs;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    qemu_net_client_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+}
+
+/*
+ * Move the datapath back to the main loop.  The host notifiers are left
+ * without handlers; they are torn down by virtio_device_stop_ioeventfd_impl().
+ *
+ * Context: QEMU global mutex held
+ */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!n->dataplane_started) {
+        /* Better luck next time. */
+        n->dataplane_disabled = false;
+        return;
+    }
+
+    for (i = 0; i < n->dataplane_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        virtio_net_set_tx_bh_context(q, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    n->dataplane_started = false;
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, n->dataplane_queues * 2, false);
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    int r;
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r == 0 && n->n_iothreads) {
+        virtio_net_dataplane_start(n);
+    }
+    return r;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    if (n->n_iothreads) {
+        virtio_net_dataplane_stop(n);
+    }
+    virtio_device_stop_ioeventfd_impl(vdev);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     n->vqs[index].rx_vq = virtio_add_queue(vdev, n->net_conf.rx_queue_size,
                                            virtio_net_handle_rx);
+    virtio_queue_set_coalescing(n->vqs[index].rx_vq, &n->net_conf.coalesce);
 
     if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
         n->vqs[index].tx_vq =
@@ -2367,6 +2985,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    n->vqs[index].ctx = n->n_iothreads ?
+        iothread_get_aio_context(n->iothreads[index % n->n_iothreads]) : NULL;
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -2444,7 +3064,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     trace_virtio_net_post_load_device();
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                    VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -2670,6 +3292,50 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    return VIRTIO_NET(opaque)->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+    VirtioNetRssData *rss = &n->rss_data;
+    int i;
+
+    if (!is_power_of_2(rss->indirections_len) ||
+        rss->indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        rss->default_queue >= n->max_queues) {
+        return -EINVAL;
+    }
+    for (i = 0; i < rss->indirections_len; i++) {
+        if (rss->indirections_table[i] >= n->max_queues) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -2720,6 +3386,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    },
 };
 
 static NetClientInfo net_virtio_info = {
@@ -2730,6 +3400,7 @@ static NetClientInfo net_virtio_info = {
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
+    .io_unplug = virtio_net_io_unplug,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -2959,6 +3630,76 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         n->host_features |= (1ULL << VIRTIO_NET_F_SPEED_DUPLEX);
     }
 
+    if (n->iothread && n->iothread_ids) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return;
+    }
+    if (n->iothread || n->iothread_ids) {
+        BusState *qbus = qdev_get_parent_bus(dev);
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+        char **ids = NULL;
+        IOThread **iothreads;
+        uint32_t n_iothreads;
+
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+            error_setg(errp, "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            return;
+        }
+        if (!virtio_device_ioeventfd_enabled(vdev)) {
+            error_setg(errp, "ioeventfd is required for iothread");
+            return;
+        }
+        if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+            error_setg(errp, "iothread requires tx=bh");
+            return;
+        }
+        /* The coalescing chains and their drain timer are per device */
+        if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+            error_setg(errp, "iothread is incompatible with guest_rsc_ext");
+            return;
+        }
+
+        if (n->iothread) {
+            n_iothreads = 1;
+        } else {
+            ids = g_strsplit(n->iothread_ids, ":", -1);
+            n_iothreads = g_strv_length(ids);
+            if (!n_iothreads) {
+                error_setg(errp, "iothreads must list at least one iothread");
+                g_strfreev(ids);
+                return;
+            }
+        }
+        iothreads = g_new(IOThread *, n_iothreads);
+        for (i = 0; i < n_iothreads; i++) {
+            iothreads[i] = n->iothread ?: iothread_by_id(ids[i]);
+            if (!iothreads[i]) {
+                error_setg(errp, "iothread '%s' not found", ids[i]);
+                g_free(iothreads);
+                g_strfreev(ids);
+                return;
+            }
+        }
+        g_strfreev(ids);
+        /*
+         * RSS steers packets into other queue pairs and shares rx_pkt
+         * between them, so all queue pairs must run in the same IOThread.
+         */
+        if (n_iothreads > 1 &&
+            (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+             virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT))) {
+            error_setg(errp, "rss and hash require a single iothread");
+            g_free(iothreads);
+            return;
+        }
+        for (i = 0; i < n_iothreads; i++) {
+            object_ref(OBJECT(iothreads[i]));
+        }
+        n->iothreads = iothreads;
+        n->n_iothreads = n_iothreads;
+    }
+
     if (n->failover) {
         n->primary_listener.should_be_hidden =
             virtio_net_primary_should_be_hidden;
@@ -3060,7 +3801,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -3072,6 +3813,8 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     QTAILQ_INIT(&n->rsc_chains);
     n->qdev = dev;
+
+    net_rx_pkt_init(&n->rx_pkt, false);
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
@@ -3082,6 +3825,13 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
+    virtio_net_dataplane_stop(n);
+    for (i = 0; i < n->n_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->n_iothreads = 0;
 
     g_free(n->netclient_name);
     n->netclient_name = NULL;
@@ -3108,6 +3858,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
+    net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
 
@@ -3209,6 +3960,10 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
                     VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
     DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                    VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                    VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
@@ -3227,7 +3982,12 @@ static Property virtio_net_properties[] = {
                      true),
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
+    DEFINE_VIRTIO_COALESCING_PROPERTIES(VirtIONet, net_conf.coalesce),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_LINK("iothread", VirtIONet, iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    /* Spread queue pairs round-robin over IOThreads, e.g. "io0:io1" */
+    DEFINE_PROP_STRING("iothreads", VirtIONet, iothread_ids),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3254,6 +4014,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->post_load = virtio_net_post_load_virtio;
     vdc->vmsd = &vmstate_virtio_net_device;
     vdc->primary_unplug_pending = primary_unplug_pending;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
 }
 
 static const TypeInfo virtio_net_info = {
@@ -26,6 +26,7 @@
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -1066,6 +1067,45 @@ static int virtio_pci_set_host_notifier_mr(DeviceState *d, int n,
     return 0;
 }
 
+/* Process the notifications left by virtio_pci_queue_notify() */
+static void virtio_pci_notify_flush(VirtIOPCIProxy *proxy)
+{
+    VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
+    unsigned long bits;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(proxy->notify_pending); i++) {
+        if (!atomic_read(&proxy->notify_pending[i])) {
+            continue;
+        }
+        bits = atomic_xchg(&proxy->notify_pending[i], 0);
+        while (bits && vdev) {
+            virtio_queue_notify(vdev, i * BITS_PER_LONG + ctzl(bits));
+            bits &= bits - 1;
+        }
+    }
+}
+
+static void virtio_pci_notify_bh(void *opaque)
+{
+    virtio_pci_notify_flush(opaque);
+}
+
+/*
+ * The notification registers are accessed without the BQL.  Queue
+ * processing needs it, so unless the vCPU happens to hold it, defer the
+ * work to a bottom half as an ioeventfd would.
+ */
+static void virtio_pci_queue_notify(VirtIOPCIProxy *proxy, unsigned queue)
+{
+    if (qemu_mutex_iothread_locked()) {
+        virtio_queue_notify(virtio_bus_get_device(&proxy->bus), queue);
+        return;
+    }
+    set_bit_atomic(queue, proxy->notify_pending);
+    qemu_bh_schedule(proxy->notify_bh);
+}
+
 static void virtio_pci_vmstate_change(DeviceState *d, bool running)
 {
     VirtIOPCIProxy *proxy = to_virtio_pci_proxy(d);
@@ -1084,6 +1124,7 @@ static void virtio_pci_vmstate_change(DeviceState *d, bool running)
         }
         virtio_pci_start_ioeventfd(proxy);
     } else {
+        virtio_pci_notify_flush(proxy);
         virtio_pci_stop_ioeventfd(proxy);
     }
 }
@@ -1214,6 +1255,9 @@ static void virtio_pci_common_write(void *opaque, hwaddr addr,
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
 
+    /* Keep notifications ordered with respect to queue and status changes */
+    virtio_pci_notify_flush(proxy);
+
     switch (addr) {
     case VIRTIO_PCI_COMMON_DFSELECT:
         proxy->dfselect = val;
@@ -1322,7 +1366,7 @@ static void virtio_pci_notify_write(void *opaque, hwaddr addr,
     unsigned queue = addr / virtio_pci_queue_mem_mult(proxy);
 
     if (queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
+        virtio_pci_queue_notify(proxy, queue);
     }
 }
 
@@ -1330,20 +1374,41 @@ static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
                                         uint64_t val, unsigned size)
 {
     VirtIODevice *vdev = opaque;
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(DEVICE(vdev)->parent_bus->parent);
     unsigned queue = val;
 
     if (queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
+        virtio_pci_queue_notify(proxy, queue);
     }
 }
 
+/*
+ * Called without the BQL.  Guests using INTx read the ISR for every
+ * interrupt on a possibly shared line, so only take the BQL when there
+ * is something to acknowledge.
+ */
 static uint64_t virtio_pci_isr_read(void *opaque, hwaddr addr,
                                     unsigned size)
 {
     VirtIOPCIProxy *proxy = opaque;
     VirtIODevice *vdev = virtio_bus_get_device(&proxy->bus);
     uint64_t val = atomic_xchg(&vdev->isr, 0);
-    pci_irq_deassert(&proxy->pci_dev);
+    bool locked;
+
+    if (!val) {
+        return 0;
+    }
+
+    locked = qemu_mutex_iothread_locked();
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    /* An interrupt may have been raised since the xchg */
+    pci_set_irq(&proxy->pci_dev, !msix_enabled(&proxy->pci_dev) &&
+                (atomic_read(&vdev->isr) & 1));
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
 
     return val;
 }
@@ -1450,6 +1515,7 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           proxy,
                           "virtio-pci-isr",
                           proxy->isr.size);
+    memory_region_clear_global_locking(&proxy->isr.mr);
 
     memory_region_init_io(&proxy->device.mr, OBJECT(proxy),
                           &device_ops,
@@ -1462,12 +1528,14 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           virtio_bus_get_device(&proxy->bus),
                           "virtio-pci-notify",
                           proxy->notify.size);
+    memory_region_clear_global_locking(&proxy->notify.mr);
 
     memory_region_init_io(&proxy->notify_pio.mr, OBJECT(proxy),
                           &notify_pio_ops,
                           virtio_bus_get_device(&proxy->bus),
                           "virtio-pci-notify-pio",
                           proxy->notify_pio.size);
+    memory_region_clear_global_locking(&proxy->notify_pio.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
@@ -1675,6 +1743,7 @@ static void virtio_pci_device_unplugged(DeviceState *d)
     bool modern = virtio_pci_modern(proxy);
     bool modern_pio = proxy->flags & VIRTIO_PCI_FLAG_MODERN_PIO_NOTIFY;
 
+    virtio_pci_notify_flush(proxy);
     virtio_pci_stop_ioeventfd(proxy);
 
     if (modern) {
@@ -1802,6 +1871,7 @@ static void virtio_pci_realize(PCIDevice *pci_dev, Error **errp)
         pci_dev->cap_present &= ~QEMU_PCI_CAP_EXPRESS;
     }
 
+    proxy->notify_bh = qemu_bh_new(virtio_pci_notify_bh, proxy);
     virtio_pci_bus_new(&proxy->bus, sizeof(proxy->bus), proxy);
     if (k->realize) {
         k->realize(proxy, errp);
@@ -1810,6 +1880,9 @@ static void virtio_pci_realize(PCIDevice *pci_dev, Error **errp)
 
 static void virtio_pci_exit(PCIDevice *pci_dev)
 {
+    VirtIOPCIProxy *proxy = VIRTIO_PCI(pci_dev);
+
+    qemu_bh_delete(proxy->notify_bh);
     msix_uninit_exclusive_bar(pci_dev);
 }
 
@@ -1820,6 +1893,7 @@ static void virtio_pci_reset(DeviceState *qdev)
     PCIDevice *dev = PCI_DEVICE(qdev);
     int i;
 
+    virtio_pci_notify_flush(proxy);
     virtio_pci_stop_ioeventfd(proxy);
     virtio_bus_reset(bus);
     msix_unuse_all_vectors(&proxy->pci_dev);
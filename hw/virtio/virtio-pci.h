@@ -156,6 +156,13 @@ struct VirtIOPCIProxy {
     VirtIOIRQFD *vector_irqfd;
     int nvqs_with_notifiers;
     VirtioBusState bus;
+
+    /*
+     * Queues notified by vCPUs that did not hold the BQL, to be processed
+     * by notify_bh.  Accessed atomically.
+     */
+    unsigned long notify_pending[BITS_TO_LONGS(VIRTIO_QUEUE_MAX)];
+    QEMUBH *notify_bh;
 };
 
 static inline bool virtio_pci_modern(VirtIOPCIProxy *proxy)
@@ -13,6 +13,8 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/qapi-visit-misc.h"
+#include "qapi/visitor.h"
 #include "cpu.h"
 #include "trace.h"
 #include "exec/address-spaces.h"
@@ -130,6 +132,23 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Free elements kept for reuse, see virtqueue_element_free() */
+    VirtQueueElement **pool;
+    unsigned int pool_num;
+    unsigned int pool_max;
+    size_t pool_sz;
+    VirtQueueElementPoolStats pool_stats;
+
+    /* Interrupt moderation, see virtio_queue_set_coalescing() */
+    VirtIOCoalescing coalesce;
+    QEMUTimer *coalesce_timer;
+    uint32_t coalesce_pending;
+    bool coalesce_irqfd;
+    uint32_t coalesce_frames;
+    uint32_t coalesce_usecs;
+    int64_t coalesce_window_start;
+    uint32_t coalesce_window_count;
 };
 
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
@@ -695,6 +714,30 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_detach_element(vq, elem, len);
 }
 
+/* virtqueue_unpop_batch:
+ * @vq: The #VirtQueue
+ * @elems: the most recently popped elements, in the order they were popped
+ * @count: number of entries in @elems
+ *
+ * Like virtqueue_unpop() for each element, in reverse order.  Useful to give
+ * back the tail of a batch returned by virtqueue_pop_batch() that the device
+ * could not process.  The caller still frees the elements.
+ */
+void virtqueue_unpop_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                           unsigned int count)
+{
+    bool packed = virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+
+    while (count--) {
+        if (packed) {
+            virtqueue_packed_rewind(vq, elems[count]->ndescs);
+        } else {
+            virtqueue_split_rewind(vq, 1);
+        }
+        virtqueue_detach_element(vq, elems[count], 0);
+    }
+}
+
 /* virtqueue_rewind:
  * @vq: The #VirtQueue
  * @num: Number of elements to push back
@@ -864,6 +907,82 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Called within rcu_read_lock().  */
+static void virtqueue_split_fill_batch(VirtQueue *vq,
+                                       VirtQueueElement *const *elems,
+                                       const unsigned int *lens,
+                                       unsigned int count)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int i, first, n;
+    VRingUsedElem uelem;
+
+    if (unlikely(!vq->vring.used)) {
+        return;
+    }
+
+    caches = vring_get_region_caches(vq);
+    first = vq->used_idx % vq->vring.num;
+    for (i = 0; i < count; i++) {
+        hwaddr pa = offsetof(VRingUsed, ring[(first + i) % vq->vring.num]);
+
+        uelem.id = elems[i]->index;
+        uelem.len = lens[i];
+        virtio_tswap32s(vq->vdev, &uelem.id);
+        virtio_tswap32s(vq->vdev, &uelem.len);
+        address_space_write_cached(&caches->used, pa, &uelem, sizeof(uelem));
+    }
+
+    /* The entries are contiguous, except where the ring wraps around. */
+    n = MIN(count, vq->vring.num - first);
+    address_space_cache_invalidate(&caches->used,
+                                   offsetof(VRingUsed, ring[first]),
+                                   n * sizeof(VRingUsedElem));
+    if (n < count) {
+        address_space_cache_invalidate(&caches->used,
+                                       offsetof(VRingUsed, ring[0]),
+                                       (count - n) * sizeof(VRingUsedElem));
+    }
+}
+
+/* virtqueue_push_batch:
+ * @vq: The #VirtQueue
+ * @elems: the elements to return to the guest
+ * @lens: number of bytes written to each element
+ * @count: number of entries in @elems and @lens, at most the queue size
+ *
+ * Equivalent to virtqueue_fill() for each element followed by a single
+ * virtqueue_flush(), so the guest sees one used index update.  As with
+ * virtqueue_push(), the caller notifies the guest afterwards, once for
+ * the whole batch.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < count; i++) {
+        trace_virtqueue_fill(vq, elems[i], lens[i], i);
+        virtqueue_unmap_sg(vq, elems[i], lens[i]);
+    }
+
+    if (!virtio_device_disabled(vq->vdev)) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            for (i = 0; i < count; i++) {
+                virtqueue_packed_fill(vq, elems[i], lens[i], i);
+            }
+        } else {
+            virtqueue_split_fill_batch(vq, elems, lens, count);
+        }
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1321,7 +1440,56 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
     virtqueue_map_iovec(vdev, elem->out_sg, elem->out_addr, elem->out_num, 0);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/*
+ * Pooled elements have room for this many scatter-gather entries in total.
+ * This covers the common requests of block and network devices; longer
+ * chains get an element of their own size.
+ */
+#define VIRTQUEUE_POOL_SG 32
+
+/*
+ * Allocate an element for a chain of @sg_num entries, from @vq's pool if
+ * possible.  @vq is NULL for elements that are not tied to a virtqueue.
+ */
+static VirtQueueElement *virtqueue_element_get(VirtQueue *vq, size_t sz,
+                                               unsigned sg_num,
+                                               size_t alloc_sz)
+{
+    VirtQueueElement *elem;
+
+    if (!vq || sg_num > VIRTQUEUE_POOL_SG ||
+        (vq->pool_sz && vq->pool_sz != sz)) {
+        if (vq) {
+            atomic_set_u64(&vq->pool_stats.unpooled,
+                           vq->pool_stats.unpooled + 1);
+        }
+        elem = g_malloc(alloc_sz);
+        elem->pool = NULL;
+        return elem;
+    }
+
+    if (!vq->pool) {
+        vq->pool_sz = sz;
+        vq->pool_max = vq->vring.num;
+        vq->pool = g_new(VirtQueueElement *, vq->pool_max);
+    }
+
+    if (vq->pool_num) {
+        elem = vq->pool[--vq->pool_num];
+        atomic_set_u64(&vq->pool_stats.hits, vq->pool_stats.hits + 1);
+    } else {
+        /* Same layout as for VIRTQUEUE_POOL_SG input buffers. */
+        elem = g_malloc(QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0])) +
+                        VIRTQUEUE_POOL_SG * (sizeof(elem->in_addr[0]) +
+                                             sizeof(elem->in_sg[0])));
+        atomic_set_u64(&vq->pool_stats.allocs, vq->pool_stats.allocs + 1);
+    }
+    elem->pool = vq;
+    return elem;
+}
+
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
@@ -1332,7 +1500,8 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    QEMU_BUILD_BUG_ON(__alignof__(hwaddr) < __alignof__(struct iovec));
+    elem = virtqueue_element_get(vq, sz, in_num + out_num, out_sg_end);
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
     elem->out_num = out_num;
     elem->in_num = in_num;
@@ -1343,10 +1512,11 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock(), when the avail ring has at least one head. */
+static VirtQueueElement *virtqueue_split_pop_avail(VirtQueue *vq, size_t sz,
+                                            VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1358,14 +1528,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1380,18 +1542,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1450,7 +1602,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1475,10 +1627,87 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_desc_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+    return caches;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_avail(vq, sz, caches);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
 {
-    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* A single read of the avail index covers the whole batch.  */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    while (n < max) {
+        elems[n] = virtqueue_split_pop_avail(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+        n++;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return n;
+}
+
+/* Called within rcu_read_lock(), when the next descriptor is available. */
+static VirtQueueElement *virtqueue_packed_pop_avail(VirtQueue *vq, size_t sz,
+                                            VRingMemoryRegionCaches *caches)
+{
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1491,11 +1720,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     uint16_t id;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1508,12 +1732,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
     id = desc.id;
@@ -1571,7 +1789,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1605,6 +1823,91 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_avail(vq, sz, caches);
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int n = 0;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return 0;
+    }
+
+    caches = virtqueue_desc_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    /*
+     * There is no avail index in a packed ring, the descriptor flags have
+     * to be checked one by one.  The region caches are looked up once.
+     */
+    do {
+        elems[n] = virtqueue_packed_pop_avail(vq, sz, caches);
+        if (!elems[n]) {
+            break;
+        }
+    } while (++n < max && !virtio_queue_packed_empty_rcu(vq));
+
+    return n;
+}
+
+/* virtqueue_element_free:
+ * @elem: a #VirtQueueElement, or the device request that embeds it
+ *
+ * Free an element returned by virtqueue_pop() or virtqueue_pop_batch().
+ * Elements of common size go back to a per-virtqueue pool and are reused
+ * by the next pops, so that the request hot path does not go through
+ * malloc.  Call it from the context that pops from the virtqueue, and
+ * before the virtqueue is deleted.  Freeing with g_free() is also correct,
+ * it just bypasses the pool.
+ */
+void virtqueue_element_free(void *elem)
+{
+    VirtQueueElement *e = elem;
+    VirtQueue *vq;
+
+    if (!e) {
+        return;
+    }
+
+    vq = e->pool;
+    if (vq && vq->pool && vq->pool_num < vq->pool_max) {
+        vq->pool[vq->pool_num++] = e;
+    } else {
+        g_free(e);
+    }
+}
+
+static void virtqueue_pool_destroy(VirtQueue *vq)
+{
+    while (vq->pool_num) {
+        g_free(vq->pool[--vq->pool_num]);
+    }
+    g_free(vq->pool);
+    vq->pool = NULL;
+    vq->pool_max = 0;
+    vq->pool_sz = 0;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1618,6 +1921,37 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/* virtqueue_pop_batch:
+ * @vq: The #VirtQueue
+ * @sz: size of each element, as for virtqueue_pop()
+ * @elems: array receiving the popped elements
+ * @max: maximum number of elements to pop, the size of @elems
+ *
+ * Pop up to @max available elements.  Compared to calling virtqueue_pop()
+ * in a loop, the avail index is read and the event index is updated once
+ * for the whole batch, and the vring region caches are looked up only once.
+ * The elements are freed with g_free() by the caller as usual.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n;
+
+    if (virtio_device_disabled(vq->vdev) || !max) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        n = virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        n = virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+    trace_virtqueue_pop_batch(vq, max, n);
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1747,7 +2081,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -1946,6 +2280,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        vdev->vq[i].coalesce_pending = 0;
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+        }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
@@ -2344,6 +2682,9 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_aio_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtqueue_pool_destroy(vq);
+    vq->coalesce_pending = 0;
+    virtio_queue_set_coalescing(vq, NULL);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2439,7 +2780,149 @@ static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
-void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+/*
+ * Adaptive moderation: below VIRTIO_COALESCE_RATE_LOW notifications per
+ * second every notification is sent right away, above
+ * VIRTIO_COALESCE_RATE_HIGH the configured limits apply in full, and in
+ * between they scale linearly with the rate.  The rate is sampled over
+ * windows of VIRTIO_COALESCE_WINDOW_US.
+ */
+#define VIRTIO_COALESCE_WINDOW_US   10000
+#define VIRTIO_COALESCE_RATE_LOW    10000
+#define VIRTIO_COALESCE_RATE_HIGH   100000
+
+static void virtio_queue_coalesce_adapt(VirtQueue *vq, int64_t now)
+{
+    int64_t elapsed = now - vq->coalesce_window_start;
+    uint64_t rate, frames;
+
+    vq->coalesce_window_count++;
+    if (elapsed < VIRTIO_COALESCE_WINDOW_US) {
+        return;
+    }
+
+    rate = vq->coalesce_window_count * 1000000ULL / elapsed;
+    vq->coalesce_window_start = now;
+    vq->coalesce_window_count = 0;
+
+    if (rate <= VIRTIO_COALESCE_RATE_LOW) {
+        vq->coalesce_frames = 1;
+        vq->coalesce_usecs = 0;
+    } else if (rate >= VIRTIO_COALESCE_RATE_HIGH) {
+        vq->coalesce_frames = vq->coalesce.max_frames;
+        vq->coalesce_usecs = vq->coalesce.max_usecs;
+    } else {
+        rate -= VIRTIO_COALESCE_RATE_LOW;
+        frames = vq->coalesce.max_frames ?: UINT32_MAX;
+        vq->coalesce_frames = 1 + (frames - 1) * rate /
+            (VIRTIO_COALESCE_RATE_HIGH - VIRTIO_COALESCE_RATE_LOW);
+        vq->coalesce_usecs = vq->coalesce.max_usecs * rate /
+            (VIRTIO_COALESCE_RATE_HIGH - VIRTIO_COALESCE_RATE_LOW);
+    }
+    trace_virtio_queue_coalesce_adapt(vq, rate, vq->coalesce_frames,
+                                      vq->coalesce_usecs);
+}
+
+/*
+ * Account for a notification of @vq.  Returns true if it is deferred, in
+ * which case the coalescing timer or a later notification will send it.
+ */
+static bool virtio_queue_coalesce(VirtQueue *vq, bool irqfd)
+{
+    int64_t now;
+
+    if (!vq->coalesce_timer) {
+        return false;
+    }
+
+    now = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    if (vq->coalesce.adaptive) {
+        virtio_queue_coalesce_adapt(vq, now);
+    }
+
+    vq->coalesce_irqfd = irqfd;
+    vq->coalesce_pending++;
+    if (!vq->coalesce_usecs ||
+        (vq->coalesce_frames && vq->coalesce_pending >= vq->coalesce_frames)) {
+        /* Send now, together with whatever was deferred so far. */
+        vq->coalesce_pending = 0;
+        timer_del(vq->coalesce_timer);
+        return false;
+    }
+
+    if (!timer_pending(vq->coalesce_timer)) {
+        timer_mod(vq->coalesce_timer, now + vq->coalesce_usecs);
+    }
+    return true;
+}
+
+static void virtio_notify_irqfd_now(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq);
+
+/* Send a notification deferred by virtio_queue_coalesce(), if any. */
+static void virtio_queue_coalesce_flush(VirtQueue *vq)
+{
+    if (!vq->coalesce_pending) {
+        return;
+    }
+
+    vq->coalesce_pending = 0;
+    if (vq->coalesce_timer) {
+        timer_del(vq->coalesce_timer);
+    }
+    if (vq->coalesce_irqfd) {
+        virtio_notify_irqfd_now(vq->vdev, vq);
+    } else {
+        virtio_notify_now(vq->vdev, vq);
+    }
+}
+
+static void virtio_queue_coalesce_timer_cb(void *opaque)
+{
+    virtio_queue_coalesce_flush(opaque);
+}
+
+/* Run the coalescing timer of @vq in @ctx, which also handles the queue. */
+static void virtio_queue_coalesce_attach(VirtQueue *vq, AioContext *ctx)
+{
+    virtio_queue_coalesce_flush(vq);
+    if (vq->coalesce_timer) {
+        timer_del(vq->coalesce_timer);
+        timer_free(vq->coalesce_timer);
+        vq->coalesce_timer = NULL;
+    }
+    if (ctx && vq->coalesce.max_usecs) {
+        vq->coalesce_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_US,
+                                           virtio_queue_coalesce_timer_cb, vq);
+    }
+}
+
+/* virtio_queue_set_coalescing:
+ * @vq: The #VirtQueue
+ * @conf: moderation limits, or NULL to disable moderation
+ *
+ * Delay guest notifications of @vq by up to @conf->max_usecs, merging up
+ * to @conf->max_frames of them into one (0 means no frame limit).  With
+ * @conf->adaptive, the limits are scaled down when the notification rate
+ * is low, so that lightly loaded queues keep their latency.  Moderation
+ * is disabled if @conf->max_usecs is zero.
+ *
+ * The timer runs in the main loop, or in the AioContext that
+ * virtio_queue_aio_set_host_notifier_handler() attaches the queue to.
+ */
+void virtio_queue_set_coalescing(VirtQueue *vq, const VirtIOCoalescing *conf)
+{
+    static const VirtIOCoalescing disabled;
+
+    vq->coalesce = conf ? *conf : disabled;
+    vq->coalesce_frames = vq->coalesce.max_frames;
+    vq->coalesce_usecs = vq->coalesce.max_usecs;
+    vq->coalesce_window_start = qemu_clock_get_us(QEMU_CLOCK_VIRTUAL);
+    vq->coalesce_window_count = 0;
+    virtio_queue_coalesce_attach(vq, qemu_get_aio_context());
+}
+
+static void virtio_notify_irqfd_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2468,13 +2951,21 @@ void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
     event_notifier_set(&vq->guest_notifier);
 }
 
+void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (virtio_queue_coalesce(vq, true)) {
+        return;
+    }
+    virtio_notify_irqfd_now(vdev, vq);
+}
+
 static void virtio_irq(VirtQueue *vq)
 {
     virtio_set_isr(vq->vdev, 0x1);
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2486,6 +2977,14 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_irq(vq);
 }
 
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (virtio_queue_coalesce(vq, false)) {
+        return;
+    }
+    virtio_notify_now(vdev, vq);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -3139,6 +3638,15 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     if (!backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
+
+    if (!running) {
+        int i;
+
+        /* Do not leave notifications behind in a stopped or migrated VM. */
+        for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+            virtio_queue_coalesce_flush(&vdev->vq[i]);
+        }
+    }
 }
 
 void virtio_instance_init_common(Object *proxy_obj, void *data,
@@ -3437,6 +3945,7 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
 {
     if (handle_output) {
         vq->handle_aio_output = handle_output;
+        virtio_queue_coalesce_attach(vq, ctx);
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read,
                                virtio_queue_host_notifier_aio_poll);
@@ -3449,6 +3958,7 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
          * in case poll callback didn't have time to run. */
         virtio_queue_host_notifier_aio_read(&vq->host_notifier);
         vq->handle_aio_output = NULL;
+        virtio_queue_coalesce_attach(vq, qemu_get_aio_context());
     }
 }
 
@@ -3577,6 +4087,9 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtqueue_pool_destroy(&vdev->vq[i]);
+        vdev->vq[i].coalesce_pending = 0;
+        virtio_queue_coalesce_attach(&vdev->vq[i], NULL);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
@@ -3600,7 +4113,11 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+/*
+ * Default VirtioDeviceClass::start_ioeventfd; devices that override it can
+ * call it to have the host notifiers handled in the main loop.
+ */
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -3662,7 +4179,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -3728,10 +4245,41 @@ bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev)
     return virtio_bus_ioeventfd_enabled(vbus);
 }
 
+/*
+ * Pool statistics summed over all virtqueues of the device.  The counters
+ * are updated by the thread that runs each virtqueue.
+ */
+static void virtio_device_get_pool_stats(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+    VirtioElemPoolStats stats = {};
+    VirtioElemPoolStats *p = &stats;
+    int i;
+
+    for (i = 0; vdev->vq && i < VIRTIO_QUEUE_MAX; i++) {
+        VirtQueueElementPoolStats *s = &vdev->vq[i].pool_stats;
+
+        stats.hits += atomic_read_u64(&s->hits);
+        stats.allocs += atomic_read_u64(&s->allocs);
+        stats.unpooled += atomic_read_u64(&s->unpooled);
+    }
+
+    visit_type_VirtioElemPoolStats(v, name, &p, errp);
+}
+
+static void virtio_device_instance_init(Object *obj)
+{
+    object_property_add(obj, "x-elem-pool-stats", "VirtioElemPoolStats",
+                        virtio_device_get_pool_stats, NULL, NULL, NULL, NULL);
+}
+
 static const TypeInfo virtio_device_info = {
     .name = TYPE_VIRTIO_DEVICE,
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(VirtIODevice),
+    .instance_init = virtio_device_instance_init,
     .class_init = virtio_device_class_init,
     .instance_finalize = virtio_device_instance_finalize,
     .abstract = true,
@@ -404,6 +404,22 @@ struct MemoryRegion {
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
+    bool coalesced_async;
+    /*
+     * For regions with coalesced ranges: all accesses, and the writes
+     * that went through the coalesced MMIO ring.
+     */
+    uint64_t coalesced_accesses;
+    uint64_t coalesced_ring_accesses;
+    /* Taken around accesses instead of the BQL, see memory_region_set_lock */
+    QemuMutex *lock;
+    /*
+     * Accesses that had to take the BQL, while the synchronization
+     * profiler is enabled; protected by the BQL
+     */
+    uint64_t bql_acquisitions;
+    uint64_t bql_wait_ns;
+    uint64_t bql_hold_ns;
 };
 
 struct IOMMUMemoryRegion {
@@ -533,6 +549,17 @@ struct MemoryListener {
      */
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
 
+    /**
+     * @log_sync_global:
+     *
+     * Like @log_sync, for listeners that can only synchronize the dirty
+     * log of the whole address space at once.  Only one of @log_sync and
+     * @log_sync_global may be set.
+     *
+     * @listener: The #MemoryListener.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+
     /**
      * @log_clear:
      *
@@ -1700,6 +1727,21 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_coalescing_async: Allow coalesced writes to be processed
+ *                                     outside of the vCPU threads.
+ *
+ * Coalesced writes are normally dispatched when the next access to a region
+ * that requires flushing is made, on the thread making it.  If the
+ * accelerator processes them from a separate thread, it will only do so
+ * for regions that opted in with this function; the access handlers of
+ * @mr must then not depend on running in a vCPU thread (e.g. look at
+ * current_cpu).  They still run with the global lock held.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_set_coalescing_async(MemoryRegion *mr);
+
 /**
  * memory_region_clear_global_locking: Declares that access processing does
  *                                     not depend on the QEMU global lock.
@@ -1713,6 +1755,25 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_global_locking(MemoryRegion *mr);
 
+/**
+ * memory_region_set_lock: Declares that access processing is serialized by
+ *                         a lock of the device rather than by the BQL.
+ *
+ * Accesses to the memory region are processed with @lock held, and not
+ * with QEMU's global lock (unless the BQL is already held when issuing the
+ * access request).  This lets vCPUs run the access handlers of a device
+ * concurrently with the main loop and with accesses to other devices.
+ *
+ * Since @lock may be taken with the BQL held, the BQL must never be taken
+ * with @lock held: the access handlers cannot take it, and have to defer
+ * anything that needs it, for example to a bottom half.  Code running under
+ * the BQL takes @lock to access the state it shares with the handlers.
+ *
+ * @mr: the memory region to be updated.
+ * @lock: the lock protecting the state used by the access handlers.
+ */
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -1973,7 +2034,7 @@ void memory_global_dirty_log_start(void);
  */
 void memory_global_dirty_log_stop(void);
 
-void mtree_info(bool flatview, bool dispatch_tree, bool owner);
+void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool locking);
 
 /**
  * memory_region_dispatch_read: perform a read directly to the specified
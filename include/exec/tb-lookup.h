@@ -16,14 +16,56 @@
 #include "exec/exec-all.h"
 #include "exec/tb-hash.h"
 
+static inline bool tb_jmp_cache_match(CPUState *cpu,
+                                      const TranslationBlock *tb,
+                                      target_ulong pc, target_ulong cs_base,
+                                      uint32_t flags, uint32_t cf_mask)
+{
+    return tb &&
+           tb->pc == pc &&
+           tb->cs_base == cs_base &&
+           tb->flags == flags &&
+           tb->trace_vcpu_dstate == *cpu->trace_dstate &&
+           (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask;
+}
+
+/*
+ * Install @tb in tb_jmp_cache slot @hash.  The previous occupant is moved
+ * to the victim set, so that two hot TBs whose PCs collide in the direct
+ * mapped cache (typically the targets of an indirect branch) do not keep
+ * falling back to the QHT.  Must be called from the vCPU thread.
+ */
+static inline void tb_jmp_cache_insert(CPUState *cpu, uint32_t hash,
+                                       TranslationBlock *tb)
+{
+    TranslationBlock *old = atomic_read(&cpu->tb_jmp_cache[hash]);
+
+    if (old && old != tb) {
+        unsigned int i = cpu->tb_jmp_victim_next;
+
+        atomic_set(&cpu->tb_jmp_victim[i], old);
+        cpu->tb_jmp_victim_next = (i + 1) & (TB_JMP_VICTIM_SIZE - 1);
+    }
+    atomic_set(&cpu->tb_jmp_cache[hash], tb);
+}
+
+/* Only counted with --enable-profiler, this is the translation hot path */
+static inline void tb_jmp_cache_stat_inc(size_t *counter)
+{
+#ifdef CONFIG_PROFILER
+    atomic_set(counter, *counter + 1);
+#endif
+}
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *
 tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
                      uint32_t *flags, uint32_t cf_mask)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb;
+    TranslationBlock *tb, *victim;
     uint32_t hash;
+    unsigned int i;
 
     cpu_get_tb_cpu_state(env, pc, cs_base, flags);
     hash = tb_jmp_cache_hash_func(*pc);
@@ -32,19 +74,32 @@ tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
     cf_mask &= ~CF_CLUSTER_MASK;
     cf_mask |= cpu->cluster_index << CF_CLUSTER_SHIFT;
 
-    if (likely(tb &&
-               tb->pc == *pc &&
-               tb->cs_base == *cs_base &&
-               tb->flags == *flags &&
-               tb->trace_vcpu_dstate == *cpu->trace_dstate &&
-               (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask)) {
+    if (likely(tb_jmp_cache_match(cpu, tb, *pc, *cs_base, *flags, cf_mask))) {
+        tb_jmp_cache_stat_inc(&cpu->tb_jmp_cache_stats.hits);
         return tb;
     }
+
+    /*
+     * Second level: swap a matching victim with the entry that shadowed it.
+     * Racing with tb_phys_invalidate may leave an invalidated TB in either
+     * cache; that is harmless since CF_INVALID never matches @cf_mask.
+     */
+    for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+        victim = atomic_rcu_read(&cpu->tb_jmp_victim[i]);
+        if (tb_jmp_cache_match(cpu, victim, *pc, *cs_base, *flags, cf_mask)) {
+            atomic_set(&cpu->tb_jmp_victim[i], tb);
+            atomic_set(&cpu->tb_jmp_cache[hash], victim);
+            tb_jmp_cache_stat_inc(&cpu->tb_jmp_cache_stats.victim_hits);
+            return victim;
+        }
+    }
+
+    tb_jmp_cache_stat_inc(&cpu->tb_jmp_cache_stats.misses);
     tb = tb_htable_lookup(cpu, *pc, *cs_base, *flags, cf_mask);
     if (tb == NULL) {
         return NULL;
     }
-    atomic_set(&cpu->tb_jmp_cache[hash], tb);
+    tb_jmp_cache_insert(cpu, hash, tb);
     return tb;
 }
 
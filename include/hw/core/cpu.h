@@ -263,12 +263,29 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/*
+ * Number of entries in the fully associative victim set that backs
+ * tb_jmp_cache.  Must be a power of 2.
+ */
+#define TB_JMP_VICTIM_SIZE 8
+
+/*
+ * Hit statistics for the per-vCPU TB lookup caches, see "info jit".
+ * Only updated when QEMU is configured with --enable-profiler.
+ */
+typedef struct TBJmpCacheStats {
+    size_t hits;
+    size_t victim_hits;
+    size_t misses;
+} TBJmpCacheStats;
+
 /* work queue */
 
 /* The union type allows passing of 64 bit target pointers on 32 bit
@@ -390,6 +407,14 @@ struct CPUState {
 
     /* Accessed in parallel; all accesses must be atomic */
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /*
+     * Entries evicted from tb_jmp_cache by a conflicting TB; accessed in
+     * parallel like tb_jmp_cache.  tb_jmp_victim_next and the statistics
+     * are only written by the vCPU thread.
+     */
+    struct TranslationBlock *tb_jmp_victim[TB_JMP_VICTIM_SIZE];
+    unsigned int tb_jmp_victim_next;
+    TBJmpCacheStats tb_jmp_cache_stats;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -412,6 +437,8 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -464,6 +491,9 @@ static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
     for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
         atomic_set(&cpu->tb_jmp_cache[i], NULL);
     }
+    for (i = 0; i < TB_JMP_VICTIM_SIZE; i++) {
+        atomic_set(&cpu->tb_jmp_victim[i], NULL);
+    }
 }
 
 /**
@@ -42,6 +42,7 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    VirtIOCoalescing coalesce;
 };
 
 struct VirtIOBlockDataPlane;
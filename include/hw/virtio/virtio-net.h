@@ -19,6 +19,7 @@
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
 #include "qemu/option_int.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -45,8 +46,23 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    VirtIOCoalescing coalesce;
 } virtio_net_conf;
 
+#define VIRTIO_NET_RSS_MAX_KEY_SIZE     40
+#define VIRTIO_NET_RSS_MAX_TABLE_LEN    128
+
+typedef struct VirtioNetRssData {
+    bool    enabled;
+    bool    redirect;
+    bool    populate_hash;
+    uint32_t hash_types;
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    uint16_t indirections_len;
+    uint16_t indirections_table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint16_t default_queue;
+} VirtioNetRssData;
+
 /* Coalesced packets type & status */
 typedef enum {
     RSC_COALESCE,           /* Data been coalesced */
@@ -132,10 +148,13 @@ typedef struct VirtIONetQueue {
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
     uint32_t tx_waiting;
+    /* RX notification deferred until the backend unplugs */
+    bool rx_notify_pending;
     struct {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    AioContext *ctx; /* dataplane AioContext, NULL without an iothread */
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -166,6 +185,18 @@ struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    /*
+     * Dataplane: queue pair i and its backend run in
+     * iothreads[i % n_iothreads], resolved from @iothread or from the
+     * colon-separated list of ids in @iothread_ids.
+     */
+    IOThread *iothread;
+    char *iothread_ids;
+    IOThread **iothreads;
+    uint32_t n_iothreads;
+    int dataplane_queues;
+    bool dataplane_started;
+    bool dataplane_disabled;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
@@ -199,6 +230,8 @@ struct VirtIONet {
     bool failover;
     DeviceListener primary_listener;
     Notifier migration_state;
+    VirtioNetRssData rss_data;
+    struct NetRxPkt *rx_pkt;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
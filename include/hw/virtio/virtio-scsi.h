@@ -58,6 +58,7 @@ struct VirtIOSCSIConf {
     CharBackend chardev;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    VirtIOCoalescing coalesce;
 };
 
 struct VirtIOSCSI;
@@ -60,8 +60,26 @@ typedef struct VirtQueueElement
     hwaddr *out_addr;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    VirtQueue *pool;
 } VirtQueueElement;
 
+typedef struct VirtIOCoalescing {
+    uint32_t max_usecs;     /* longest notification delay, 0 disables */
+    uint32_t max_frames;    /* notifications merged into one, 0: no limit */
+    bool adaptive;          /* scale the limits with the notification rate */
+} VirtIOCoalescing;
+
+#define DEFINE_VIRTIO_COALESCING_PROPERTIES(_state, _field)             \
+    DEFINE_PROP_UINT32("coalesce-usecs", _state, _field.max_usecs, 0),   \
+    DEFINE_PROP_UINT32("coalesce-frames", _state, _field.max_frames, 0), \
+    DEFINE_PROP_BOOL("coalesce-adaptive", _state, _field.adaptive, false)
+
+typedef struct VirtQueueElementPoolStats {
+    uint64_t hits;      /* elements reused from the pool */
+    uint64_t allocs;    /* elements allocated to grow the pool */
+    uint64_t unpooled;  /* elements too large for the pool */
+} VirtQueueElementPoolStats;
+
 #define VIRTIO_QUEUE_MAX 1024
 
 #define VIRTIO_NO_VECTOR 0xffff
@@ -189,17 +207,24 @@ void virtio_delete_queue(VirtQueue *vq);
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count);
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_detach_element(VirtQueue *vq, const VirtQueueElement *elem,
                               unsigned int len);
 void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
                      unsigned int len);
+void virtqueue_unpop_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                           unsigned int count);
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
 
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+void virtqueue_element_free(void *elem);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
@@ -212,6 +237,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq);
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
+void virtio_queue_set_coalescing(VirtQueue *vq, const VirtIOCoalescing *conf);
 
 int virtio_save(VirtIODevice *vdev, QEMUFile *f);
 
@@ -313,6 +339,8 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                 bool with_irqfd);
 int virtio_device_start_ioeventfd(VirtIODevice *vdev);
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev);
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev);
 int virtio_device_grab_ioeventfd(VirtIODevice *vdev);
 void virtio_device_release_ioeventfd(VirtIODevice *vdev);
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev);
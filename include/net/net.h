@@ -60,6 +60,8 @@ typedef int (SetVnetBE)(NetClientState *, bool);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
+typedef void (NetIOUnplug)(NetClientState *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -81,6 +83,8 @@ typedef struct NetClientInfo {
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
+    NetSetAioContext *set_aio_context;
+    NetIOUnplug *io_unplug;
 } NetClientInfo;
 
 struct NetClientState {
@@ -98,7 +102,9 @@ struct NetClientState {
     unsigned rxfilter_notify_enabled:1;
     int vring_enable;
     int vnet_hdr_len;
+    unsigned int io_plugged;
     QTAILQ_HEAD(, NetFilterState) filters;
+    AioContext *aio_context; /* NULL when running in the main loop */
 };
 
 typedef struct NICState {
@@ -164,6 +170,10 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_net_client_can_set_aio_context(NetClientState *nc);
+void qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx);
+void qemu_net_io_plug(NetClientState *nc);
+void qemu_net_io_unplug(NetClientState *nc);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
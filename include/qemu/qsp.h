@@ -11,13 +11,26 @@
 #ifndef QEMU_QSP_H
 #define QEMU_QSP_H
 
+/*
+ * Sorting by hold time only reports the BQL, the only lock whose hold
+ * times are tracked.
+ */
 enum QSPSortBy {
     QSP_SORT_BY_TOTAL_WAIT_TIME,
     QSP_SORT_BY_AVG_WAIT_TIME,
+    QSP_SORT_BY_TOTAL_HOLD_TIME,
+    QSP_SORT_BY_AVG_HOLD_TIME,
 };
 
+/* BQL hold time histogram buckets: <1us, <10us, ... <100ms, >=100ms */
+#define QSP_HOLD_HIST_BUCKETS 7
+
+struct SyncProfileEntryList;
+
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
+struct SyncProfileEntryList *qsp_query(size_t max, enum QSPSortBy sort_by,
+                                       bool callsite_coalesce);
 
 bool qsp_is_enabled(void);
 void qsp_enable(void);
@@ -18,8 +18,16 @@ typedef struct KVMSlot
     hwaddr start_addr;
     ram_addr_t memory_size;
     void *ram;
+    ram_addr_t ram_start_offset;
     int slot;
     int flags;
+    /*
+     * The slot as KVM knows it.  Changes made by the listener callbacks
+     * are only applied when the memory transaction commits.
+     */
+    hwaddr old_start_addr;
+    ram_addr_t old_memory_size;
+    void *old_ram;
     int old_flags;
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
@@ -27,10 +35,11 @@ typedef struct KVMSlot
 
 typedef struct KVMMemoryListener {
     MemoryListener listener;
-    /* Protects the slots and all inside them */
-    QemuMutex slots_lock;
     KVMSlot *slots;
     int as_id;
+    bool update_pending;
+    /* KVM_SET_USER_MEMORY_REGION calls issued so far */
+    uint64_t nr_slot_ioctls;
 } KVMMemoryListener;
 
 #define TYPE_KVM_ACCEL ACCEL_CLASS_NAME("kvm")
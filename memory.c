@@ -101,6 +101,101 @@ static AddrRange addrrange_intersection(AddrRange r1, AddrRange r2)
     return addrrange_make(start, int128_sub(end, start));
 }
 
+static gint addrrange_compare(gconstpointer a, gconstpointer b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
+    }
+    return int128_gt(r1->start, r2->start);
+}
+
+/* Sort an array of ranges and merge those that overlap or touch. */
+static void addrranges_merge(GArray *ranges)
+{
+    AddrRange *r = (AddrRange *)ranges->data;
+    unsigned i, j;
+
+    if (!ranges->len) {
+        return;
+    }
+
+    g_array_sort(ranges, addrrange_compare);
+    for (i = 0, j = 1; j < ranges->len; j++) {
+        if (int128_ge(addrrange_end(r[i]), r[j].start)) {
+            Int128 end = int128_max(addrrange_end(r[i]), addrrange_end(r[j]));
+            r[i].size = int128_sub(end, r[i].start);
+        } else {
+            r[++i] = r[j];
+        }
+    }
+    g_array_set_size(ranges, i + 1);
+}
+
+/*
+ * Parts of the memory regions that changed in the current transaction,
+ * as a GArray of AddrRange in the coordinates of each region.  At commit,
+ * only the places where they show up in each FlatView are rendered again.
+ * Regions are only compared by address while walking the memory tree, so
+ * a region that went away in the meantime is simply never found.
+ */
+static GHashTable *memory_region_update_ranges;
+static unsigned memory_region_update_nr;
+/* Too many changes, or a global one: render all FlatViews from scratch */
+static bool memory_region_update_all;
+
+#define MEMORY_REGION_UPDATE_MAX 256
+
+static void memory_region_update_range(MemoryRegion *mr,
+                                       Int128 start, Int128 size)
+{
+    AddrRange range = addrrange_make(start, size);
+    GArray *ranges;
+
+    memory_region_update_pending = true;
+    if (memory_region_update_all) {
+        return;
+    }
+    if (++memory_region_update_nr > MEMORY_REGION_UPDATE_MAX) {
+        memory_region_update_all = true;
+        return;
+    }
+
+    if (!memory_region_update_ranges) {
+        memory_region_update_ranges =
+            g_hash_table_new_full(NULL, NULL, NULL,
+                                  (GDestroyNotify)g_array_unref);
+    }
+    ranges = g_hash_table_lookup(memory_region_update_ranges, mr);
+    if (!ranges) {
+        ranges = g_array_new(FALSE, FALSE, sizeof(AddrRange));
+        g_hash_table_insert(memory_region_update_ranges, mr, ranges);
+    }
+    g_array_append_val(ranges, range);
+}
+
+static void memory_region_update_region(MemoryRegion *mr)
+{
+    memory_region_update_range(mr, int128_zero(), mr->size);
+}
+
+static void memory_region_update_everything(void)
+{
+    memory_region_update_pending = true;
+    memory_region_update_all = true;
+}
+
+static void memory_region_update_done(void)
+{
+    if (memory_region_update_ranges) {
+        g_hash_table_remove_all(memory_region_update_ranges);
+    }
+    memory_region_update_nr = 0;
+    memory_region_update_all = false;
+    memory_region_update_pending = false;
+}
+
 enum ListenerDirection { Forward, Reverse };
 
 #define MEMORY_LISTENER_CALL_GLOBAL(_callback, _direction, _args...)    \
@@ -319,6 +414,23 @@ static bool can_merge(FlatRange *r1, FlatRange *r2)
         && r1->nonvolatile == r2->nonvolatile;
 }
 
+/* Index of the first range of @view that ends after @addr */
+static unsigned flatview_find_after(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (int128_le(addrrange_end(view->ranges[mid].addr), addr)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /* Attempt to simplify a view by merging adjacent ranges */
 static void flatview_simplify(FlatView *view)
 {
@@ -626,7 +738,8 @@ static void render_memory_region(FlatView *view,
     fr.nonvolatile = nonvolatile;
 
     /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    for (i = flatview_find_after(view, base);
+         i < view->nr && int128_nz(remain); ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -699,10 +812,26 @@ static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
     return NULL;
 }
 
+/* Build the dispatch tree of a freshly rendered view and publish it. */
+static void flatview_install(FlatView *view)
+{
+    int i;
+
+    flatview_simplify(view);
+
+    view->dispatch = address_space_dispatch_new(view);
+    for (i = 0; i < view->nr; i++) {
+        MemoryRegionSection mrs =
+            section_from_flat_range(&view->ranges[i], view);
+        flatview_add_to_dispatch(view, &mrs);
+    }
+    address_space_dispatch_compact(view->dispatch);
+    g_hash_table_replace(flat_views, view->root, view);
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
-    int i;
     FlatView *view;
 
     view = flatview_new(mr);
@@ -712,17 +841,126 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
                              addrrange_make(int128_zero(), int128_2_64()),
                              false, false);
     }
-    flatview_simplify(view);
+    flatview_install(view);
 
-    view->dispatch = address_space_dispatch_new(view);
-    for (i = 0; i < view->nr; i++) {
-        MemoryRegionSection mrs =
-            section_from_flat_range(&view->ranges[i], view);
-        flatview_add_to_dispatch(view, &mrs);
+    return view;
+}
+
+/*
+ * Collect into @dirty the absolute ranges of the view rooted at @mr
+ * where the changes of the current transaction show up.  This walks the
+ * tree like render_memory_region() does, except that changes are recorded
+ * before checking whether the region is enabled, and are clipped only to
+ * the window of the parent: the region may have been disabled, moved or
+ * shrunk, and its old contents must go too.
+ */
+static void flatview_collect_updates(GArray *dirty, MemoryRegion *mr,
+                                     Int128 base, AddrRange clip)
+{
+    MemoryRegion *subregion;
+    GArray *ranges;
+    AddrRange tmp;
+    unsigned i;
+
+    int128_addto(&base, int128_make64(mr->addr));
+
+    ranges = g_hash_table_lookup(memory_region_update_ranges, mr);
+    for (i = 0; ranges && i < ranges->len; i++) {
+        tmp = addrrange_shift(g_array_index(ranges, AddrRange, i), base);
+        if (addrrange_intersects(tmp, clip)) {
+            tmp = addrrange_intersection(tmp, clip);
+            g_array_append_val(dirty, tmp);
+        }
     }
-    address_space_dispatch_compact(view->dispatch);
-    g_hash_table_replace(flat_views, mr, view);
 
+    if (!mr->enabled) {
+        return;
+    }
+
+    tmp = addrrange_make(base, mr->size);
+    if (!addrrange_intersects(tmp, clip)) {
+        return;
+    }
+    clip = addrrange_intersection(tmp, clip);
+
+    if (mr->alias) {
+        int128_subfrom(&base, int128_make64(mr->alias->addr));
+        int128_subfrom(&base, int128_make64(mr->alias_offset));
+        flatview_collect_updates(dirty, mr->alias, base, clip);
+        return;
+    }
+
+    QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+        flatview_collect_updates(dirty, subregion, base, clip);
+    }
+}
+
+/* Copy the part [@start, @end) of @fr at the end of @view. */
+static void flatview_append_part(FlatView *view, FlatRange *fr,
+                                 Int128 start, Int128 end)
+{
+    FlatRange part = *fr;
+
+    part.addr = addrrange_make(start, int128_sub(end, start));
+    part.offset_in_region += int128_get64(int128_sub(start, fr->addr.start));
+    flatview_insert(view, view->nr, &part);
+}
+
+/*
+ * Update the topology of @mr, whose view before the transaction was @old.
+ * The ranges of @old outside of the parts touched by the transaction are
+ * kept as they are, and only the touched parts are rendered again; if
+ * none of the changes show up in the view, @old itself is reused.
+ */
+static FlatView *flatview_update(FlatView *old, MemoryRegion *mr)
+{
+    GArray *dirty = g_array_new(FALSE, FALSE, sizeof(AddrRange));
+    AddrRange *d;
+    FlatView *view;
+    FlatRange *fr;
+    Int128 start, end;
+    unsigned i, j;
+
+    flatview_collect_updates(dirty, mr, int128_zero(),
+                             addrrange_make(int128_zero(), int128_2_64()));
+    if (!dirty->len) {
+        g_array_free(dirty, TRUE);
+        flatview_ref(old);
+        g_hash_table_replace(flat_views, mr, old);
+        return old;
+    }
+    addrranges_merge(dirty);
+    d = (AddrRange *)dirty->data;
+
+    view = flatview_new(mr);
+    trace_flatview_update(view, mr, dirty->len);
+
+    j = 0;
+    FOR_EACH_FLAT_RANGE(fr, old) {
+        start = fr->addr.start;
+        end = addrrange_end(fr->addr);
+        while (j < dirty->len && int128_le(addrrange_end(d[j]), start)) {
+            j++;
+        }
+        for (i = j; int128_lt(start, end); i++) {
+            if (i == dirty->len || int128_ge(d[i].start, end)) {
+                flatview_append_part(view, fr, start, end);
+                break;
+            }
+            if (int128_lt(start, d[i].start)) {
+                flatview_append_part(view, fr, start, d[i].start);
+            }
+            start = addrrange_end(d[i]);
+        }
+    }
+
+    /* The gaps left are exactly the dirty ranges; fill them again. */
+    for (i = 0; i < dirty->len; i++) {
+        render_memory_region(view, mr, int128_zero(), d[i], false, false);
+    }
+    g_array_free(dirty, TRUE);
+
+    flatview_install(view);
     return view;
 }
 
@@ -966,27 +1204,60 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /* Render unique FVs, starting from the old ones where possible */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view = NULL;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
-        generate_memory_topology(physmr);
+        if (old_views && memory_region_update_ranges &&
+            !memory_region_update_all) {
+            old_view = g_hash_table_lookup(old_views, physmr);
+        }
+        if (old_view) {
+            flatview_update(old_view, physmr);
+        } else {
+            generate_memory_topology(physmr);
+        }
+    }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
+}
+
+/*
+ * Replay an unchanged view to the listeners that rebuild their whole state
+ * between begin and commit, as if it had been compared to itself.
+ */
+static void address_space_replay_nop(AddressSpace *as, FlatView *view)
+{
+    MemoryListener *listener;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(listener, &as->listeners, link_as) {
+        if (!listener->region_nop) {
+            continue;
+        }
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection mrs = section_from_flat_range(fr, view);
+
+            listener->region_nop(listener, &mrs);
+        }
     }
 }
 
-static void address_space_set_flatview(AddressSpace *as)
+/* Returns whether the view of @as changed. */
+static bool address_space_set_flatview(AddressSpace *as)
 {
     FlatView *old_view = address_space_to_flatview(as);
     MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
@@ -995,7 +1266,8 @@ static void address_space_set_flatview(AddressSpace *as)
     assert(new_view);
 
     if (old_view == new_view) {
-        return;
+        address_space_replay_nop(as, new_view);
+        return false;
     }
 
     if (old_view) {
@@ -1029,6 +1301,7 @@ static void address_space_set_flatview(AddressSpace *as)
     if (old_view) {
         flatview_unref(old_view);
     }
+    return true;
 }
 
 static void address_space_update_topology(AddressSpace *as)
@@ -1063,10 +1336,12 @@ void memory_region_transaction_commit(void)
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (address_space_set_flatview(as) ||
+                    ioeventfd_update_pending) {
+                    address_space_update_ioeventfds(as);
+                }
             }
-            memory_region_update_pending = false;
+            memory_region_update_done();
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
         } else if (ioeventfd_update_pending) {
@@ -1415,12 +1690,22 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
     unsigned size = memop_size(op);
     MemTxResult r;
 
+    if (unlikely(!QTAILQ_EMPTY(&mr->coalesced))) {
+        mr->coalesced_accesses++;
+    }
+
     if (!memory_region_access_valid(mr, addr, size, false, attrs)) {
         *pval = unassigned_mem_read(mr, addr, size);
         return MEMTX_DECODE_ERROR;
     }
 
+    if (mr->lock) {
+        qemu_mutex_lock(mr->lock);
+    }
     r = memory_region_dispatch_read1(mr, addr, pval, size, attrs);
+    if (mr->lock) {
+        qemu_mutex_unlock(mr->lock);
+    }
     adjust_endianness(mr, pval, op);
     return r;
 }
@@ -1458,6 +1743,11 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          MemTxAttrs attrs)
 {
     unsigned size = memop_size(op);
+    MemTxResult r;
+
+    if (unlikely(!QTAILQ_EMPTY(&mr->coalesced))) {
+        mr->coalesced_accesses++;
+    }
 
     if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
         unassigned_mem_write(mr, addr, data, size);
@@ -1471,20 +1761,26 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
+    if (mr->lock) {
+        qemu_mutex_lock(mr->lock);
+    }
     if (mr->ops->write) {
-        return access_with_adjusted_size(addr, &data, size,
-                                         mr->ops->impl.min_access_size,
-                                         mr->ops->impl.max_access_size,
-                                         memory_region_write_accessor, mr,
-                                         attrs);
+        r = access_with_adjusted_size(addr, &data, size,
+                                      mr->ops->impl.min_access_size,
+                                      mr->ops->impl.max_access_size,
+                                      memory_region_write_accessor, mr,
+                                      attrs);
     } else {
-        return
-            access_with_adjusted_size(addr, &data, size,
+        r = access_with_adjusted_size(addr, &data, size,
                                       mr->ops->impl.min_access_size,
                                       mr->ops->impl.max_access_size,
                                       memory_region_write_with_attrs_accessor,
                                       mr, attrs);
     }
+    if (mr->lock) {
+        qemu_mutex_unlock(mr->lock);
+    }
+    return r;
 }
 
 void memory_region_init_io(MemoryRegion *mr,
@@ -2003,7 +2299,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2029,6 +2327,11 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      * address space once.
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global) {
+            /* Whatever @mr is, this listener can only sync everything. */
+            listener->log_sync_global(listener);
+            continue;
+        }
         if (!listener->log_sync) {
             continue;
         }
@@ -2121,7 +2424,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_region(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2131,7 +2436,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_region(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2141,7 +2448,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_region(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2292,11 +2601,22 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_coalescing_async(MemoryRegion *mr)
+{
+    mr->coalesced_async = true;
+}
+
 void memory_region_clear_global_locking(MemoryRegion *mr)
 {
     mr->global_locking = false;
 }
 
+void memory_region_set_lock(MemoryRegion *mr, QemuMutex *lock)
+{
+    mr->lock = lock;
+    mr->global_locking = false;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2392,7 +2712,10 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, int128_make64(subregion->addr),
+                                   subregion->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2431,7 +2754,10 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_range(mr, int128_make64(subregion->addr),
+                                   subregion->size);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2442,7 +2768,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_region(mr);
     memory_region_transaction_commit();
 }
 
@@ -2457,8 +2783,8 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_update_range(mr, int128_zero(), int128_max(s, mr->size));
     mr->size = s;
-    memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
 
@@ -2480,8 +2806,15 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        memory_region_transaction_begin();
+        /* The re-add below only sees the new address; drop the old one */
+        if (mr->container) {
+            memory_region_update_range(mr->container,
+                                       int128_make64(mr->addr), mr->size);
+        }
         mr->addr = addr;
         memory_region_readd_subregion(mr);
+        memory_region_transaction_commit();
     }
 }
 
@@ -2495,7 +2828,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_region(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2622,7 +2957,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_everything();
     memory_region_transaction_commit();
 }
 
@@ -2632,7 +2967,7 @@ static void memory_global_dirty_log_do_stop(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_everything();
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2880,10 +3215,26 @@ static void mtree_print_mr_owner(const MemoryRegion *mr)
     }
 }
 
+static void mtree_print_mr_locking(const MemoryRegion *mr)
+{
+    if (mr->lock) {
+        qemu_printf(" [device lock]");
+    } else if (!mr->global_locking) {
+        qemu_printf(" [no BQL]");
+    }
+    if (mr->bql_acquisitions) {
+        qemu_printf(" [BQL: %" PRIu64 " accesses, avg wait %" PRIu64
+                    " ns, avg hold %" PRIu64 " ns]",
+                    mr->bql_acquisitions,
+                    mr->bql_wait_ns / mr->bql_acquisitions,
+                    mr->bql_hold_ns / mr->bql_acquisitions);
+    }
+}
+
 static void mtree_print_mr(const MemoryRegion *mr, unsigned int level,
                            hwaddr base,
                            MemoryRegionListHead *alias_print_queue,
-                           bool owner)
+                           bool owner, bool locking)
 {
     MemoryRegionList *new_ml, *ml, *next_ml;
     MemoryRegionListHead submr_print_queue;
@@ -2954,6 +3305,15 @@ static void mtree_print_mr(const MemoryRegion *mr, unsigned int level,
         if (owner) {
             mtree_print_mr_owner(mr);
         }
+        if (!QTAILQ_EMPTY(&mr->coalesced)) {
+            qemu_printf(" [coalesced%s: %" PRIu64 " from ring, %" PRIu64
+                        " other]", mr->coalesced_async ? " async" : "",
+                        mr->coalesced_ring_accesses,
+                        mr->coalesced_accesses - mr->coalesced_ring_accesses);
+        }
+        if (locking) {
+            mtree_print_mr_locking(mr);
+        }
     }
     qemu_printf("\n");
 
@@ -2978,7 +3338,7 @@ static void mtree_print_mr(const MemoryRegion *mr, unsigned int level,
 
     QTAILQ_FOREACH(ml, &submr_print_queue, mrqueue) {
         mtree_print_mr(ml->mr, level + 1, cur_start,
-                       alias_print_queue, owner);
+                       alias_print_queue, owner, locking);
     }
 
     QTAILQ_FOREACH_SAFE(ml, &submr_print_queue, mrqueue, next_ml) {
@@ -3089,7 +3449,7 @@ static gboolean mtree_info_flatview_free(gpointer key, gpointer value,
     return true;
 }
 
-void mtree_info(bool flatview, bool dispatch_tree, bool owner)
+void mtree_info(bool flatview, bool dispatch_tree, bool owner, bool locking)
 {
     MemoryRegionListHead ml_head;
     MemoryRegionList *ml, *ml2;
@@ -3137,14 +3497,14 @@ void mtree_info(bool flatview, bool dispatch_tree, bool owner)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         qemu_printf("address-space: %s\n", as->name);
-        mtree_print_mr(as->root, 1, 0, &ml_head, owner);
+        mtree_print_mr(as->root, 1, 0, &ml_head, owner, locking);
         qemu_printf("\n");
     }
 
     /* print aliased regions */
     QTAILQ_FOREACH(ml, &ml_head, mrqueue) {
         qemu_printf("memory-region: %s\n", memory_region_name(ml->mr));
-        mtree_print_mr(ml->mr, 1, 0, &ml_head, owner);
+        mtree_print_mr(ml->mr, 1, 0, &ml_head, owner, locking);
         qemu_printf("\n");
     }
 
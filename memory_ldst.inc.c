@@ -60,7 +60,7 @@ static inline uint32_t glue(address_space_ldl_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
     return val;
@@ -128,7 +128,7 @@ static inline uint64_t glue(address_space_ldq_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
     return val;
@@ -183,7 +183,7 @@ uint32_t glue(address_space_ldub, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
     return val;
@@ -230,7 +230,7 @@ static inline uint32_t glue(address_space_lduw_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
     return val;
@@ -291,7 +291,7 @@ void glue(address_space_stl_notdirty, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
 }
@@ -335,7 +335,7 @@ static inline void glue(address_space_stl_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
 }
@@ -387,7 +387,7 @@ void glue(address_space_stb, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
 }
@@ -431,7 +431,7 @@ static inline void glue(address_space_stw_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
 }
@@ -495,7 +495,7 @@ static void glue(address_space_stq_internal, SUFFIX)(ARG1_DECL,
         *result = r;
     }
     if (release_lock) {
-        qemu_mutex_unlock_iothread();
+        finish_mmio_access();
     }
     RCU_READ_UNLOCK();
 }
@@ -484,9 +484,16 @@ static void hmp_info_sync_profile(Monitor *mon, const QDict *qdict)
     int64_t max = qdict_get_try_int(qdict, "max", 10);
     bool mean = qdict_get_try_bool(qdict, "mean", false);
     bool coalesce = !qdict_get_try_bool(qdict, "no_coalesce", false);
+    bool hold = qdict_get_try_bool(qdict, "hold", false);
     enum QSPSortBy sort_by;
 
-    sort_by = mean ? QSP_SORT_BY_AVG_WAIT_TIME : QSP_SORT_BY_TOTAL_WAIT_TIME;
+    if (hold) {
+        sort_by = mean ? QSP_SORT_BY_AVG_HOLD_TIME :
+                         QSP_SORT_BY_TOTAL_HOLD_TIME;
+    } else {
+        sort_by = mean ? QSP_SORT_BY_AVG_WAIT_TIME :
+                         QSP_SORT_BY_TOTAL_WAIT_TIME;
+    }
     qsp_report(max, sort_by, coalesce);
 }
 
@@ -1081,8 +1088,9 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
     bool flatview = qdict_get_try_bool(qdict, "flatview", false);
     bool dispatch_tree = qdict_get_try_bool(qdict, "dispatch_tree", false);
     bool owner = qdict_get_try_bool(qdict, "owner", false);
+    bool locking = qdict_get_try_bool(qdict, "locking", false);
 
-    mtree_info(flatview, dispatch_tree, owner);
+    mtree_info(flatview, dispatch_tree, owner, locking);
 }
 
 #ifdef CONFIG_PROFILER
@@ -413,3 +413,30 @@ MemoryInfo *qmp_query_memory_size_summary(Error **errp)
 
     return mem_info;
 }
+
+SyncProfileEntryList *qmp_query_sync_profile(bool has_max, int64_t max,
+                                             bool has_sort,
+                                             SyncProfileSort sort,
+                                             bool has_coalesce, bool coalesce,
+                                             Error **errp)
+{
+    static const enum QSPSortBy sort_by[SYNC_PROFILE_SORT__MAX] = {
+        [SYNC_PROFILE_SORT_WAIT_TOTAL] = QSP_SORT_BY_TOTAL_WAIT_TIME,
+        [SYNC_PROFILE_SORT_WAIT_AVG]   = QSP_SORT_BY_AVG_WAIT_TIME,
+        [SYNC_PROFILE_SORT_HOLD_TOTAL] = QSP_SORT_BY_TOTAL_HOLD_TIME,
+        [SYNC_PROFILE_SORT_HOLD_AVG]   = QSP_SORT_BY_AVG_HOLD_TIME,
+    };
+
+    if (!has_sort) {
+        sort = SYNC_PROFILE_SORT_WAIT_TOTAL;
+    }
+    if (!has_max) {
+        max = 10;
+    } else if (max < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max",
+                   "a non-negative integer");
+        return NULL;
+    }
+
+    return qsp_query(max, sort_by[sort], !has_coalesce || coalesce);
+}
@@ -219,6 +219,13 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    /* Filters run under the BQL, not in the netdev's iothread */
+    if (ncs[0]->aio_context) {
+        error_setg(errp, "netdev '%s' is running in an iothread",
+                   nf->netdev_id);
+        return;
+    }
+
     nf->netdev = ncs[0];
 
     if (nfc->setup) {
@@ -75,6 +75,15 @@ typedef struct NetL2TPV3State {
 
     struct mmsghdr *msgvec;
 
+    /*
+     * these are used for batched xmit while the peer is plugged -
+     * packets are copied and sent with a single sendmmsg
+     */
+
+    struct mmsghdr *tx_msgvec;
+    int tx_count;
+    int tx_sent;
+
     /*
      * peer address
      */
@@ -159,10 +168,15 @@ static void l2tpv3_write_poll(NetL2TPV3State *s, bool enable)
     }
 }
 
+static int l2tpv3_tx_flush(NetL2TPV3State *s);
+
 static void l2tpv3_writable(void *opaque)
 {
     NetL2TPV3State *s = opaque;
     l2tpv3_write_poll(s, false);
+    if (l2tpv3_tx_flush(s) < 0) {
+        return;
+    }
     qemu_flush_queued_packets(&s->nc);
 }
 
@@ -179,32 +193,32 @@ static void l2tpv3_poll(NetClientState *nc, bool enable)
     l2tpv3_read_poll(s, enable);
 }
 
-static void l2tpv3_form_header(NetL2TPV3State *s)
+static void l2tpv3_form_header(NetL2TPV3State *s, uint8_t *header_buf)
 {
     uint32_t *counter;
 
     if (s->udp) {
-        stl_be_p((uint32_t *) s->header_buf, L2TPV3_DATA_PACKET);
+        stl_be_p((uint32_t *) header_buf, L2TPV3_DATA_PACKET);
     }
     stl_be_p(
-            (uint32_t *) (s->header_buf + s->session_offset),
+            (uint32_t *) (header_buf + s->session_offset),
             s->tx_session
         );
     if (s->cookie) {
         if (s->cookie_is_64) {
             stq_be_p(
-                (uint64_t *)(s->header_buf + s->cookie_offset),
+                (uint64_t *)(header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         } else {
             stl_be_p(
-                (uint32_t *) (s->header_buf + s->cookie_offset),
+                (uint32_t *) (header_buf + s->cookie_offset),
                 s->tx_cookie
             );
         }
     }
     if (s->has_counter) {
-        counter = (uint32_t *)(s->header_buf + s->counter_offset);
+        counter = (uint32_t *)(header_buf + s->counter_offset);
         if (s->pin_counter) {
             *counter = 0;
         } else {
@@ -213,6 +227,57 @@ static void l2tpv3_form_header(NetL2TPV3State *s)
     }
 }
 
+/*
+ * Send the packets batched so far.  Returns -EAGAIN if the socket buffer
+ * is full; the rest of the batch is then sent from l2tpv3_writable().
+ */
+static int l2tpv3_tx_flush(NetL2TPV3State *s)
+{
+    int ret;
+
+    while (s->tx_sent < s->tx_count) {
+        do {
+            ret = sendmmsg(s->fd, s->tx_msgvec + s->tx_sent,
+                           s->tx_count - s->tx_sent, 0);
+        } while ((ret == -1) && (errno == EINTR));
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == ENOBUFS) {
+                l2tpv3_write_poll(s, true);
+                return -EAGAIN;
+            }
+            /* drop the offending packet, as the unbatched path does */
+            ret = 1;
+        }
+        s->tx_sent += ret;
+    }
+    s->tx_count = 0;
+    s->tx_sent = 0;
+    return 0;
+}
+
+static ssize_t l2tpv3_tx_batch(NetL2TPV3State *s,
+                               const struct iovec *iov,
+                               int iovcnt)
+{
+    struct mmsghdr *msg;
+    struct iovec *vec;
+
+    if (s->tx_count == MAX_L2TPV3_MSGCNT && l2tpv3_tx_flush(s) < 0) {
+        /* still blocked, have the packet queued */
+        return 0;
+    }
+
+    msg = s->tx_msgvec + s->tx_count++;
+    vec = msg->msg_hdr.msg_iov;
+    l2tpv3_form_header(s, vec[0].iov_base);
+    vec[1].iov_len = iov_to_buf(iov, iovcnt, 0, vec[1].iov_base, BUFFER_SIZE);
+
+    if (s->tx_count == MAX_L2TPV3_MSGCNT || !s->nc.io_plugged) {
+        l2tpv3_tx_flush(s);
+    }
+    return vec[1].iov_len;
+}
+
 static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
                     const struct iovec *iov,
                     int iovcnt)
@@ -222,6 +287,15 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
     struct msghdr message;
     int ret;
 
+    if (nc->io_plugged || s->tx_count) {
+        if (iov_size(iov, iovcnt) <= BUFFER_SIZE) {
+            return l2tpv3_tx_batch(s, iov, iovcnt);
+        }
+        if (l2tpv3_tx_flush(s) < 0) {
+            return 0;
+        }
+    }
+
     if (iovcnt > MAX_L2TPV3_IOVCNT - 1) {
         error_report(
             "iovec too long %d > %d, change l2tpv3.h",
@@ -229,7 +303,7 @@ static ssize_t net_l2tpv3_receive_dgram_iov(NetClientState *nc,
         );
         return -1;
     }
-    l2tpv3_form_header(s);
+    l2tpv3_form_header(s, s->header_buf);
     memcpy(s->vec + 1, iov, iovcnt * sizeof(struct iovec));
     s->vec->iov_base = s->header_buf;
     s->vec->iov_len = s->offset;
@@ -271,7 +345,21 @@ static ssize_t net_l2tpv3_receive_dgram(NetClientState *nc,
     struct msghdr message;
     ssize_t ret = 0;
 
-    l2tpv3_form_header(s);
+    if (nc->io_plugged || s->tx_count) {
+        const struct iovec iov = {
+            .iov_base = (void *) buf,
+            .iov_len = size,
+        };
+
+        if (size <= BUFFER_SIZE) {
+            return l2tpv3_tx_batch(s, &iov, 1);
+        }
+        if (l2tpv3_tx_flush(s) < 0) {
+            return 0;
+        }
+    }
+
+    l2tpv3_form_header(s, s->header_buf);
     vec = s->vec;
     vec->iov_base = s->header_buf;
     vec->iov_len = s->offset;
@@ -351,9 +439,13 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
     bool bad_read;
     int data_size;
     struct mmsghdr *msgvec;
+    NetClientState *peer = s->nc.peer;
 
     /* go into ring mode only if there is a "pending" tail */
     if (s->queue_depth > 0) {
+        if (peer) {
+            qemu_net_io_plug(peer);
+        }
         do {
             msgvec = s->msgvec + s->queue_tail;
             if (msgvec->msg_len > 0) {
@@ -394,6 +486,9 @@ static void net_l2tpv3_process_queue(NetL2TPV3State *s)
                  qemu_can_send_packet(&s->nc) &&
                 ((size > 0) || bad_read)
             );
+        if (peer) {
+            qemu_net_io_unplug(peer);
+        }
     }
 }
 
@@ -510,11 +605,18 @@ static void net_l2tpv3_cleanup(NetClientState *nc)
         close(s->fd);
     }
     destroy_vector(s->msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
+    destroy_vector(s->tx_msgvec, MAX_L2TPV3_MSGCNT, IOVSIZE);
     g_free(s->vec);
     g_free(s->header_buf);
     g_free(s->dgram_dst);
 }
 
+static void l2tpv3_io_unplug(NetClientState *nc)
+{
+    NetL2TPV3State *s = DO_UPCAST(NetL2TPV3State, nc, nc);
+    l2tpv3_tx_flush(s);
+}
+
 static NetClientInfo net_l2tpv3_info = {
     .type = NET_CLIENT_DRIVER_L2TPV3,
     .size = sizeof(NetL2TPV3State),
@@ -522,6 +624,7 @@ static NetClientInfo net_l2tpv3_info = {
     .receive_iov = net_l2tpv3_receive_dgram_iov,
     .poll = l2tpv3_poll,
     .cleanup = net_l2tpv3_cleanup,
+    .io_unplug = l2tpv3_io_unplug,
 };
 
 int net_init_l2tpv3(const Netdev *netdev,
@@ -531,7 +634,7 @@ int net_init_l2tpv3(const Netdev *netdev,
     const NetdevL2TPv3Options *l2tpv3;
     NetL2TPV3State *s;
     NetClientState *nc;
-    int fd = -1, gairet;
+    int fd = -1, gairet, i;
     struct addrinfo hints;
     struct addrinfo *result = NULL;
     char *srcport, *dstport;
@@ -716,6 +819,12 @@ int net_init_l2tpv3(const Netdev *netdev,
     }
 
     s->msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
+    s->tx_msgvec = build_l2tpv3_vector(s, MAX_L2TPV3_MSGCNT);
+    for (i = 0; i < MAX_L2TPV3_MSGCNT; i++) {
+        s->tx_msgvec[i].msg_hdr.msg_name = s->dgram_dst;
+        s->tx_msgvec[i].msg_hdr.msg_namelen = s->dst_size;
+        s->tx_msgvec[i].msg_hdr.msg_iov[0].iov_len = s->offset;
+    }
     s->vec = g_new(struct iovec, MAX_L2TPV3_IOVCNT);
     s->header_buf = g_malloc(s->header_size);
 
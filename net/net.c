@@ -503,6 +503,74 @@ int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 #endif
 }
 
+/*
+ * A backend can only be moved out of the main loop if it supports it, and if
+ * it has no filters attached: filters expect to run under the BQL.
+ */
+bool qemu_net_client_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context && QTAILQ_EMPTY(&nc->filters);
+}
+
+/*
+ * Run the I/O handlers of @nc in @ctx, or in the main loop if @ctx is NULL.
+ * Packets sent by @nc are then delivered to its peer from @ctx, with @ctx
+ * acquired.  Both @nc and its peer (normally a NIC queue) belong to @ctx
+ * from then on; see qemu_net_client_acquire().
+ */
+void qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_net_client_can_set_aio_context(nc));
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+    if (nc->peer) {
+        nc->peer->aio_context = ctx;
+    }
+}
+
+/*
+ * Packets can still be sent from the main loop by a client whose datapath
+ * runs in an AioContext, e.g. self-announcements on a NIC queue handled
+ * by an iothread.  Hold the AioContext across the send so that it is
+ * serialized with the datapath.  Returns the AioContext to release, if any.
+ */
+static AioContext *qemu_net_client_acquire(NetClientState *nc)
+{
+    AioContext *ctx = nc->aio_context;
+
+    if (!ctx || in_aio_context_home_thread(ctx)) {
+        return NULL;
+    }
+    aio_context_acquire(ctx);
+    return ctx;
+}
+
+static void qemu_net_client_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+/*
+ * Tell @nc that a burst of packets is about to be delivered to it.  Until
+ * the matching qemu_net_io_unplug(), @nc may accept packets without
+ * completing them right away, e.g. to submit them with a single system
+ * call or to notify the guest only once.  Calls can be nested.
+ */
+void qemu_net_io_plug(NetClientState *nc)
+{
+    nc->io_plugged++;
+}
+
+void qemu_net_io_unplug(NetClientState *nc)
+{
+    assert(nc->io_plugged > 0);
+    if (--nc->io_plugged == 0 && nc->info->io_unplug) {
+        nc->info->io_unplug(nc);
+    }
+}
+
 int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 {
 #ifdef HOST_WORDS_BIGENDIAN
@@ -596,6 +664,8 @@ void qemu_purge_queued_packets(NetClientState *nc)
 
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_HUBPORT) {
@@ -603,7 +673,10 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+    qemu_net_io_plug(nc);
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    qemu_net_io_unplug(nc);
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -619,10 +692,10 @@ void qemu_flush_queued_packets(NetClientState *nc)
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
-static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
-                                                 unsigned flags,
-                                                 const uint8_t *buf, int size,
-                                                 NetPacketSent *sent_cb)
+static ssize_t qemu_do_send_packet_async(NetClientState *sender,
+                                         unsigned flags,
+                                         const uint8_t *buf, int size,
+                                         NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
@@ -654,6 +727,19 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
 }
 
+static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
+                                                 unsigned flags,
+                                                 const uint8_t *buf, int size,
+                                                 NetPacketSent *sent_cb)
+{
+    AioContext *ctx = qemu_net_client_acquire(sender);
+    ssize_t ret;
+
+    ret = qemu_do_send_packet_async(sender, flags, buf, size, sent_cb);
+    qemu_net_client_release(ctx);
+    return ret;
+}
+
 ssize_t qemu_send_packet_async(NetClientState *sender,
                                const uint8_t *buf, int size,
                                NetPacketSent *sent_cb)
@@ -735,9 +821,9 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_do_sendv_packet_async(NetClientState *sender,
+                                          const struct iovec *iov, int iovcnt,
+                                          NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -771,6 +857,18 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    AioContext *ctx = qemu_net_client_acquire(sender);
+    ssize_t ret;
+
+    ret = qemu_do_sendv_packet_async(sender, iov, iovcnt, sent_cb);
+    qemu_net_client_release(ctx);
+    return ret;
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -952,6 +1050,12 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
+#ifdef CONFIG_LINUX
+        [NET_CLIENT_DRIVER_SHMRING]   = net_init_shmring,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1085,6 +1189,12 @@ static void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
+#ifdef CONFIG_LINUX
+        "shmring",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -0,0 +1,678 @@
+/*
+ * Shared memory ring network backend.
+ *
+ * Connects two QEMU processes on the same host through a pair of
+ * single-producer/single-consumer rings in shared memory.  Each side
+ * allocates the ring it transmits on in a sealed memfd, together with an
+ * eventfd to signal new frames and one to signal free slots, and passes
+ * the three file descriptors to the other side over a UNIX socket
+ * chardev.  Frames are copied into and out of the rings without a
+ * system call; eventfds are only written when the other side asked for
+ * it, and at most once per burst while the sending NIC is plugged.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+
+#include "clients.h"
+#include "chardev/char-fe.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
+#include "qemu/units.h"
+
+#define SHMRING_MAGIC               0x474e5253  /* "SRNG" */
+#define SHMRING_VERSION             1
+
+#define SHMRING_DEFAULT_SLOTS       256
+#define SHMRING_MAX_SLOTS           32768
+#define SHMRING_DEFAULT_SLOT_SIZE   2048
+#define SHMRING_MIN_SLOT_SIZE       64
+#define SHMRING_MAX_SLOT_SIZE       (64 * KiB)
+
+/* Maximum number of frames received per event before yielding. */
+#define SHMRING_BATCH_SIZE          64
+
+/*
+ * Ring header.  Each index and the flag next to it are only written by
+ * one side, and live in separate cache lines.
+ */
+typedef struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+
+    /* Written by the producer. */
+    uint32_t prod QEMU_ALIGNED(64);
+    uint32_t need_space;    /* producer waits for a free slot */
+
+    /* Written by the consumer. */
+    uint32_t cons QEMU_ALIGNED(64);
+    uint32_t need_kick;     /* consumer waits for a new frame */
+} ShmRingHeader;
+
+typedef struct ShmRingSlot {
+    uint32_t len;
+    uint32_t reserved;
+    uint8_t data[];
+} ShmRingSlot;
+
+/* Sent over the chardev together with SHMRING_HELLO_FDS descriptors. */
+typedef struct ShmRingHello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+} ShmRingHello;
+
+enum {
+    SHMRING_FD_MEM,
+    SHMRING_FD_KICK,
+    SHMRING_FD_SPACE,
+    SHMRING_HELLO_FDS,
+};
+
+typedef struct ShmRing {
+    ShmRingHeader *hdr;
+    uint8_t *slots;
+    size_t size;
+    int fd;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t stride;
+    uint32_t idx;           /* private copy of our index in the header */
+    EventNotifier kick;     /* producer -> consumer: frames available */
+    EventNotifier space;    /* consumer -> producer: slots freed */
+} ShmRing;
+
+typedef struct ShmRingState {
+    NetClientState nc;
+    CharBackend chr;
+
+    ShmRing tx;             /* ours, we are the producer */
+    ShmRing rx;             /* the peer's, we are the consumer */
+    bool connected;
+    bool read_poll;
+    bool tx_kick_pending;
+    QEMUBH *rx_bh;
+    uint8_t *rx_buf;        /* private copy of the frame being received */
+
+    ShmRingHello hello;
+    size_t hello_len;
+    int hello_fds[SHMRING_HELLO_FDS];
+    int n_hello_fds;
+} ShmRingState;
+
+static void shmring_send(void *opaque);
+
+static uint32_t shmring_stride(uint32_t slot_size)
+{
+    return QEMU_ALIGN_UP(sizeof(ShmRingSlot) + slot_size, 64);
+}
+
+static size_t shmring_mem_size(uint32_t num_slots, uint32_t slot_size)
+{
+    return sizeof(ShmRingHeader) +
+           (size_t)num_slots * shmring_stride(slot_size);
+}
+
+static ShmRingSlot *shmring_slot(ShmRing *r, uint32_t idx)
+{
+    return (ShmRingSlot *)(r->slots + (idx & (r->num_slots - 1)) * r->stride);
+}
+
+static bool shmring_check_geometry(uint32_t num_slots, uint32_t slot_size,
+                                   Error **errp)
+{
+    if (num_slots < 2 || num_slots > SHMRING_MAX_SLOTS ||
+        !is_power_of_2(num_slots)) {
+        error_setg(errp, "number of slots must be a power of 2 between 2 "
+                   "and %d", SHMRING_MAX_SLOTS);
+        return false;
+    }
+    if (slot_size < SHMRING_MIN_SLOT_SIZE ||
+        slot_size > SHMRING_MAX_SLOT_SIZE) {
+        error_setg(errp, "slot size must be between %d and %d",
+                   SHMRING_MIN_SLOT_SIZE, (int)SHMRING_MAX_SLOT_SIZE);
+        return false;
+    }
+    return true;
+}
+
+static void shmring_ring_init(ShmRing *r, uint32_t num_slots,
+                              uint32_t slot_size)
+{
+    r->num_slots = num_slots;
+    r->slot_size = slot_size;
+    r->stride = shmring_stride(slot_size);
+    r->size = shmring_mem_size(num_slots, slot_size);
+    r->slots = (uint8_t *)r->hdr + sizeof(ShmRingHeader);
+    r->idx = 0;
+}
+
+/* Start the transmit ring over, nobody is consuming it. */
+static void shmring_tx_reset(ShmRingState *s)
+{
+    ShmRingHeader *hdr = s->tx.hdr;
+
+    hdr->magic = SHMRING_MAGIC;
+    hdr->version = SHMRING_VERSION;
+    hdr->num_slots = s->tx.num_slots;
+    hdr->slot_size = s->tx.slot_size;
+    hdr->prod = 0;
+    hdr->need_space = 0;
+    hdr->cons = 0;
+    /* The consumer starts out idle. */
+    hdr->need_kick = 1;
+    smp_wmb();  /* reset before the peer gets to see the ring */
+
+    s->tx.idx = 0;
+    s->tx_kick_pending = false;
+    event_notifier_test_and_clear(&s->tx.space);
+}
+
+static void shmring_update_fd_handler(ShmRingState *s)
+{
+    if (s->connected) {
+        qemu_set_fd_handler(event_notifier_get_fd(&s->rx.kick),
+                            s->read_poll ? shmring_send : NULL, NULL, s);
+    }
+}
+
+static void shmring_read_poll(ShmRingState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        shmring_update_fd_handler(s);
+    }
+}
+
+static void shmring_poll(NetClientState *nc, bool enable)
+{
+    ShmRingState *s = DO_UPCAST(ShmRingState, nc, nc);
+
+    shmring_read_poll(s, enable);
+}
+
+/* Wake the consumer up, if it is waiting for frames. */
+static void shmring_tx_kick(ShmRingState *s)
+{
+    s->tx_kick_pending = false;
+    smp_mb();   /* publish prod before reading need_kick */
+    if (atomic_read(&s->tx.hdr->need_kick)) {
+        event_notifier_set(&s->tx.kick);
+    }
+}
+
+static ssize_t shmring_receive(NetClientState *nc,
+                               const uint8_t *buf, size_t size)
+{
+    ShmRingState *s = DO_UPCAST(ShmRingState, nc, nc);
+    ShmRing *r = &s->tx;
+    ShmRingSlot *slot;
+
+    /* Like an unplugged cable, drop frames while nobody listens. */
+    if (!s->connected || size > r->slot_size) {
+        return size;
+    }
+
+    if (r->idx - atomic_read(&r->hdr->cons) >= r->num_slots) {
+        /* Full.  Ask the consumer to tell us about free slots... */
+        atomic_set(&r->hdr->need_space, 1);
+        smp_mb();   /* set need_space before reading cons */
+        if (r->idx - atomic_read(&r->hdr->cons) >= r->num_slots) {
+            /*
+             * ... and queue the frame until it does.  Make sure it knows
+             * about the frames that are already on the ring.
+             */
+            shmring_tx_kick(s);
+            return 0;
+        }
+        atomic_set(&r->hdr->need_space, 0);
+    }
+
+    slot = shmring_slot(r, r->idx);
+    memcpy(slot->data, buf, size);
+    slot->len = size;
+
+    /* Publish the slot contents before the index. */
+    smp_wmb();
+    atomic_set(&r->hdr->prod, ++r->idx);
+
+    /* While the sender is plugged, wake the consumer once per burst. */
+    if (nc->io_plugged) {
+        s->tx_kick_pending = true;
+    } else {
+        shmring_tx_kick(s);
+    }
+
+    return size;
+}
+
+static void shmring_io_unplug(NetClientState *nc)
+{
+    ShmRingState *s = DO_UPCAST(ShmRingState, nc, nc);
+
+    if (s->tx_kick_pending) {
+        shmring_tx_kick(s);
+    }
+}
+
+/* The consumer freed slots, retry the frames we had to queue. */
+static void shmring_writable(void *opaque)
+{
+    ShmRingState *s = opaque;
+
+    event_notifier_test_and_clear(&s->tx.space);
+    atomic_set(&s->tx.hdr->need_space, 0);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/*
+ * Complete a previous send (backend --> guest) and resume reading from
+ * the ring.
+ */
+static void shmring_send_completed(NetClientState *nc, ssize_t len)
+{
+    ShmRingState *s = DO_UPCAST(ShmRingState, nc, nc);
+
+    shmring_read_poll(s, true);
+    qemu_bh_schedule(s->rx_bh);
+}
+
+static void shmring_detach(ShmRingState *s)
+{
+    ShmRing *r = &s->rx;
+    int i;
+
+    if (s->connected) {
+        qemu_set_fd_handler(event_notifier_get_fd(&r->kick), NULL, NULL,
+                            NULL);
+        qemu_set_fd_handler(event_notifier_get_fd(&s->tx.space), NULL, NULL,
+                            NULL);
+        munmap(r->hdr, r->size);
+        close(r->fd);
+        event_notifier_cleanup(&r->kick);
+        event_notifier_cleanup(&r->space);
+        memset(r, 0, sizeof(*r));
+        g_free(s->rx_buf);
+        s->rx_buf = NULL;
+        s->connected = false;
+    }
+
+    for (i = 0; i < s->n_hello_fds; i++) {
+        close(s->hello_fds[i]);
+    }
+    s->n_hello_fds = 0;
+    s->hello_len = 0;
+}
+
+/* The peer misbehaved, drop the connection. */
+static void shmring_disconnect(ShmRingState *s, const char *reason)
+{
+    error_report("shmring %s: %s, disconnecting", s->nc.name, reason);
+    shmring_detach(s);
+    qemu_chr_fe_disconnect(&s->chr);
+}
+
+static void shmring_send(void *opaque)
+{
+    ShmRingState *s = opaque;
+    ShmRing *r = &s->rx;
+    NetClientState *peer = s->nc.peer;
+    const char *error = NULL;
+    unsigned int n = 0;
+    uint32_t prod, len;
+    ShmRingSlot *slot;
+
+    if (!s->connected) {
+        return;
+    }
+
+    event_notifier_test_and_clear(&r->kick);
+    atomic_set(&r->hdr->need_kick, 0);
+
+    /* Let the peer collect the whole batch before it notifies the guest. */
+    if (peer) {
+        qemu_net_io_plug(peer);
+    }
+    while (n < SHMRING_BATCH_SIZE) {
+        prod = atomic_read(&r->hdr->prod);
+        if (prod == r->idx) {
+            /* Empty.  Ask the producer for a kick, then check again. */
+            atomic_set(&r->hdr->need_kick, 1);
+            smp_mb();   /* set need_kick before reading prod */
+            if (atomic_read(&r->hdr->prod) == r->idx) {
+                break;
+            }
+            atomic_set(&r->hdr->need_kick, 0);
+            continue;
+        }
+        if (prod - r->idx > r->num_slots) {
+            error = "invalid producer index";
+            break;
+        }
+
+        /* Read the index before the slot contents. */
+        smp_rmb();
+        slot = shmring_slot(r, r->idx);
+        len = atomic_read(&slot->len);
+        if (len > r->slot_size) {
+            error = "invalid frame length";
+            break;
+        }
+
+        /*
+         * The peer can still write to the slot, so it must not be read
+         * again from the ring once its length has been checked.
+         */
+        memcpy(s->rx_buf, slot->data, len);
+        r->idx++;
+        n++;
+        if (!qemu_send_packet_async(&s->nc, s->rx_buf, len,
+                                    shmring_send_completed)) {
+            /*
+             * The peer does not receive anymore.  The frame was copied to
+             * its queue, stop reading until shmring_send_completed().
+             */
+            shmring_read_poll(s, false);
+            break;
+        }
+    }
+    if (peer) {
+        qemu_net_io_unplug(peer);
+    }
+
+    if (error) {
+        shmring_disconnect(s, error);
+        return;
+    }
+
+    smp_mb();   /* finish reading the slots before handing them back */
+    atomic_set(&r->hdr->cons, r->idx);
+    smp_mb();   /* publish cons before reading need_space */
+    if (atomic_read(&r->hdr->need_space)) {
+        event_notifier_set(&r->space);
+    }
+
+    /* Yield to other event sources, but come back for the rest. */
+    if (n == SHMRING_BATCH_SIZE && s->read_poll) {
+        qemu_bh_schedule(s->rx_bh);
+    }
+}
+
+/* Map the peer's transmit ring described by the hello message. */
+static int shmring_attach(ShmRingState *s, Error **errp)
+{
+    ShmRingHello *hello = &s->hello;
+    ShmRing *r = &s->rx;
+    struct stat st;
+    size_t size;
+    void *ptr;
+    int seals;
+
+    if (hello->magic != SHMRING_MAGIC || hello->version != SHMRING_VERSION) {
+        error_setg(errp, "peer is not a compatible shmring netdev");
+        return -1;
+    }
+    if (s->n_hello_fds != SHMRING_HELLO_FDS) {
+        error_setg(errp, "peer sent %d file descriptors, expected %d",
+                   s->n_hello_fds, SHMRING_HELLO_FDS);
+        return -1;
+    }
+    if (!shmring_check_geometry(hello->num_slots, hello->slot_size, errp)) {
+        error_prepend(errp, "peer ring: ");
+        return -1;
+    }
+
+    /* The peer must not be able to make our accesses fault. */
+    size = shmring_mem_size(hello->num_slots, hello->slot_size);
+    seals = fcntl(s->hello_fds[SHMRING_FD_MEM], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        error_setg(errp, "peer ring memory is not sealed against shrinking");
+        return -1;
+    }
+    if (fstat(s->hello_fds[SHMRING_FD_MEM], &st) < 0 || st.st_size < size) {
+        error_setg(errp, "peer ring memory is too small");
+        return -1;
+    }
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               s->hello_fds[SHMRING_FD_MEM], 0);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map peer ring");
+        return -1;
+    }
+
+    r->hdr = ptr;
+    r->fd = s->hello_fds[SHMRING_FD_MEM];
+    shmring_ring_init(r, hello->num_slots, hello->slot_size);
+    r->idx = atomic_read(&r->hdr->cons);
+    event_notifier_init_fd(&r->kick, s->hello_fds[SHMRING_FD_KICK]);
+    event_notifier_init_fd(&r->space, s->hello_fds[SHMRING_FD_SPACE]);
+    s->rx_buf = g_malloc(hello->slot_size);
+    s->n_hello_fds = 0;
+    s->connected = true;
+
+    qemu_set_fd_handler(event_notifier_get_fd(&s->tx.space),
+                        shmring_writable, NULL, s);
+    shmring_update_fd_handler(s);
+
+    /* Pick up frames sent before we were listening. */
+    qemu_bh_schedule(s->rx_bh);
+    qemu_flush_queued_packets(&s->nc);
+    return 0;
+}
+
+static int shmring_chr_can_read(void *opaque)
+{
+    ShmRingState *s = opaque;
+
+    /* Anything after the hello message is ignored. */
+    return s->connected ? sizeof(ShmRingHello) :
+                          sizeof(ShmRingHello) - s->hello_len;
+}
+
+static void shmring_chr_read(void *opaque, const uint8_t *buf, int size)
+{
+    ShmRingState *s = opaque;
+    Error *err = NULL;
+    int fds[SHMRING_HELLO_FDS];
+    int i, n;
+
+    n = qemu_chr_fe_get_msgfds(&s->chr, fds, ARRAY_SIZE(fds));
+    if (n > 0) {
+        for (i = 0; i < s->n_hello_fds; i++) {
+            close(s->hello_fds[i]);
+        }
+        memcpy(s->hello_fds, fds, n * sizeof(int));
+        s->n_hello_fds = n;
+    }
+
+    if (s->connected) {
+        return;
+    }
+
+    memcpy((uint8_t *)&s->hello + s->hello_len, buf, size);
+    s->hello_len += size;
+    if (s->hello_len < sizeof(ShmRingHello)) {
+        return;
+    }
+
+    if (shmring_attach(s, &err) < 0) {
+        error_prepend(&err, "shmring %s: ", s->nc.name);
+        error_report_err(err);
+        shmring_detach(s);
+        qemu_chr_fe_disconnect(&s->chr);
+    }
+}
+
+static void shmring_chr_event(void *opaque, QEMUChrEvent event)
+{
+    ShmRingState *s = opaque;
+    ShmRingHello hello = {
+        .magic = SHMRING_MAGIC,
+        .version = SHMRING_VERSION,
+        .num_slots = s->tx.num_slots,
+        .slot_size = s->tx.slot_size,
+    };
+    int fds[SHMRING_HELLO_FDS] = {
+        [SHMRING_FD_MEM] = s->tx.fd,
+        [SHMRING_FD_KICK] = event_notifier_get_fd(&s->tx.kick),
+        [SHMRING_FD_SPACE] = event_notifier_get_fd(&s->tx.space),
+    };
+
+    switch (event) {
+    case CHR_EVENT_OPENED:
+        shmring_detach(s);
+        shmring_tx_reset(s);
+        if (qemu_chr_fe_set_msgfds(&s->chr, fds, ARRAY_SIZE(fds)) < 0 ||
+            qemu_chr_fe_write_all(&s->chr, (const uint8_t *)&hello,
+                                  sizeof(hello)) != sizeof(hello)) {
+            error_report("shmring %s: failed to send ring to peer",
+                         s->nc.name);
+            qemu_chr_fe_disconnect(&s->chr);
+        }
+        break;
+    case CHR_EVENT_CLOSED:
+        shmring_detach(s);
+        break;
+    case CHR_EVENT_BREAK:
+    case CHR_EVENT_MUX_IN:
+    case CHR_EVENT_MUX_OUT:
+        /* Ignore */
+        break;
+    }
+}
+
+static void shmring_cleanup(NetClientState *nc)
+{
+    ShmRingState *s = DO_UPCAST(ShmRingState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+    qemu_chr_fe_deinit(&s->chr, false);
+    shmring_detach(s);
+    if (s->rx_bh) {
+        qemu_bh_delete(s->rx_bh);
+    }
+
+    if (s->tx.hdr) {
+        event_notifier_cleanup(&s->tx.kick);
+        event_notifier_cleanup(&s->tx.space);
+        qemu_memfd_free(s->tx.hdr, s->tx.size, s->tx.fd);
+    }
+}
+
+static NetClientInfo net_shmring_info = {
+    .type = NET_CLIENT_DRIVER_SHMRING,
+    .size = sizeof(ShmRingState),
+    .receive = shmring_receive,
+    .poll = shmring_poll,
+    .io_unplug = shmring_io_unplug,
+    .cleanup = shmring_cleanup,
+};
+
+static int shmring_tx_create(ShmRingState *s, uint32_t num_slots,
+                             uint32_t slot_size, Error **errp)
+{
+    ShmRing *r = &s->tx;
+    size_t size = shmring_mem_size(num_slots, slot_size);
+    void *ptr;
+
+    r->fd = qemu_memfd_create("qemu-shmring", size, false, 0,
+                              F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                              errp);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map ring");
+        close(r->fd);
+        return -1;
+    }
+    r->hdr = ptr;
+    shmring_ring_init(r, num_slots, slot_size);
+
+    if (event_notifier_init(&r->kick, 0) < 0) {
+        error_setg_errno(errp, errno, "failed to create eventfd");
+        goto err_mem;
+    }
+    if (event_notifier_init(&r->space, 0) < 0) {
+        error_setg_errno(errp, errno, "failed to create eventfd");
+        goto err_kick;
+    }
+
+    shmring_tx_reset(s);
+    return 0;
+
+err_kick:
+    event_notifier_cleanup(&r->kick);
+err_mem:
+    qemu_memfd_free(r->hdr, r->size, r->fd);
+    r->hdr = NULL;
+    return -1;
+}
+
+int net_init_shmring(const Netdev *netdev, const char *name,
+                     NetClientState *peer, Error **errp)
+{
+    const NetdevShmRingOptions *opts;
+    NetClientState *nc;
+    ShmRingState *s;
+    uint32_t num_slots, slot_size;
+    Chardev *chr;
+
+    assert(netdev->type == NET_CLIENT_DRIVER_SHMRING);
+    opts = &netdev->u.shmring;
+
+    chr = qemu_chr_find(opts->chardev);
+    if (!chr) {
+        error_setg(errp, "chardev \"%s\" not found", opts->chardev);
+        return -1;
+    }
+    if (!qemu_chr_has_feature(chr, QEMU_CHAR_FEATURE_FD_PASS)) {
+        error_setg(errp, "chardev \"%s\" does not support FD passing",
+                   opts->chardev);
+        return -1;
+    }
+
+    num_slots = opts->has_slots ? opts->slots : SHMRING_DEFAULT_SLOTS;
+    slot_size = opts->has_slot_size ? opts->slot_size :
+                                      SHMRING_DEFAULT_SLOT_SIZE;
+    if (!shmring_check_geometry(num_slots, slot_size, errp)) {
+        return -1;
+    }
+
+    nc = qemu_new_net_client(&net_shmring_info, peer, "shmring", name);
+    s = DO_UPCAST(ShmRingState, nc, nc);
+    snprintf(nc->info_str, sizeof(nc->info_str),
+             "shmring: chardev=%s,slots=%u,slot-size=%u",
+             opts->chardev, num_slots, slot_size);
+
+    if (shmring_tx_create(s, num_slots, slot_size, errp) < 0) {
+        goto err;
+    }
+    s->rx_bh = qemu_bh_new(shmring_send, s);
+    s->read_poll = true;
+
+    if (!qemu_chr_fe_init(&s->chr, chr, errp)) {
+        goto err;
+    }
+    qemu_chr_fe_set_handlers(&s->chr, shmring_chr_can_read, shmring_chr_read,
+                             shmring_chr_event, NULL, s, NULL, true);
+    return 0;
+
+err:
+    qemu_del_net_client(nc);
+    return -1;
+}
@@ -41,6 +41,8 @@
 #include "chardev/char-fe.h"
 #include "sysemu/sysemu.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
 #include "util.h"
@@ -77,14 +79,34 @@ struct slirp_config_str {
     char str[1024];
 };
 
+typedef struct SlirpState SlirpState;
+
 struct GuestFwd {
     CharBackend hd;
     struct in_addr server;
     int port;
     Slirp *slirp;
+    SlirpState *s;
 };
 
-typedef struct SlirpState {
+/* A timer of the stack, recreated when it moves to another AioContext */
+typedef struct SlirpTimer {
+    SlirpState *s;
+    QEMUTimer *timer;
+    SlirpTimerCb cb;
+    void *cb_opaque;
+    QLIST_ENTRY(SlirpTimer) next;
+} SlirpTimer;
+
+/* A host socket watched in an AioContext */
+typedef struct SlirpAioFd {
+    SlirpState *s;
+    int fd;
+    int events;             /* G_IO_* conditions the stack waits for */
+    int revents;            /* conditions seen since the last poll */
+} SlirpAioFd;
+
+struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
     Slirp *slirp;
@@ -94,7 +116,15 @@ typedef struct SlirpState {
     gchar *smb_dir;
 #endif
     GSList *fwd;
-} SlirpState;
+    QLIST_HEAD(, SlirpTimer) timers;
+    bool peer_plugged;
+
+    AioContext *ctx;        /* NULL when running in the main loop */
+    GArray *pollfds;
+    GHashTable *aio_fds;    /* fd -> SlirpAioFd */
+    QEMUBH *poll_bh;
+    QEMUTimer *poll_timer;
+};
 
 static struct slirp_config_str *slirp_configs;
 static QTAILQ_HEAD(, SlirpState) slirp_stacks =
@@ -119,15 +149,57 @@ static ssize_t net_slirp_send_packet(const void *pkt, size_t pkt_len,
     return qemu_send_packet(&s->nc, pkt, pkt_len);
 }
 
+/*
+ * In an AioContext, the stack is used from the context's thread with the
+ * context held.  Callers from the main loop serialize with it here.
+ */
+static void net_slirp_lock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+    }
+}
+
+static void net_slirp_unlock(SlirpState *s)
+{
+    if (s->ctx) {
+        aio_context_release(s->ctx);
+    }
+}
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
+    /*
+     * While the NIC hands us a burst, let it collect the frames the stack
+     * answers with (ACKs, mostly) and deliver them as a burst too.
+     */
+    if (nc->io_plugged && nc->peer && !s->peer_plugged) {
+        qemu_net_io_plug(nc->peer);
+        s->peer_plugged = true;
+    }
+
     slirp_input(s->slirp, buf, size);
 
+    /* The frame may have opened a socket or queued data for one. */
+    if (s->ctx) {
+        qemu_bh_schedule(s->poll_bh);
+    }
+
     return size;
 }
 
+static void net_slirp_io_unplug(NetClientState *nc)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    if (s->peer_plugged) {
+        s->peer_plugged = false;
+        qemu_net_io_unplug(nc->peer);
+    }
+}
+
 static void slirp_smb_exit(Notifier *n, void *data)
 {
     SlirpState *s = container_of(n, SlirpState, exit_notifier);
@@ -142,13 +214,20 @@ static void slirp_free_fwd(gpointer data)
     g_free(data);
 }
 
+static void net_slirp_aio_detach(SlirpState *s);
+
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
     g_slist_free_full(s->fwd, slirp_free_fwd);
-    main_loop_poll_remove_notifier(&s->poll_notifier);
-    unregister_savevm(NULL, "slirp", s->slirp);
+    if (s->ctx) {
+        net_slirp_aio_detach(s);
+        s->ctx = NULL;
+    } else {
+        main_loop_poll_remove_notifier(&s->poll_notifier);
+    }
+    unregister_savevm(NULL, "slirp", s);
     slirp_cleanup(s->slirp);
     if (s->exit_notifier.notify) {
         qemu_remove_exit_notifier(&s->exit_notifier);
@@ -157,13 +236,6 @@ static void net_slirp_cleanup(NetClientState *nc)
     QTAILQ_REMOVE(&slirp_stacks, s, entry);
 }
 
-static NetClientInfo net_slirp_info = {
-    .type = NET_CLIENT_DRIVER_USER,
-    .size = sizeof(SlirpState),
-    .receive = net_slirp_receive,
-    .cleanup = net_slirp_cleanup,
-};
-
 static void net_slirp_guest_error(const char *msg, void *opaque)
 {
     qemu_log_mask(LOG_GUEST_ERROR, "%s", msg);
@@ -174,24 +246,75 @@ static int64_t net_slirp_clock_get_ns(void *opaque)
     return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 }
 
+static void net_slirp_timer_cb(void *opaque)
+{
+    SlirpTimer *t = opaque;
+
+    net_slirp_lock(t->s);
+    t->cb(t->cb_opaque);
+    net_slirp_unlock(t->s);
+}
+
+static void net_slirp_timer_init(SlirpTimer *t)
+{
+    if (t->s->ctx) {
+        t->timer = aio_timer_new_with_attrs(t->s->ctx, QEMU_CLOCK_VIRTUAL,
+                                            SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                            net_slirp_timer_cb, t);
+    } else {
+        t->timer = timer_new_full(NULL, QEMU_CLOCK_VIRTUAL,
+                                  SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                                  net_slirp_timer_cb, t);
+    }
+}
+
+/* Move the timers of the stack to its current context. */
+static void net_slirp_timers_attach(SlirpState *s)
+{
+    SlirpTimer *t;
+
+    QLIST_FOREACH(t, &s->timers, next) {
+        bool pending = timer_pending(t->timer);
+        int64_t expire = timer_expire_time_ns(t->timer);
+
+        timer_del(t->timer);
+        timer_free(t->timer);
+        net_slirp_timer_init(t);
+        if (pending) {
+            timer_mod_ns(t->timer, expire);
+        }
+    }
+}
+
 static void *net_slirp_timer_new(SlirpTimerCb cb,
                                  void *cb_opaque, void *opaque)
 {
-    return timer_new_full(NULL, QEMU_CLOCK_VIRTUAL,
-                          SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
-                          cb, cb_opaque);
+    SlirpTimer *t = g_new0(SlirpTimer, 1);
+
+    t->s = opaque;
+    t->cb = cb;
+    t->cb_opaque = cb_opaque;
+    net_slirp_timer_init(t);
+    QLIST_INSERT_HEAD(&t->s->timers, t, next);
+    return t;
 }
 
 static void net_slirp_timer_free(void *timer, void *opaque)
 {
-    timer_del(timer);
-    timer_free(timer);
+    SlirpTimer *t = timer;
+
+    QLIST_REMOVE(t, next);
+    timer_del(t->timer);
+    timer_free(t->timer);
+    g_free(t);
 }
 
 static void net_slirp_timer_mod(void *timer, int64_t expire_timer,
                                 void *opaque)
 {
-    timer_mod(timer, expire_timer);
+    SlirpTimer *t = timer;
+
+    timer_mod(t->timer, expire_timer);
 }
 
 static void net_slirp_register_poll_fd(int fd, void *opaque)
@@ -206,7 +329,13 @@ static void net_slirp_unregister_poll_fd(int fd, void *opaque)
 
 static void net_slirp_notify(void *opaque)
 {
-    qemu_notify_event();
+    SlirpState *s = opaque;
+
+    if (s->ctx) {
+        qemu_bh_schedule(s->poll_bh);
+    } else {
+        qemu_notify_event();
+    }
 }
 
 static const SlirpCb slirp_cb = {
@@ -286,6 +415,24 @@ static int net_slirp_get_revents(int idx, void *opaque)
     return slirp_gio_to_poll(g_array_index(pollfds, GPollFD, idx).revents);
 }
 
+/*
+ * Serve all ready host sockets in one go; the frames they produce for the
+ * guest are delivered as one burst.
+ */
+static void net_slirp_pollfds_poll(SlirpState *s, bool select_error,
+                                   GArray *pollfds)
+{
+    NetClientState *peer = s->nc.peer;
+
+    if (peer) {
+        qemu_net_io_plug(peer);
+    }
+    slirp_pollfds_poll(s->slirp, select_error, net_slirp_get_revents, pollfds);
+    if (peer) {
+        qemu_net_io_unplug(peer);
+    }
+}
+
 static void net_slirp_poll_notify(Notifier *notifier, void *data)
 {
     MainLoopPoll *poll = data;
@@ -298,14 +445,194 @@ static void net_slirp_poll_notify(Notifier *notifier, void *data)
         break;
     case MAIN_LOOP_POLL_OK:
     case MAIN_LOOP_POLL_ERR:
-        slirp_pollfds_poll(s->slirp, poll->state == MAIN_LOOP_POLL_ERR,
-                           net_slirp_get_revents, poll->pollfds);
+        net_slirp_pollfds_poll(s, poll->state == MAIN_LOOP_POLL_ERR,
+                               poll->pollfds);
         break;
     default:
         g_assert_not_reached();
     }
 }
 
+/*
+ * Outside of the main loop there is no poll notifier.  The sockets the
+ * stack asks for are registered as fd handlers of the AioContext instead,
+ * refreshed after every round; a handler records which conditions are
+ * met and schedules a bottom half, which then serves all sockets that
+ * became ready in the same iteration with a single slirp_pollfds_poll().
+ */
+static void net_slirp_aio_ready(SlirpAioFd *f)
+{
+    GPollFD pfd = {
+        .fd = f->fd,
+        .events = f->events,
+    };
+
+    /* aio handlers only tell readable from writable, ask for the rest. */
+    if (g_poll(&pfd, 1, 0) > 0) {
+        f->revents |= pfd.revents;
+        qemu_bh_schedule(f->s->poll_bh);
+    }
+}
+
+static void net_slirp_aio_read(void *opaque)
+{
+    net_slirp_aio_ready(opaque);
+}
+
+static void net_slirp_aio_write(void *opaque)
+{
+    net_slirp_aio_ready(opaque);
+}
+
+static void net_slirp_aio_set_handler(SlirpState *s, SlirpAioFd *f)
+{
+    aio_set_fd_handler(s->ctx, f->fd, true,
+                       f->events & ~G_IO_OUT ? net_slirp_aio_read : NULL,
+                       f->events & G_IO_OUT ? net_slirp_aio_write : NULL,
+                       NULL, f);
+}
+
+/* Ask the stack which sockets to watch and update the fd handlers. */
+static void net_slirp_aio_fill(SlirpState *s)
+{
+    uint32_t timeout = UINT32_MAX;
+    GHashTableIter iter;
+    gpointer value;
+    SlirpAioFd *f;
+    GPollFD *pfd;
+    guint i;
+
+    g_array_set_size(s->pollfds, 0);
+    slirp_pollfds_fill(s->slirp, &timeout, net_slirp_add_poll, s->pollfds);
+
+    g_hash_table_iter_init(&iter, s->aio_fds);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = value;
+        f->revents = 0;
+    }
+
+    /* Use revents to collect the conditions per fd. */
+    for (i = 0; i < s->pollfds->len; i++) {
+        pfd = &g_array_index(s->pollfds, GPollFD, i);
+        f = g_hash_table_lookup(s->aio_fds, GINT_TO_POINTER(pfd->fd));
+        if (!f) {
+            f = g_new0(SlirpAioFd, 1);
+            f->s = s;
+            f->fd = pfd->fd;
+            g_hash_table_insert(s->aio_fds, GINT_TO_POINTER(f->fd), f);
+        }
+        f->revents |= pfd->events;
+    }
+
+    g_hash_table_iter_init(&iter, s->aio_fds);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = value;
+        if (!f->revents) {
+            aio_set_fd_handler(s->ctx, f->fd, true, NULL, NULL, NULL, NULL);
+            g_hash_table_iter_remove(&iter);
+            continue;
+        }
+        if (f->events != f->revents) {
+            f->events = f->revents;
+            net_slirp_aio_set_handler(s, f);
+        }
+        f->revents = 0;
+    }
+
+    if (timeout != UINT32_MAX) {
+        timer_mod(s->poll_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + timeout);
+    } else {
+        timer_del(s->poll_timer);
+    }
+}
+
+static void net_slirp_aio_poll(void *opaque)
+{
+    SlirpState *s = opaque;
+    SlirpAioFd *f;
+    GPollFD *pfd;
+    guint i;
+
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->pollfds->len; i++) {
+        pfd = &g_array_index(s->pollfds, GPollFD, i);
+        f = g_hash_table_lookup(s->aio_fds, GINT_TO_POINTER(pfd->fd));
+        pfd->revents = f ? f->revents & pfd->events : 0;
+    }
+    net_slirp_pollfds_poll(s, false, s->pollfds);
+    net_slirp_aio_fill(s);
+    aio_context_release(s->ctx);
+}
+
+static void net_slirp_aio_attach(SlirpState *s)
+{
+    aio_context_acquire(s->ctx);
+    s->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    s->aio_fds = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                       NULL, g_free);
+    s->poll_bh = aio_bh_new(s->ctx, net_slirp_aio_poll, s);
+    s->poll_timer = aio_timer_new_with_attrs(s->ctx, QEMU_CLOCK_VIRTUAL,
+                                             SCALE_MS,
+                                             QEMU_TIMER_ATTR_EXTERNAL,
+                                             net_slirp_aio_poll, s);
+    net_slirp_aio_fill(s);
+    aio_context_release(s->ctx);
+}
+
+static void net_slirp_aio_detach(SlirpState *s)
+{
+    GHashTableIter iter;
+    gpointer value;
+    SlirpAioFd *f;
+
+    aio_context_acquire(s->ctx);
+    g_hash_table_iter_init(&iter, s->aio_fds);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = value;
+        aio_set_fd_handler(s->ctx, f->fd, true, NULL, NULL, NULL, NULL);
+    }
+    g_hash_table_destroy(s->aio_fds);
+    s->aio_fds = NULL;
+    g_array_free(s->pollfds, TRUE);
+    s->pollfds = NULL;
+    qemu_bh_delete(s->poll_bh);
+    s->poll_bh = NULL;
+    timer_del(s->poll_timer);
+    timer_free(s->poll_timer);
+    s->poll_timer = NULL;
+    aio_context_release(s->ctx);
+}
+
+static void net_slirp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    if (s->ctx) {
+        net_slirp_aio_detach(s);
+    } else {
+        main_loop_poll_remove_notifier(&s->poll_notifier);
+    }
+
+    s->ctx = ctx;
+    net_slirp_timers_attach(s);
+
+    if (ctx) {
+        net_slirp_aio_attach(s);
+    } else {
+        main_loop_poll_add_notifier(&s->poll_notifier);
+    }
+}
+
+static NetClientInfo net_slirp_info = {
+    .type = NET_CLIENT_DRIVER_USER,
+    .size = sizeof(SlirpState),
+    .receive = net_slirp_receive,
+    .cleanup = net_slirp_cleanup,
+    .io_unplug = net_slirp_io_unplug,
+    .set_aio_context = net_slirp_set_aio_context,
+};
+
 static ssize_t
 net_slirp_stream_read(void *buf, size_t size, void *opaque)
 {
@@ -329,16 +656,22 @@ net_slirp_stream_write(const void *buf, size_t size, void *opaque)
 
 static int net_slirp_state_load(QEMUFile *f, void *opaque, int version_id)
 {
-    Slirp *slirp = opaque;
+    SlirpState *s = opaque;
+    int ret;
 
-    return slirp_state_load(slirp, version_id, net_slirp_stream_read, f);
+    net_slirp_lock(s);
+    ret = slirp_state_load(s->slirp, version_id, net_slirp_stream_read, f);
+    net_slirp_unlock(s);
+    return ret;
 }
 
 static void net_slirp_state_save(QEMUFile *f, void *opaque)
 {
-    Slirp *slirp = opaque;
+    SlirpState *s = opaque;
 
-    slirp_state_save(slirp, net_slirp_stream_write, f);
+    net_slirp_lock(s);
+    slirp_state_save(s->slirp, net_slirp_stream_write, f);
+    net_slirp_unlock(s);
 }
 
 static SaveVMHandlers savevm_slirp_state = {
@@ -558,6 +891,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
              restricted ? "on" : "off");
 
     s = DO_UPCAST(SlirpState, nc, nc);
+    QLIST_INIT(&s->timers);
 
     s->slirp = slirp_init(restricted, ipv4, net, mask, host,
                           ipv6, ip6_prefix, vprefix6_len, ip6_host,
@@ -577,7 +911,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
      */
     g_assert(slirp_state_version() == 4);
     register_savevm_live("slirp", 0, slirp_state_version(),
-                         &savevm_slirp_state, s->slirp);
+                         &savevm_slirp_state, s);
 
     s->poll_notifier.notify = net_slirp_poll_notify;
     main_loop_poll_add_notifier(&s->poll_notifier);
@@ -695,7 +1029,9 @@ void hmp_hostfwd_remove(Monitor *mon, const QDict *qdict)
         goto fail_syntax;
     }
 
+    net_slirp_lock(s);
     err = slirp_remove_hostfwd(s->slirp, is_udp, host_addr, host_port);
+    net_slirp_unlock(s);
 
     monitor_printf(mon, "host forwarding rule for %s %s\n", src_str,
                    err ? "not found" : "removed");
@@ -798,7 +1134,12 @@ void hmp_hostfwd_add(Monitor *mon, const QDict *qdict)
     }
     if (s) {
         Error *err = NULL;
-        if (slirp_hostfwd(s, redir_str, &err) < 0) {
+        int ret;
+
+        net_slirp_lock(s);
+        ret = slirp_hostfwd(s, redir_str, &err);
+        net_slirp_unlock(s);
+        if (ret < 0) {
             error_report_err(err);
         }
     }
@@ -925,13 +1266,21 @@ static int slirp_smb(SlirpState* s, const char *exported_dir,
 static int guestfwd_can_read(void *opaque)
 {
     struct GuestFwd *fwd = opaque;
-    return slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    int ret;
+
+    net_slirp_lock(fwd->s);
+    ret = slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    net_slirp_unlock(fwd->s);
+    return ret;
 }
 
 static void guestfwd_read(void *opaque, const uint8_t *buf, int size)
 {
     struct GuestFwd *fwd = opaque;
+
+    net_slirp_lock(fwd->s);
     slirp_socket_recv(fwd->slirp, fwd->server, fwd->port, buf, size);
+    net_slirp_unlock(fwd->s);
 }
 
 static ssize_t guestfwd_write(const void *buf, size_t len, void *chr)
@@ -1012,6 +1361,7 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str, Error **errp)
         fwd->server = server;
         fwd->port = port;
         fwd->slirp = s->slirp;
+        fwd->s = s;
 
         qemu_chr_fe_set_handlers(&fwd->hd, guestfwd_can_read, guestfwd_read,
                                  NULL, NULL, fwd, NULL, true);
@@ -1031,7 +1381,11 @@ void hmp_info_usernet(Monitor *mon, const QDict *qdict)
     QTAILQ_FOREACH(s, &slirp_stacks, entry) {
         int id;
         bool got_hub_id = net_hub_id_for_client(&s->nc, &id) == 0;
-        char *info = slirp_connection_info(s->slirp);
+        char *info;
+
+        net_slirp_lock(s);
+        info = slirp_connection_info(s->slirp);
+        net_slirp_unlock(s);
         monitor_printf(mon, "Hub %d (%s):\n%s",
                        got_hub_id ? id : -1,
                        s->nc.name, info);
@@ -61,6 +61,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx; /* NULL when running in the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -68,9 +69,20 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+static void tap_aio_send(void *opaque);
+static void tap_aio_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, true,
+                           s->read_poll && s->enabled ?
+                           tap_aio_send : NULL,
+                           s->write_poll && s->enabled ?
+                           tap_aio_writable : NULL,
+                           NULL, s);
+        return;
+    }
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -184,9 +196,13 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    NetClientState *peer = s->nc.peer;
     int size;
     int packets = 0;
 
+    if (peer) {
+        qemu_net_io_plug(peer);
+    }
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -219,6 +235,9 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    if (peer) {
+        qemu_net_io_unplug(peer);
+    }
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -308,6 +327,40 @@ static void tap_exit_notify(Notifier *notifier, void *data)
     }
 }
 
+/* In an AioContext other than the main loop, fd handlers hold the context */
+static void tap_aio_send(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_send(s);
+    aio_context_release(ctx);
+}
+
+static void tap_aio_writable(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    aio_context_acquire(ctx);
+    tap_writable(s);
+    aio_context_release(ctx);
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool enabled = s->enabled;
+
+    /* Remove the handlers from the old context before installing new ones */
+    s->enabled = false;
+    tap_update_fd_handler(s);
+    s->ctx = ctx;
+    s->enabled = enabled;
+    tap_update_fd_handler(s);
+}
+
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -361,6 +414,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -118,7 +118,10 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (entries of the per-vCPU KVM dirty ring, default=0)\n"
+    "                coalesced-io-thread=on|off (process coalesced MMIO in a separate thread, default=off)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                ebb=on|off (keep TCG globals in registers across conditional branches, default=on)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 STEXI
 @item -accel @var{name}[,prop=@var{value}[,...]]
@@ -138,8 +141,28 @@ surface, at a performance cost for non-MSI interrupts.  Disabling the in-kernel
 irqchip completely is not recommended except for debugging purposes.
 @item kvm-shadow-mem=size
 Defines the size of the KVM shadow MMU.
+@item dirty-ring-size=@var{n}
+When non-zero, KVM reports dirty guest pages through a ring of @var{n}
+entries per vCPU instead of a bitmap per memory slot, so that syncing
+the dirty log costs in proportion to the pages actually dirtied rather
+than to the size of guest memory.  This makes migration of large guests
+cheaper.  @var{n} must be a power of two; a good starting point is 4096.
+The default of 0 uses the bitmap.
+@item coalesced-io-thread=on|off
+When enabled, writes that KVM queues in the coalesced MMIO and PIO ring are
+processed by a separate thread as soon as a vCPU exits, instead of waiting
+for the next access that requires them to be flushed.  Only devices that
+support it are handled this way; currently these are the legacy VGA memory
+windows.  The numbers of coalesced and other accesses are shown for each
+memory region with coalescing by @code{info mtree}.
 @item tb-size=@var{n}
 Controls the size (in MiB) of the TCG translation block cache.
+@item ebb=on|off
+Controls whether the TCG register allocator treats the fall-through path of a
+conditional branch as the continuation of the same block.  When enabled
+(the default), guest registers are only written back to memory at the branch
+and stay in host registers, instead of being reloaded after every branch.
+Disabling it can be useful to compare generated code size and speed.
 @item thread=single|multi
 Controls number of TCG threads. When the TCG is multi-threaded there will be one
 thread per vCPU therefor taking advantage of additional host cores. The default
@@ -2369,6 +2392,26 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "                attach to the existing network interface 'name' with AF_XDP socket\n"
+    "                use 'mode=MODE' to specify an XDP program attach mode\n"
+    "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'inhibit=on|off' to inhibit loading of a default XDP program (default: off)\n"
+    "                with inhibit=on,\n"
+    "                  use 'sock-fds' to provide file descriptors for already open AF_XDP sockets\n"
+    "                  added to a socket map in XDP program.  One socket per queue.\n"
+    "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
+    "                use 'start-queue=m' to specify the first queue that should be used\n"
+#endif
+#ifdef CONFIG_LINUX
+    "-netdev shmring,id=str,chardev=dev[,slots=n][,slot-size=bytes]\n"
+    "                connect to another QEMU process through shared memory rings,\n"
+    "                set up over the unix socket chardev 'dev'\n"
+    "                use 'slots=n' to set the number of frames in the transmit ring (default: 256)\n"
+    "                use 'slot-size=bytes' to set the largest frame that can be sent (default: 2048)\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2389,6 +2432,12 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
+#ifdef CONFIG_LINUX
+    "shmring|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2812,6 +2861,64 @@ vde_switch -F -sock /tmp/myswitch
 @value{qemu_system} linux.img -nic vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{ifname}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,inhibit=on|off][,sock-fds=@var{x}:@var{y}:...:@var{z}]
+Configure AF_XDP backend to connect to a network interface @var{ifname} using
+AF_XDP sockets.  A default XDP program is loaded to the interface and attached
+in @option{mode=native} (driver support required) or @option{mode=skb}; by
+default native mode is tried first.  Use @option{force-copy=on} to disable
+zero-copy even if the driver supports it.
+
+Use @option{queues=@var{n}} to bind @var{n} consecutive hardware queues,
+starting from @option{start-queue=@var{m}}, each to its own AF_XDP socket;
+they map one to one to the queue pairs of a multiqueue virtio-net device.
+Received packets are handed to the guest in batches.  The interface should
+be configured so that traffic is steered only to the selected queues.
+
+With @option{inhibit=on} no XDP program is loaded; an external program must
+redirect traffic to the sockets passed in @option{sock-fds}, which should
+already be inserted into its socket map, one per queue in queue order.  This
+allows running QEMU without CAP_NET_ADMIN and CAP_SYS_ADMIN.
+
+This option is only available if QEMU has been compiled with AF_XDP support.
+
+Example:
+@example
+# set up a veth pair for testing
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up; ip link set veth1 up
+# launch QEMU instance
+@value{qemu_system} linux.img -nic af-xdp,ifname=veth0,mode=skb
+@end example
+
+@item -netdev shmring,chardev=@var{id}[,slots=@var{n}][,slot-size=@var{bytes}]
+Connect to another QEMU process on the same host through a pair of shared
+memory rings.  The chardev @var{id} must be a unix domain socket; when it
+connects, each side passes the other the memory of the ring it transmits on
+and the event file descriptors used for notifications.  Frames are then
+exchanged without going through the host kernel.  Frames sent while no peer
+is connected, and frames larger than @option{slot-size}, are dropped.
+
+Use @option{slots=@var{n}} to size the transmit ring (a power of 2, 256 by
+default) and @option{slot-size=@var{bytes}} to set the largest frame (2048 by
+default); guests using jumbo frames need a larger slot size.  The two sides
+may use different values.
+
+This option is only available on Linux hosts.
+
+Example:
+@example
+# first QEMU instance, waits for the second one
+@value{qemu_system} linux.img \
+        -chardev socket,id=chr0,path=/tmp/shmring0,server,nowait \
+        -netdev shmring,id=net0,chardev=chr0 \
+        -device virtio-net-pci,netdev=net0
+# second QEMU instance
+@value{qemu_system} linux.img \
+        -chardev socket,id=chr0,path=/tmp/shmring0,reconnect=1 \
+        -netdev shmring,id=net0,chardev=chr0 \
+        -device e1000,netdev=net0,mac=52:54:00:12:34:57
+@end example
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -4972,6 +5079,27 @@ The polling parameters can be modified at run-time using the @code{qom-set} comm
 (qemu) qom-set /objects/iothread1 poll-max-ns 100000
 @end example
 
+@item -object vhost-user-blk-server,id=@var{id},node-name=@var{node},unix-socket=@var{path}[,writable=@var{on|off}][,iothread=@var{iothread}][,num-queues=@var{n}]
+
+Export the block node @var{node} as a vhost-user-blk device.  The server
+listens on the UNIX socket @var{path} for a vhost-user master, for example
+another QEMU process with a @code{vhost-user-blk-pci} device, and serves
+one master at a time.  Request data is transferred directly between the
+block layer and the master's memory, without going through the socket.
+
+The node is exported read-only unless @option{writable} is @code{on}.
+Requests are processed in the IOThread @var{iothread}, to which the node is
+moved, or in the main loop if @option{iothread} is not given.
+@option{num-queues} sets the maximum number of virtqueues (default: 1).
+
+@example
+# @var{qemu-system-x86_64} -blockdev file,filename=disk.qcow2,node-name=file0 \
+    -blockdev qcow2,file=file0,node-name=disk0 \
+    -object iothread,id=iothread0 \
+    -object vhost-user-blk-server,id=vub0,node-name=disk0,writable=on,\
+            unix-socket=/tmp/vhost-user-blk.sock,iothread=iothread0
+@end example
+
 @end table
 
 ETEXI
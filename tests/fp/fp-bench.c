@@ -33,6 +33,10 @@ enum op {
     OP_FMA,
     OP_SQRT,
     OP_CMP,
+    OP_MINNUM,
+    OP_MAXNUM,
+    OP_FROM_INT,
+    OP_CVT,
     OP_MAX_NR,
 };
 
@@ -44,6 +48,10 @@ static const char * const op_names[] = {
     [OP_FMA] = "mulAdd",
     [OP_SQRT] = "sqrt",
     [OP_CMP] = "cmp",
+    [OP_MINNUM] = "minNum",
+    [OP_MAXNUM] = "maxNum",
+    [OP_FROM_INT] = "fromInt64",
+    [OP_CVT] = "cvt",
     [OP_MAX_NR] = NULL,
 };
 
@@ -163,12 +171,30 @@ static void update_random_ops(int n_ops, enum precision prec)
     }
 }
 
+/*
+ * fromInt64 converts the raw random bits as an int64, which covers both
+ * the exact and the rounding cases.  cvt converts single precision
+ * inputs to double and double precision ones to single; the latter are
+ * widened from random singles, so that they are in range.
+ */
 static void fill_random(union fp *ops, int n_ops, enum precision prec,
-                        bool no_neg)
+                        enum op op, bool no_neg)
 {
     int i;
 
     for (i = 0; i < n_ops; i++) {
+        if (op == OP_FROM_INT) {
+            ops[i].u64 = random_ops[i];
+            continue;
+        }
+        if (op == OP_CVT && (prec == PREC_DOUBLE || prec == PREC_FLOAT64)) {
+            float_status status = { 0 };
+
+            ops[i].f64 = float32_to_float64(make_float32(random_ops[i]),
+                                            &status);
+            continue;
+        }
+
         switch (prec) {
         case PREC_SINGLE:
         case PREC_FLOAT32:
@@ -203,10 +229,10 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
         int64_t t0;
         int i;
 
-        update_random_ops(n_ops, prec);
+        update_random_ops(n_ops, op == OP_CVT ? PREC_FLOAT32 : prec);
         switch (prec) {
         case PREC_SINGLE:
-            fill_random(ops, n_ops, prec, no_neg);
+            fill_random(ops, n_ops, prec, op, no_neg);
             t0 = get_clock();
             for (i = 0; i < OPS_PER_ITER; i++) {
                 float a = ops[0].f;
@@ -235,13 +261,25 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = isgreater(a, b);
                     break;
+                case OP_MINNUM:
+                    res.f = fminf(a, b);
+                    break;
+                case OP_MAXNUM:
+                    res.f = fmaxf(a, b);
+                    break;
+                case OP_FROM_INT:
+                    res.f = (int64_t)ops[0].u64;
+                    break;
+                case OP_CVT:
+                    res.d = a;
+                    break;
                 default:
                     g_assert_not_reached();
                 }
             }
             break;
         case PREC_DOUBLE:
-            fill_random(ops, n_ops, prec, no_neg);
+            fill_random(ops, n_ops, prec, op, no_neg);
             t0 = get_clock();
             for (i = 0; i < OPS_PER_ITER; i++) {
                 double a = ops[0].d;
@@ -270,13 +308,25 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = isgreater(a, b);
                     break;
+                case OP_MINNUM:
+                    res.d = fmin(a, b);
+                    break;
+                case OP_MAXNUM:
+                    res.d = fmax(a, b);
+                    break;
+                case OP_FROM_INT:
+                    res.d = (int64_t)ops[0].u64;
+                    break;
+                case OP_CVT:
+                    res.f = a;
+                    break;
                 default:
                     g_assert_not_reached();
                 }
             }
             break;
         case PREC_FLOAT32:
-            fill_random(ops, n_ops, prec, no_neg);
+            fill_random(ops, n_ops, prec, op, no_neg);
             t0 = get_clock();
             for (i = 0; i < OPS_PER_ITER; i++) {
                 float32 a = ops[0].f32;
@@ -305,13 +355,25 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = float32_compare_quiet(a, b, &soft_status);
                     break;
+                case OP_MINNUM:
+                    res.f32 = float32_minnum(a, b, &soft_status);
+                    break;
+                case OP_MAXNUM:
+                    res.f32 = float32_maxnum(a, b, &soft_status);
+                    break;
+                case OP_FROM_INT:
+                    res.f32 = int64_to_float32(ops[0].u64, &soft_status);
+                    break;
+                case OP_CVT:
+                    res.f64 = float32_to_float64(a, &soft_status);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
             }
             break;
         case PREC_FLOAT64:
-            fill_random(ops, n_ops, prec, no_neg);
+            fill_random(ops, n_ops, prec, op, no_neg);
             t0 = get_clock();
             for (i = 0; i < OPS_PER_ITER; i++) {
                 float64 a = ops[0].f64;
@@ -340,6 +402,18 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = float64_compare_quiet(a, b, &soft_status);
                     break;
+                case OP_MINNUM:
+                    res.f64 = float64_minnum(a, b, &soft_status);
+                    break;
+                case OP_MAXNUM:
+                    res.f64 = float64_maxnum(a, b, &soft_status);
+                    break;
+                case OP_FROM_INT:
+                    res.f64 = int64_to_float64(ops[0].u64, &soft_status);
+                    break;
+                case OP_CVT:
+                    res.f32 = float64_to_float32(a, &soft_status);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
@@ -377,6 +451,10 @@ GEN_BENCH_ALL_TYPES(mul, OP_MUL, 2)
 GEN_BENCH_ALL_TYPES(div, OP_DIV, 2)
 GEN_BENCH_ALL_TYPES(fma, OP_FMA, 3)
 GEN_BENCH_ALL_TYPES(cmp, OP_CMP, 2)
+GEN_BENCH_ALL_TYPES(minnum, OP_MINNUM, 2)
+GEN_BENCH_ALL_TYPES(maxnum, OP_MAXNUM, 2)
+GEN_BENCH_ALL_TYPES(from_int, OP_FROM_INT, 1)
+GEN_BENCH_ALL_TYPES(cvt, OP_CVT, 1)
 #undef GEN_BENCH_ALL_TYPES
 
 #define GEN_BENCH_ALL_TYPES_NO_NEG(name, op, n)                         \
@@ -407,6 +485,10 @@ static const bench_func_t bench_funcs[OP_MAX_NR][PREC_MAX_NR] = {
     GEN_BENCH_FUNCS(fma, OP_FMA),
     GEN_BENCH_FUNCS(sqrt, OP_SQRT),
     GEN_BENCH_FUNCS(cmp, OP_CMP),
+    GEN_BENCH_FUNCS(minnum, OP_MINNUM),
+    GEN_BENCH_FUNCS(maxnum, OP_MAXNUM),
+    GEN_BENCH_FUNCS(from_int, OP_FROM_INT),
+    GEN_BENCH_FUNCS(cvt, OP_CVT),
 };
 
 #undef GEN_BENCH_FUNCS
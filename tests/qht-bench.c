@@ -9,8 +9,35 @@
 #include "qemu/atomic.h"
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "qemu/xxhash.h"
 
+/*
+ * Latencies are recorded in log2 buckets, each split in 2^LAT_SUB_BITS
+ * linear sub-buckets; this keeps the error of the reported percentiles
+ * under 25% while using a fixed amount of memory per thread.
+ */
+#define LAT_SUB_BITS 2
+#define LAT_N_BUCKETS (64 << LAT_SUB_BITS)
+
+enum lat_op {
+    LAT_LOOKUP,
+    LAT_INSERT,
+    LAT_REMOVE,
+    LAT_NR,
+};
+
+static const char * const lat_op_names[LAT_NR] = {
+    [LAT_LOOKUP] = "Lookup",
+    [LAT_INSERT] = "Insert",
+    [LAT_REMOVE] = "Remove",
+};
+
+struct lat_hist {
+    uint64_t count[LAT_N_BUCKETS];
+    uint64_t max;
+};
+
 struct thread_stats {
     size_t rd;
     size_t not_rd;
@@ -28,6 +55,7 @@ struct thread_info {
     uint64_t r;
     bool write_op; /* writes alternate between insertions and removals */
     bool resize_down;
+    struct lat_hist *lat; /* LAT_NR histograms, only if measure_latency */
 } QEMU_ALIGNED(64); /* avoid false sharing among threads */
 
 static struct qht ht;
@@ -54,6 +82,7 @@ static double resize_rate; /* 0.0 to 1.0 */
 static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 static bool precompute_hash;
+static bool measure_latency;
 
 static double update_rate; /* 0.0 to 1.0 */
 static uint64_t update_threshold;
@@ -73,6 +102,7 @@ static const char commands_string[] =
     "\n"
     " -o = offset at which keys start\n"
     " -p = precompute hashes\n"
+    " -L = measure latency percentiles of lookups/insertions/removals\n"
     "\n"
     " -g = set -s,-k,-K,-l,-r to the same value\n"
     " -s = initial size hint\n"
@@ -128,6 +158,50 @@ static uint64_t xorshift64star(uint64_t x)
     return x * UINT64_C(2685821657736338717);
 }
 
+static unsigned int lat_bucket(uint64_t ns)
+{
+    int msb;
+
+    if (ns < (1 << LAT_SUB_BITS)) {
+        return ns;
+    }
+    msb = 63 - clz64(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) |
+           ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* smallest latency that falls into bucket @b; the inverse of lat_bucket() */
+static uint64_t lat_bucket_min(unsigned int b)
+{
+    unsigned int msb;
+
+    if (b < (1 << LAT_SUB_BITS)) {
+        return b;
+    }
+    msb = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    return ((1ULL << LAT_SUB_BITS) | (b & ((1 << LAT_SUB_BITS) - 1))) <<
+           (msb - LAT_SUB_BITS);
+}
+
+static inline int64_t lat_start(void)
+{
+    return measure_latency ? get_clock() : 0;
+}
+
+static inline void lat_end(struct thread_info *info, enum lat_op op,
+                           int64_t start)
+{
+    if (measure_latency) {
+        struct lat_hist *hist = &info->lat[op];
+        uint64_t ns = get_clock() - start;
+
+        hist->count[lat_bucket(ns)]++;
+        if (ns > hist->max) {
+            hist->max = ns;
+        }
+    }
+}
+
 static void do_rz(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
@@ -152,6 +226,7 @@ static void do_rw(struct thread_info *info)
 {
     struct thread_stats *stats = &info->stats;
     uint32_t hash;
+    int64_t t;
     long *p;
 
     if (info->r >= update_threshold) {
@@ -159,7 +234,9 @@ static void do_rw(struct thread_info *info)
 
         p = &keys[info->r & (lookup_range - 1)];
         hash = hfunc(*p);
+        t = lat_start();
         read = qht_lookup(&ht, p, hash);
+        lat_end(info, LAT_LOOKUP, t);
         if (read) {
             stats->rd++;
         } else {
@@ -172,7 +249,9 @@ static void do_rw(struct thread_info *info)
             bool written = false;
 
             if (qht_lookup(&ht, p, hash) == NULL) {
+                t = lat_start();
                 written = qht_insert(&ht, p, hash, NULL);
+                lat_end(info, LAT_INSERT, t);
             }
             if (written) {
                 stats->in++;
@@ -183,7 +262,9 @@ static void do_rw(struct thread_info *info)
             bool removed = false;
 
             if (qht_lookup(&ht, p, hash)) {
+                t = lat_start();
                 removed = qht_remove(&ht, p, hash);
+                lat_end(info, LAT_REMOVE, t);
             }
             if (removed) {
                 stats->rm++;
@@ -228,6 +309,7 @@ static void prepare_thread_info(struct thread_info *info, int i)
     info->resize_down = true;
 
     memset(&info->stats, 0, sizeof(info->stats));
+    info->lat = measure_latency ? g_new0(struct lat_hist, LAT_NR) : NULL;
 }
 
 static void
@@ -274,6 +356,7 @@ static void pr_params(void)
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
     printf(" offset:            %ld\n", populate_offset);
+    printf(" measure latency:   %s\n", measure_latency ? "on" : "off");
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
     printf(" update range:      %lu\n", update_range);
@@ -363,6 +446,54 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
     }
 }
 
+static void pr_lat_percentile(const struct lat_hist *hist, uint64_t total,
+                              double pct)
+{
+    uint64_t target = total * pct / 100.0;
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < LAT_N_BUCKETS; i++) {
+        sum += hist->count[i];
+        if (sum > target) {
+            break;
+        }
+    }
+    if (i == LAT_N_BUCKETS) {
+        i--;
+    }
+    printf(" p%g %" PRIu64, pct, lat_bucket_min(i));
+}
+
+static void pr_lat_stats(void)
+{
+    int op, i, j;
+
+    for (op = 0; op < LAT_NR; op++) {
+        struct lat_hist hist = {};
+        uint64_t total = 0;
+
+        for (i = 0; i < n_rw_threads; i++) {
+            const struct lat_hist *h = &rw_info[i].lat[op];
+
+            for (j = 0; j < LAT_N_BUCKETS; j++) {
+                hist.count[j] += h->count[j];
+                total += h->count[j];
+            }
+            hist.max = MAX(hist.max, h->max);
+        }
+        if (total == 0) {
+            continue;
+        }
+        printf(" %s latency (ns):", lat_op_names[op]);
+        pr_lat_percentile(&hist, total, 50);
+        pr_lat_percentile(&hist, total, 99);
+        pr_lat_percentile(&hist, total, 99.9);
+        pr_lat_percentile(&hist, total, 99.99);
+        printf(" max %" PRIu64 "\n", hist.max);
+    }
+}
+
 static void pr_stats(void)
 {
     struct thread_stats s = {};
@@ -394,6 +525,10 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    if (measure_latency) {
+        pr_lat_stats();
+    }
 }
 
 static void run_test(void)
@@ -421,7 +556,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:pr:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:k:K:l:hLn:N:o:pr:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -451,6 +586,9 @@ static void parse_args(int argc, char *argv[])
         case 'l':
             lookup_range = pow2ceil(atol(optarg));
             break;
+        case 'L':
+            measure_latency = true;
+            break;
         case 'n':
             n_rw_threads = atoi(optarg);
             break;
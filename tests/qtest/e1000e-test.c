@@ -231,6 +231,42 @@ static void test_e1000e_multiple_transfers(void *obj, void *data,
 
 }
 
+#define E1000E_IO_BAR   2
+#define E1000E_IOADDR   0x00
+#define E1000E_IODATA   0x04
+
+/*
+ * Writes to the descriptor tail registers are taken under a device lock
+ * and applied to the core later.  Reads must see the last value written,
+ * whichever BAR it went through.
+ */
+static void test_e1000e_tail_regs(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QE1000E_PCI *e1000e = obj;
+    QPCIDevice *dev = &e1000e->pci_dev;
+    QPCIBar mmio = e1000e->mac_regs;
+    QPCIBar io = qpci_iomap(dev, E1000E_IO_BAR, NULL);
+    uint32_t i;
+
+    /* RDT only hands receive buffers to the device */
+    for (i = 1; i < 8; i++) {
+        qpci_io_writel(dev, mmio, E1000E_RDT, i);
+        g_assert_cmpint(qpci_io_readl(dev, mmio, E1000E_RDT), ==, i);
+    }
+
+    /* A pending write is applied before other registers are accessed */
+    qpci_io_writel(dev, mmio, E1000E_RDT, 9);
+    qpci_io_writel(dev, io, E1000E_IOADDR, E1000E_RDT);
+    g_assert_cmpint(qpci_io_readl(dev, io, E1000E_IODATA), ==, 9);
+
+    /* Writes through the I/O BAR are visible to the tail register */
+    qpci_io_writel(dev, io, E1000E_IODATA, 11);
+    g_assert_cmpint(qpci_io_readl(dev, mmio, E1000E_RDT), ==, 11);
+    g_assert_cmpint(qpci_io_readl(dev, io, E1000E_IODATA), ==, 11);
+
+    qpci_iounmap(dev, io);
+}
+
 static void test_e1000e_hotplug(void *obj, void *data, QGuestAllocator * alloc)
 {
     QTestState *qts = global_qtest;  /* TODO: get rid of global_qtest here */
@@ -274,6 +310,7 @@ static void register_e1000e_test(void)
     qos_add_test("multiple_transfers", "e1000e",
                       test_e1000e_multiple_transfers, &opts);
     qos_add_test("hotplug", "e1000e", test_e1000e_hotplug, &opts);
+    qos_add_test("tail_regs", "e1000e", test_e1000e_tail_regs, &opts);
 }
 
 libqos_init(register_e1000e_test);
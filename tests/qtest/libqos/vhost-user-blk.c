@@ -0,0 +1,76 @@
+/*
+ * libqos driver for vhost-user-blk-pci
+ *
+ * The device talks to a vhost-user backend through "chardev=char1", which
+ * tests using this node have to set up.  The guest-visible side is the
+ * same as virtio-blk-pci, so the virtio-blk structures are reused.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qemu/module.h"
+#include "standard-headers/linux/virtio_ids.h"
+#include "libqos/qgraph.h"
+#include "libqos/virtio-blk.h"
+
+#define PCI_SLOT                0x04
+#define PCI_FN                  0x00
+
+static void *vhost_user_blk_pci_get_driver(void *object,
+                                           const char *interface)
+{
+    QVirtioBlkPCI *v_blk = object;
+
+    if (!g_strcmp0(interface, "vhost-user-blk")) {
+        return &v_blk->blk;
+    }
+    if (!g_strcmp0(interface, "virtio")) {
+        return v_blk->blk.vdev;
+    }
+    if (!g_strcmp0(interface, "pci-device")) {
+        return v_blk->pci_vdev.pdev;
+    }
+
+    fprintf(stderr, "%s not present in vhost-user-blk-pci\n", interface);
+    g_assert_not_reached();
+}
+
+static void *vhost_user_blk_pci_create(void *pci_bus, QGuestAllocator *t_alloc,
+                                       void *addr)
+{
+    QVirtioBlkPCI *v_blk = g_new0(QVirtioBlkPCI, 1);
+    QOSGraphObject *obj = &v_blk->pci_vdev.obj;
+
+    virtio_pci_init(&v_blk->pci_vdev, pci_bus, addr);
+    v_blk->blk.vdev = &v_blk->pci_vdev.vdev;
+
+    g_assert_cmphex(v_blk->blk.vdev->device_type, ==, VIRTIO_ID_BLOCK);
+
+    obj->get_driver = vhost_user_blk_pci_get_driver;
+
+    return obj;
+}
+
+static void vhost_user_blk_register_nodes(void)
+{
+    char *arg = g_strdup_printf("id=drv0,chardev=char1,addr=%x.%x",
+                                PCI_SLOT, PCI_FN);
+    QPCIAddress addr = {
+        .devfn = QPCI_DEVFN(PCI_SLOT, PCI_FN),
+    };
+    QOSGraphEdgeOptions opts = {
+        .extra_device_opts = arg,
+    };
+
+    add_qpci_address(&opts, &addr);
+    qos_node_create_driver("vhost-user-blk-pci", vhost_user_blk_pci_create);
+    qos_node_consumes("vhost-user-blk-pci", "pci-bus", &opts);
+    qos_node_produces("vhost-user-blk-pci", "vhost-user-blk");
+
+    g_free(arg);
+}
+
+libqos_init(vhost_user_blk_register_nodes);
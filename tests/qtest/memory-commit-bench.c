@@ -0,0 +1,134 @@
+/*
+ * Cost of memory topology updates as PCI devices are added
+ *
+ * Starts PC machines with an increasing number of pci-testdev functions,
+ * all with their memory BAR mapped, and measures how long it takes to
+ * turn memory decoding of one of them off and on.  Each of these config
+ * space writes is one memory_region_transaction_commit() that unmaps or
+ * maps a single BAR among all the others.  Writes that leave the command
+ * register unchanged give the cost of the qtest round trips, which is
+ * subtracted.
+ *
+ * Usage:
+ *   QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *       tests/qtest/memory-commit-bench [-n devices] [-i iterations]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+/* Slots 0 and 1 hold the host bridge and the ISA bridge */
+#define FIRST_SLOT      2
+#define MAX_DEVICES     ((32 - FIRST_SLOT) * 8)
+
+static unsigned int max_devices = MAX_DEVICES;
+static unsigned int iterations = 200;
+
+static const char commands_string[] =
+    " -n = maximum number of devices (default and max: 240)\n"
+    " -i = iterations per measurement (default: 200)";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static int64_t time_command_writes(QPCIDevice *dev, uint16_t off,
+                                   uint16_t on)
+{
+    int64_t start = g_get_monotonic_time();
+    unsigned int i;
+
+    for (i = 0; i < iterations; i++) {
+        qpci_config_writew(dev, PCI_COMMAND, off);
+        qpci_config_writew(dev, PCI_COMMAND, on);
+    }
+    return g_get_monotonic_time() - start;
+}
+
+static void bench(unsigned int devices)
+{
+    GString *cmdline = g_string_new("-machine pc -nodefaults");
+    QPCIDevice **devs = g_new0(QPCIDevice *, devices);
+    QTestState *qts;
+    QPCIBus *bus;
+    int64_t base, toggle;
+    unsigned int i;
+
+    for (i = 0; i < devices; i++) {
+        g_string_append_printf(cmdline,
+                               " -device pci-testdev,addr=%x.%x%s",
+                               FIRST_SLOT + i / 8, i % 8,
+                               i % 8 ? "" : ",multifunction=on");
+    }
+    qts = qtest_init(cmdline->str);
+    bus = qpci_new_pc(qts, NULL);
+
+    /* Only the memory BAR: there is not enough I/O space for all of them */
+    for (i = 0; i < devices; i++) {
+        devs[i] = qpci_device_find(bus, QPCI_DEVFN(FIRST_SLOT + i / 8,
+                                                   i % 8));
+        g_assert(devs[i]);
+        qpci_iomap(devs[i], 0, NULL);
+        qpci_config_writew(devs[i], PCI_COMMAND, PCI_COMMAND_MEMORY);
+    }
+
+    base = time_command_writes(devs[devices / 2], PCI_COMMAND_MEMORY,
+                               PCI_COMMAND_MEMORY);
+    toggle = time_command_writes(devs[devices / 2], 0, PCI_COMMAND_MEMORY);
+
+    printf("%4u devices: %8.2f us per commit (%.2f us per write)\n",
+           devices, (double)(toggle - base) / (2 * iterations),
+           (double)toggle / (2 * iterations));
+
+    for (i = 0; i < devices; i++) {
+        g_free(devs[i]);
+    }
+    g_free(devs);
+    qpci_free_pc(bus);
+    qtest_quit(qts);
+    g_string_free(cmdline, true);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:i:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            max_devices = MAX(MIN(atoi(optarg), MAX_DEVICES), 1);
+            break;
+        case 'i':
+            iterations = MAX(atoi(optarg), 1);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int devices;
+
+    parse_args(argc, argv);
+
+    for (devices = 1; devices < max_devices; devices *= 2) {
+        bench(devices);
+    }
+    bench(max_devices);
+    return 0;
+}
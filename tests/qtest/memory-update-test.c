@@ -0,0 +1,75 @@
+/*
+ * QTest testcase for incremental FlatView updates
+ *
+ * Moves the ACPI PM I/O space of the PIIX4 around with
+ * memory_region_set_address(), which only re-renders the parts of the
+ * address space touched by the move.  Checks that the old location stops
+ * decoding, and that the resulting topology is the same as a full
+ * re-render, which starting dirty logging for migration forces.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "migration-helpers.h"
+
+#define PIIX4_PM_DEVFN  QPCI_DEVFN(1, 3)
+#define PMBASE          0x40
+#define PMREGMISC       0x80
+#define PM1_EN          0x02
+#define PM1_EN_PWRBTN   0x0100
+
+static void set_pm_base(QPCIDevice *dev, uint16_t base)
+{
+    qpci_config_writel(dev, PMBASE, base | 1);
+    qpci_config_writeb(dev, PMREGMISC, 1);
+}
+
+static void test_set_address(void)
+{
+    static const uint16_t bases[] = { 0xc100, 0xc040, 0xc020, 0xc000 };
+    QTestState *qts = qtest_init("-machine pc");
+    QPCIBus *bus = qpci_new_pc(qts, NULL);
+    QPCIDevice *dev = qpci_device_find(bus, PIIX4_PM_DEVFN);
+    uint16_t old = 0xc000;
+    char *full, *incremental;
+    int i;
+
+    g_assert(dev);
+    set_pm_base(dev, old);
+    qtest_outw(qts, old + PM1_EN, PM1_EN_PWRBTN);
+    g_assert_cmphex(qtest_inw(qts, old + PM1_EN), ==, PM1_EN_PWRBTN);
+
+    for (i = 0; i < ARRAY_SIZE(bases); i++) {
+        set_pm_base(dev, bases[i]);
+        g_assert_cmphex(qtest_inw(qts, bases[i] + PM1_EN), ==,
+                        PM1_EN_PWRBTN);
+        /* Nothing is left at the old place, even where the ranges overlap */
+        g_assert_cmphex(qtest_inw(qts, old + PM1_EN), ==, 0xffff);
+        old = bases[i];
+    }
+
+    incremental = qtest_hmp(qts, "info mtree -f");
+    migrate_qmp(qts, "exec:cat > /dev/null", "{}");
+    wait_for_migration_complete(qts);
+    full = qtest_hmp(qts, "info mtree -f");
+    g_assert_cmpstr(incremental, ==, full);
+
+    g_free(incremental);
+    g_free(full);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/memory/update/set-address", test_set_address);
+
+    return g_test_run();
+}
@@ -66,6 +66,33 @@ static void nvmetest_oob_cmb_test(void *obj, void *data, QGuestAllocator *alloc)
     g_assert_cmpint(qpci_io_readl(pdev, bar, cmb_bar_size - 1), !=, 0x44332211);
 }
 
+/* Doorbell writes are processed outside of the BQL, then validated */
+static void nvmetest_invalid_db_test(void *obj, void *data,
+                                     QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIDevice *pdev = &nvme->dev;
+    QPCIBar bar;
+
+    qpci_device_enable(pdev);
+    bar = qpci_iomap(pdev, 0, NULL);
+
+    /* The controller is disabled, so no queue exists */
+    qpci_io_writel(pdev, bar, 0x1000, 1);
+    qpci_io_writel(pdev, bar, 0x1004, 1);
+    qpci_io_writel(pdev, bar, 0x1000 + 8 * 63, 0xffff);
+
+    /* Misaligned doorbell writes */
+    qpci_io_writew(pdev, bar, 0x1002, 1);
+    qpci_io_writeb(pdev, bar, 0x1009, 1);
+
+    /* Doorbells read as zero */
+    g_assert_cmpint(qpci_io_readl(pdev, bar, 0x1000), ==, 0);
+
+    g_assert_cmpint(qpci_io_readl(pdev, bar, 0x08), ==, 0x00010200); /* VS */
+    g_assert_cmpint(qpci_io_readl(pdev, bar, 0x1c), ==, 0);          /* CSTS */
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -83,6 +110,7 @@ static void nvme_register_nodes(void)
     qos_add_test("oob-cmb-access", "nvme", nvmetest_oob_cmb_test, &(QOSGraphTestOptions) {
         .edge.extra_device_opts = "cmb_size_mb=2"
     });
+    qos_add_test("invalid-doorbell", "nvme", nvmetest_invalid_db_test, NULL);
 }
 
 libqos_init(nvme_register_nodes);
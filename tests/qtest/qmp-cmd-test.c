@@ -213,6 +213,21 @@ static void test_object_add_without_props(void)
     qtest_quit(qts);
 }
 
+/* The report must not be sized by what the client asks for */
+static void test_query_sync_profile_max(void)
+{
+    QTestState *qts;
+    QDict *resp;
+
+    qts = qtest_initf("%s -enable-sync-profile", common_args);
+    resp = qtest_qmp(qts, "{'execute': 'query-sync-profile', 'arguments':"
+                     " {'max': 1000000000000 } }");
+    g_assert_nonnull(resp);
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+    qtest_quit(qts);
+}
+
 int main(int argc, char *argv[])
 {
     QmpSchema schema;
@@ -226,6 +241,8 @@ int main(int argc, char *argv[])
     qtest_add_func("qmp/object-add-without-props",
                    test_object_add_without_props);
     /* TODO: add coverage of generic object-add failure modes */
+    qtest_add_func("qmp/query-sync-profile-max",
+                   test_query_sync_profile_max);
 
     ret = g_test_run();
 
@@ -0,0 +1,165 @@
+/*
+ * QTest testcase for the shmring network backend
+ *
+ * Two shmring netdevs of the same QEMU are connected to each other, and
+ * each of them to a socket netdev through a hub:
+ *
+ *   sock0 <-> hub 0 <-> ring0 <=> ring1 <-> hub 1 <-> sock1
+ *
+ * Frames written to one socket come out of the other one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define SLOTS           4
+#define SLOT_SIZE       128
+#define BURST           (16 * SLOTS)
+#define TIMEOUT_MS      (30 * 1000)
+
+/* Frames sent until the link is up are tagged, and skipped on receipt. */
+#define PING            0xff
+
+static void send_frame(int fd, const uint8_t *buf, uint32_t len)
+{
+    uint32_t be_len = htonl(len);
+    struct iovec iov[] = {
+        { .iov_base = &be_len, .iov_len = sizeof(be_len) },
+        { .iov_base = (void *)buf, .iov_len = len },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(be_len) + len);
+    g_assert_cmpint(ret, ==, sizeof(be_len) + len);
+}
+
+/* Returns the length of the frame, or -1 if none arrived in @timeout_ms. */
+static int recv_frame(int fd, uint8_t *buf, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint32_t len;
+    ssize_t ret;
+
+    if (poll(&pfd, 1, timeout_ms) == 0) {
+        return -1;
+    }
+
+    ret = qemu_recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, <=, SLOT_SIZE);
+    ret = qemu_recv(fd, buf, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    return len;
+}
+
+/* Frames are dropped until both rings are attached. */
+static void wait_link(int from, int to)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_MS * 1000;
+    uint8_t ping = PING;
+    uint8_t buf[SLOT_SIZE];
+
+    do {
+        g_assert(g_get_monotonic_time() < end);
+        send_frame(from, &ping, sizeof(ping));
+    } while (recv_frame(to, buf, 100) < 0);
+}
+
+static int recv_data_frame(int fd, uint8_t *buf)
+{
+    int len;
+
+    do {
+        len = recv_frame(fd, buf, TIMEOUT_MS);
+        g_assert_cmpint(len, >, 0);
+    } while (len == 1 && buf[0] == PING);
+    return len;
+}
+
+/*
+ * Send a burst much larger than the ring, so that the producer has to
+ * wait for free slots, and check that it arrives complete and in order.
+ * The oversized frames in it are dropped.
+ */
+static void test_burst(int from, int to)
+{
+    uint8_t buf[SLOT_SIZE + 1];
+    int i, len;
+
+    for (i = 0; i < BURST; i++) {
+        len = i % 7 == 6 ? SLOT_SIZE + 1 : 2 + i % SLOT_SIZE;
+        memset(buf, i, len);
+        send_frame(from, buf, len);
+    }
+
+    for (i = 0; i < BURST; i++) {
+        if (i % 7 == 6) {
+            continue;
+        }
+        len = recv_data_frame(to, buf);
+        g_assert_cmpint(len, ==, 2 + i % SLOT_SIZE);
+        g_assert_cmpint(buf[0], ==, i);
+        g_assert_cmpint(buf[len - 1], ==, i);
+    }
+}
+
+static void test_loopback(void)
+{
+    int sock0[2], sock1[2];
+    char *tmpdir, *path;
+    QTestState *qts;
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sock0);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sock1);
+    g_assert_cmpint(ret, !=, -1);
+    tmpdir = g_dir_make_tmp("test-shmring-XXXXXX", NULL);
+    g_assert(tmpdir);
+    path = g_strdup_printf("%s/shmring.sock", tmpdir);
+
+    qts = qtest_initf(
+        "-M none "
+        "-chardev socket,id=chr0,path=%s,server,nowait "
+        "-chardev socket,id=chr1,path=%s "
+        "-netdev socket,id=sock0,fd=%d "
+        "-netdev socket,id=sock1,fd=%d "
+        "-netdev shmring,id=ring0,chardev=chr0,slots=%d,slot-size=%d "
+        "-netdev shmring,id=ring1,chardev=chr1,slots=%d,slot-size=%d "
+        "-netdev hubport,id=hub0a,hubid=0,netdev=sock0 "
+        "-netdev hubport,id=hub0b,hubid=0,netdev=ring0 "
+        "-netdev hubport,id=hub1a,hubid=1,netdev=sock1 "
+        "-netdev hubport,id=hub1b,hubid=1,netdev=ring1",
+        path, path, sock0[1], sock1[1],
+        SLOTS, SLOT_SIZE, SLOTS, SLOT_SIZE);
+
+    wait_link(sock0[0], sock1[0]);
+    wait_link(sock1[0], sock0[0]);
+    test_burst(sock0[0], sock1[0]);
+    test_burst(sock1[0], sock0[0]);
+
+    qtest_quit(qts);
+    close(sock0[0]);
+    close(sock0[1]);
+    close(sock1[0]);
+    close(sock1[1]);
+    unlink(path);
+    rmdir(tmpdir);
+    g_free(path);
+    g_free(tmpdir);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/netdev/shmring/loopback", test_loopback);
+
+    return g_test_run();
+}
@@ -0,0 +1,190 @@
+/*
+ * QTest testcase for the vhost-user-blk export server
+ *
+ * A second QEMU process exports a raw image with -object
+ * vhost-user-blk-server, and the vhost-user-blk-pci device of the QEMU
+ * under test connects to it.  Requests submitted on the virtqueue are
+ * served by the exporting process.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "qemu/module.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "libqos/qgraph.h"
+#include "libqos/virtio-blk.h"
+
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
+
+typedef struct QVirtioBlkReq {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} QVirtioBlkReq;
+
+#ifdef HOST_WORDS_BIGENDIAN
+static const bool host_is_big_endian = true;
+#else
+static const bool host_is_big_endian; /* false */
+#endif
+
+typedef struct TestExport {
+    QTestState *qts;
+    char *tmpdir;
+    char *image;
+    char *socket;
+} TestExport;
+
+static void test_export_free(void *opaque)
+{
+    TestExport *exp = opaque;
+
+    qos_invalidate_command_line();
+    qtest_quit(exp->qts);
+    unlink(exp->socket);
+    unlink(exp->image);
+    rmdir(exp->tmpdir);
+    g_free(exp->socket);
+    g_free(exp->image);
+    g_free(exp->tmpdir);
+    g_free(exp);
+}
+
+static void *vhost_user_blk_test_setup(GString *cmd_line, void *arg)
+{
+    TestExport *exp = g_new0(TestExport, 1);
+    int fd, ret;
+
+    exp->tmpdir = g_dir_make_tmp("vhost-user-blk-test-XXXXXX", NULL);
+    g_assert(exp->tmpdir);
+    exp->image = g_strdup_printf("%s/disk.img", exp->tmpdir);
+    exp->socket = g_strdup_printf("%s/vhost-user-blk.sock", exp->tmpdir);
+
+    fd = open(exp->image, O_RDWR | O_CREAT, 0600);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    /* The server listens once the exporting QEMU is up */
+    exp->qts = qtest_initf("-machine none "
+                           "-blockdev driver=file,node-name=disk0,"
+                           "filename=%s "
+                           "-object vhost-user-blk-server,id=vub0,"
+                           "node-name=disk0,unix-socket=%s,writable=on",
+                           exp->image, exp->socket);
+
+    /* Guest memory has to be shared with the exporting process */
+    g_string_append_printf(cmd_line,
+                           " -m 256 -object memory-backend-file,id=mem,"
+                           "size=256M,mem-path=%s,share=on"
+                           " -numa node,memdev=mem"
+                           " -chardev socket,id=char1,path=%s",
+                           exp->tmpdir, exp->socket);
+
+    g_test_queue_destroy(test_export_free, exp);
+    return exp;
+}
+
+/* Submits a request with an optional 512 byte data buffer, returns status */
+static uint8_t vhost_user_blk_request(QVirtioDevice *dev, QVirtQueue *vq,
+                                      QGuestAllocator *alloc, uint32_t type,
+                                      uint64_t sector, char *data)
+{
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req = {
+        .type = type,
+        .ioprio = 1,
+        .sector = sector,
+    };
+    size_t data_size = data ? 512 : 0;
+    uint8_t status = 0xff;
+    uint64_t addr;
+    uint32_t free_head;
+
+    if (qvirtio_is_big_endian(dev) != host_is_big_endian) {
+        req.type = bswap32(req.type);
+        req.ioprio = bswap32(req.ioprio);
+        req.sector = bswap64(req.sector);
+    }
+
+    addr = guest_alloc(alloc, sizeof(req) + data_size + 1);
+    memwrite(addr, &req, sizeof(req));
+    if (type == VIRTIO_BLK_T_OUT) {
+        memwrite(addr + sizeof(req), data, data_size);
+    }
+    memwrite(addr + sizeof(req) + data_size, &status, 1);
+
+    free_head = qvirtqueue_add(qts, vq, addr, sizeof(req), false, true);
+    if (data) {
+        qvirtqueue_add(qts, vq, addr + sizeof(req), data_size,
+                       type == VIRTIO_BLK_T_IN, true);
+    }
+    qvirtqueue_add(qts, vq, addr + sizeof(req) + data_size, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(addr + sizeof(req) + data_size);
+    if (type == VIRTIO_BLK_T_IN) {
+        memread(addr + sizeof(req), data, data_size);
+    }
+
+    guest_free(alloc, addr);
+    return status;
+}
+
+static void test_read_write_flush(void *obj, void *arg,
+                                  QGuestAllocator *alloc)
+{
+    QVirtioBlk *blk = obj;
+    QVirtioDevice *dev = blk->vdev;
+    QVirtQueue *vq;
+    uint64_t features;
+    char *data;
+
+    features = qvirtio_get_features(dev);
+    g_assert(features & (1u << VIRTIO_BLK_F_FLUSH));
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1u << VIRTIO_RING_F_EVENT_IDX));
+    qvirtio_set_features(dev, features);
+
+    g_assert_cmpint(qvirtio_config_readq(dev, 0), ==, TEST_IMAGE_SIZE / 512);
+
+    vq = qvirtqueue_setup(dev, alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    data = g_malloc0(512);
+    strcpy(data, "TEST");
+    g_assert_cmpint(vhost_user_blk_request(dev, vq, alloc, VIRTIO_BLK_T_OUT,
+                                           1, data), ==, VIRTIO_BLK_S_OK);
+
+    memset(data, 0, 512);
+    g_assert_cmpint(vhost_user_blk_request(dev, vq, alloc, VIRTIO_BLK_T_IN,
+                                           1, data), ==, VIRTIO_BLK_S_OK);
+    g_assert_cmpstr(data, ==, "TEST");
+
+    g_assert_cmpint(vhost_user_blk_request(dev, vq, alloc, VIRTIO_BLK_T_FLUSH,
+                                           0, NULL), ==, VIRTIO_BLK_S_OK);
+
+    g_free(data);
+    qvirtqueue_cleanup(dev->bus, vq, alloc);
+}
+
+static void register_vhost_user_blk_test(void)
+{
+    QOSGraphTestOptions opts = {
+        .before = vhost_user_blk_test_setup,
+    };
+
+    qos_add_test("read-write-flush", "vhost-user-blk",
+                 test_read_write_flush, &opts);
+}
+
+libqos_init(register_vhost_user_blk_test);
@@ -12,6 +12,7 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qdict.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -23,6 +24,7 @@
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
+#define VIRTIO_QUEUE_MAX        1024
 
 typedef struct QVirtioBlkReq {
     uint32_t type;
@@ -717,6 +719,599 @@ static void pci_hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
     qpci_unplug_acpi_device_test(qts, "drv1", PCI_SLOT_HP);
 }
 
+/*
+ * Queue notifications and ISR reads of virtio 1.0 devices are dispatched
+ * without the BQL.  Check notifications for queues that do not exist,
+ * that reading the ISR acknowledges the interrupt, and a notification
+ * that is immediately followed by a reset.
+ */
+static void pci_notify(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioPCIDevice *pdev = &blk->pci_vdev;
+    QVirtioDevice *dev = &pdev->vdev;
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    QVirtQueue *vq;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint16_t used_idx;
+    gint64 end;
+    char *data;
+
+    if (!pdev->notify_cfg_offset) {
+        g_test_skip("virtio 1.0 is not available");
+        return;
+    }
+
+    vq = test_basic(dev, t_alloc);
+
+    /* Notifications for queues that do not exist are ignored */
+    qpci_io_writew(pdev->pdev, pdev->bar,
+                   pdev->notify_cfg_offset + pdev->notify_off_multiplier, 1);
+    qpci_io_writew(pdev->pdev, pdev->bar,
+                   pdev->notify_cfg_offset +
+                   (VIRTIO_QUEUE_MAX - 1) * pdev->notify_off_multiplier,
+                   VIRTIO_QUEUE_MAX - 1);
+
+    /* Read request, waiting for it without reading the ISR */
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 0;
+    req.data = g_malloc0(512);
+    req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+    used_idx = readw(vq->used + 2);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    end = g_get_monotonic_time() + QVIRTIO_BLK_TIMEOUT_US;
+    while (readw(vq->used + 2) == used_idx) {
+        g_assert(g_get_monotonic_time() < end);
+        qtest_clock_step(qts, 100);
+    }
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+    data = g_malloc0(512);
+    memread(req_addr + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST");
+    g_free(data);
+
+    /* Reading the ISR acknowledges the interrupt */
+    g_assert_cmpint(qpci_io_readb(pdev->pdev, pdev->bar,
+                                  pdev->isr_cfg_offset), ==, 1);
+    g_assert_cmpint(qpci_io_readb(pdev->pdev, pdev->bar,
+                                  pdev->isr_cfg_offset), ==, 0);
+
+    /* Reset right after a notification, then start over */
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    qvirtio_reset(dev);
+    guest_free(t_alloc, req_addr);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+
+    qvirtio_set_acknowledge(dev);
+    qvirtio_set_driver(dev);
+    vq = test_basic(dev, t_alloc);
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * A small split and packed ring driver for the batch tests.  Requests are
+ * made available in bursts with a single kick, so that the device pops and
+ * pushes them in batches, and the ring is small so that it wraps around
+ * many times.
+ */
+#define BATCH_QUEUE_SIZE        16
+#define BATCH_REQS              5
+#define BATCH_DESCS             3
+#define BATCH_ROUNDS            20
+#define BATCH_REQ_SIZE          (16 + 512 + 1)
+
+typedef struct BatchRing {
+    QVirtioDevice *dev;
+    QVirtQueue *vq;
+    bool packed;
+    uint16_t avail_idx;     /* split: avail->idx, packed: next free slot */
+    bool avail_wrap;
+    uint16_t used_idx;      /* split: used->idx seen, packed: next used slot */
+    bool used_wrap;
+    uint64_t reqs[BATCH_REQS];
+} BatchRing;
+
+static void batch_ring_start(BatchRing *r, QVirtioDevice *dev,
+                             QGuestAllocator *alloc, bool packed)
+{
+    uint64_t features;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1u << VIRTIO_RING_F_EVENT_IDX) |
+                  (1u << VIRTIO_BLK_F_SCSI));
+    if (!packed) {
+        features &= ~(1ull << VIRTIO_F_RING_PACKED);
+    }
+    qvirtio_set_features(dev, features);
+
+    memset(r, 0, sizeof(*r));
+    r->dev = dev;
+    r->packed = packed;
+    r->avail_wrap = true;
+    r->used_wrap = true;
+    r->vq = qvirtqueue_setup(dev, alloc, 0);
+    g_assert_cmpint(r->vq->size, ==, BATCH_QUEUE_SIZE);
+    if (packed) {
+        /* qvring_init() fills in a split descriptor table */
+        qtest_memset(global_qtest, r->vq->desc, 0, BATCH_QUEUE_SIZE * 16);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    for (i = 0; i < BATCH_REQS; i++) {
+        r->reqs[i] = guest_alloc(alloc, BATCH_REQ_SIZE);
+    }
+}
+
+static void batch_ring_stop(BatchRing *r, QGuestAllocator *alloc)
+{
+    int i;
+
+    for (i = 0; i < BATCH_REQS; i++) {
+        guest_free(alloc, r->reqs[i]);
+    }
+    qvirtqueue_cleanup(r->dev->bus, r->vq, alloc);
+}
+
+/* virtio 1.0 rings are little-endian whatever the guest is */
+static void batch_writew(uint64_t addr, uint16_t val)
+{
+    uint8_t buf[2];
+
+    stw_le_p(buf, val);
+    memwrite(addr, buf, sizeof(buf));
+}
+
+static uint32_t batch_readl(uint64_t addr)
+{
+    uint8_t buf[4];
+
+    memread(addr, buf, sizeof(buf));
+    return ldl_le_p(buf);
+}
+
+static void batch_write_desc(BatchRing *r, uint16_t slot, uint64_t addr,
+                             uint32_t len, uint16_t id_or_next,
+                             uint16_t flags)
+{
+    uint8_t desc[16];
+
+    stq_le_p(desc, addr);
+    stl_le_p(desc + 8, len);
+    if (r->packed) {
+        stw_le_p(desc + 12, id_or_next);
+        stw_le_p(desc + 14, flags);
+    } else {
+        stw_le_p(desc + 12, flags);
+        stw_le_p(desc + 14, id_or_next);
+    }
+    memwrite(r->vq->desc + 16 * slot, desc, sizeof(desc));
+}
+
+/*
+ * Make request @id available, with descriptors of @lens bytes carved from
+ * its buffer.  Returns the number of descriptors used.
+ */
+static unsigned int batch_add(BatchRing *r, uint16_t id, unsigned int ndescs,
+                              const uint32_t *lens, const bool *write)
+{
+    uint16_t head_flags = 0;
+    uint64_t addr = r->reqs[id];
+    unsigned int j;
+
+    for (j = 0; j < ndescs; j++) {
+        uint16_t flags = 0;
+        uint16_t slot;
+
+        if (j + 1 < ndescs) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        if (write[j]) {
+            flags |= VRING_DESC_F_WRITE;
+        }
+
+        if (r->packed) {
+            slot = r->avail_idx;
+            flags |= r->avail_wrap << VRING_PACKED_DESC_F_AVAIL |
+                     !r->avail_wrap << VRING_PACKED_DESC_F_USED;
+            if (++r->avail_idx == BATCH_QUEUE_SIZE) {
+                r->avail_idx = 0;
+                r->avail_wrap = !r->avail_wrap;
+            }
+        } else {
+            /* All requests complete between bursts, reuse the table */
+            slot = id * BATCH_DESCS + j;
+        }
+
+        if (j == 0) {
+            /* The head is made available last */
+            head_flags = flags;
+        } else {
+            batch_write_desc(r, slot, addr, lens[j],
+                             r->packed ? id : slot + 1, flags);
+        }
+        addr += lens[j];
+    }
+
+    if (r->packed) {
+        uint16_t head = (r->avail_idx + BATCH_QUEUE_SIZE - ndescs) %
+                        BATCH_QUEUE_SIZE;
+
+        batch_write_desc(r, head, r->reqs[id], lens[0], id, head_flags);
+    } else {
+        batch_write_desc(r, id * BATCH_DESCS, r->reqs[id], lens[0],
+                         id * BATCH_DESCS + 1, head_flags);
+        batch_writew(r->vq->avail + 4 +
+                     2 * (r->avail_idx % BATCH_QUEUE_SIZE),
+                     id * BATCH_DESCS);
+        r->avail_idx++;
+    }
+    return ndescs;
+}
+
+/* Publish the burst and notify the device once */
+static void batch_kick(BatchRing *r)
+{
+    if (!r->packed) {
+        batch_writew(r->vq->avail + 2, r->avail_idx);
+    }
+    r->dev->bus->virtqueue_kick(r->dev, r->vq);
+}
+
+static void batch_add_rw(BatchRing *r, uint16_t id, uint32_t type,
+                         uint64_t sector, uint8_t pattern)
+{
+    static const uint32_t lens[BATCH_DESCS] = { 16, 512, 1 };
+    const bool write[BATCH_DESCS] = {
+        false, type == VIRTIO_BLK_T_IN, true
+    };
+    uint8_t hdr[16];
+    uint8_t data[512];
+
+    stl_le_p(hdr, type);
+    stl_le_p(hdr + 4, 0);
+    stq_le_p(hdr + 8, sector);
+    memwrite(r->reqs[id], hdr, sizeof(hdr));
+    memset(data, type == VIRTIO_BLK_T_OUT ? pattern : 0, sizeof(data));
+    memwrite(r->reqs[id] + 16, data, sizeof(data));
+    writeb(r->reqs[id] + 16 + 512, 0xff);
+
+    batch_add(r, id, BATCH_DESCS, lens, write);
+}
+
+/* Wait for @count requests to be used, returns a bitmap of their ids */
+static uint32_t batch_wait(BatchRing *r, unsigned int count)
+{
+    gint64 end = g_get_monotonic_time() + QVIRTIO_BLK_TIMEOUT_US;
+    uint32_t done = 0;
+
+    while (count) {
+        uint16_t id;
+
+        if (r->packed) {
+            uint8_t desc[16];
+            uint16_t flags;
+            bool avail, used;
+
+            memread(r->vq->desc + 16 * r->used_idx, desc, sizeof(desc));
+            flags = lduw_le_p(desc + 14);
+            avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+            used = flags & (1 << VRING_PACKED_DESC_F_USED);
+            if (avail != used || used != r->used_wrap) {
+                goto wait;
+            }
+            id = lduw_le_p(desc + 12);
+            r->used_idx += BATCH_DESCS;
+            if (r->used_idx >= BATCH_QUEUE_SIZE) {
+                r->used_idx -= BATCH_QUEUE_SIZE;
+                r->used_wrap = !r->used_wrap;
+            }
+        } else {
+            uint16_t used_idx = batch_readl(r->vq->used) >> 16;
+
+            if (used_idx == r->used_idx) {
+                goto wait;
+            }
+            id = batch_readl(r->vq->used + 4 +
+                             8 * (r->used_idx % BATCH_QUEUE_SIZE));
+            g_assert_cmpint(id % BATCH_DESCS, ==, 0);
+            id /= BATCH_DESCS;
+            r->used_idx++;
+        }
+
+        g_assert_cmpint(id, <, BATCH_REQS);
+        g_assert(!(done & (1u << id)));
+        done |= 1u << id;
+        count--;
+        continue;
+
+wait:
+        g_assert(g_get_monotonic_time() < end);
+        qtest_clock_step(global_qtest, 100);
+    }
+    return done;
+}
+
+static void batch_round(BatchRing *r, unsigned int round)
+{
+    uint8_t data[512];
+    int i;
+
+    for (i = 0; i < BATCH_REQS; i++) {
+        batch_add_rw(r, i, VIRTIO_BLK_T_OUT, i, round * BATCH_REQS + i);
+    }
+    batch_kick(r);
+    g_assert_cmphex(batch_wait(r, BATCH_REQS), ==, (1u << BATCH_REQS) - 1);
+
+    for (i = 0; i < BATCH_REQS; i++) {
+        batch_add_rw(r, i, VIRTIO_BLK_T_IN, i, 0);
+    }
+    batch_kick(r);
+    g_assert_cmphex(batch_wait(r, BATCH_REQS), ==, (1u << BATCH_REQS) - 1);
+
+    for (i = 0; i < BATCH_REQS; i++) {
+        g_assert_cmpint(readb(r->reqs[i] + 16 + 512), ==, VIRTIO_BLK_S_OK);
+        memread(r->reqs[i] + 16, data, sizeof(data));
+        g_assert_cmpint(data[0], ==, (uint8_t)(round * BATCH_REQS + i));
+        g_assert_cmpint(data[511], ==, (uint8_t)(round * BATCH_REQS + i));
+    }
+}
+
+static void batch_test(QVirtioBlkPCI *blk, QGuestAllocator *alloc,
+                       bool packed)
+{
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    static const uint32_t hdr_len[] = { 16 };
+    static const bool hdr_write[] = { false };
+    gint64 end;
+    BatchRing r;
+    unsigned int round;
+    int i;
+
+    if (!blk->pci_vdev.notify_cfg_offset) {
+        g_test_skip("virtio 1.0 is not available");
+        return;
+    }
+    if (packed &&
+        !(qvirtio_get_features(dev) & (1ull << VIRTIO_F_RING_PACKED))) {
+        g_test_skip("packed virtqueues are not available");
+        return;
+    }
+
+    batch_ring_start(&r, dev, alloc, packed);
+    for (round = 0; round < BATCH_ROUNDS; round++) {
+        batch_round(&r, round);
+    }
+
+    /*
+     * A request without an in header in the middle of a burst breaks the
+     * device; the requests popped after it are given back unprocessed.
+     */
+    for (i = 0; i < BATCH_REQS; i++) {
+        if (i == BATCH_REQS / 2) {
+            batch_add(&r, i, 1, hdr_len, hdr_write);
+        } else {
+            batch_add_rw(&r, i, VIRTIO_BLK_T_IN, i, 0);
+        }
+    }
+    batch_kick(&r);
+    end = g_get_monotonic_time() + QVIRTIO_BLK_TIMEOUT_US;
+    while (!(dev->bus->get_status(dev) & VIRTIO_CONFIG_S_NEEDS_RESET)) {
+        g_assert(g_get_monotonic_time() < end);
+        qtest_clock_step(global_qtest, 100);
+    }
+    batch_ring_stop(&r, alloc);
+
+    /* The device works again after a reset */
+    qvirtio_start_device(dev);
+    batch_ring_start(&r, dev, alloc, packed);
+    batch_round(&r, 0);
+    batch_ring_stop(&r, alloc);
+}
+
+static void pool_stats_get(uint64_t *hits, uint64_t *allocs,
+                           uint64_t *unpooled)
+{
+    QDict *rsp, *ret;
+
+    rsp = qmp("{ 'execute': 'qom-get', 'arguments': {"
+              " 'path': '/machine/peripheral/drv0/virtio-backend',"
+              " 'property': 'x-elem-pool-stats' } }");
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(ret);
+    *hits = qdict_get_int(ret, "hits");
+    *allocs = qdict_get_int(ret, "allocs");
+    *unpooled = qdict_get_int(ret, "unpooled");
+    qobject_unref(rsp);
+}
+
+/*
+ * Once the element pool has grown to the number of requests in flight,
+ * every request is served from it and nothing more is allocated.
+ */
+static void pool_stats(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    uint64_t hits, allocs, unpooled;
+    uint64_t hits2, allocs2, unpooled2;
+    unsigned int round;
+    BatchRing r;
+
+    if (!blk->pci_vdev.notify_cfg_offset) {
+        g_test_skip("virtio 1.0 is not available");
+        return;
+    }
+
+    batch_ring_start(&r, &blk->pci_vdev.vdev, t_alloc, false);
+    batch_round(&r, 0);
+    pool_stats_get(&hits, &allocs, &unpooled);
+    g_assert_cmpint(allocs, >, 0);
+    g_assert_cmpint(allocs, <=, BATCH_REQS);
+    g_assert_cmpint(unpooled, ==, 0);
+
+    for (round = 1; round <= BATCH_ROUNDS; round++) {
+        batch_round(&r, round);
+    }
+    pool_stats_get(&hits2, &allocs2, &unpooled2);
+    g_assert_cmpint(hits2 - hits, ==, BATCH_ROUNDS * BATCH_REQS * 2);
+    g_assert_cmpint(allocs2, ==, allocs);
+    g_assert_cmpint(unpooled2, ==, 0);
+
+    batch_ring_stop(&r, t_alloc);
+}
+
+static void batch_split(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    batch_test(obj, t_alloc, false);
+}
+
+static void batch_packed(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    batch_test(obj, t_alloc, true);
+}
+
+/*
+ * Notification coalescing runs on the virtual clock, which only moves
+ * when the test steps it.  These values match the device options that
+ * the coalesce tests are registered with.
+ */
+#define COALESCE_USECS          1000
+#define COALESCE_FRAMES         4
+#define COALESCE_WINDOW_US      10000   /* VIRTIO_COALESCE_WINDOW_US */
+#define COALESCE_RATE_HIGH      100000  /* VIRTIO_COALESCE_RATE_HIGH */
+
+/*
+ * Complete a single read without moving the virtual clock, returns whether
+ * the queue interrupt was raised for it (or for earlier deferred ones).
+ */
+static bool coalesce_request(BatchRing *r)
+{
+    gint64 end = g_get_monotonic_time() + QVIRTIO_BLK_TIMEOUT_US;
+
+    batch_add_rw(r, 0, VIRTIO_BLK_T_IN, 0, 0);
+    batch_kick(r);
+    while ((uint16_t)(batch_readl(r->vq->used) >> 16) == r->used_idx) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(10);
+    }
+    r->used_idx++;
+    g_assert_cmpint(readb(r->reqs[0] + 16 + 512), ==, VIRTIO_BLK_S_OK);
+
+    return r->dev->bus->get_queue_isr_status(r->dev, r->vq);
+}
+
+static void coalesce_step_us(int64_t us)
+{
+    qtest_clock_step(global_qtest, us * 1000);
+}
+
+static bool coalesce_start(QVirtioBlkPCI *blk, QGuestAllocator *alloc,
+                           BatchRing *r)
+{
+    if (!blk->pci_vdev.notify_cfg_offset) {
+        g_test_skip("virtio 1.0 is not available");
+        return false;
+    }
+
+    batch_ring_start(r, &blk->pci_vdev.vdev, alloc, false);
+    return true;
+}
+
+/*
+ * With fixed limits, completions are signalled once COALESCE_FRAMES of
+ * them are pending, or COALESCE_USECS after the first one otherwise.
+ */
+static void coalesce(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    BatchRing r;
+    int i, round;
+
+    if (!coalesce_start(obj, t_alloc, &r)) {
+        return;
+    }
+
+    for (round = 0; round < 3; round++) {
+        for (i = 1; i < COALESCE_FRAMES; i++) {
+            g_assert(!coalesce_request(&r));
+        }
+        g_assert(coalesce_request(&r));
+    }
+
+    for (round = 0; round < 3; round++) {
+        for (i = 1; i < COALESCE_FRAMES; i++) {
+            g_assert(!coalesce_request(&r));
+            coalesce_step_us(COALESCE_USECS / (2 * COALESCE_FRAMES));
+        }
+        g_assert(!r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+        coalesce_step_us(COALESCE_USECS / 2);
+        g_assert(!r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+        coalesce_step_us(COALESCE_USECS / 2);
+        g_assert(r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+    }
+
+    /* The deadline does not move with further completions */
+    g_assert(!coalesce_request(&r));
+    coalesce_step_us(COALESCE_USECS - 1);
+    g_assert(!coalesce_request(&r));
+    coalesce_step_us(1);
+    g_assert(r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+
+    batch_ring_stop(&r, t_alloc);
+}
+
+/*
+ * With adaptive limits, a queue below the low notification rate is
+ * signalled right away, and one above the high rate gets the full
+ * COALESCE_USECS delay.
+ */
+static void coalesce_adaptive(void *obj, void *u_data,
+                              QGuestAllocator *t_alloc)
+{
+    int high = COALESCE_RATE_HIGH / (1000000 / COALESCE_WINDOW_US);
+    BatchRing r;
+    int i;
+
+    if (!coalesce_start(obj, t_alloc, &r)) {
+        return;
+    }
+
+    /* One notification over two windows */
+    coalesce_step_us(2 * COALESCE_WINDOW_US);
+    g_assert(coalesce_request(&r));
+
+    /* Enough notifications over one window to reach the high rate */
+    for (i = 0; i < high; i++) {
+        g_assert(coalesce_request(&r));
+    }
+    coalesce_step_us(COALESCE_WINDOW_US);
+    g_assert(!coalesce_request(&r));
+    coalesce_step_us(COALESCE_USECS / 2);
+    g_assert(!r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+    coalesce_step_us(COALESCE_USECS / 2);
+    g_assert(r.dev->bus->get_queue_isr_status(r.dev, r.vq));
+
+    /* And back to the low rate */
+    coalesce_step_us(2 * COALESCE_WINDOW_US);
+    g_assert(coalesce_request(&r));
+    g_assert(coalesce_request(&r));
+
+    batch_ring_stop(&r, t_alloc);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -797,6 +1392,20 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("notify", "virtio-blk-pci", pci_notify, &opts);
+
+    opts.edge.extra_device_opts = "queue-size=16";
+    qos_add_test("batch-split", "virtio-blk-pci", batch_split, &opts);
+    qos_add_test("pool-stats", "virtio-blk-pci", pool_stats, &opts);
+    opts.edge.extra_device_opts = "queue-size=16,packed=on";
+    qos_add_test("batch-packed", "virtio-blk-pci", batch_packed, &opts);
+    opts.edge.extra_device_opts = "queue-size=16,coalesce-usecs=1000,"
+                                  "coalesce-frames=4";
+    qos_add_test("coalesce", "virtio-blk-pci", coalesce, &opts);
+    opts.edge.extra_device_opts = "queue-size=16,coalesce-usecs=1000,"
+                                  "coalesce-adaptive=on";
+    qos_add_test("coalesce-adaptive", "virtio-blk-pci", coalesce_adaptive,
+                 &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -0,0 +1,676 @@
+/*
+ * Throughput of virtio-net queue pairs, with and without iothreads
+ *
+ * Starts a PC machine with a multiqueue virtio-net-pci device.  The test
+ * acts as the guest driver: it fills the rings of all enabled queue pairs
+ * and keeps them full for the duration of each measurement, re-posting
+ * completed descriptors in batches so that the device, not the qtest
+ * protocol, is the bottleneck.
+ *
+ * Backends:
+ *
+ * - tap (default): frames are sent on the TX queues of 1, 2, 4...
+ *   queue pairs.  They are addressed to a MAC that is not the tap
+ *   interface's, so the host kernel drops them right after receiving
+ *   them, much like the sink of a netperf TCP_STREAM test.  Creating the
+ *   tap interface needs CAP_NET_ADMIN.
+ *
+ * - l2tpv3: a single queue pair sends to an l2tpv3 netdev, which batches
+ *   the frames with sendmmsg(); the datagrams that reach a UDP socket on
+ *   the host are counted too.
+ *
+ * - user: a single queue pair is connected to the user-mode stack.  The
+ *   guest sends UDP datagrams to 10.0.2.2, which slirp forwards to a
+ *   socket on the host loopback, and the host sends UDP datagrams to a
+ *   hostfwd port, which slirp forwards to the guest's RX queue.
+ *
+ * Each configuration is measured with the datapath in the main loop and
+ * with one iothread per queue pair, except l2tpv3 which cannot run in an
+ * iothread.
+ *
+ * Usage:
+ *   QTEST_QEMU_BINARY=x86_64-softmmu/qemu-system-x86_64 \
+ *       tests/qtest/virtio-net-bench [-b backend] [-q queues] [-d duration] \
+ *       [-s size]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include "libqtest.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "libqos/malloc-pc.h"
+#include "libqos/pci-pc.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define PCI_SLOT        0x04
+#define MAX_QUEUES      8
+#define ETH_ZLEN        60
+#define ETH_MAX_LEN     65535
+#define ETH_MTU_LEN     1514
+#define UDP_HDRS_LEN    (14 + 20 + 8)
+#define MAX_RING_SIZE   1024
+#define SINK_BATCH      64
+#define RX_BUF_SIZE     2048
+
+/* The user-mode stack's addresses for the guest and the host */
+#define GUEST_IP        0x0a00020f
+#define HOST_IP         0x0a000202
+#define GUEST_UDP_PORT  9
+
+static const uint8_t guest_mac[ETH_ALEN] = {
+    0x52, 0x54, 0x00, 0x12, 0x34, 0x56
+};
+
+static const char *backend = "tap";
+static unsigned int max_queues = 4;
+static unsigned int duration = 5;
+static unsigned int frame_size = 64;
+
+static int sink_fd = -1;
+static uint16_t sink_port;
+static bool sink_stop;
+static uint64_t sink_frames;
+
+static uint16_t hostfwd_port;
+static bool source_stop;
+static uint64_t source_frames;
+
+static const char commands_string[] =
+    " -b = netdev backend, tap, l2tpv3 or user (default: tap)\n"
+    " -q = maximum number of queue pairs (default: 4, max: 8)\n"
+    " -d = duration of each measurement, in seconds (default: 5)\n"
+    " -s = frame size in bytes, without the virtio-net header (default: 64)";
+
+typedef struct BenchQueue {
+    QVirtQueue *vq;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+    uint64_t frames;
+} BenchQueue;
+
+typedef struct Bench {
+    QTestState *qts;
+    QGuestAllocator alloc;
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    unsigned int queues;
+    bool iothreads;
+    uint32_t hdr_len;
+    uint64_t frame;
+    uint64_t rx_buf;
+    BenchQueue rxq[MAX_QUEUES];
+    BenchQueue txq[MAX_QUEUES];
+} Bench;
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void set_link_up(const char *ifname)
+{
+    struct ifreq ifr = { 0 };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    g_assert(fd >= 0);
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    g_assert(ioctl(fd, SIOCGIFFLAGS, &ifr) == 0);
+    ifr.ifr_flags |= IFF_UP;
+    g_assert(ioctl(fd, SIOCSIFFLAGS, &ifr) == 0);
+    close(fd);
+}
+
+/* Count the datagrams that the netdev sends to the host */
+static void *sink_thread_func(void *arg)
+{
+    static uint8_t bufs[SINK_BATCH][2048];
+    struct mmsghdr msgs[SINK_BATCH];
+    struct iovec iovs[SINK_BATCH];
+    int i, ret;
+
+    for (i = 0; i < SINK_BATCH; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = sizeof(bufs[i]);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!atomic_read(&sink_stop)) {
+        /* Truncated datagrams are counted too */
+        ret = recvmmsg(sink_fd, msgs, SINK_BATCH, MSG_WAITFORONE, NULL);
+        if (ret > 0) {
+            atomic_set_u64(&sink_frames, sink_frames + ret);
+        }
+    }
+    return NULL;
+}
+
+static void sink_open(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    /* Lets the sink thread notice sink_stop */
+    struct timeval timeout = { .tv_usec = 100 * 1000 };
+    socklen_t len = sizeof(addr);
+    int rcvbuf = 16 * 1024 * 1024;
+
+    sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert(sink_fd >= 0);
+    setsockopt(sink_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    g_assert(setsockopt(sink_fd, SOL_SOCKET, SO_RCVTIMEO,
+                        &timeout, sizeof(timeout)) == 0);
+    g_assert(bind(sink_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(sink_fd, (struct sockaddr *)&addr, &len) == 0);
+    sink_port = ntohs(addr.sin_port);
+}
+
+/* Send UDP datagrams to the hostfwd port until source_stop is set */
+static void *source_thread_func(void *arg)
+{
+    static uint8_t payload[ETH_MTU_LEN];
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(hostfwd_port),
+    };
+    struct mmsghdr msgs[SINK_BATCH];
+    struct iovec iov = {
+        .iov_base = payload,
+        .iov_len = frame_size - UDP_HDRS_LEN,
+    };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int i, ret;
+
+    g_assert(fd >= 0);
+    g_assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    for (i = 0; i < SINK_BATCH; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!atomic_read(&source_stop)) {
+        ret = sendmmsg(fd, msgs, SINK_BATCH, 0);
+        if (ret > 0) {
+            atomic_set_u64(&source_frames, source_frames + ret);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Find a free UDP port for hostfwd.  Another process could take it
+ * before QEMU binds it, which is good enough for a benchmark.
+ */
+static uint16_t free_udp_port(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    g_assert(fd >= 0);
+    g_assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static uint16_t ip_checksum(const uint8_t *p, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 2) {
+        sum += lduw_be_p(p + i);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* A UDP datagram from the guest to port @dport of the host */
+static void build_udp_frame(uint8_t *p, uint32_t size, uint16_t dport)
+{
+    uint8_t *ip = p + 14;
+    uint8_t *udp = ip + 20;
+
+    memset(p, 0x52, ETH_ALEN);
+    memcpy(p + ETH_ALEN, guest_mac, ETH_ALEN);
+    stw_be_p(p + 2 * ETH_ALEN, 0x0800);
+
+    ip[0] = 0x45;                       /* version, header length */
+    stw_be_p(ip + 2, size - 14);        /* total length */
+    stw_be_p(ip + 6, 0x4000);           /* don't fragment */
+    ip[8] = 64;                         /* TTL */
+    ip[9] = 17;                         /* UDP */
+    stl_be_p(ip + 12, GUEST_IP);
+    stl_be_p(ip + 16, HOST_IP);
+    stw_be_p(ip + 10, ip_checksum(ip, 20));
+
+    stw_be_p(udp, GUEST_UDP_PORT);
+    stw_be_p(udp + 2, dport);
+    stw_be_p(udp + 4, size - 14 - 20);  /* no checksum */
+}
+
+/* A gratuitous ARP announcement, so that slirp learns the guest's MAC */
+static void build_arp_frame(uint8_t *p)
+{
+    uint8_t *arp = p + 14;
+
+    memset(p, 0xff, ETH_ALEN);
+    memcpy(p + ETH_ALEN, guest_mac, ETH_ALEN);
+    stw_be_p(p + 2 * ETH_ALEN, 0x0806);
+
+    stw_be_p(arp, 1);                   /* Ethernet */
+    stw_be_p(arp + 2, 0x0800);          /* IPv4 */
+    arp[4] = ETH_ALEN;
+    arp[5] = 4;
+    stw_be_p(arp + 6, 1);               /* request */
+    memcpy(arp + 8, guest_mac, ETH_ALEN);
+    stl_be_p(arp + 14, GUEST_IP);
+    stl_be_p(arp + 24, GUEST_IP);
+}
+
+/* Make @n more descriptors available on @q */
+static void post(QTestState *qts, QVirtioDevice *dev, BenchQueue *q,
+                 uint16_t n)
+{
+    uint16_t ring[MAX_RING_SIZE];
+    uint16_t first = q->avail_idx % q->vq->size;
+    uint16_t head = MIN(n, q->vq->size - first);
+    uint16_t i;
+
+    if (!n) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        ring[i] = cpu_to_le16((q->avail_idx + i) % q->vq->size);
+    }
+    /* vq->avail->ring[], which can wrap around */
+    qtest_memwrite(qts, q->vq->avail + 4 + 2 * first, ring, 2 * head);
+    if (head < n) {
+        qtest_memwrite(qts, q->vq->avail + 4, ring + head, 2 * (n - head));
+    }
+    q->avail_idx += n;
+    /* vq->avail->idx */
+    qtest_writew(qts, q->vq->avail + 2, q->avail_idx);
+    dev->bus->virtqueue_kick(dev, q->vq);
+}
+
+/* Point all descriptors of @q to the same buffer */
+static void setup_ring(QTestState *qts, BenchQueue *q, uint64_t addr,
+                       uint32_t len, uint16_t flags)
+{
+    struct vring_desc *desc = g_new0(struct vring_desc, q->vq->size);
+    uint32_t i;
+
+    for (i = 0; i < q->vq->size; i++) {
+        desc[i].addr = cpu_to_le64(addr);
+        desc[i].len = cpu_to_le32(len);
+        desc[i].flags = cpu_to_le16(flags);
+    }
+    qtest_memwrite(qts, q->vq->desc, desc, sizeof(*desc) * q->vq->size);
+    g_free(desc);
+
+    /* Completions are polled; don't take an interrupt for each of them */
+    qtest_writew(qts, q->vq->avail, VRING_AVAIL_F_NO_INTERRUPT);
+    q->avail_idx = 0;
+    q->used_idx = 0;
+    q->frames = 0;
+}
+
+/* Enable @pairs queue pairs through the control virtqueue */
+static void set_queue_pairs(QTestState *qts, QVirtioDevice *dev,
+                            QGuestAllocator *alloc, QVirtQueue *ctrl_vq,
+                            uint16_t pairs)
+{
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+    };
+    uint16_t pairs_le = cpu_to_le16(pairs);
+    uint64_t req = guest_alloc(alloc, 8);
+    uint32_t free_head;
+
+    qtest_memwrite(qts, req, &hdr, sizeof(hdr));
+    qtest_memwrite(qts, req + 2, &pairs_le, sizeof(pairs_le));
+    qtest_writeb(qts, req + 4, 0xff);
+
+    free_head = qvirtqueue_add(qts, ctrl_vq, req, 2, false, true);
+    qvirtqueue_add(qts, ctrl_vq, req + 2, 2, false, true);
+    qvirtqueue_add(qts, ctrl_vq, req + 4, 1, true, false);
+    qvirtqueue_kick(qts, dev, ctrl_vq, free_head);
+    qvirtio_wait_used_elem(qts, dev, ctrl_vq, free_head, NULL,
+                           10 * 1000 * 1000);
+    g_assert_cmpint(qtest_readb(qts, req + 4), ==, VIRTIO_NET_OK);
+    guest_free(alloc, req);
+}
+
+static void bench_init(Bench *b, unsigned int queues, bool iothreads)
+{
+    GString *cmdline = g_string_new("-machine pc -nodefaults");
+    g_autofree char *ifname = g_strdup_printf("vnbench%d", getpid() % 10000);
+    QVirtQueue *ctrl_vq;
+    uint64_t features;
+    unsigned int i;
+
+    memset(b, 0, sizeof(*b));
+    b->queues = queues;
+    b->iothreads = iothreads;
+
+    if (iothreads) {
+        for (i = 0; i < queues; i++) {
+            g_string_append_printf(cmdline, " -object iothread,id=io%u", i);
+        }
+    }
+    if (!strcmp(backend, "l2tpv3")) {
+        g_string_append_printf(cmdline,
+                               " -netdev l2tpv3,id=hn0,udp=on,"
+                               "src=127.0.0.1,srcport=0,"
+                               "dst=127.0.0.1,dstport=%u,"
+                               "txsession=1,rxsession=1",
+                               sink_port);
+    } else if (!strcmp(backend, "user")) {
+        g_string_append_printf(cmdline,
+                               " -netdev user,id=hn0,"
+                               "hostfwd=udp:127.0.0.1:%u-:%u",
+                               hostfwd_port, GUEST_UDP_PORT);
+    } else {
+        g_string_append_printf(cmdline,
+                               " -netdev tap,id=hn0,ifname=%s,queues=%u,"
+                               "vhost=off,script=no,downscript=no",
+                               ifname, queues);
+    }
+    g_string_append_printf(cmdline,
+                           " -device virtio-net-pci,netdev=hn0,mq=on,"
+                           "mac=52:54:00:12:34:56,vectors=%u,addr=%x.0",
+                           2 * queues + 2, PCI_SLOT);
+    if (iothreads) {
+        g_string_append(cmdline, ",iothreads=io0");
+        for (i = 1; i < queues; i++) {
+            g_string_append_printf(cmdline, ":io%u", i);
+        }
+    }
+    b->qts = qtest_init(cmdline->str);
+    g_string_free(cmdline, true);
+    if (!strcmp(backend, "tap")) {
+        set_link_up(ifname);
+    }
+
+    pc_alloc_init(&b->alloc, b->qts, ALLOC_NO_FLAGS);
+    b->bus = qpci_new_pc(b->qts, &b->alloc);
+    b->dev = virtio_pci_new(b->bus, &(QPCIAddress) {
+        .devfn = QPCI_DEVFN(PCI_SLOT, 0),
+    });
+    g_assert(b->dev);
+    qvirtio_pci_device_enable(b->dev);
+    qvirtio_start_device(&b->dev->vdev);
+
+    /* No offloads: every frame is a single buffer with a plain header */
+    features = qvirtio_get_features(&b->dev->vdev) &
+        ((1ull << VIRTIO_NET_F_MQ) | (1ull << VIRTIO_NET_F_CTRL_VQ) |
+         (1ull << VIRTIO_F_VERSION_1));
+    qvirtio_set_features(&b->dev->vdev, features);
+    b->hdr_len = features & (1ull << VIRTIO_F_VERSION_1) ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+        sizeof(struct virtio_net_hdr);
+
+    for (i = 0; i < queues; i++) {
+        b->rxq[i].vq = qvirtqueue_setup(&b->dev->vdev, &b->alloc, 2 * i);
+        b->txq[i].vq = qvirtqueue_setup(&b->dev->vdev, &b->alloc, 2 * i + 1);
+        g_assert_cmpint(b->rxq[i].vq->size, <=, MAX_RING_SIZE);
+        g_assert_cmpint(b->txq[i].vq->size, <=, MAX_RING_SIZE);
+    }
+    ctrl_vq = qvirtqueue_setup(&b->dev->vdev, &b->alloc, 2 * queues);
+    qvirtio_set_driver_ok(&b->dev->vdev);
+    set_queue_pairs(b->qts, &b->dev->vdev, &b->alloc, ctrl_vq, queues);
+
+    /* The header is all zeroes; the frame is filled in by the caller */
+    b->frame = guest_alloc(&b->alloc, b->hdr_len + frame_size);
+    qtest_memset(b->qts, b->frame, 0, b->hdr_len + frame_size);
+    for (i = 0; i < queues; i++) {
+        setup_ring(b->qts, &b->txq[i], b->frame, b->hdr_len + frame_size, 0);
+    }
+
+    /* The RX queues are only filled for the user backend's RX test */
+    b->rx_buf = guest_alloc(&b->alloc, RX_BUF_SIZE);
+    for (i = 0; i < queues; i++) {
+        setup_ring(b->qts, &b->rxq[i], b->rx_buf, RX_BUF_SIZE,
+                   VRING_DESC_F_WRITE);
+    }
+}
+
+static void bench_fini(Bench *b)
+{
+    qvirtio_pci_device_disable(b->dev);
+    qos_object_destroy((QOSGraphObject *)b->dev);
+    qpci_free_pc(b->bus);
+    qtest_quit(b->qts);
+}
+
+static void set_frame(Bench *b, const uint8_t *buf, uint32_t len)
+{
+    qtest_memwrite(b->qts, b->frame + b->hdr_len, buf, len);
+}
+
+/* Send a single frame on the first TX queue and wait for its completion */
+static void send_one(Bench *b)
+{
+    BenchQueue *q = &b->txq[0];
+    int64_t end = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+
+    post(b->qts, &b->dev->vdev, q, 1);
+    /* vq->used->idx */
+    while (qtest_readw(b->qts, q->vq->used + 2) != q->avail_idx) {
+        g_assert(g_get_monotonic_time() < end);
+        g_usleep(1000);
+    }
+    q->used_idx = q->avail_idx;
+}
+
+/*
+ * Keep the rings of @qs full for the duration of the measurement.
+ * Returns the elapsed time in microseconds.
+ */
+static int64_t run(Bench *b, BenchQueue *qs)
+{
+    int64_t start, now, end;
+    unsigned int i;
+
+    for (i = 0; i < b->queues; i++) {
+        qs[i].frames = 0;
+        post(b->qts, &b->dev->vdev, &qs[i],
+             qs[i].vq->size - (uint16_t)(qs[i].avail_idx - qs[i].used_idx));
+    }
+
+    start = g_get_monotonic_time();
+    end = start + duration * G_USEC_PER_SEC;
+    do {
+        for (i = 0; i < b->queues; i++) {
+            /* vq->used->idx */
+            uint16_t used = qtest_readw(b->qts, qs[i].vq->used + 2);
+            uint16_t done = used - qs[i].used_idx;
+
+            qs[i].used_idx = used;
+            qs[i].frames += done;
+            post(b->qts, &b->dev->vdev, &qs[i], done);
+        }
+        now = g_get_monotonic_time();
+    } while (now < end);
+    return now - start;
+}
+
+static void report(Bench *b, const char *dir, BenchQueue *qs, int64_t usecs)
+{
+    uint64_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < b->queues; i++) {
+        total += qs[i].frames;
+    }
+    printf("%-6s %u queue pair(s), %-9s, %s: %8.3f Mpps, %8.2f Gbit/s",
+           backend, b->queues, b->iothreads ? "iothreads" : "main loop",
+           dir, (double)total / usecs,
+           (double)total * frame_size * 8 / usecs / 1000);
+    for (i = 0; i < b->queues; i++) {
+        printf(" q%u=%.3f", i, (double)qs[i].frames / usecs);
+    }
+}
+
+static void bench_tx(Bench *b)
+{
+    uint64_t sunk = atomic_read_u64(&sink_frames);
+    int64_t usecs = run(b, b->txq);
+
+    sunk = atomic_read_u64(&sink_frames) - sunk;
+    report(b, "tx", b->txq, usecs);
+    if (sink_fd >= 0) {
+        printf(", %.3f Mpps delivered", (double)sunk / usecs);
+    }
+    printf("\n");
+}
+
+static void bench_rx(Bench *b)
+{
+    QemuThread source_thread;
+    uint64_t sent;
+    int64_t usecs;
+
+    atomic_set(&source_stop, false);
+    atomic_set_u64(&source_frames, 0);
+    qemu_thread_create(&source_thread, "source", source_thread_func, NULL,
+                       QEMU_THREAD_JOINABLE);
+    usecs = run(b, b->rxq);
+    sent = atomic_read_u64(&source_frames);
+    atomic_set(&source_stop, true);
+    qemu_thread_join(&source_thread);
+
+    report(b, "rx", b->rxq, usecs);
+    printf(", %.3f Mpps offered\n", (double)sent / usecs);
+}
+
+/* Raw frames to a MAC that the host drops */
+static void bench_raw(unsigned int queues, bool iothreads)
+{
+    uint8_t *buf = g_malloc0(frame_size);
+    Bench b;
+
+    bench_init(&b, queues, iothreads);
+    /* Locally administered unicast addresses */
+    memset(buf, 0x02, ETH_ALEN);
+    memset(buf + ETH_ALEN, 0x52, ETH_ALEN);
+    stw_be_p(buf + 2 * ETH_ALEN, 0x88b5); /* local experimental */
+    set_frame(&b, buf, frame_size);
+    bench_tx(&b);
+    bench_fini(&b);
+    g_free(buf);
+}
+
+/* UDP through slirp, to 10.0.2.2 and from a hostfwd port */
+static void bench_user(bool iothreads)
+{
+    uint8_t *buf = g_malloc0(frame_size);
+    Bench b;
+
+    bench_init(&b, 1, iothreads);
+    build_arp_frame(buf);
+    set_frame(&b, buf, ETH_ZLEN);
+    send_one(&b);
+
+    memset(buf, 0, frame_size);
+    build_udp_frame(buf, frame_size, sink_port);
+    set_frame(&b, buf, frame_size);
+    bench_tx(&b);
+    bench_rx(&b);
+    bench_fini(&b);
+    g_free(buf);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hb:q:d:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'b':
+            if (strcmp(optarg, "tap") && strcmp(optarg, "l2tpv3") &&
+                strcmp(optarg, "user")) {
+                usage_complete(argv);
+                exit(1);
+            }
+            backend = optarg;
+            break;
+        case 'q':
+            max_queues = MAX(MIN(atoi(optarg), MAX_QUEUES), 1);
+            break;
+        case 'd':
+            duration = MAX(atoi(optarg), 1);
+            break;
+        case 's':
+            frame_size = MAX(MIN(atoi(optarg), ETH_MAX_LEN), ETH_ZLEN);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QemuThread sink_thread;
+    unsigned int queues;
+
+    parse_args(argc, argv);
+
+    if (!strcmp(backend, "tap")) {
+        if (access("/dev/net/tun", R_OK | W_OK)) {
+            fprintf(stderr, "%s: /dev/net/tun is not accessible\n", argv[0]);
+            return 1;
+        }
+        for (queues = 1; queues <= max_queues; queues *= 2) {
+            bench_raw(queues, false);
+            bench_raw(queues, true);
+        }
+        return 0;
+    }
+
+    sink_open();
+    qemu_thread_create(&sink_thread, "sink", sink_thread_func, NULL,
+                       QEMU_THREAD_JOINABLE);
+    if (!strcmp(backend, "l2tpv3")) {
+        /* l2tpv3 has a single queue and cannot run in an iothread */
+        bench_raw(1, false);
+    } else {
+        /* Datagrams from the host must fit the RX buffers and the MTU */
+        frame_size = MIN(frame_size, ETH_MTU_LEN);
+        hostfwd_port = free_udp_port();
+        bench_user(false);
+        bench_user(true);
+    }
+    atomic_set(&sink_stop, true);
+    qemu_thread_join(&sink_thread);
+    close(sink_fd);
+    return 0;
+}
@@ -217,6 +217,17 @@ static void qht_do_test(unsigned int mode, size_t init_entries)
     insert(10, 150);
     check_n(N);
 
+    /* grow a populated table; lookups must not miss entries being migrated */
+    qht_resize(&ht, N * 4);
+    check(0, N, true);
+    check_n(N);
+    rm(10, 200);
+    check(10, 200, false);
+    check_n(N - 190);
+    insert(10, 200);
+    check(0, N, true);
+    iter_check(N);
+
     qht_reset(&ht);
     insert(0, N);
     rm_nonexist(N, N + 32);
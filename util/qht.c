@@ -43,10 +43,30 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Growing the hash table is done incrementally. The new map is published
+ * right away with a pointer to the old map in new->old; from then on, writers
+ * only operate on the new map. Each head bucket of the old map is migrated
+ * (i.e. its entries are moved into the new map) either on demand, by the
+ * first writer that needs a bucket of the new map the old bucket maps to, or
+ * in batches of QHT_GROW_STEP_BUCKETS by every insertion and removal, which
+ * walk the old map in order. The thread that migrates the last bucket clears
+ * new->old and frees the old map once no RCU readers can see it. Only the
+ * buckets being migrated are locked, so concurrent lookups and writes to
+ * other buckets can proceed, and no thread ever migrates the whole map at
+ * once, except for the operations that hold ht->lock, which first complete
+ * any pending migration.
+ *
+ * Lookups that find new->old set search the old map before the new one;
+ * since migration inserts an entry into the new map before removing it
+ * from the old one, a lookup cannot miss an entry that is being migrated.
+ * Readers that loaded ht->map before the new map was published only search
+ * the old map, whose buckets may be emptied under their feet; a failed
+ * lookup therefore re-reads ht->map and retries if it has changed.
+ *
+ * Shrinking or resetting the hash table is done by taking all bucket spinlocks
+ * (so that no other writers can race with us) and then copying all entries
+ * into a new hash map. Then, the ht->map pointer is set, and the old map is
+ * freed once no RCU readers can see it anymore.
  *
  * Writers check for concurrent resizes by comparing ht->map before and after
  * acquiring their bucket lock. If they don't match, a resize has occured
@@ -68,6 +88,7 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/rcu.h"
 
 //#define QHT_DEBUG
@@ -159,6 +180,15 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @old: map being migrated into this one by an incremental resize, or NULL.
+ *       Set before the map is published; cleared once all of its buckets
+ *       have been migrated.
+ * @old_n_buckets: number of head buckets in @old.
+ * @migrated: bitmap of the head buckets of @old that have already been
+ *            migrated to this map. Bits are only set with the lock of the
+ *            corresponding @old bucket and of all buckets it maps to held.
+ * @n_migrated: number of bits set in @migrated.
+ * @grow_next: next head bucket of @old to be migrated by qht_grow_step().
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -168,14 +198,28 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    struct qht_map *old;
+    size_t old_n_buckets;
+    unsigned long *migrated;
+    size_t n_migrated;
+    size_t grow_next;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
 #define QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV 8
 
+/* number of old head buckets migrated by each write during a grow */
+#define QHT_GROW_STEP_BUCKETS 4
+
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new,
                                 bool reset);
 static void qht_grow_maybe(struct qht *ht);
+static void qht_do_grow(struct qht *ht, struct qht_map *new);
+static void qht_map_destroy(struct qht_map *map);
+static void *qht_insert__locked(const struct qht *ht, struct qht_map *map,
+                                struct qht_bucket *head, void *p, uint32_t hash,
+                                bool *needs_resize);
+static void qht_bucket_reset__locked(struct qht_bucket *head);
 
 #ifdef QHT_DEBUG
 
@@ -275,41 +319,149 @@ static inline bool qht_map_is_stale__locked(const struct qht *ht,
 }
 
 /*
- * Grab all bucket locks, and set @pmap after making sure the map isn't stale.
+ * Return true if the head bucket of @map->old whose entries can map to
+ * @hash has not been migrated to @map yet.
+ *
+ * Call with the bucket lock of @hash in @map held.
+ */
+static inline bool qht_map_needs_migration__locked(const struct qht_map *map,
+                                                   uint32_t hash)
+{
+    return unlikely(atomic_read(&map->old)) &&
+           !test_bit(hash & (map->old_n_buckets - 1), map->migrated);
+}
+
+/*
+ * Complete the grow of @map from @old once all of its buckets are migrated.
+ * Both the last migrator and qht_grow_finish__htlocked() can get here, so
+ * only the first of them frees @old.
+ */
+static void qht_map_grow_done(struct qht_map *map, struct qht_map *old)
+{
+    /* all entries are in @map now; see qht_lookup_custom() */
+    if (atomic_cmpxchg(&map->old, old, NULL) == old) {
+        call_rcu(old, qht_map_destroy, rcu);
+    }
+}
+
+/*
+ * Move the entries in the head bucket @idx of @old to @map, which is being
+ * grown from @old.
  *
- * Pairs with qht_map_unlock_buckets(), hence the pass-by-reference.
+ * Besides the old bucket, this locks every bucket of @map that entries of
+ * the old bucket can map to (in increasing order), so that concurrent writers
+ * to those buckets see either none or all of the migrated entries.
+ * Whoever migrates the last bucket completes the grow.
  *
- * Note: callers cannot have ht->lock held.
+ * Note: callers cannot hold any bucket lock, and must be in an RCU read-side
+ * critical section if they do not hold ht->lock.
  */
-static inline
-void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
+static void qht_map_migrate_bucket(const struct qht *ht, struct qht_map *map,
+                                   struct qht_map *old, size_t idx)
+{
+    struct qht_bucket *head = &old->buckets[idx];
+    struct qht_bucket *b;
+    size_t i;
+    int j;
+
+    qemu_spin_lock(&head->lock);
+    if (test_bit(idx, map->migrated)) {
+        qemu_spin_unlock(&head->lock);
+        return;
+    }
+    for (i = idx; i < map->n_buckets; i += old->n_buckets) {
+        qemu_spin_lock(&map->buckets[i].lock);
+    }
+
+    /*
+     * Insert into the new map before removing from the old one; this is what
+     * allows lookups to search the old map first without missing entries.
+     */
+    b = head;
+    do {
+        for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+            void *p = b->pointers[j];
+            uint32_t hash = b->hashes[j];
+
+            if (p == NULL) {
+                goto done;
+            }
+            qht_insert__locked(ht, map, qht_map_to_bucket(map, hash), p, hash,
+                               NULL);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    qht_bucket_reset__locked(head);
+    set_bit_atomic(idx, map->migrated);
+
+    for (i = idx; i < map->n_buckets; i += old->n_buckets) {
+        qht_bucket_debug__locked(&map->buckets[i]);
+        qemu_spin_unlock(&map->buckets[i].lock);
+    }
+    qemu_spin_unlock(&head->lock);
+
+    if (atomic_fetch_inc(&map->n_migrated) + 1 == map->old_n_buckets) {
+        qht_map_grow_done(map, old);
+    }
+}
+
+/*
+ * Migrate the next few buckets of an ongoing grow, if any.
+ *
+ * Note: callers cannot hold any bucket lock.
+ */
+static void qht_grow_step(struct qht *ht)
 {
     struct qht_map *map;
+    struct qht_map *old;
+    size_t idx;
+    int i;
 
+    rcu_read_lock();
     map = atomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        for (i = 0; i < QHT_GROW_STEP_BUCKETS; i++) {
+            idx = atomic_fetch_inc(&map->grow_next);
+            if (idx >= map->old_n_buckets) {
+                break;
+            }
+            qht_map_migrate_bucket(ht, map, old, idx);
+        }
     }
-    qht_map_unlock_buckets(map);
+    rcu_read_unlock();
+}
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    qht_map_lock_buckets(map);
-    qht_unlock(ht);
-    *pmap = map;
-    return;
+/*
+ * Complete an ongoing grow, if any.
+ * Call with ht->lock held.
+ */
+static void qht_grow_finish__htlocked(struct qht *ht)
+{
+    struct qht_map *map = ht->map;
+    struct qht_map *old;
+    size_t i;
+
+    rcu_read_lock();
+    old = atomic_rcu_read(&map->old);
+    if (old) {
+        for (i = 0; i < map->old_n_buckets; i++) {
+            qht_map_migrate_bucket(ht, map, old, i);
+        }
+        qht_map_grow_done(map, old);
+    }
+    rcu_read_unlock();
 }
 
 /*
- * Get a head bucket and lock it, making sure its parent map is not stale.
+ * Get a head bucket and lock it, making sure its parent map is not stale
+ * and that no entries that map to it are still pending migration.
  * @pmap is filled with a pointer to the bucket's parent map.
  *
  * Unlock with qemu_spin_unlock(&b->lock).
  *
- * Note: callers cannot have ht->lock held.
+ * Note: callers cannot hold any bucket lock.
  */
 static inline
 struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
@@ -317,25 +469,33 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
 {
     struct qht_bucket *b;
     struct qht_map *map;
+    struct qht_map *old;
 
-    map = atomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    for (;;) {
+        map = atomic_rcu_read(&ht->map);
+        b = qht_map_to_bucket(map, hash);
 
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
-    }
-    qemu_spin_unlock(&b->lock);
+        qemu_spin_lock(&b->lock);
+        if (unlikely(qht_map_is_stale__locked(ht, map))) {
+            /* we raced with a resize; retry with the updated ht->map */
+            qemu_spin_unlock(&b->lock);
+            continue;
+        }
+        if (likely(!qht_map_needs_migration__locked(map, hash))) {
+            *pmap = map;
+            return b;
+        }
+        qemu_spin_unlock(&b->lock);
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qht_unlock(ht);
-    *pmap = map;
-    return b;
+        /* @map->old is freed after an RCU grace period; keep it alive */
+        rcu_read_lock();
+        old = atomic_rcu_read(&map->old);
+        if (old) {
+            qht_map_migrate_bucket(ht, map, old,
+                                   hash & (map->old_n_buckets - 1));
+        }
+        rcu_read_unlock();
+    }
 }
 
 static inline bool qht_map_needs_resize(const struct qht_map *map)
@@ -364,6 +524,7 @@ static void qht_map_destroy(struct qht_map *map)
         qht_chain_destroy(&map->buckets[i]);
     }
     qemu_vfree(map->buckets);
+    g_free(map->migrated);
     g_free(map);
 }
 
@@ -376,6 +537,11 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
+    map->old = NULL;
+    map->old_n_buckets = 0;
+    map->migrated = NULL;
+    map->n_migrated = 0;
+    map->grow_next = 0;
     map->n_added_buckets_threshold = n_buckets /
         QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
 
@@ -409,6 +575,10 @@ void qht_init(struct qht *ht, qht_cmp_func_t cmp, size_t n_elems,
 /* call only when there are no readers/writers left */
 void qht_destroy(struct qht *ht)
 {
+    /* a grow that is still in progress owns the old map */
+    if (ht->map->old) {
+        qht_map_destroy(ht->map->old);
+    }
     qht_map_destroy(ht->map);
     memset(ht, 0, sizeof(*ht));
 }
@@ -448,9 +618,13 @@ void qht_reset(struct qht *ht)
 {
     struct qht_map *map;
 
-    qht_map_lock_buckets__no_stale(ht, &map);
+    qht_lock(ht);
+    qht_grow_finish__htlocked(ht);
+    map = ht->map;
+    qht_map_lock_buckets(map);
     qht_map_reset__all_locked(map);
     qht_map_unlock_buckets(map);
+    qht_unlock(ht);
 }
 
 static inline void qht_do_resize(struct qht *ht, struct qht_map *new)
@@ -472,6 +646,7 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     n_buckets = qht_elems_to_buckets(n_elems);
 
     qht_lock(ht);
+    qht_grow_finish__htlocked(ht);
     map = ht->map;
     if (n_buckets != map->n_buckets) {
         new = qht_map_create(n_buckets);
@@ -523,15 +698,14 @@ void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
     return ret;
 }
 
-void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
-                        qht_lookup_func_t func)
+static inline
+void *qht_map_lookup(const struct qht_map *map, const void *userp,
+                     uint32_t hash, qht_lookup_func_t func)
 {
     const struct qht_bucket *b;
-    const struct qht_map *map;
     unsigned int version;
     void *ret;
 
-    map = atomic_rcu_read(&ht->map);
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
@@ -546,6 +720,46 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     return qht_lookup__slowpath(b, func, userp, hash);
 }
 
+void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
+                        qht_lookup_func_t func)
+{
+    const struct qht_map *map;
+    const struct qht_map *old;
+    const struct qht_map *new;
+    void *ret;
+
+    map = atomic_rcu_read(&ht->map);
+    for (;;) {
+        old = atomic_rcu_read(&map->old);
+        /*
+         * During an incremental resize, entries are moved to @map before
+         * being removed from @old, so @old must be searched first.
+         */
+        if (unlikely(old)) {
+            ret = qht_map_lookup(old, userp, hash, func);
+            if (ret) {
+                return ret;
+            }
+        }
+        ret = qht_map_lookup(map, userp, hash, func);
+        if (likely(ret)) {
+            return ret;
+        }
+        /*
+         * If @map has been grown since we loaded it, the entry might have
+         * been migrated out of it while we were looking; retry. The barrier
+         * pairs with the publication of the new map, which happens before
+         * any bucket of @map is reset.
+         */
+        smp_rmb();
+        new = atomic_rcu_read(&ht->map);
+        if (likely(new == map)) {
+            return NULL;
+        }
+        map = new;
+    }
+}
+
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
 {
     return qht_lookup_custom(ht, userp, hash, ht->cmp);
@@ -612,12 +826,13 @@ static __attribute__((noinline)) void qht_grow_maybe(struct qht *ht)
     if (qht_trylock(ht)) {
         return;
     }
+    qht_grow_finish__htlocked(ht);
     map = ht->map;
     /* another thread might have just performed the resize we were after */
     if (qht_map_needs_resize(map)) {
         struct qht_map *new = qht_map_create(map->n_buckets * 2);
 
-        qht_do_resize(ht, new);
+        qht_do_grow(ht, new);
     }
     qht_unlock(ht);
 }
@@ -627,6 +842,7 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
     struct qht_bucket *b;
     struct qht_map *map;
     bool needs_resize = false;
+    bool growing;
     void *prev;
 
     /* NULL pointers are not supported */
@@ -634,10 +850,13 @@ bool qht_insert(struct qht *ht, void *p, uint32_t hash, void **existing)
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
     prev = qht_insert__locked(ht, map, b, p, hash, &needs_resize);
+    growing = atomic_read(&map->old);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
 
-    if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
+    if (unlikely(growing)) {
+        qht_grow_step(ht);
+    } else if (unlikely(needs_resize) && ht->mode & QHT_MODE_AUTO_RESIZE) {
         qht_grow_maybe(ht);
     }
     if (likely(prev == NULL)) {
@@ -738,6 +957,7 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
 {
     struct qht_bucket *b;
     struct qht_map *map;
+    bool growing;
     bool ret;
 
     /* NULL pointers are not supported */
@@ -745,8 +965,13 @@ bool qht_remove(struct qht *ht, const void *p, uint32_t hash)
 
     b = qht_bucket_lock__no_stale(ht, hash, &map);
     ret = qht_remove__locked(b, p, hash);
+    growing = atomic_read(&map->old);
     qht_bucket_debug__locked(b);
     qemu_spin_unlock(&b->lock);
+
+    if (unlikely(growing)) {
+        qht_grow_step(ht);
+    }
     return ret;
 }
 
@@ -802,10 +1027,13 @@ do_qht_iter(struct qht *ht, const struct qht_iter *iter, void *userp)
 {
     struct qht_map *map;
 
-    map = atomic_rcu_read(&ht->map);
+    qht_lock(ht);
+    qht_grow_finish__htlocked(ht);
+    map = ht->map;
     qht_map_lock_buckets(map);
     qht_map_iter__all_locked(map, iter, userp);
     qht_map_unlock_buckets(map);
+    qht_unlock(ht);
 }
 
 void qht_iter(struct qht *ht, qht_iter_func_t func, void *userp)
@@ -844,6 +1072,25 @@ static void qht_map_copy(void *p, uint32_t hash, void *userp)
     qht_insert__locked(ht, new, b, p, hash, NULL);
 }
 
+/*
+ * Start growing the hash table into @new. The buckets of the current map
+ * are migrated by subsequent writers, a few at a time (see qht_grow_step()),
+ * or on demand when they need a bucket that has not been migrated yet (see
+ * qht_bucket_lock__no_stale()).
+ * Call with ht->lock held and no grow in progress.
+ */
+static void qht_do_grow(struct qht *ht, struct qht_map *new)
+{
+    struct qht_map *old = ht->map;
+
+    g_assert(new->n_buckets > old->n_buckets);
+    g_assert(old->old == NULL);
+    new->migrated = bitmap_new(old->n_buckets);
+    new->old_n_buckets = old->n_buckets;
+    new->old = old;
+    atomic_rcu_set(&ht->map, new);
+}
+
 /*
  * Atomically perform a resize and/or reset.
  * Call with ht->lock held.
@@ -886,11 +1133,16 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     size_t ret = false;
 
     qht_lock(ht);
+    qht_grow_finish__htlocked(ht);
     if (n_buckets != ht->map->n_buckets) {
         struct qht_map *new;
 
         new = qht_map_create(n_buckets);
-        qht_do_resize(ht, new);
+        if (n_buckets > ht->map->n_buckets) {
+            qht_do_grow(ht, new);
+        } else {
+            qht_do_resize(ht, new);
+        }
         ret = true;
     }
     qht_unlock(ht);
@@ -898,10 +1150,42 @@ bool qht_resize(struct qht *ht, size_t n_elems)
     return ret;
 }
 
+/* return the number of entries in @head's chain; @pbuckets gets its length */
+static size_t qht_bucket_count(const struct qht_bucket *head,
+                               size_t *pbuckets)
+{
+    const struct qht_bucket *b;
+    unsigned int version;
+    size_t buckets;
+    size_t entries;
+    int j;
+
+    do {
+        version = seqlock_read_begin(&head->sequence);
+        buckets = 0;
+        entries = 0;
+        b = head;
+        do {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                if (atomic_read(&b->pointers[j]) == NULL) {
+                    break;
+                }
+                entries++;
+            }
+            buckets++;
+            b = atomic_rcu_read(&b->next);
+        } while (b);
+    } while (seqlock_read_retry(&head->sequence, version));
+
+    *pbuckets = buckets;
+    return entries;
+}
+
 /* pass @stats to qht_statistics_destroy() when done */
 void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
 {
     const struct qht_map *map;
+    const struct qht_map *old;
     int i;
 
     map = atomic_rcu_read(&ht->map);
@@ -917,30 +1201,23 @@ void qht_statistics_init(const struct qht *ht, struct qht_stats *stats)
     }
     stats->head_buckets = map->n_buckets;
 
+    /* count the entries that an ongoing grow has not migrated yet */
+    rcu_read_lock();
+    old = atomic_rcu_read(&map->old);
+    if (unlikely(old)) {
+        for (i = 0; i < old->n_buckets; i++) {
+            size_t buckets;
+
+            stats->entries += qht_bucket_count(&old->buckets[i], &buckets);
+        }
+    }
+    rcu_read_unlock();
+
     for (i = 0; i < map->n_buckets; i++) {
-        const struct qht_bucket *head = &map->buckets[i];
-        const struct qht_bucket *b;
-        unsigned int version;
         size_t buckets;
         size_t entries;
-        int j;
 
-        do {
-            version = seqlock_read_begin(&head->sequence);
-            buckets = 0;
-            entries = 0;
-            b = head;
-            do {
-                for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
-                    if (atomic_read(&b->pointers[j]) == NULL) {
-                        break;
-                    }
-                    entries++;
-                }
-                buckets++;
-                b = atomic_rcu_read(&b->next);
-            } while (b);
-        } while (seqlock_read_retry(&head->sequence, version));
+        entries = qht_bucket_count(&map->buckets[i], &buckets);
 
         if (entries) {
             qdist_inc(&stats->chain, buckets);
@@ -24,6 +24,13 @@
  * synchronization objects this might be expensive, but note that it is
  * very rarely called -- reports are generated only when requested by users.
  *
+ * For the BQL, the unlock function is intercepted too, so that QSP also
+ * tracks for how long the lock is held after being taken at each call site,
+ * including a histogram of the hold times. Long hold times stall vCPUs that
+ * need the BQL, e.g. for MMIO. A condition variable wait on the BQL ends the
+ * current hold; the hold that follows the wakeup is attributed to the wait's
+ * call site.
+ *
  * Reports are generated as a table where each row represents a call site. A
  * call site is the triplet formed by the __file__ and __LINE__ of the caller
  * as well as the address of the "object" (i.e. mutex, rec. mutex or condvar)
@@ -64,6 +71,7 @@
 #include "qemu/qht.h"
 #include "qemu/rcu.h"
 #include "qemu/xxhash.h"
+#include "qapi/qapi-types-misc.h"
 
 enum QSPType {
     QSP_MUTEX,
@@ -85,6 +93,10 @@ struct QSPEntry {
     const QSPCallSite *callsite;
     uint64_t n_acqs;
     uint64_t ns;
+    /* BQL only */
+    uint64_t n_holds;
+    uint64_t hold_ns;
+    uint64_t hold_hist[QSP_HOLD_HIST_BUCKETS];
     unsigned int n_objs; /* count of coalesced objs; only used for reporting */
 };
 typedef struct QSPEntry QSPEntry;
@@ -107,6 +119,17 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+/*
+ * Bumped by qsp_enable().  The BQL can be taken or released with profiling
+ * disabled, so a hold is only valid in the generation it began in.
+ */
+static unsigned int qsp_gen;
+
+/* the entry the BQL is held for by this thread, if any, and since when */
+static __thread QSPEntry *qsp_bql_entry;
+static __thread int64_t qsp_bql_t0;
+static __thread unsigned int qsp_bql_gen;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -125,6 +148,7 @@ static const char * const qsp_typenames[] = {
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
+QemuMutexUnlockFunc qemu_bql_mutex_unlock_func = qemu_mutex_unlock_impl;
 QemuMutexLockFunc qemu_mutex_lock_func = qemu_mutex_lock_impl;
 QemuMutexTrylockFunc qemu_mutex_trylock_func = qemu_mutex_trylock_impl;
 QemuRecMutexLockFunc qemu_rec_mutex_lock_func = qemu_rec_mutex_lock_impl;
@@ -357,6 +381,51 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
     do_qsp_entry_record(e, delta, true);
 }
 
+static inline void qsp_bql_hold_begin(QSPEntry *e, int64_t t)
+{
+    qsp_bql_entry = e;
+    qsp_bql_t0 = t;
+    qsp_bql_gen = atomic_read(&qsp_gen);
+}
+
+/* drop a hold left over from before profiling was last re-enabled */
+static inline QSPEntry *qsp_bql_current(void)
+{
+    if (qsp_bql_entry && qsp_bql_gen != atomic_read(&qsp_gen)) {
+        qsp_bql_entry = NULL;
+    }
+    return qsp_bql_entry;
+}
+
+static int qsp_hold_bucket(int64_t ns)
+{
+    int64_t limit = 1000;
+    int i;
+
+    for (i = 0; i < QSP_HOLD_HIST_BUCKETS - 1 && ns >= limit; i++) {
+        limit *= 10;
+    }
+    return i;
+}
+
+/* as with do_qsp_entry_record, only the current thread writes to the entry */
+static void qsp_bql_hold_end(int64_t t)
+{
+    QSPEntry *e = qsp_bql_current();
+    int64_t delta;
+    int i;
+
+    if (e == NULL) {
+        return;
+    }
+    delta = t - qsp_bql_t0;
+    i = qsp_hold_bucket(delta);
+    atomic_set_u64(&e->hold_ns, e->hold_ns + delta);
+    atomic_set_u64(&e->n_holds, e->n_holds + 1);
+    atomic_set_u64(&e->hold_hist[i], e->hold_hist[i] + 1);
+    qsp_bql_entry = NULL;
+}
+
 #define QSP_GEN_VOID(type_, qsp_t_, func_, impl_)                       \
     static void func_(type_ *obj, const char *file, int line)           \
     {                                                                   \
@@ -387,7 +456,6 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
         return err;                                                     \
     }
 
-QSP_GEN_VOID(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_VOID(QemuMutex, QSP_MUTEX, qsp_mutex_lock, qemu_mutex_lock_impl)
 QSP_GEN_RET1(QemuMutex, QSP_MUTEX, qsp_mutex_trylock, qemu_mutex_trylock_impl)
 
@@ -399,18 +467,52 @@ QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
 
+static void qsp_bql_mutex_lock(QemuMutex *mutex, const char *file, int line)
+{
+    QSPEntry *e;
+    int64_t t0, t1;
+
+    t0 = get_clock();
+    qemu_mutex_lock_impl(mutex, file, line);
+    t1 = get_clock();
+
+    e = qsp_entry_get(mutex, file, line, QSP_BQL_MUTEX);
+    qsp_entry_record(e, t1 - t0);
+    qsp_bql_hold_begin(e, t1);
+}
+
+static void qsp_bql_mutex_unlock(QemuMutex *mutex, const char *file, int line)
+{
+    qsp_bql_hold_end(get_clock());
+    qemu_mutex_unlock_impl(mutex, file, line);
+}
+
+static inline bool qsp_bql_held(QemuMutex *mutex)
+{
+    QSPEntry *e = qsp_bql_current();
+
+    return e && e->callsite->obj == mutex;
+}
+
 static void
 qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
 {
     QSPEntry *e;
     int64_t t0, t1;
+    bool bql = qsp_bql_held(mutex);
 
     t0 = get_clock();
+    if (bql) {
+        qsp_bql_hold_end(t0);
+    }
     qemu_cond_wait_impl(cond, mutex, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
     qsp_entry_record(e, t1 - t0);
+    if (bql) {
+        qsp_bql_hold_begin(qsp_entry_get(mutex, file, line, QSP_BQL_MUTEX), t1);
+    }
 }
 
 static bool
@@ -419,14 +521,21 @@ qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
 {
     QSPEntry *e;
     int64_t t0, t1;
+    bool bql = qsp_bql_held(mutex);
     bool ret;
 
     t0 = get_clock();
+    if (bql) {
+        qsp_bql_hold_end(t0);
+    }
     ret = qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
     qsp_entry_record(e, t1 - t0);
+    if (bql) {
+        qsp_bql_hold_begin(qsp_entry_get(mutex, file, line, QSP_BQL_MUTEX), t1);
+    }
     return ret;
 }
 
@@ -437,9 +546,11 @@ bool qsp_is_enabled(void)
 
 void qsp_enable(void)
 {
+    atomic_inc(&qsp_gen);
     atomic_set(&qemu_mutex_lock_func, qsp_mutex_lock);
     atomic_set(&qemu_mutex_trylock_func, qsp_mutex_trylock);
     atomic_set(&qemu_bql_mutex_lock_func, qsp_bql_mutex_lock);
+    atomic_set(&qemu_bql_mutex_unlock_func, qsp_bql_mutex_unlock);
     atomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock);
     atomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
     atomic_set(&qemu_cond_wait_func, qsp_cond_wait);
@@ -451,6 +562,7 @@ void qsp_disable(void)
     atomic_set(&qemu_mutex_lock_func, qemu_mutex_lock_impl);
     atomic_set(&qemu_mutex_trylock_func, qemu_mutex_trylock_impl);
     atomic_set(&qemu_bql_mutex_lock_func, qemu_mutex_lock_impl);
+    atomic_set(&qemu_bql_mutex_unlock_func, qemu_mutex_unlock_impl);
     atomic_set(&qemu_rec_mutex_lock_func, qemu_rec_mutex_lock_impl);
     atomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
     atomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
@@ -485,6 +597,25 @@ static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
         }
         break;
     }
+    case QSP_SORT_BY_TOTAL_HOLD_TIME:
+        if (a->hold_ns > b->hold_ns) {
+            return -1;
+        } else if (a->hold_ns < b->hold_ns) {
+            return 1;
+        }
+        break;
+    case QSP_SORT_BY_AVG_HOLD_TIME:
+    {
+        double avg_a = a->n_holds ? a->hold_ns / a->n_holds : 0;
+        double avg_b = b->n_holds ? b->hold_ns / b->n_holds : 0;
+
+        if (avg_a > avg_b) {
+            return -1;
+        } else if (avg_a < avg_b) {
+            return 1;
+        }
+        break;
+    }
     default:
         g_assert_not_reached();
     }
@@ -525,6 +656,18 @@ static void qsp_sort(void *p, uint32_t h, void *userp)
     g_tree_insert(tree, e, NULL);
 }
 
+/* @e might be in the global hash table, so read from it atomically */
+static void qsp_entry_add_holds(QSPEntry *agg, const QSPEntry *e)
+{
+    int i;
+
+    agg->hold_ns += atomic_read_u64(&e->hold_ns);
+    agg->n_holds += atomic_read_u64(&e->n_holds);
+    for (i = 0; i < QSP_HOLD_HIST_BUCKETS; i++) {
+        agg->hold_hist[i] += atomic_read_u64(&e->hold_hist[i]);
+    }
+}
+
 static void qsp_aggregate(void *p, uint32_t h, void *up)
 {
     struct qht *ht = up;
@@ -540,6 +683,7 @@ static void qsp_aggregate(void *p, uint32_t h, void *up)
      */
     agg->ns += atomic_read_u64(&e->ns);
     agg->n_acqs += atomic_read_u64(&e->n_acqs);
+    qsp_entry_add_holds(agg, e);
 }
 
 static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
@@ -547,6 +691,7 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     struct qht *ht = htp;
     QSPEntry *old = p;
     QSPEntry *new;
+    int i;
 
     new = qht_lookup(ht, old, hash);
     /* entries are never deleted, so we must have this one */
@@ -554,12 +699,18 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     /* our reading of the stats happened after the snapshot was taken */
     g_assert(new->n_acqs >= old->n_acqs);
     g_assert(new->ns >= old->ns);
+    g_assert(new->n_holds >= old->n_holds);
 
     new->n_acqs -= old->n_acqs;
     new->ns -= old->ns;
+    new->n_holds -= old->n_holds;
+    new->hold_ns -= old->hold_ns;
+    for (i = 0; i < QSP_HOLD_HIST_BUCKETS; i++) {
+        new->hold_hist[i] -= old->hold_hist[i];
+    }
 
     /* No point in reporting an empty entry */
-    if (new->n_acqs == 0 && new->ns == 0) {
+    if (new->n_acqs == 0 && new->ns == 0 && new->n_holds == 0) {
         bool removed = qht_remove(ht, new, hash);
 
         g_assert(removed);
@@ -589,6 +740,7 @@ static void qsp_iter_callsite_coalesce(void *p, uint32_t h, void *htp)
     }
     e->ns += old->ns;
     e->n_acqs += old->n_acqs;
+    qsp_entry_add_holds(e, old);
 }
 
 static void qsp_ht_delete(void *p, uint32_t h, void *htp)
@@ -664,8 +816,15 @@ struct QSPReportEntry {
     const char *typename;
     double time_s;
     double ns_avg;
+    uint64_t ns;
     uint64_t n_acqs;
     unsigned int n_objs;
+    bool bql;
+    double hold_s;
+    double hold_ns_avg;
+    uint64_t hold_ns;
+    uint64_t n_holds;
+    uint64_t hold_hist[QSP_HOLD_HIST_BUCKETS];
 };
 typedef struct QSPReportEntry QSPReportEntry;
 
@@ -673,6 +832,7 @@ struct QSPReport {
     QSPReportEntry *entries;
     size_t n_entries;
     size_t max_n_entries;
+    bool holds_only;
 };
 typedef struct QSPReport QSPReport;
 
@@ -685,6 +845,9 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     if (report->n_entries == report->max_n_entries) {
         return TRUE;
     }
+    if (report->holds_only && !e->n_holds) {
+        return FALSE;
+    }
     entry = &report->entries[report->n_entries];
     report->n_entries++;
 
@@ -693,8 +856,15 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     entry->callsite_at = qsp_at(e->callsite);
     entry->typename = qsp_typenames[e->callsite->type];
     entry->time_s = e->ns * 1e-9;
+    entry->ns = e->ns;
     entry->n_acqs = e->n_acqs;
     entry->ns_avg = e->n_acqs ? e->ns / e->n_acqs : 0;
+    entry->bql = e->callsite->type == QSP_BQL_MUTEX;
+    entry->hold_s = e->hold_ns * 1e-9;
+    entry->hold_ns = e->hold_ns;
+    entry->n_holds = e->n_holds;
+    entry->hold_ns_avg = e->n_holds ? e->hold_ns / e->n_holds : 0;
+    memcpy(entry->hold_hist, e->hold_hist, sizeof(entry->hold_hist));
     return FALSE;
 }
 
@@ -753,6 +923,63 @@ static void pr_report(const QSPReport *rep)
     g_free(dashes);
 }
 
+static const char * const qsp_hold_hist_names[QSP_HOLD_HIST_BUCKETS] = {
+    "<1us", "<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms",
+};
+
+static void pr_report_holds(const QSPReport *rep)
+{
+    char *dashes;
+    size_t max_len = 0;
+    int callsite_len = 0;
+    int callsite_rspace;
+    int n_dashes;
+    size_t i;
+    int j;
+
+    for (i = 0; i < rep->n_entries; i++) {
+        size_t len = strlen(rep->entries[i].callsite_at);
+
+        if (len > max_len) {
+            max_len = len;
+        }
+    }
+
+    callsite_len = MAX(max_len, strlen("Call site"));
+    callsite_rspace = callsite_len - strlen("Call site");
+
+    qemu_printf("Call site%*s  Hold Time (s)         Count  Average (us)",
+                callsite_rspace, "");
+    for (j = 0; j < QSP_HOLD_HIST_BUCKETS; j++) {
+        qemu_printf("  %8s", qsp_hold_hist_names[j]);
+    }
+    qemu_printf("\n");
+
+    n_dashes = callsite_len + 45 + 10 * QSP_HOLD_HIST_BUCKETS;
+    dashes = g_malloc(n_dashes + 1);
+    memset(dashes, '-', n_dashes);
+    dashes[n_dashes] = '\0';
+    qemu_printf("%s\n", dashes);
+
+    for (i = 0; i < rep->n_entries; i++) {
+        const QSPReportEntry *e = &rep->entries[i];
+        GString *s = g_string_new(NULL);
+
+        g_string_append_printf(s, "%s%*s  %13.5f  %12" PRIu64 "  %12.2f",
+                               e->callsite_at,
+                               callsite_len - (int)strlen(e->callsite_at), "",
+                               e->hold_s, e->n_holds, e->hold_ns_avg * 1e-3);
+        for (j = 0; j < QSP_HOLD_HIST_BUCKETS; j++) {
+            g_string_append_printf(s, "  %8" PRIu64, e->hold_hist[j]);
+        }
+        qemu_printf("%s\n", s->str);
+        g_string_free(s, TRUE);
+    }
+
+    qemu_printf("%s\n", dashes);
+    g_free(dashes);
+}
+
 static void report_destroy(QSPReport *rep)
 {
     size_t i;
@@ -765,24 +992,81 @@ static void report_destroy(QSPReport *rep)
     g_free(rep->entries);
 }
 
-void qsp_report(size_t max, enum QSPSortBy sort_by,
-                bool callsite_coalesce)
+static void qsp_report_build(QSPReport *rep, size_t max,
+                             enum QSPSortBy sort_by, bool callsite_coalesce)
 {
     GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
-    QSPReport rep;
 
     qsp_init();
+    qsp_mktree(tree, callsite_coalesce);
 
-    rep.entries = g_new0(QSPReportEntry, max);
-    rep.n_entries = 0;
-    rep.max_n_entries = max;
+    /* @max comes from the user, there cannot be more entries than nodes */
+    max = MIN(max, g_tree_nnodes(tree));
+    rep->entries = g_new0(QSPReportEntry, max);
+    rep->n_entries = 0;
+    rep->max_n_entries = max;
+    rep->holds_only = sort_by == QSP_SORT_BY_TOTAL_HOLD_TIME ||
+                      sort_by == QSP_SORT_BY_AVG_HOLD_TIME;
 
-    qsp_mktree(tree, callsite_coalesce);
-    g_tree_foreach(tree, qsp_tree_report, &rep);
+    g_tree_foreach(tree, qsp_tree_report, rep);
     g_tree_destroy(tree);
+}
 
-    pr_report(&rep);
+void qsp_report(size_t max, enum QSPSortBy sort_by,
+                bool callsite_coalesce)
+{
+    QSPReport rep;
+
+    qsp_report_build(&rep, max, sort_by, callsite_coalesce);
+    if (rep.holds_only) {
+        pr_report_holds(&rep);
+    } else {
+        pr_report(&rep);
+    }
+    report_destroy(&rep);
+}
+
+SyncProfileEntryList *qsp_query(size_t max, enum QSPSortBy sort_by,
+                                bool callsite_coalesce)
+{
+    SyncProfileEntryList *head = NULL, **tail = &head;
+    QSPReport rep;
+    size_t i;
+    int j;
+
+    qsp_report_build(&rep, max, sort_by, callsite_coalesce);
+    for (i = 0; i < rep.n_entries; i++) {
+        const QSPReportEntry *e = &rep.entries[i];
+        SyncProfileEntry *info = g_new0(SyncProfileEntry, 1);
+        SyncProfileEntryList *elem = g_new0(SyncProfileEntryList, 1);
+
+        info->type = g_strdup(e->typename);
+        info->callsite = g_strdup(e->callsite_at);
+        info->objects = MAX(e->n_objs, 1);
+        info->acquisitions = e->n_acqs;
+        info->wait_ns = e->ns;
+        if (e->bql) {
+            intList **hist_tail = &info->hold_histogram;
+
+            info->has_holds = info->has_hold_ns = true;
+            info->has_hold_histogram = true;
+            info->holds = e->n_holds;
+            info->hold_ns = e->hold_ns;
+            for (j = 0; j < QSP_HOLD_HIST_BUCKETS; j++) {
+                intList *bucket = g_new0(intList, 1);
+
+                bucket->value = e->hold_hist[j];
+                *hist_tail = bucket;
+                hist_tail = &bucket->next;
+            }
+        }
+
+        elem->value = info;
+        *tail = elem;
+        tail = &elem->next;
+    }
     report_destroy(&rep);
+    return head;
 }
 
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
@@ -2556,6 +2556,11 @@ static bool object_create_initial(const char *type, QemuOpts *opts)
     if (g_str_equal(type, "cryptodev-vhost-user")) {
         return false;
     }
+
+    /* Reason: vhost-user-blk-server property "node-name" */
+    if (g_str_equal(type, "vhost-user-blk-server")) {
+        return false;
+    }
 #endif
 
     /*